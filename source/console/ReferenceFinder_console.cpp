@@ -14,6 +14,7 @@ Copyright:    
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <cstdlib>
 
 using namespace std;
 
@@ -99,8 +100,8 @@ void ConsoleDatabaseProgress(ReferenceFinder::DatabaseInfo info, void*, bool&)
       break;
     
     case ReferenceFinder::DATABASE_READY:
-      // Called when we're completely done
-      cout << endl << endl << flush;
+      // Called when we're completely done; say where the memory went.
+      cout << endl << ReferenceFinder::GetBudgetReport() << endl << flush;
       break;
   }
 }
@@ -166,6 +167,12 @@ int main()
   VerbalStreamDgmr vsdgmr(cout);
   ReferenceFinder::SetDatabaseFn(&ConsoleDatabaseProgress);
   ReferenceFinder::SetStatisticsFn(&ConsoleStatisticsProgress);
+  
+  // Keep a snapshot of the database in the user's home directory, so that it
+  // only has to be built once.
+  const char* home = getenv("HOME");
+  if (home) 
+    ReferenceFinder::sDatabaseFile = string(home) + "/.ReferenceFinder.rfdb";
   ReferenceFinder::MakeAllMarksAndLines();
 
   //  Loop forever until the user quits from the menu.
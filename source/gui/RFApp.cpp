@@ -179,6 +179,14 @@ bool RFApp::OnInit()
   displayPrefs.FromConfig();
   displayPrefs.ToApp();
 
+  // Keep a snapshot of the database with the other cached files, so that it
+  // doesn't have to be built again when we start with the same settings.
+  if (wxFileName::DirExists(GetCacheDir())) {
+    wxFileName snapshotFile(GetCacheDir(), wxT("database.rfdb"));
+    ReferenceFinder::sDatabaseFile = 
+      std::string(snapshotFile.GetFullPath().mb_str(wxConvFile));
+  }
+
   gFrame = new RFFrame(wxT("ReferenceFinder"));
   gCanvas->SetContentNone();
   gFrame->Show(true);
@@ -197,6 +205,28 @@ bool RFApp::OnInit()
 }
 
 
+/*****
+Return the directory for cached files, namely the help data and the database
+snapshot. It's in the user data dir, since the application might be read-only.
+It might not exist yet; LoadHelp() creates it.
+*****/
+wxString RFApp::GetCacheDir()
+{
+  wxString userDataDir = wxStandardPaths::Get().GetUserLocalDataDir();
+
+#if __LINUX__
+  /* In Linux/Unix, by default wxConfig instantiates the default
+     wxFileConfig set to save the user's local configuration in a file
+     in his/her home directory, named "." + GetAppName () - which
+     happens to be the same path as returned by GetUserLocalDataDir
+     above. To avoid conflicts, add a suffix to the cache directory's
+     name. */
+  userDataDir.append (".cache");
+#endif
+  return userDataDir;
+}
+
+
 /*****
 Set directory prefix for auxiliary data files. Gives user a chance to run the
 program even if installed differently than built under GNU/Linux.
@@ -278,18 +308,7 @@ bool RFApp::LoadHelp()
   // application might be read-only so we'll put cached files in the user data
   // dir, which we might have to create if it doesn't yet exist. And if we're
   // unable to create it, then we just won't use a cache for the help data.
-  wxString userDataDir = wxStandardPaths::Get().GetUserLocalDataDir();
-
-#if __LINUX__
-  /* In Linux/Unix, by default wxConfig instantiates the default
-     wxFileConfig set to save the user's local configuration in a file
-     in his/her home directory, named "." + GetAppName () - which
-     happens to be the same path as returned by GetUserLocalDataDir
-     above. To avoid conflicts, add a suffix to the help cache
-     directory's name. */
-  userDataDir.append (".cache");
-#endif
-
+  wxString userDataDir = GetCacheDir();
   if (!wxFileName::DirExists(userDataDir)) {
     wxFileName::Mkdir(userDataDir); 
   }
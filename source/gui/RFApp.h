@@ -84,6 +84,7 @@ public:
   void CheckDirectoryPrefix();
   bool ShowSplashScreen();
   bool LoadHelp();
+  wxString GetCacheDir();
   void ShowOptionalAbout();
   void OnInitCmdLine(wxCmdLineParser& parser);
   bool OnCmdLineParsed(wxCmdLineParser& parser);
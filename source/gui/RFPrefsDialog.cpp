@@ -675,7 +675,8 @@ RFDisplayPrefs::RFDisplayPrefs() :
   mSearchNum(5),
   mNumBuckets(11),
   mBucketSize(0.001),
-  mNumTrials(1000)
+  mNumTrials(1000),
+  mStatisticsSeed(1)
 {
 }
 
@@ -693,6 +694,7 @@ const wxString KEY_SEARCH_NUM = wxT("SearchNum");
 const wxString KEY_NUM_BUCKETS = wxT("NumBuckets");
 const wxString KEY_BUCKET_SIZE = wxT("BucketSize");
 const wxString KEY_NUM_TRIALS = wxT("NumTrials");
+const wxString KEY_STATISTICS_SEED = wxT("StatisticsSeed");
 
 
 /*****
@@ -710,6 +712,7 @@ void RFDisplayPrefs::ToConfig()
   wxConfig::Get()->Write(KEY_NUM_BUCKETS, mNumBuckets);
   wxConfig::Get()->Write(KEY_BUCKET_SIZE, mBucketSize);
   wxConfig::Get()->Write(KEY_NUM_TRIALS, mNumTrials);
+  wxConfig::Get()->Write(KEY_STATISTICS_SEED, mStatisticsSeed);
 }
 
 
@@ -729,6 +732,7 @@ void RFDisplayPrefs::FromConfig()
   wxConfig::Get()->Read(KEY_NUM_BUCKETS, &mNumBuckets, defaults.mNumBuckets);
   wxConfig::Get()->Read(KEY_BUCKET_SIZE, &mBucketSize, defaults.mBucketSize);
   wxConfig::Get()->Read(KEY_NUM_TRIALS, &mNumTrials, defaults.mNumTrials);
+  wxConfig::Get()->Read(KEY_STATISTICS_SEED, &mStatisticsSeed, defaults.mStatisticsSeed);
 }
 
 
@@ -747,6 +751,7 @@ void RFDisplayPrefs::ToApp()
   ReferenceFinder::sNumBuckets = mNumBuckets;
   ReferenceFinder::sBucketSize = mBucketSize;
   ReferenceFinder::sNumTrials = mNumTrials;
+  ReferenceFinder::sStatisticsSeed = mStatisticsSeed;
 }
 
 
@@ -765,6 +770,7 @@ void RFDisplayPrefs::FromApp()
   mNumBuckets = ReferenceFinder::sNumBuckets;
   mBucketSize = ReferenceFinder::sBucketSize;
   mNumTrials = ReferenceFinder::sNumTrials = mNumTrials;
+  mStatisticsSeed = ReferenceFinder::sStatisticsSeed;
 }
 
 
@@ -816,6 +822,7 @@ RFDisplayPanel::RFDisplayPanel(wxWindow* parent) :
         AddTextPair(wxT("Num Error Buckets:"), mNumBuckets);
         AddTextPair(wxT("Error Bucket Size:"), mBucketSize);
         AddTextPair(wxT("Number of Trials:"), mNumTrials);
+        AddTextPair(wxT("Random Seed:"), mStatisticsSeed);
       }
     }
   }
@@ -850,6 +857,8 @@ void RFDisplayPanel::Fill()
   mBucketSize->SetSelection(-1, -1);
   mNumTrials->SetValue(wxString::Format(wxT("%d"), mDisplayPrefs.mNumTrials));
   mNumTrials->SetSelection(-1, -1);
+  mStatisticsSeed->SetValue(wxString::Format(wxT("%d"), mDisplayPrefs.mStatisticsSeed));
+  mStatisticsSeed->SetSelection(-1, -1);
 }
 
 
@@ -900,6 +909,11 @@ bool RFDisplayPanel::Read()
     mNumTrials->SetFocus();
     return false;
   }
+  if (!ReadInt(wxT("random seed"), mStatisticsSeed, mDisplayPrefs.mStatisticsSeed, 0)) {
+    mStatisticsSeed->SetSelection(-1, -1);
+    mStatisticsSeed->SetFocus();
+    return false;
+  }
 
   return true;
 }
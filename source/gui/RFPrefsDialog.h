@@ -142,6 +142,7 @@ struct RFDisplayPrefs {
   int mNumBuckets;
   double mBucketSize;
   int mNumTrials;
+  int mStatisticsSeed;
 
   RFDisplayPrefs();
   void ToConfig();
@@ -175,6 +176,7 @@ private:
   wxTextCtrl* mNumBuckets;
   wxTextCtrl* mBucketSize;
   wxTextCtrl* mNumTrials;
+  wxTextCtrl* mStatisticsSeed;
   
   void Fill();
   bool Read();
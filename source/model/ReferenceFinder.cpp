@@ -12,8 +12,42 @@ Copyright:    
 
 #include <fstream>
 #include <sstream>
+#include <set>
 #include <algorithm>
+#include <functional>
 #include <iomanip>
+#include <new>
+#include <cstdio>
+#include <cstring>
+
+#ifdef RF_USE_THREADS
+#include <thread>
+#include <atomic>
+#endif
+
+// Database snapshots are mapped into memory where the platform supports it.
+#if defined(_WIN32)
+  #define WIN32_LEAN_AND_MEAN
+  #define NOMINMAX
+  #include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+  #define RF_USE_MMAP
+#endif
+
+// Searches that scan every ref work out several errors at once with whatever
+// vector instructions the compiler has been told it can use. Define
+// RF_NO_SIMD to keep them to one at a time.
+#if !defined(RF_NO_SIMD) && defined(__AVX__)
+  #include <immintrin.h>
+  #define RF_USE_AVX
+#elif !defined(RF_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+  #include <emmintrin.h>
+  #define RF_USE_SSE2
+#endif
 
 using namespace std;
 
@@ -54,10 +88,41 @@ ReferenceFinder::rank_t ReferenceFinder::sMaxRank = 6;
 size_t ReferenceFinder::sMaxLines = 500000;
 size_t ReferenceFinder::sMaxMarks = 500000;
 
+// Finer control over how the room for marks and lines gets shared out. If
+// sMaxBytes is nonzero, sMaxLines and sMaxMarks are both scaled down until
+// the marks and lines fit in that much memory. Each rank may then take at most
+// sRankQuota of the room that's left for lines and marks, and each kind of
+// line (O1-O7) may take at most its sAxiomQuota of the room for lines in that
+// rank. Normally the kinds of line are built one after another, so when room
+// runs short the last ones get none; with sAxiomsTakeTurns set, they take
+// turns, a batch of tasks at a time. The defaults (no limits, no turns) give
+// every rank and kind of line as much as it can get, in order.
+size_t ReferenceFinder::sMaxBytes = 0;
+double ReferenceFinder::sRankQuota = 1.0;
+double ReferenceFinder::sAxiomQuota[7] = {1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+bool ReferenceFinder::sAxiomsTakeTurns = false;
+
+// Marks of the highest rank are never used to make lines, and there are far
+// more of them than of any other rank. If sVirtualMarks is set, they aren't
+// stored at all; instead, searches for marks look for pairs of lines that
+// intersect close to the target. FindDeeperMarks() can go on past sMaxRank.
+// The marks found are the ones a full build would have stored, made from the
+// same lines (see FindIntersections()).
+bool ReferenceFinder::sVirtualMarks = false;
+
+// Lines through two marks (O1) are the hardest to fold accurately, but there's
+// one for nearly every pair of marks, so they can take up much of the room for
+// lines. If sVirtualRefLine_C2P_C2P is set, none of them are stored; searches
+// for lines make the ones through pairs of marks close to the target instead.
+// Nothing is made from them, either, so the database comes out different.
+bool ReferenceFinder::sVirtualRefLine_C2P_C2P = false;
+
 // constants that quantify the discretization of marks and lines in forming
 // keys. The maximum key has the value (sNumX * sNumY) for marks, (sNumA * sNumD)
 // for lines. These numbers set a limit on the accuracy, since we won't create
-// more than one object for a given key.
+// more than one object for a given key. Keys are 64 bits, so any values that
+// fit in an int will do; the key sets only grow with the number of objects,
+// so finer divisions cost nothing unless they actually yield more objects.
 int ReferenceFinder::sNumX = 5000;
 int ReferenceFinder::sNumY = 5000;
 int ReferenceFinder::sNumA = 5000;
@@ -88,6 +153,37 @@ bool ReferenceFinder::sLineWorstCaseError = true;
 // attempts.
 int ReferenceFinder::sDatabaseStatusSkip = 200000;
 
+// Number of threads used to build the database. 0 means one per processor; 1
+// builds serially. Either way, the database that results is the same.
+int ReferenceFinder::sNumThreads = 0;
+
+// If sDatabaseFile names a file, MakeAllMarksAndLines() saves a snapshot of the
+// database there, and loads it instead of building the database again whenever
+// the settings are the same.
+string ReferenceFinder::sDatabaseFile;
+
+// If sUseSearchIndexes == true, searches only look at the part of the database
+// near their targets. Otherwise they scan all of it, which gives the same
+// results, and is useful for checking them.
+bool ReferenceFinder::sUseSearchIndexes = true;
+
+// Searches keep their results for the last sQueryCacheSize targets, so that
+// asking for the same target again is nearly free. Targets are rounded to the
+// grid of the keys (sNumX by sNumY, sNumA by sNumD), so targets that close
+// together get the same results. The results go whenever the database is
+// rebuilt. Set it to 0 to search every time.
+size_t ReferenceFinder::sQueryCacheSize = 1000;
+
+// Marks that searches make from the lines in the database, with sVirtualMarks,
+// and lines they make through its marks, with sVirtualRefLine_C2P_C2P or in
+// FindDeeperLines(), are kept so that finding the same one again gives back
+// the same object. Once
+// there are sMaxVirtualRefs of them, the next search that could make more
+// throws them all away, along with the results in the cache, so the memory
+// they take stays bounded however long the program runs. Refs found by one
+// search are good until the next one starts.
+size_t ReferenceFinder::sMaxVirtualRefs = 100000;
+
 // If sClarifyVerbalAmbiguities == true, then verbal instructions that could be
 // ambigious because there are multiples solutions are clarified with
 // additional information.
@@ -101,6 +197,7 @@ bool ReferenceFinder::sAxiomsInVerbalDirections = true;
 int ReferenceFinder::sNumBuckets = 11;          // how many error buckets to use
 double ReferenceFinder::sBucketSize = 0.001;    // size of each bucket
 int ReferenceFinder::sNumTrials = 1000;         // number of test cases total
+int ReferenceFinder::sStatisticsSeed = 1;       // seed for the test points
 string ReferenceFinder::sStatistics;            // holds results of analysis
     
 // Letters that are used for labels for marks and lines.
@@ -113,6 +210,15 @@ private static member initialization
 *****/
 RefContainer<RefLine> ReferenceFinder::sBasisLines;
 RefContainer<RefMark> ReferenceFinder::sBasisMarks;
+RefArena ReferenceFinder::sArena;
+RefSnapshot ReferenceFinder::sSnapshot;
+RefMarkGrid ReferenceFinder::sMarkGrid;
+RefLineIndex ReferenceFinder::sLineIndex;
+RefQueryCache ReferenceFinder::sQueryCache;
+RefVirtualRefs ReferenceFinder::sVirtualRefs;
+unsigned long ReferenceFinder::sGeneration = 0;
+ReferenceFinder::DatabaseSettings ReferenceFinder::sDatabaseSettings;
+ReferenceFinder::rank_t ReferenceFinder::sNumRanks = 0;
 ReferenceFinder::DatabaseFn ReferenceFinder::sDatabaseFn = 0;
 void* ReferenceFinder::sDatabaseUserData = 0;
 ReferenceFinder::StatisticsFn ReferenceFinder::sStatisticsFn = 0;
@@ -134,10 +240,10 @@ can adjust the frequency of calling by changing the variable
 sDatabaseStatusSkip. If the client DatabaseFn sets the value of haltFlag to
 true, we immediately terminate construction of references.
 *****/
-void ReferenceFinder::CheckDatabaseStatus()
+void ReferenceFinder::CheckDatabaseStatus(size_t numTried)
 {
-  if (sStatusCount < sDatabaseStatusSkip) sStatusCount++;
-  else {
+  sStatusCount += int(numTried);
+  if (sStatusCount > sDatabaseStatusSkip) {
     bool haltFlag = false;
     if (sDatabaseFn) (*sDatabaseFn)(
       DatabaseInfo(DATABASE_WORKING, sCurRank, GetNumLines(), GetNumMarks()), 
@@ -148,6 +254,394 @@ void ReferenceFinder::CheckDatabaseStatus()
 }
 
 
+/*****
+Return the number of threads to use for building the database.
+*****/
+size_t ReferenceFinder::GetNumThreads()
+{
+#ifdef RF_USE_THREADS
+  if (sNumThreads > 0) return size_t(sNumThreads);
+  size_t numProcs = thread::hardware_concurrency();
+  return numProcs > 0 ? numProcs : 1;
+#else
+  return 1;
+#endif
+}
+
+
+/*****
+Call f(i) for each i from 0 to n - 1, spreading the calls over GetNumThreads()
+threads. Each thread claims the next unclaimed index as soon as it finishes
+its previous one, so the load balances itself even when the calls vary a lot
+in cost. The calls must not depend on each other.
+*****/
+template <class F>
+static void ParallelFor(F& f, size_t n)
+{
+#ifdef RF_USE_THREADS
+  size_t numThreads = min(n, ReferenceFinder::GetNumThreads());
+  if (numThreads > 1) {
+    atomic<size_t> next(0);
+    auto work = [&f, &next, n]() {
+      for (size_t i = next++; i < n; i = next++) f(i);
+    };
+    vector<thread> threads;
+    for (size_t i = 1; i < numThreads; i++) threads.push_back(thread(work));
+    work();
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; i++) f(i);
+}
+
+
+/*****
+Function object that runs a range of RefTasks, putting the candidates from
+each one into its own RefCandidates.
+*****/
+template <class Rs>
+class RunTasks {
+public:
+  const vector<RefTask>& mTasks;
+  size_t mFirst;
+  vector<RefCandidates<Rs> >& mResults;
+  RunTasks(const vector<RefTask>& tasks, size_t first, 
+    vector<RefCandidates<Rs> >& results) : 
+    mTasks(tasks), mFirst(first), mResults(results) {};
+  void operator()(size_t i) {
+    Rs::DoTask(mTasks[mFirst + i], mResults[i]);
+  };
+};
+
+
+/*****
+Append the work for one combination of ranks (given by at) to tasks. The
+outermost loop runs over numOuter objects and each of these leads to about
+numInner candidates; we slice up the outer loop so that each task makes
+roughly the same number of candidates.
+*****/
+void ReferenceFinder::AddTasks(vector<RefTask>& tasks, const RefTask& at,
+  size_t numOuter, double numInner)
+{
+  const double TASK_SIZE = 65536;  // candidates per task
+  if (numOuter == 0 || numInner <= 0) return;
+  size_t numSlice = size_t(max_val(1.0, TASK_SIZE / numInner));
+  for (size_t i = 0; i < numOuter; i += numSlice) {
+    tasks.push_back(at);
+    tasks.back().mBegin = i;
+    tasks.back().mEnd = min_val(numOuter, i + numSlice);
+  }
+}
+
+
+/**********
+class RefSchedule::Entry - the tasks added by one MakeAll() routine, and how
+far they've got. EntryOf<Rs, R> runs them for objects of type Rs going into a
+RefContainer<R>.
+**********/
+class RefSchedule::Entry {
+public:
+  double mQuota;          // most of the room in the container we may take
+  size_t mMaxAdded;       // most objects we may add, set by Run()
+  size_t mNumAdded;       // objects added so far
+  bool mDone;             // true = no more tasks, or no more room
+  Entry(double quota) : 
+    mQuota(quota), mMaxAdded(0), mNumAdded(0), mDone(false) {};
+  virtual ~Entry() {};
+  virtual size_t GetSize() const = 0;
+  virtual void RunBatch(size_t batchSize, size_t maxSize) = 0;
+};
+
+template <class Rs, class R>
+class RefSchedule::EntryOf : public RefSchedule::Entry {
+public:
+  EntryOf(const vector<RefTask>& tasks, RefContainer<R>& rc, double quota) :
+    Entry(quota), mTasks(tasks), mNext(0), mRC(rc) {
+    mDone = mTasks.empty();
+  };
+  size_t GetSize() const {return mRC.GetTotalSize();};
+  void RunBatch(size_t batchSize, size_t maxSize);
+private:
+  vector<RefTask> mTasks;
+  size_t mNext;           // index of the next task to run
+  RefContainer<R>& mRC;
+};
+
+
+/*****
+Run the next batchSize tasks and put the new objects into the container,
+stopping when it holds maxSize objects or we've added all we're allowed. The
+tasks are run several at a time in parallel; each task only reads the
+container, so the database doesn't change while a batch is running. Once a
+batch is done, we add its candidates in task order, which is exactly the order
+in which a single loop would have constructed them. So the first candidate
+constructed with a given key still gets it, and the database comes out the
+same no matter how many threads we use.
+*****/
+template <class Rs, class R>
+void RefSchedule::EntryOf<Rs, R>::RunBatch(size_t batchSize, size_t maxSize)
+{
+  if (mRC.GetTotalSize() >= maxSize || mNumAdded >= mMaxAdded) {
+    mDone = true;
+    return;
+  }
+  size_t n = min_val(batchSize, mTasks.size() - mNext);
+  vector<RefCandidates<Rs> > results(n);
+  RunTasks<Rs> runTasks(mTasks, mNext, results);
+  ParallelFor(runTasks, n);
+  mNext += n;
+  for (size_t i = 0; i < n; i++) {
+    RefCandidates<Rs>& ac = results[i];
+    for (size_t j = 0; j < ac.size(); j++) {
+      size_t size = mRC.GetTotalSize();
+      if (size >= maxSize || mNumAdded >= mMaxAdded) {
+        mDone = true;
+        return;
+      }
+      mRC.AddCopyIfValidAndUnique(ac[j]);
+      mNumAdded += mRC.GetTotalSize() - size;
+    }
+    ReferenceFinder::CheckDatabaseStatus(ac.mNumTried);
+  }
+  if (mNext == mTasks.size()) mDone = true;
+}
+
+
+/*****
+Destructor
+*****/
+RefSchedule::~RefSchedule()
+{
+  for (size_t i = 0; i < mEntries.size(); i++) delete mEntries[i];
+}
+
+
+/*****
+Add the tasks built by one of the MakeAll() routines, which make objects of
+type Rs for container rc. Their objects may take up to quota (0 to 1) of the
+room that's left in the container when Run() is called.
+*****/
+template <class Rs, class R>
+void RefSchedule::Add(const vector<RefTask>& tasks, RefContainer<R>& rc, 
+  double quota)
+{
+  mEntries.push_back(new EntryOf<Rs, R>(tasks, rc, quota));
+}
+
+
+/*****
+Run the tasks of every entry until the container holds maxSize objects. If
+takeTurns is false, each entry runs to the end before the next one starts, so
+the first entries get first pick of the room; otherwise the entries take turns,
+one batch at a time, so every entry gets its share before the room runs out.
+Either way, the database comes out the same no matter how many threads we use.
+*****/
+void RefSchedule::Run(size_t maxSize, bool takeTurns)
+{
+  // When the entries take turns, a turn is always TURN_SIZE tasks, split over
+  // however many threads we have, since how much each entry gets done before
+  // the room runs out depends on it. Otherwise the batches only set how often
+  // we merge: after every task with one thread, as the serial loops used to.
+  const size_t TURN_SIZE = 8;
+  size_t numThreads = ReferenceFinder::GetNumThreads();
+  size_t batchSize = takeTurns ? TURN_SIZE : 
+    ((numThreads > 1) ? 4 * numThreads : 1);
+  for (size_t i = 0; i < mEntries.size(); i++) {
+    Entry* ae = mEntries[i];
+    size_t size = ae->GetSize();
+    size_t room = (size < maxSize) ? maxSize - size : 0;
+    ae->mMaxAdded = (ae->mQuota >= 1) ? room : size_t(ae->mQuota * room);
+  }
+  bool working = true;
+  while (working) {
+    working = false;
+    for (size_t i = 0; i < mEntries.size(); i++) {
+      Entry* ae = mEntries[i];
+      while (!ae->mDone) {
+        ae->RunBatch(batchSize, maxSize);
+        if (takeTurns) break;
+      }
+      if (!ae->mDone) working = true;
+    }
+  }
+}
+
+
+/*****
+Function object for RefColumns::ForEachColumn() that adds up the bytes in one
+row of every column.
+*****/
+class RefRowBytes {
+public:
+  size_t mBytes;
+  RefRowBytes() : mBytes(0) {};
+  template <class T>
+  void Column(RefColumn<T>&) {mBytes += sizeof(T);};
+};
+
+
+/*****
+Return about how much memory each mark or line in container rc takes up: a row
+in each of its columns, its share of the key set (2 to 4 slots and their
+filter bits) and its entry in the search index.
+*****/
+template <class R>
+static size_t GetRowBytes(RefContainer<R>& rc)
+{
+  RefRowBytes rb;
+  rc.cols.ForEachColumn(rb);
+  return rb.mBytes + 3 * (sizeof(RefBase::key_t) + 1) + 
+    sizeof(RefBase::row_t);
+}
+
+
+/*****
+Work out how many lines and marks we may build: sMaxLines and sMaxMarks,
+scaled down by the same factor if they won't fit within sMaxBytes.
+*****/
+void ReferenceFinder::GetBudgets(size_t& maxLines, size_t& maxMarks)
+{
+  maxLines = sMaxLines;
+  maxMarks = sMaxMarks;
+  if (sMaxBytes == 0) return;
+  double bytes = double(maxLines) * GetRowBytes(sBasisLines) + 
+    double(maxMarks) * GetRowBytes(sBasisMarks);
+  if (bytes <= sMaxBytes) return;
+  double scale = sMaxBytes / bytes;
+  maxLines = size_t(scale * maxLines);
+  maxMarks = size_t(scale * maxMarks);
+}
+
+
+/*****
+Create all marks of a given rank. The lines of that rank must be complete.
+*****/
+void ReferenceFinder::MakeAllMarksOfRank(rank_t arank)
+{
+  size_t maxLines, maxMarks;
+  GetBudgets(maxLines, maxMarks);
+  RefSchedule markSchedule;
+  RefMark_Intersection::MakeAll(arank, markSchedule);
+  markSchedule.Run(GetRankLimit(GetNumMarks(), maxMarks), false);
+  sBasisMarks.FlushBuffer();
+}
+
+
+/*****
+Return true if the marks of rank arank are left out of the database, to be
+made when they're searched for: the highest rank, if sVirtualMarks is set.
+*****/
+bool ReferenceFinder::HasVirtualMarks(rank_t arank)
+{
+  return sVirtualMarks && arank > 0 && arank == sMaxRank;
+}
+
+
+/*****
+Return the most objects a container of the given size may hold after the
+current rank is built, if it may hold budget objects in all.
+*****/
+size_t ReferenceFinder::GetRankLimit(size_t size, size_t budget)
+{
+  if (size >= budget) return size;
+  if (sRankQuota >= 1) return budget;
+  return size + size_t(sRankQuota * (budget - size));
+}
+
+
+/*****
+Return the query that FindBestMarks() looks up in the cache for numRefs marks
+near ap. It's rounded to the grid of the keys of the marks.
+*****/
+RefQueryCache::Query ReferenceFinder::GetQuery(const XYPt& ap, short numRefs)
+{
+  RefQueryCache::Query aq;
+  aq.mType = 0;
+  aq.mCoords[0] = (long long)(floor(0.5 + ap.x / sPaper.mWidth * sNumX));
+  aq.mCoords[1] = (long long)(floor(0.5 + ap.y / sPaper.mHeight * sNumY));
+  aq.mNumRefs = numRefs;
+  aq.mWorstCase = false;
+  aq.mGoodEnough = sGoodEnoughError;
+  aq.mGeneration = sGeneration;
+  return aq;
+}
+
+
+/*****
+Return the query that FindBestLines() looks up in the cache for numRefs lines
+near al. It's rounded to the grid of the keys of the lines, with the line
+turned around if need be so that d >= 0, as RefLine::FinishConstructor() does.
+*****/
+RefQueryCache::Query ReferenceFinder::GetQuery(const XYLine& al, short numRefs)
+{
+  const double pi = 3.14159265358979323;
+  double sign = (al.d < 0) ? -1 : 1;
+  double fa = (1. + atan2(sign * al.u.y, sign * al.u.x) / pi) / 2.0;
+  double dmax = sqrt(pow(sPaper.mWidth, 2) + pow(sPaper.mHeight, 2));
+  double fd = sign * al.d / dmax;
+  RefQueryCache::Query aq;
+  aq.mType = 1;
+  aq.mCoords[0] = (long long)(floor(0.5 + fa * sNumA));
+  aq.mCoords[1] = (long long)(floor(0.5 + fd * sNumD));
+  aq.mNumRefs = numRefs;
+  aq.mWorstCase = sLineWorstCaseError;
+  aq.mGoodEnough = sGoodEnoughError;
+  aq.mGeneration = sGeneration;
+  return aq;
+}
+
+
+/*****
+Throw away the refs that searches have made, if there are sMaxVirtualRefs of
+them, and the cached results that point to them. Called at the start of every
+search that could make more.
+*****/
+void ReferenceFinder::TrimVirtualRefs()
+{
+  if (sVirtualRefs.size() < sMaxVirtualRefs) return;
+  sVirtualRefs.Clear();
+  sQueryCache.Clear();
+}
+
+
+/*****
+Return a report of how much of the budget the database uses: the number of
+lines of each kind (O1-O7) and the memory they take up, then the same for the
+marks.
+*****/
+string ReferenceFinder::GetBudgetReport()
+{
+  size_t maxLines, maxMarks;
+  GetBudgets(maxLines, maxMarks);
+  size_t lineBytes = GetRowBytes(sBasisLines);
+  size_t markBytes = GetRowBytes(sBasisMarks);
+  size_t numLines = sBasisLines.cols.size();
+  size_t numMarks = sBasisMarks.cols.size();
+  vector<size_t> counts(RefBase::REFTYPE_L2L_P2L + 1, 0);
+  for (size_t i = 0; i < numLines; i++) counts[sBasisLines.cols.mType[i]]++;
+  const char* names[7] = {"O1 (C2P_C2P)", "O2 (P2P)", "O3 (L2L)", 
+    "O4 (L2L_C2P)", "O5 (P2L_C2P)", "O6 (P2L_P2L)", "O7 (L2L_P2L)"};
+  stringstream ss;
+  ss.setf(ios_base::fixed, ios_base::floatfield);
+  ss.precision(1);
+  ss << "Lines: " << numLines << " of " << maxLines << ", " << 
+    (numLines * lineBytes) / 1024.0 << " KB" << endl;
+  ss << "  original: " << counts[RefBase::REFTYPE_ORIGINAL] << " lines" << 
+    endl;
+  for (int k = 0; k < 7; k++) {
+    size_t n = counts[RefBase::REFTYPE_C2P_C2P + k];
+    ss << "  " << names[k] << ": " << n << " lines, " << 
+      (n * lineBytes) / 1024.0 << " KB";
+    if (maxLines > 0) ss << ", " << (100.0 * n) / maxLines << "% of budget";
+    ss << endl;
+  }
+  ss << "Marks: " << numMarks << " of " << maxMarks << ", " << 
+    (numMarks * markBytes) / 1024.0 << " KB" << endl;
+  return ss.str();
+}
+
+
 /*****
 Create all marks and lines of a given rank.
 *****/
@@ -162,24 +656,33 @@ void ReferenceFinder::MakeAllMarksAndLinesOfRank(rank_t arank)
 
   // We give first preference to lines that don't involve making creases
   // through points, because these are the hardest to do accurately in practice.
-  if (sUseRefLine_L2L) RefLine_L2L::MakeAll(arank);
-  if (sUseRefLine_P2P) RefLine_P2P::MakeAll(arank);
-  if (sUseRefLine_L2L_P2L) RefLine_L2L_P2L::MakeAll(arank);
-  if (sUseRefLine_P2L_P2L) RefLine_P2L_P2L::MakeAll(arank);
+  RefSchedule lineSchedule;
+  if (sUseRefLine_L2L) RefLine_L2L::MakeAll(arank, lineSchedule);
+  if (sUseRefLine_P2P) RefLine_P2P::MakeAll(arank, lineSchedule);
+  if (sUseRefLine_L2L_P2L) RefLine_L2L_P2L::MakeAll(arank, lineSchedule);
+  if (sUseRefLine_P2L_P2L) RefLine_P2L_P2L::MakeAll(arank, lineSchedule);
   
   // Next, we'll make lines that put a crease through a single point.
-  if (sUseRefLine_P2L_C2P) RefLine_P2L_C2P::MakeAll(arank);
-  if (sUseRefLine_L2L_C2P) RefLine_L2L_C2P::MakeAll(arank);
+  if (sUseRefLine_P2L_C2P) RefLine_P2L_C2P::MakeAll(arank, lineSchedule);
+  if (sUseRefLine_L2L_C2P) RefLine_L2L_C2P::MakeAll(arank, lineSchedule);
     
   // Finally, we'll do lines that put a crease through both points. 
-  if (sUseRefLine_C2P_C2P) RefLine_C2P_C2P::MakeAll(arank);
+  if (sUseRefLine_C2P_C2P && !sVirtualRefLine_C2P_C2P) 
+    RefLine_C2P_C2P::MakeAll(arank, lineSchedule);
+  
+  // Now build them, within this rank's share of the budget.
+  size_t maxLines, maxMarks;
+  GetBudgets(maxLines, maxMarks);
+  lineSchedule.Run(GetRankLimit(GetNumLines(), maxLines), sAxiomsTakeTurns);
       
   // Having constructed all lines in the buffer, add them to the main collection.
   sBasisLines.FlushBuffer();
   
   // construct all types of marks of the given rank
-  RefMark_Intersection::MakeAll(arank);
-  sBasisMarks.FlushBuffer();
+  if (!HasVirtualMarks(arank)) MakeAllMarksOfRank(arank);
+  
+  // This rank is complete, so it can be kept if we extend the database later.
+  sNumRanks = arank + 1;
   
   // if we're reporting status, say how many we constructed.
   bool haltFlag = false;
@@ -190,16 +693,123 @@ void ReferenceFinder::MakeAllMarksAndLinesOfRank(rank_t arank)
 }
 
 
+/*****
+Capture the current settings that affect the contents of the database.
+*****/
+ReferenceFinder::DatabaseSettings::DatabaseSettings() :
+  mWidth(sPaper.mWidth),
+  mHeight(sPaper.mHeight),
+  mMaxLines(sMaxLines),
+  mMaxMarks(sMaxMarks),
+  mMaxBytes(sMaxBytes),
+  mRankQuota(sRankQuota),
+  mAxiomsTakeTurns(sAxiomsTakeTurns),
+  mVirtualMarks(sVirtualMarks),
+  mVirtualRefLine_C2P_C2P(sVirtualRefLine_C2P_C2P),
+  mNumX(sNumX),
+  mNumY(sNumY),
+  mNumA(sNumA),
+  mNumD(sNumD),
+  mMinAspectRatio(sMinAspectRatio),
+  mMinAngleSine(sMinAngleSine),
+  mVisibilityMatters(sVisibilityMatters)
+{
+  mUseRefLine[0] = sUseRefLine_C2P_C2P;
+  mUseRefLine[1] = sUseRefLine_P2P;
+  mUseRefLine[2] = sUseRefLine_L2L;
+  mUseRefLine[3] = sUseRefLine_L2L_C2P;
+  mUseRefLine[4] = sUseRefLine_P2L_C2P;
+  mUseRefLine[5] = sUseRefLine_P2L_P2L;
+  mUseRefLine[6] = sUseRefLine_L2L_P2L;
+  for (int i = 0; i < 7; i++) mAxiomQuota[i] = sAxiomQuota[i];
+}
+
+
+/*****
+Return true if two sets of settings would produce the same database.
+*****/
+bool ReferenceFinder::DatabaseSettings::operator==(
+  const DatabaseSettings& ds) const
+{
+  for (int i = 0; i < 7; i++) 
+    if (mUseRefLine[i] != ds.mUseRefLine[i] || 
+      mAxiomQuota[i] != ds.mAxiomQuota[i]) return false;
+  return mWidth == ds.mWidth && mHeight == ds.mHeight && 
+    mMaxLines == ds.mMaxLines && mMaxMarks == ds.mMaxMarks &&
+    mMaxBytes == ds.mMaxBytes && mRankQuota == ds.mRankQuota &&
+    mAxiomsTakeTurns == ds.mAxiomsTakeTurns && 
+    mVirtualMarks == ds.mVirtualMarks &&
+    mVirtualRefLine_C2P_C2P == ds.mVirtualRefLine_C2P_C2P &&
+    mNumX == ds.mNumX && mNumY == ds.mNumY && 
+    mNumA == ds.mNumA && mNumD == ds.mNumD &&
+    mMinAspectRatio == ds.mMinAspectRatio && 
+    mMinAngleSine == ds.mMinAngleSine &&
+    mVisibilityMatters == ds.mVisibilityMatters;
+}
+
+
 /*****
 Create all marks and lines sequentially. you should have previously verified
 that LineKeySizeOK() and MarkKeySizeOK() return true.
+
+Since each rank is built only from the ranks below it, a database built with
+the same settings except for sMaxRank is identical up to its last complete
+rank. So if nothing else has changed, we keep the complete ranks we already
+have (no more than sMaxRank of them) and build only the ones that are missing.
+That also picks up a build that was cancelled by the user partway through.
+If there's a snapshot of a database with the same settings and more ranks, we
+load it first, and save a new one if we've built any ranks.
 *****/
 void ReferenceFinder::MakeAllMarksAndLines()
 {
-  // Start by clearing out any old marks or lines; this is so we can restart if
-  // we want.
-  sBasisLines.Rebuild();
-  sBasisMarks.Rebuild();
+  // If the database we have isn't big enough, the snapshot may have more.
+  DatabaseSettings settings;
+  rank_t numHave = (settings == sDatabaseSettings) ? sNumRanks : rank_t(0);
+  if (numHave <= sMaxRank && !sDatabaseFile.empty())
+    LoadDatabase(settings, numHave);
+  
+  // Figure out how much of the existing database we can keep. The ranks are
+  // the same as long as the settings are.
+  rank_t numKeep = 0;
+  if (settings == sDatabaseSettings) 
+    numKeep = min(sNumRanks, rank_t(sMaxRank + 1));
+  bool makeLastMarks = false;
+  sGeneration++;
+  sArena.Clear();
+  sVirtualRefs.Clear();
+  sMarkGrid.Clear();
+  sLineIndex.Clear();
+  
+  if (numKeep == 0) {
+    // Start by clearing out any old marks or lines; this is so we can restart
+    // if we want.
+    sBasisLines.Rebuild();
+    sBasisMarks.Rebuild();
+    sSnapshot.Close();
+    sNumRanks = 0;
+    sDatabaseSettings = settings;
+  }
+  else {
+    // Cut the database back to the last rank we're keeping. If there are more
+    // ranks to build, make the objects we'll build them from; that also copies
+    // any columns that are views of the snapshot, since they'll be added to.
+    // With virtual marks, the last rank we keep never has marks of its own:
+    // they're either left out for good or made below, before they're needed.
+    rank_t lastRank = rank_t(numKeep - 1);
+    sBasisLines.Truncate(lastRank);
+    if (sVirtualMarks && lastRank > 0) {
+      sBasisMarks.Truncate(rank_t(lastRank - 1));
+      makeLastMarks = (numKeep <= sMaxRank);
+    }
+    else sBasisMarks.Truncate(lastRank);
+    sNumRanks = numKeep;
+    if (numKeep <= sMaxRank) {
+      sBasisLines.Expand();
+      sBasisMarks.Expand();
+      sSnapshot.Close();
+    }
+  }
+  rank_t numKept = numKeep;
   
   // Let the user know that we're initializing and what operations we're using.
   bool haltFlag = false;
@@ -211,57 +821,85 @@ void ReferenceFinder::MakeAllMarksAndLines()
   // lines up to rank 4 and marks up to rank 8 with no limits would result in
   // 4185 lines and 1,090,203 marks, which would take about 60 MB of memory.
   
-  // Rank 0: Construct the four edges of the square.
-  sBasisLines.Add(new RefLine_Original(sPaper.mBottomEdge, 0, 
-    string("the bottom edge")));
-  sBasisLines.Add(new RefLine_Original(sPaper.mLeftEdge, 0, 
-    string("the left edge")));
-  sBasisLines.Add(new RefLine_Original(sPaper.mRightEdge, 0, 
-    string("the right edge")));
-  sBasisLines.Add(new RefLine_Original(sPaper.mTopEdge, 0, 
-    string("the top edge")));
-    
-  // Rank 0: Construct the four corners of the square.
-  sBasisMarks.Add(new RefMark_Original(sPaper.mBotLeft, 0, 
-    string("the bottom left corner")));
-  sBasisMarks.Add(new RefMark_Original(sPaper.mBotRight, 0, 
-    string("the bottom right corner")));
-  sBasisMarks.Add(new RefMark_Original(sPaper.mTopLeft, 0, 
-    string("the top left corner")));
-  sBasisMarks.Add(new RefMark_Original(sPaper.mTopRight, 0, 
-    string("the top right corner")));
-    
-  // Report our status for rank 0.
-  if (sDatabaseFn) (*sDatabaseFn)(
-    DatabaseInfo(DATABASE_RANK_COMPLETE, 0, GetNumLines(), GetNumMarks()), 
-    sDatabaseUserData, haltFlag);
+  if (numKeep == 0) {
+    // Rank 0: Construct the four edges of the square.
+    sBasisLines.Add(sArena.New(RefLine_Original(sPaper.mBottomEdge, 0, 
+      string("the bottom edge"))));
+    sBasisLines.Add(sArena.New(RefLine_Original(sPaper.mLeftEdge, 0, 
+      string("the left edge"))));
+    sBasisLines.Add(sArena.New(RefLine_Original(sPaper.mRightEdge, 0, 
+      string("the right edge"))));
+    sBasisLines.Add(sArena.New(RefLine_Original(sPaper.mTopEdge, 0, 
+      string("the top edge"))));
+      
+    // Rank 0: Construct the four corners of the square.
+    sBasisMarks.Add(sArena.New(RefMark_Original(sPaper.mBotLeft, 0, 
+      string("the bottom left corner"))));
+    sBasisMarks.Add(sArena.New(RefMark_Original(sPaper.mBotRight, 0, 
+      string("the bottom right corner"))));
+    sBasisMarks.Add(sArena.New(RefMark_Original(sPaper.mTopLeft, 0, 
+      string("the top left corner"))));
+    sBasisMarks.Add(sArena.New(RefMark_Original(sPaper.mTopRight, 0, 
+      string("the top right corner"))));
+      
+    // Flush the buffers.
+    sBasisLines.FlushBuffer();
+    sBasisMarks.FlushBuffer();
+    sNumRanks = numKeep = 1;
+  }
+
+  // Report our status for the ranks we already have.
+  for (rank_t irank = 0; irank < numKeep; irank++) {
+    sCurRank = irank;
+    if (sDatabaseFn) (*sDatabaseFn)(
+      DatabaseInfo(DATABASE_RANK_COMPLETE, irank, 
+      sBasisLines.rankStart[irank + 1], sBasisMarks.rankStart[irank + 1]), 
+      sDatabaseUserData, haltFlag);
+  }
   
-  // Rank 1: Construct the two diagonals.
-  sBasisLines.Add(new RefLine_Original(sPaper.mUpwardDiagonal, 1, 
-    string("the upward diagonal")));
-  sBasisLines.Add(new RefLine_Original(sPaper.mDownwardDiagonal, 1, 
-    string("the downward diagonal")));
+  // Rank 1: Construct the two diagonals. These stay in the buffer until the
+  // rest of rank 1 is built, so that all of rank 1 gets sorted together. A
+  // database of rank 0 doesn't get them, since nothing else of rank 1 is built
+  // and the containers haven't been made ready to add to.
+  if (numKeep == 1 && sMaxRank >= 1) {
+    sBasisLines.Add(sArena.New(RefLine_Original(sPaper.mUpwardDiagonal, 1, 
+      string("the upward diagonal"))));
+    sBasisLines.Add(sArena.New(RefLine_Original(sPaper.mDownwardDiagonal, 1, 
+      string("the downward diagonal"))));
+  }
     
-  // Flush the buffers.
-  sBasisLines.FlushBuffer();
-  sBasisMarks.FlushBuffer();
-
-  // Now build the rest, one rank at a time, starting with rank 1. This can
-  // be terminated by a EXC_HALT if the user cancelled during the callback.
+  // Now build the rest, one rank at a time. This can be terminated by a
+  // EXC_HALT if the user cancelled during the callback.
   try {
-    for (rank_t irank = 1; irank <= sMaxRank; irank++) {
+    if (makeLastMarks) {
+      sCurRank = rank_t(numKeep - 1);
+      MakeAllMarksOfRank(sCurRank);
+    }
+    for (rank_t irank = rank_t(numKeep); irank <= sMaxRank; irank++) {
       MakeAllMarksAndLinesOfRank(irank);
     }
   }
   catch(EXC_HALT) {
-    sBasisLines.FlushBuffer();
-    sBasisMarks.FlushBuffer();
+    // keep whatever we built before the user cancelled
   }
-
-  // Once that's done, all the objects are in the sortable arrays and we can
-  // free up the memory used by the maps.
-  sBasisLines.ClearMaps();
-  sBasisMarks.ClearMaps();
+  
+  // Put anything left over from a cancelled rank in the arrays so it can be
+  // searched.
+  sBasisLines.FlushBuffer();
+  sBasisMarks.FlushBuffer();
+  
+  // Now everything is in the columns, and we can free up the memory used by
+  // the objects and the key sets.
+  sBasisLines.Compact();
+  sBasisMarks.Compact();
+  sArena.Release();
+  
+  // Index the marks and lines for searching.
+  sMarkGrid.Build(sBasisMarks.cols);
+  sLineIndex.Build(sBasisLines.cols);
+  
+  // Save whatever we added, so that it doesn't have to be built again.
+  if (sNumRanks > numKept && !sDatabaseFile.empty()) SaveDatabase();
   
   // And perform a final update of progress.
   if (sDatabaseFn) (*sDatabaseFn)(
@@ -270,1031 +908,2476 @@ void ReferenceFinder::MakeAllMarksAndLines()
 }
 
 
-/*****
-Find the best marks closest to a given point ap, storing the results in the
-vector vm.
-*****/
-void ReferenceFinder::FindBestMarks(const XYPt& ap, vector<RefMark*>& vm, 
-  short numMarks)
-{
-  vm.resize(numMarks);
-  partial_sort_copy(sBasisMarks.begin(), sBasisMarks.end(), vm.begin(), vm.end(), 
-    CompareRankAndError<RefMark>(ap));
-}
+/*  Notes on database snapshots.
+A snapshot file starts with a SnapshotHeader, which is followed by the lines and
+then the marks. Each of those consists of a SnapshotCounts, the first numRanks
++ 1 entries of rankStart, the names of the originals (each one followed by a
+'\0'), and then the columns, in the order that ForEachColumn() gives them. Each
+piece is padded to a multiple of 8 bytes, so every column is properly aligned
+when the file is mapped into memory, and can be used as it stands. Values are
+stored just as they are in memory, so a snapshot can only be used by a build
+whose byte order and type sizes match those of the build that wrote it; the
+header and the fingerprint take care of that. The checksum covers everything
+after the header.
+*/
+const char SNAPSHOT_MAGIC[8] = {'R', 'F', 'D', 'B', 'S', 'N', 'A', 'P'};
+const unsigned int SNAPSHOT_VERSION = 5;
+const unsigned int SNAPSHOT_BYTE_ORDER = 0x01020304;
+const unsigned long long SNAPSHOT_HASH_BASIS = 14695981039346656037ULL;
+
+struct SnapshotHeader {
+  char mMagic[8];                   // SNAPSHOT_MAGIC
+  unsigned int mVersion;            // SNAPSHOT_VERSION
+  unsigned int mByteOrder;          // SNAPSHOT_BYTE_ORDER, as written
+  unsigned long long mFingerprint;  // DatabaseSettings::GetFingerprint()
+  unsigned long long mBodySize;     // number of bytes after the header
+  unsigned long long mChecksum;     // hash of the bytes after the header
+  unsigned int mNumRanks;           // number of complete ranks
+  unsigned int mUnused;
+};
+
+struct SnapshotCounts {
+  unsigned int mNumRows;            // number of marks or lines
+  unsigned int mNamesSize;          // number of bytes of names
+};
 
 
 /*****
-Find the best lines closest to a given line al, storing the results in the
-vector vl.
+Hash n bytes into h, 8 at a time; the last word is padded with zeros. Hashing
+bytes that have been padded to a multiple of 8 piece by piece gives the same
+result as hashing all of them at once.
 *****/
-void ReferenceFinder::FindBestLines(const XYLine& al, vector<RefLine*>& vl, 
-  short numLines)
+static unsigned long long HashBytes(unsigned long long h, const void* p, 
+  size_t n)
 {
-  vl.resize(numLines);
-  partial_sort_copy(sBasisLines.begin(), sBasisLines.end(), vl.begin(), vl.end(), 
-    CompareRankAndError<RefLine>(al));
+  const unsigned long long PRIME = 1099511628211ULL;
+  const char* c = static_cast<const char*>(p);
+  for (; n > 0; c += 8) {
+    unsigned long long w = 0;
+    size_t nw = min(n, size_t(8));
+    memcpy(&w, c, nw);
+    n -= nw;
+    h = (h ^ w) * PRIME;
+    h ^= h >> 32;
+  }
+  return h;
 }
 
 
 /*****
-Return true if ap is a valid mark. Return an error message if it isn't.
+Return a hash of the settings, along with the snapshot version and the sizes
+of the types that go into the columns.
 *****/
-bool ReferenceFinder::ValidateMark(const XYPt& ap, string& err)
+unsigned long long ReferenceFinder::DatabaseSettings::GetFingerprint() const
 {
-  if (ap.x < 0 || ap.x > sPaper.mWidth) {
-    stringstream ss;
-    ss << "Error -- x coordinate should lie between 0 and " << 
-      sPaper.mWidth;
-    err = ss.str();
-    return false;
-  }
-  
-  if (ap.y < 0 || ap.y > sPaper.mHeight) {
-    stringstream ss;
-    ss << "Error -- y coordinate should lie between 0 and " << 
-      sPaper.mHeight;
-    err = ss.str();
-    return false;
-  }
-  return true;
+  unsigned int sizes[4] = {SNAPSHOT_VERSION, 
+    sizeof(rank_t), sizeof(key_t), sizeof(row_t)};
+  unsigned long long counts[3] = {mMaxLines, mMaxMarks, mMaxBytes};
+  int nums[4] = {mNumX, mNumY, mNumA, mNumD};
+  double values[12] = {mWidth, mHeight, mMinAspectRatio, mMinAngleSine, 
+    mRankQuota};
+  for (int i = 0; i < 7; i++) values[5 + i] = mAxiomQuota[i];
+  bool flags[11];
+  for (int i = 0; i < 7; i++) flags[i] = mUseRefLine[i];
+  flags[7] = mVisibilityMatters;
+  flags[8] = mAxiomsTakeTurns;
+  flags[9] = mVirtualMarks;
+  flags[10] = mVirtualRefLine_C2P_C2P;
+  unsigned long long h = SNAPSHOT_HASH_BASIS;
+  h = HashBytes(h, sizes, sizeof(sizes));
+  h = HashBytes(h, counts, sizeof(counts));
+  h = HashBytes(h, nums, sizeof(nums));
+  h = HashBytes(h, values, sizeof(values));
+  h = HashBytes(h, flags, sizeof(flags));
+  return h;
 }
 
 
+/**********
+class SnapshotWriter - writes the pieces of a snapshot to a stream, padding
+each one and keeping the checksum up to date. It can be passed to 
+RefColumns::ForEachColumn() to write the first mNumRows rows of each column.
+**********/
+class SnapshotWriter {
+public:
+  SnapshotWriter(ostream& aos) : mOS(aos), mNumRows(0), mSize(0), 
+    mChecksum(SNAPSHOT_HASH_BASIS) {};
+  void Put(const void* p, size_t n) {
+    const char zeros[8] = {0};
+    size_t pad = (8 - n % 8) % 8;
+    mOS.write(static_cast<const char*>(p), streamsize(n));
+    mOS.write(zeros, streamsize(pad));
+    mChecksum = HashBytes(mChecksum, p, n);
+    mSize += n + pad;
+  };
+  template <class T>
+  void Column(RefColumn<T>& ac) {
+    Put(ac.data(), mNumRows * sizeof(T));
+  };
+  void SetNumRows(size_t n) {mNumRows = n;};
+  unsigned long long GetSize() const {return mSize;};
+  unsigned long long GetChecksum() const {return mChecksum;};
+private:
+  ostream& mOS;
+  size_t mNumRows;
+  unsigned long long mSize;
+  unsigned long long mChecksum;
+};
+
+
+/**********
+class SnapshotReader - takes the pieces of a snapshot from memory in the order
+they were written. Passed to RefColumns::ForEachColumn(), it makes each column
+a view of the next mNumRows values. If the snapshot runs out, IsOK() turns
+false.
+**********/
+class SnapshotReader {
+public:
+  SnapshotReader(const char* adata, size_t asize) : mData(adata), 
+    mSize(asize), mPos(0), mNumRows(0), mOK(true) {};
+  template <class T>
+  const T* Take(size_t n) {
+    if (!mOK || n > (mSize - mPos) / sizeof(T)) {
+      mOK = false;
+      return 0;
+    }
+    const T* p = reinterpret_cast<const T*>(mData + mPos);
+    mPos += n * sizeof(T) + (8 - (n * sizeof(T)) % 8) % 8;
+    mPos = min(mPos, mSize);
+    return p;
+  };
+  template <class T>
+  void Column(RefColumn<T>& ac) {
+    const T* p = Take<T>(mNumRows);
+    if (p) ac.View(p, mNumRows);
+  };
+  void SetNumRows(size_t n) {mNumRows = n;};
+  bool IsOK() const {return mOK;};
+private:
+  const char* mData;
+  size_t mSize;
+  size_t mPos;
+  size_t mNumRows;
+  bool mOK;
+};
+
+
 /*****
-Validate the two entered points that define the line. Return an error message
-if they aren't distinct.
+Write the refs of the first numRanks ranks of a container to a snapshot.
 *****/
-bool ReferenceFinder::ValidateLine(const XYPt& ap1, const XYPt& ap2, 
-  string& err)
-{
-  if ((ap1 - ap2).Mag() > EPS) return true;
-  stringstream ss;
-  ss.precision(10);
-  ss << "Error -- the two points must be distinct (separated by at least " <<
-      EPS << ").";
-  err = ss.str();
-  return false;
+template <class R>
+static void SaveColumns(SnapshotWriter& aw, RefContainer<R>& rc, 
+  RefBase::rank_t numRanks)
+{
+  SnapshotCounts counts;
+  counts.mNumRows = RefBase::row_t(rc.rankStart[numRanks]);
+  vector<RefBase::row_t> rankStart(rc.rankStart.begin(), 
+    rc.rankStart.begin() + numRanks + 1);
+  string names;
+  for (size_t i = 0; i < counts.mNumRows; i++) 
+    if (rc.cols.mType[i] == RefBase::REFTYPE_ORIGINAL) {
+      names += rc.cols.mNames[rc.cols.mAux[i]];
+      names += '\0';
+    }
+  counts.mNamesSize = (unsigned int)(names.size());
+  aw.Put(&counts, sizeof(counts));
+  aw.Put(&rankStart[0], rankStart.size() * sizeof(RefBase::row_t));
+  aw.Put(names.data(), names.size());
+  aw.SetNumRows(counts.mNumRows);
+  rc.cols.ForEachColumn(aw);
 }
 
 
 /*****
-Compute statistics on the accuracy of the current set of marks for a randomly 
-chosen set of points and pass the results in our static string variable.
+Read the refs of a container from a snapshot. Its columns become views of the
+snapshot. Return false if the snapshot ran out.
 *****/
-void ReferenceFinder::CalcStatistics()
-{
-  bool cancel = false;
-  if (sStatisticsFn) {
-    sStatisticsFn(StatisticsInfo(STATISTICS_BEGIN), 
-      sStatisticsUserData, cancel);
+template <class R>
+static bool LoadColumns(SnapshotReader& ar, RefContainer<R>& rc, 
+  RefBase::rank_t numRanks)
+{
+  const SnapshotCounts* counts = ar.Take<SnapshotCounts>(1);
+  if (!counts) return false;
+  const RefBase::row_t* rankStart = ar.Take<RefBase::row_t>(numRanks + 1);
+  const char* names = ar.Take<char>(counts->mNamesSize);
+  if (!ar.IsOK()) return false;
+  rc.rankStart.assign(rankStart, rankStart + numRanks + 1);
+  rc.cols.mNames.clear();
+  const char* namesEnd = names + counts->mNamesSize;
+  while (names < namesEnd) {
+    const char* nameEnd = 
+      static_cast<const char*>(memchr(names, '\0', size_t(namesEnd - names)));
+    if (!nameEnd) return false;
+    rc.cols.mNames.push_back(string(names, nameEnd));
+    names = nameEnd + 1;
   }
-  
-  vector<int> errBucket;              // number of errors in each bucket
-  errBucket.assign(sNumBuckets, 0);
-  vector<double> errors;              // list of all errors
-  vector <RefMark*> sortMarks(1);     // a vector to do our sorting into
-  
-  // Run a bunch of test cases on random points.
-  int actNumTrials = sNumTrials;
-  for (size_t i = 0; i < size_t(sNumTrials); i++) {
-    XYPt testPt((double(rand()) / (RAND_MAX * sPaper.mWidth)), 
-      double(rand()) / (RAND_MAX * sPaper.mHeight));
-    
-    // Find the mark closest to the test mark.
-    partial_sort_copy(sBasisMarks.begin(), sBasisMarks.end(), 
-      sortMarks.begin(), sortMarks.end(), CompareError<RefMark>(testPt));
-      
-    // note how close we were
-    double error = (testPt - sortMarks[0]->p).Mag();
-    errors.push_back(error);
-    // Report progress, and check for early termination from user
-    if (sStatisticsFn) {
-      sStatisticsFn(StatisticsInfo(STATISTICS_WORKING, i, error), 
-        sStatisticsUserData, cancel);
-      if (cancel) {
-        actNumTrials = 1 + int(i);
-        break;
+  ar.SetNumRows(counts->mNumRows);
+  rc.cols.ForEachColumn(ar);
+  return ar.IsOK();
+}
+
+
+/*****
+Return true if the rows of a container that was read from a snapshot make
+sense: each one is in the right rank, the originals have names, and everything
+else was made from refs that exist and are of no higher rank (lower, for lines,
+so that nothing can be made from itself). That's all MakeObject() needs to make
+any of them. isMarks says whether cols holds the marks.
+*****/
+static bool CheckColumns(const RefColumnsBase& cols, 
+  const vector<size_t>& rankStart, bool isMarks, 
+  const RefColumnsBase& lines, const RefColumnsBase& marks)
+{
+  // What each kind of ref is made from, in the order of its parent columns
+  static const char* const PARENTS[] = 
+    {"", "LL", "MM", "MM", "LL", "LM", "MLM", "MLML", "LML"};
+  if (rankStart[0] != 0 || rankStart.back() != cols.size()) return false;
+  size_t numNames = 0;
+  for (size_t r = 0; r + 1 < rankStart.size(); r++) {
+    if (rankStart[r + 1] < rankStart[r]) return false;
+    for (size_t i = rankStart[r]; i < rankStart[r + 1]; i++) {
+      if (cols.mRank[i] != r) return false;
+      unsigned char type = cols.mType[i];
+      if (type == RefBase::REFTYPE_ORIGINAL) {
+        if (cols.mAux[i] != numNames++) return false;
+        continue;
+      }
+      if ((type == RefBase::REFTYPE_INTERSECTION) != isMarks || 
+        type > RefBase::REFTYPE_L2L_P2L || cols.mAux[i] > 2) return false;
+      const char* parents = PARENTS[type];
+      for (int k = 0; parents[k]; k++) {
+        const RefColumnsBase& pcols = (parents[k] == 'M') ? marks : lines;
+        RefBase::row_t p = cols.mParents[k][i];
+        if (p >= pcols.size() || pcols.mRank[p] > r || 
+          (!isMarks && pcols.mRank[p] == r)) return false;
       }
     }
-    
-    // Compute a bucket index for this error. Over the top goes into last
-    // bucket. Then record the error in the appropriate bucket.
-    int errindex = int(error / sBucketSize);
-    if (errindex >= sNumBuckets) errindex = sNumBuckets - 1;
-    errBucket[errindex] += 1;
   }
-  
-  // Now compose a report of the results.
-  stringstream ss;
-  ss << fixed << showpoint << setprecision(1);
-  ss << "Distribution of errors for " << actNumTrials << " trials:" << endl;
-  int total = 0;
-  // Report the number of errors for each error bucket
-  for (int i = 0; i < sNumBuckets - 1; i++) {
-    total += errBucket[i];
-    ss << "error < " << 
-      setprecision(3) << sBucketSize * (i + 1) << 
-      " = " << total << " (" << 
-      setprecision(1) << 100. * double(total) / actNumTrials << 
-      "%)" << endl;
+  return numNames == cols.mNames.size();
+}
+
+
+/*****
+Save the complete ranks of the database to sDatabaseFile. The snapshot is
+written to a temporary file first, which then replaces any old one, so that
+nobody ever sees half of a snapshot. Failures are silently ignored; we just
+won't have a snapshot.
+*****/
+void ReferenceFinder::SaveDatabase()
+{
+  string tempFile = sDatabaseFile + ".tmp";
+  ofstream fout(tempFile.c_str(), ios::out | ios::binary | ios::trunc);
+  if (!fout.good()) return;
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.mMagic, SNAPSHOT_MAGIC, sizeof(header.mMagic));
+  header.mVersion = SNAPSHOT_VERSION;
+  header.mByteOrder = SNAPSHOT_BYTE_ORDER;
+  header.mFingerprint = sDatabaseSettings.GetFingerprint();
+  header.mNumRanks = sNumRanks;
+  fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  
+  SnapshotWriter writer(fout);
+  SaveColumns(writer, sBasisLines, sNumRanks);
+  SaveColumns(writer, sBasisMarks, sNumRanks);
+  
+  // Now that we know what's in it, we can fill in the rest of the header.
+  header.mBodySize = writer.GetSize();
+  header.mChecksum = writer.GetChecksum();
+  fout.seekp(0);
+  fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  fout.close();
+  if (fout.fail()) {
+    remove(tempFile.c_str());
+    return;
   }
-  ss << "error > " << 
-    setprecision(3) << sBucketSize * (sNumBuckets - 1) << 
-    " = " << (actNumTrials - total) << " (" << 
-    setprecision(1) << 100. * double(actNumTrials - total) / actNumTrials << 
-    "%)" << endl;
-    
-  // Sort the errors and write percentiles of the errors into output string
-  sort(errors.begin(), errors.end());
-  ss << setprecision(4);
-  ss << endl << "Distribution of errors:" << endl;
-  ss << "10th percentile :" << errors[int(.10 * errors.size())] << endl;
-  ss << "20th percentile :" << errors[int(.20 * errors.size())] << endl;
-  ss << "50th percentile :" << errors[int(.50 * errors.size())] << endl;
-  ss << "80th percentile :" << errors[int(.80 * errors.size())] << endl;
-  ss << "90th percentile :" << errors[int(.90 * errors.size())] << endl;
-  ss << "95th percentile :" << errors[int(.95 * errors.size())] << endl;
-  ss << "99th percentile :" << errors[int(.99 * errors.size())] << endl;
-  
-  sStatistics = ss.str();
+#ifdef _WIN32
+  remove(sDatabaseFile.c_str());    // rename() won't replace a file here
+#endif
+  if (rename(tempFile.c_str(), sDatabaseFile.c_str()) != 0) 
+    remove(tempFile.c_str());
+}
+
+
+/*****
+If sDatabaseFile holds a snapshot of a database built with the given settings
+that has more than minRanks complete ranks, replace the database with it and
+return true. The columns become views of the snapshot, which stays mapped in
+sSnapshot. If the header or the checksum is wrong, the database is untouched.
+*****/
+bool ReferenceFinder::LoadDatabase(const DatabaseSettings& settings, 
+  rank_t minRanks)
+{
+  RefSnapshot snapshot;
+  if (!snapshot.Open(sDatabaseFile) || 
+    snapshot.GetSize() < sizeof(SnapshotHeader)) return false;
+  SnapshotHeader header;
+  memcpy(&header, snapshot.GetData(), sizeof(header));
+  const char* body = snapshot.GetData() + sizeof(header);
+  size_t bodySize = snapshot.GetSize() - sizeof(header);
+  if (memcmp(header.mMagic, SNAPSHOT_MAGIC, sizeof(header.mMagic)) != 0 ||
+    header.mVersion != SNAPSHOT_VERSION || 
+    header.mByteOrder != SNAPSHOT_BYTE_ORDER ||
+    header.mFingerprint != settings.GetFingerprint() ||
+    header.mBodySize != bodySize || 
+    header.mNumRanks <= minRanks || 
+    header.mNumRanks > numeric_limits<rank_t>::max() ||
+    HashBytes(SNAPSHOT_HASH_BASIS, body, bodySize) != header.mChecksum) 
+    return false;
   
-  // Call the callback for the final time, passing the string containing the
-  // results.
-  if (sStatisticsFn) {
-    sStatisticsFn(StatisticsInfo(STATISTICS_DONE), 
-      sStatisticsUserData, cancel);
+  // Out with the old database, in with the new. The old snapshot, if any, is
+  // closed on the way out.
+  sBasisLines.Rebuild();
+  sBasisMarks.Rebuild();
+  sSnapshot.Swap(snapshot);
+  rank_t numRanks = rank_t(header.mNumRanks);
+  SnapshotReader reader(body, bodySize);
+  if (LoadColumns(reader, sBasisLines, numRanks) && 
+    LoadColumns(reader, sBasisMarks, numRanks) &&
+    CheckColumns(sBasisLines.cols, sBasisLines.rankStart, false, 
+      sBasisLines.cols, sBasisMarks.cols) &&
+    CheckColumns(sBasisMarks.cols, sBasisMarks.rankStart, true, 
+      sBasisLines.cols, sBasisMarks.cols)) {
+    sDatabaseSettings = settings;
+    sNumRanks = numRanks;
+    return true;
   }
+  
+  // A good checksum on bad contents; we're left with nothing.
+  sBasisLines.Rebuild();
+  sBasisMarks.Rebuild();
+  sSnapshot.Close();
+  sNumRanks = 0;
+  return false;
 }
 
 
 /*****
-This routine builds Peter Messer's construction of  cube root of 2. Only used
-for testing, but I'll leave it in here for edification.
+struct RefMatch - a row of a RefContainer and how far its ref is from a target.
+Matches are ordered the same way as CompareRankAndError orders refs; exact ties
+go to the lower row.
 *****/
-void ReferenceFinder::MesserCubeRoot(ostream& os)
-{
-  // Rank 0: Construct the four edges of the square.
-  RefLine *be, *le, *re, *te;
+struct RefMatch {
+  double mError;
+  RefBase::rank_t mRank;
+  RefBase::row_t mRow;
   
-  ReferenceFinder::sBasisLines.Add(be = new RefLine_Original(
-    sPaper.mBottomEdge, 0, string("bottom edge")));
-  ReferenceFinder::sBasisLines.Add(le = new RefLine_Original(
-    sPaper.mLeftEdge, 0, string("left edge")));
-  ReferenceFinder::sBasisLines.Add(re = new RefLine_Original(
-    sPaper.mRightEdge, 0, string("right edge")));
-  ReferenceFinder::sBasisLines.Add(te = new RefLine_Original
-    (sPaper.mTopEdge, 0, string("top edge")));
-
-  // Rank 0: Construct the four corners of the square.
-  RefMark *blc, *brc, *tlc, *trc;
-  
-  ReferenceFinder::sBasisMarks.Add(blc = new RefMark_Original(
-  sPaper.mBotLeft, 0, string("bot left corner")));
-  ReferenceFinder::sBasisMarks.Add(brc = new RefMark_Original(
-  sPaper.mBotRight, 0, string("bot right corner")));
-  ReferenceFinder::sBasisMarks.Add(tlc = new RefMark_Original(
-  sPaper.mTopLeft, 0, string("top left corner")));
-  ReferenceFinder::sBasisMarks.Add(trc = new RefMark_Original(
-  sPaper.mTopRight, 0, string("top right corner")));
+  RefMatch(double aerror, RefBase::rank_t arank, RefBase::row_t arow) :
+    mError(aerror), mRank(arank), mRow(arow) {};
+  bool operator<(const RefMatch& rm) const {
+    if ((mError > ReferenceFinder::sGoodEnoughError) || 
+      (rm.mError > ReferenceFinder::sGoodEnoughError)) {
+      if (mError != rm.mError) return mError < rm.mError;
+      if (mRank != rm.mRank) return mRank < rm.mRank;
+    }
+    else {
+      if (mRank != rm.mRank) return mRank < rm.mRank;
+      if (mError != rm.mError) return mError < rm.mError;
+    }
+    return mRow < rm.mRow;
+  };
+};
 
-  // Create the endpoints of the two initial fold lines
-  RefMark *rma1, *rma2, *rmb1, *rmb2;
-  ReferenceFinder::sBasisMarks.Add(rma1 = new RefMark_Original(XYPt(0, 1./3), 0, 
-    string("(0, 1/3)")));
-  ReferenceFinder::sBasisMarks.Add(rma2 = new RefMark_Original(XYPt(1, 1./3), 0, 
-    string("(1, 1/3)")));
-  ReferenceFinder::sBasisMarks.Add(rmb1 = new RefMark_Original(XYPt(0, 2./3), 0, 
-    string("(0, 2/3)")));
-  ReferenceFinder::sBasisMarks.Add(rmb2 = new RefMark_Original(XYPt(1, 2./3), 0, 
-    string("(1, 2/3)")));
 
-  // Create and add the two initial fold lines.
-  RefLine *rla, *rlb;
-  ReferenceFinder::sBasisLines.Add(rla = new RefLine_C2P_C2P(rma1, rma2));
-  ReferenceFinder::sBasisLines.Add(rlb = new RefLine_C2P_C2P(rmb1, rmb2));
-  
-  // Construct the fold line
-  RefLine_P2L_P2L rlc(brc, le, rma2, rlb, 0);
-  
-  // Print the entire sequence
-  rlc.PutHowtoSequence(os);
-  
-  // quit the program
-  exit(1);
+/*****
+Add match rm to best, a sorted list of no more than numRefs matches, if it's
+good enough to be there.
+*****/
+static void AddMatch(vector<RefMatch>& best, const RefMatch& rm, size_t numRefs)
+{
+  if (best.size() >= numRefs && (best.empty() || !(rm < best.back()))) return;
+  best.insert(upper_bound(best.begin(), best.end(), rm), rm);
+  if (best.size() > numRefs) best.pop_back();
+}
+
+
+/*****
+Return the largest error that a ref of rank arank could have and still make
+best, a list of no more than numRefs matches, or -1 if it can't make the list
+at all. A ref of higher rank can never have a larger limit.
+*****/
+static double GetErrorLimit(const vector<RefMatch>& best, size_t numRefs, 
+  RefBase::rank_t arank)
+{
+  if (numRefs == 0) return -1;
+  if (best.size() < numRefs) return numeric_limits<double>::max();
+  const RefMatch& rm = best.back();
+  if (rm.mError > ReferenceFinder::sGoodEnoughError || arank == rm.mRank) 
+    return rm.mError;
+  if (arank < rm.mRank) return ReferenceFinder::sGoodEnoughError;
+  return -1;
+}
+
+
+/*****
+Packs of doubles, for the scans below: as many as fit in a vector register, or
+just one if we aren't using vector instructions. Only operations that round
+exactly the way the scalar ones do are used, so a pack of errors comes out the
+same as if each one had been worked out by itself.
+*****/
+#if defined(RF_USE_AVX)
+typedef __m256d pack_t;
+const size_t PACK_SIZE = 4;
+inline pack_t PackSet(double x) {return _mm256_set1_pd(x);}
+inline pack_t PackLoad(const double* p) {return _mm256_loadu_pd(p);}
+inline void PackStore(double* p, pack_t x) {_mm256_storeu_pd(p, x);}
+inline pack_t PackAdd(pack_t x, pack_t y) {return _mm256_add_pd(x, y);}
+inline pack_t PackSub(pack_t x, pack_t y) {return _mm256_sub_pd(x, y);}
+inline pack_t PackMul(pack_t x, pack_t y) {return _mm256_mul_pd(x, y);}
+inline pack_t PackSqrt(pack_t x) {return _mm256_sqrt_pd(x);}
+inline pack_t PackMax(pack_t x, pack_t y) {return _mm256_max_pd(x, y);}
+inline pack_t PackMin(pack_t x, pack_t y) {return _mm256_min_pd(x, y);}
+#elif defined(RF_USE_SSE2)
+typedef __m128d pack_t;
+const size_t PACK_SIZE = 2;
+inline pack_t PackSet(double x) {return _mm_set1_pd(x);}
+inline pack_t PackLoad(const double* p) {return _mm_loadu_pd(p);}
+inline void PackStore(double* p, pack_t x) {_mm_storeu_pd(p, x);}
+inline pack_t PackAdd(pack_t x, pack_t y) {return _mm_add_pd(x, y);}
+inline pack_t PackSub(pack_t x, pack_t y) {return _mm_sub_pd(x, y);}
+inline pack_t PackMul(pack_t x, pack_t y) {return _mm_mul_pd(x, y);}
+inline pack_t PackSqrt(pack_t x) {return _mm_sqrt_pd(x);}
+inline pack_t PackMax(pack_t x, pack_t y) {return _mm_max_pd(x, y);}
+inline pack_t PackMin(pack_t x, pack_t y) {return _mm_min_pd(x, y);}
+#else
+typedef double pack_t;
+const size_t PACK_SIZE = 1;
+inline pack_t PackSet(double x) {return x;}
+inline pack_t PackLoad(const double* p) {return *p;}
+inline void PackStore(double* p, pack_t x) {*p = x;}
+inline pack_t PackAdd(pack_t x, pack_t y) {return x + y;}
+inline pack_t PackSub(pack_t x, pack_t y) {return x - y;}
+inline pack_t PackMul(pack_t x, pack_t y) {return x * y;}
+inline pack_t PackSqrt(pack_t x) {return sqrt(x);}
+inline pack_t PackMax(pack_t x, pack_t y) {return max_val(x, y);}
+inline pack_t PackMin(pack_t x, pack_t y) {return min_val(x, y);}
+#endif
+inline pack_t PackDot(pack_t x1, pack_t y1, pack_t x2, pack_t y2) {
+  // Same as XYPt::Dot()
+  return PackAdd(PackMul(x1, x2), PackMul(y1, y2));
+}
+inline pack_t PackMag(pack_t x, pack_t y) {
+  // Same as XYPt::Mag()
+  return PackSqrt(PackDot(x, y, x, y));
 }
 
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
+/**********
+class RefScan - the target of a search that scans every ref, set up so that
+GetErrors() can work out the errors of a run of rows in the columns a pack at a
+time. Each error is computed with exactly the same arithmetic, in the same
+order, as DistanceBetween(). class R = RefMark or RefLine.
+**********/
+template <class R>
+class RefScan;
+
+template <>
+class RefScan<RefMark> {
+public:
+  RefScan(const XYPt& ap) : mTarget(ap) {};
+  void GetErrors(const RefColumns<RefMark>& cols, size_t abegin, size_t aend, 
+    double* aerrs) const {
+    // Distance from each mark to the target
+    pack_t tx = PackSet(mTarget.x);
+    pack_t ty = PackSet(mTarget.y);
+    const double* px = cols.mX.data();
+    const double* py = cols.mY.data();
+    size_t i = abegin;
+    for (; i + PACK_SIZE <= aend; i += PACK_SIZE, aerrs += PACK_SIZE) {
+      pack_t dx = PackSub(PackLoad(px + i), tx);
+      pack_t dy = PackSub(PackLoad(py + i), ty);
+      PackStore(aerrs, PackMag(dx, dy));
+    }
+    for (; i < aend; i++) 
+      *aerrs++ = RefMark::DistanceBetween(cols.GetBare(row_t(i)), mTarget);
+  };
+private:
+  typedef RefBase::row_t row_t;
+  XYPt mTarget;
+};
+
+template <>
+class RefScan<RefLine> {
+public:
+  RefScan(const XYLine& al) : mTarget(al), mWorstCase(false), mMisses(false) {
+    // For the worst-case error, we need to know where the target leaves the
+    // paper; if it misses the paper, every line is very far away from it.
+    if (ReferenceFinder::sLineWorstCaseError) {
+      mWorstCase = true;
+      mMisses = !ReferenceFinder::sPaper.ClipLine(al, mEnd1, mEnd2);
+    }
+  };
+  void GetErrors(const RefColumns<RefLine>& cols, size_t abegin, size_t aend, 
+    double* aerrs) const {
+    if (mMisses) fill(aerrs, aerrs + (aend - abegin), 1 / EPS);
+    else if (mWorstCase) GetWorstCaseErrors(cols, abegin, aend, aerrs);
+    else GetPythagoreanErrors(cols, abegin, aend, aerrs);
+  };
+private:
+  typedef RefBase::row_t row_t;
+  XYLine mTarget;
+  bool mWorstCase;
+  bool mMisses;
+  XYPt mEnd1;     // where the target leaves the paper
+  XYPt mEnd2;
+  
+  void GetWorstCaseErrors(const RefColumns<RefLine>& cols, size_t abegin, 
+    size_t aend, double* aerrs) const {
+    // The smaller of the two ways of pairing up the endpoints
+    pack_t ax = PackSet(mEnd1.x);
+    pack_t ay = PackSet(mEnd1.y);
+    pack_t bx = PackSet(mEnd2.x);
+    pack_t by = PackSet(mEnd2.y);
+    size_t i = abegin;
+    for (; i + PACK_SIZE <= aend; i += PACK_SIZE, aerrs += PACK_SIZE) {
+      pack_t x1 = PackLoad(cols.mX1.data() + i);
+      pack_t y1 = PackLoad(cols.mY1.data() + i);
+      pack_t x2 = PackLoad(cols.mX2.data() + i);
+      pack_t y2 = PackLoad(cols.mY2.data() + i);
+      pack_t err1 = PackMax(PackMag(PackSub(x1, ax), PackSub(y1, ay)), 
+        PackMag(PackSub(x2, bx), PackSub(y2, by)));
+      pack_t err2 = PackMax(PackMag(PackSub(x1, bx), PackSub(y1, by)), 
+        PackMag(PackSub(x2, ax), PackSub(y2, ay)));
+      PackStore(aerrs, PackMin(err1, err2));
+    }
+    for (; i < aend; i++) 
+      *aerrs++ = RefLine::DistanceBetween(cols.GetEnd1(row_t(i)), 
+        cols.GetEnd2(row_t(i)), mEnd1, mEnd2);
+  };
+  void GetPythagoreanErrors(const RefColumns<RefLine>& cols, size_t abegin, 
+    size_t aend, double* aerrs) const {
+    // The sine of the angle between the lines and the difference in distance
+    pack_t tnx = PackSet(-mTarget.u.y);   // the target's normal, rotated
+    pack_t tny = PackSet(mTarget.u.x);
+    pack_t tux = PackSet(mTarget.u.x);
+    pack_t tuy = PackSet(mTarget.u.y);
+    pack_t td = PackSet(mTarget.d);
+    size_t i = abegin;
+    for (; i + PACK_SIZE <= aend; i += PACK_SIZE, aerrs += PACK_SIZE) {
+      pack_t ux = PackLoad(cols.mUx.data() + i);
+      pack_t uy = PackLoad(cols.mUy.data() + i);
+      pack_t s = PackDot(ux, uy, tnx, tny);
+      pack_t dd = PackSub(PackLoad(cols.mD.data() + i), 
+        PackMul(td, PackDot(ux, uy, tux, tuy)));
+      PackStore(aerrs, PackMag(s, dd));
+    }
+    for (; i < aend; i++) 
+      *aerrs++ = RefLine::DistanceBetween(cols.GetBare(row_t(i)), mTarget);
+  };
+};
 
 
-/******************************************************************************
-Section 1: lightweight classes that represent points and lines
-******************************************************************************/
+/*****
+Find the numRefs refs in columns cols closest to each of the numTargets targets
+in atargets, by scanning all of them, and put the matches for target t in
+abests[t], best first. We go through the columns a block of rows at a time,
+working out the errors of the whole block for each target in turn, so every
+target shares the one pass through memory. Each target keeps a sorted list of
+its best matches so far, so only the refs that make the final list have to be
+made into objects. At the end, we work out the errors of those refs again the
+usual way and sort them again, so that the lists can't depend on how the
+errors were computed.
+
+The columns are sorted by rank, so once a target's list is full of refs that
+are good enough, and of lower rank than the rest of the columns, nothing that
+is left could get onto it (see GetErrorLimit()), and that target is done. Most
+targets are done long before the highest ranks, which hold most of the refs.
+
+Only rows abegin up to (but not including) aend are scanned, which by default
+is all of them.
+*****/
+template <class R>
+static void ScanBestRefs(const RefColumns<R>& cols, 
+  const typename R::bare_t* atargets, size_t numTargets, size_t numRefs, 
+  vector<RefMatch>* abests, size_t abegin = 0, size_t aend = size_t(-1))
+{
+  typedef RefBase::row_t row_t;
+  const size_t SCAN_BLOCK = 1024;
+  double errs[SCAN_BLOCK];
+  vector<RefScan<R> > scans;
+  scans.reserve(numTargets);
+  for (size_t t = 0; t < numTargets; t++) {
+    scans.push_back(RefScan<R>(atargets[t]));
+    abests[t].clear();
+    abests[t].reserve(numRefs + 1);
+  }
+  size_t n = min(cols.size(), aend);
+  vector<bool> done(numTargets, false);
+  size_t numLeft = numTargets;
+  for (size_t i0 = abegin; i0 < n && numLeft > 0; i0 += SCAN_BLOCK) {
+    size_t i1 = min(n, i0 + SCAN_BLOCK);
+    for (size_t t = 0; t < numTargets; t++) {
+      if (done[t]) continue;
+      scans[t].GetErrors(cols, i0, i1, errs);
+      for (size_t i = i0; i < i1; i++) 
+        AddMatch(abests[t], RefMatch(errs[i - i0], cols.mRank[i], row_t(i)), 
+          numRefs);
+      if (i1 < n && GetErrorLimit(abests[t], numRefs, cols.mRank[i1]) < 0) {
+        done[t] = true;
+        numLeft--;
+      }
+    }
+  }
+  for (size_t t = 0; t < numTargets; t++) {
+    vector<RefMatch>& best = abests[t];
+    for (size_t i = 0; i < best.size(); i++) 
+      best[i].mError = R::DistanceBetween(cols.GetBare(best[i].mRow), 
+        atargets[t]);
+    sort(best.begin(), best.end());
+  }
+}
+
 
 /**********
-class XYPt - a 2-vector that represents a point or 2-vector (direction vector).
-It is a lightweight mathematical object. Most operations are defined in the
-header, intended to be inlined for speed.
+class RefShardScan - function object for ParallelFor() that scans one shard of
+the rows of cols for a single target, as ScanBestRefs() does, putting the best
+matches in that shard into abests[i].
 **********/
+template <class R>
+class RefShardScan {
+public:
+  enum {SHARD_SIZE = 65536};  // fewest rows worth a thread of their own
+  
+  RefShardScan(const RefColumns<R>& acols, const typename R::bare_t& atarget, 
+    size_t anumRefs, vector<vector<RefMatch> >& abests) : 
+    mCols(acols), mTarget(atarget), mNumRefs(anumRefs), mBests(abests) {};
+  void operator()(size_t i) {
+    // Scan shard i
+    size_t n = mCols.size();
+    size_t numShards = mBests.size();
+    ScanBestRefs(mCols, &mTarget, 1, mNumRefs, &mBests[i], 
+      n / numShards * i + min(i, n % numShards), 
+      n / numShards * (i + 1) + min(i + 1, n % numShards));
+  };
+
+private:
+  const RefColumns<R>& mCols;
+  const typename R::bare_t& mTarget;
+  size_t mNumRefs;
+  vector<vector<RefMatch> >& mBests;
+};
+
 
 /*****
-Stream I/O for a XYPt spits out the point as a parenthesis-enclosed,
-comma-delimited pair. 
+Find the numRefs refs in columns cols closest to atarget and put them in best,
+as ScanBestRefs() does, but with the rows split into shards that are scanned
+over GetNumThreads() threads. A ref that doesn't make the list for its own
+shard can't make it for all of them, so merging the lists from the shards
+gives exactly the list from a single scan. Small databases are scanned in one
+piece, since it isn't worth starting threads for them.
 *****/
-ostream& operator<<(ostream& os, const XYPt& p)
-{
-  return os << "(" << (p.x) << "," << (p.y) << ")";
+template <class R>
+static void ShardBestRefs(const RefColumns<R>& cols, 
+  const typename R::bare_t& atarget, size_t numRefs, vector<RefMatch>& best)
+{
+  size_t numShards = min(ReferenceFinder::GetNumThreads(), 
+    cols.size() / RefShardScan<R>::SHARD_SIZE);
+  if (numShards <= 1) {
+    ScanBestRefs(cols, &atarget, 1, numRefs, &best);
+    return;
+  }
+  vector<vector<RefMatch> > bests(numShards);
+  RefShardScan<R> scan(cols, atarget, numRefs, bests);
+  ParallelFor(scan, numShards);
+  best.clear();
+  best.reserve(numRefs + 1);
+  for (size_t i = 0; i < numShards; i++) 
+    for (size_t j = 0; j < bests[i].size(); j++) 
+      AddMatch(best, bests[i][j], numRefs);
+}
+
+
+/*****
+Go through the cells of grid in rings around the cell nearest to ap, starting
+with that cell itself, and pass the rows of each one to av.Visit(). After each
+ring, av.IsDone() is told how close to ap any mark outside of it could be, and
+can end the walk.
+*****/
+template <class V>
+static void ForEachRing(const RefMarkGrid& grid, const XYPt& ap, V& av)
+{
+  if (grid.IsEmpty()) return;
+  int cx, cy;
+  grid.GetCell(ap, cx, cy);
+  int numRings = grid.GetNumRings(cx, cy);
+  for (int k = 0; k < numRings; k++) {
+    // Ring k consists of whole rows of cells at the top and bottom, and the
+    // cells at either end of the rows in between.
+    int xmin = max(cx - k, 0);
+    int xmax = min(cx + k, grid.GetNumX() - 1);
+    int ymin = max(cy - k, 0);
+    int ymax = min(cy + k, grid.GetNumY() - 1);
+    for (int iy = ymin; iy <= ymax; iy++) {
+      if (iy == cy - k || iy == cy + k) {
+        for (int ix = xmin; ix <= xmax; ix++) 
+          av.Visit(grid.CellBegin(ix, iy), grid.CellEnd(ix, iy));
+      }
+      else {
+        if (cx - k == xmin) 
+          av.Visit(grid.CellBegin(xmin, iy), grid.CellEnd(xmin, iy));
+        if (cx + k == xmax) 
+          av.Visit(grid.CellBegin(xmax, iy), grid.CellEnd(xmax, iy));
+      }
+    }
+    if (av.IsDone(grid.GetDistanceBeyond(ap, cx, cy, k))) break;
+  }
 }
 
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
-
+/*****
+Go through the buckets of index in order of the lower bounds on the errors of
+their lines from al, and pass the rows of each one to av.Visit(). Before each
+bucket, av.IsDone() is told its bound, and can end the walk. For the worst-case
+error, pa and pb are where al crosses the edges of the paper.
+*****/
+template <class V>
+static void ForEachBucket(const RefLineIndex& index, const XYLine& al, 
+  const XYPt& pa, const XYPt& pb, V& av)
+{
+  // Make a heap of the buckets, with the smallest lower bound on top.
+  bool worstCase = ReferenceFinder::sLineWorstCaseError;
+  double angle = atan2(al.u.y, al.u.x);
+  vector<pair<double, size_t> > order(index.GetNumBuckets());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i].first = worstCase ? index.GetLowerBound(i, pa, pb) : 
+      index.GetLowerBound(i, al, angle);
+    order[i].second = i;
+  }
+  greater<pair<double, size_t> > later;
+  make_heap(order.begin(), order.end(), later);
+  while (!order.empty()) {
+    if (av.IsDone(order.front().first)) break;
+    size_t ib = order.front().second;
+    pop_heap(order.begin(), order.end(), later);
+    order.pop_back();
+    av.Visit(index.BucketBegin(ib), index.BucketEnd(ib));
+  }
+}
 
-/**********
-class XYLine - a class for representing a line by a scalar d and the unit
-normal to the line, u, where the point d*u is the point on the line closest to
-the origin. Note that (d,u) and (-d,-u) represent the same line. If u isn't a
-unit vector, many things will break, so when in doubt, use Normalize() or
-NormalizeSelf().
-**********/
 
 /*****
-Stream I/O for a XYLine spits out the values of d and u as a
-parenthesis-enclosed, comma-delimited pair, e.g., "(0,(1,0))".
+Return the error of the ref in row i of cols from target ap or al, the same way
+DistanceBetween() does. For the worst-case error of a line, pa and pb are where
+al crosses the edges of the paper.
 *****/
-ostream& operator<<(ostream& os, const XYLine& l)
+static double GetRefError(const RefColumns<RefMark>& cols, RefBase::row_t i, 
+  const XYPt& ap, const XYPt& /* pa */, const XYPt& /* pb */)
 {
-  return os << "(" << (l.d) << "," << (l.u) << ")";
+  return RefMark::DistanceBetween(cols.GetBare(i), ap);
 }
 
-
-#ifdef __MWERKS__
-#pragma mark -
-#endif
+static double GetRefError(const RefColumns<RefLine>& cols, RefBase::row_t i, 
+  const XYLine& al, const XYPt& pa, const XYPt& pb)
+{
+  if (ReferenceFinder::sLineWorstCaseError) 
+    return RefLine::DistanceBetween(cols.GetEnd1(i), cols.GetEnd2(i), pa, pb);
+  return RefLine::DistanceBetween(cols.GetBare(i), al);
+}
 
 
 /**********
-class XYRect - a class for representing rectangles by two points, the bottom
-left and top right corners.
+class RefNearMatcher - visitor for ForEachRing() and ForEachBucket() that keeps
+best, a list of the numRefs best matches for a target, and stops once none of
+the refs that are left could make the list. Any ref within sGoodEnoughError
+beats any ref that isn't, so that's once all of them are farther away than that,
+and also farther away than the last ref on the list (unless that one is good
+enough itself). class R = RefMark or RefLine.
 **********/
+template <class R>
+class RefNearMatcher {
+public:
+  RefNearMatcher(const RefColumns<R>& acols, const typename R::bare_t& atarget, 
+    const XYPt& apa, const XYPt& apb, size_t anumRefs, 
+    vector<RefMatch>& abest) : 
+    mCols(acols), mTarget(atarget), mPa(apa), mPb(apb), mNumRefs(anumRefs), 
+    mBest(abest) {};
+  void Visit(const RefBase::row_t* abegin, const RefBase::row_t* aend) {
+    // The rows in a cell or bucket are in order, so their ranks are too, and
+    // once one can't make the list, none of the rest can either.
+    for (const RefBase::row_t* pr = abegin; pr != aend; pr++) {
+      RefBase::rank_t irank = mCols.mRank[*pr];
+      if (mBest.size() >= mNumRefs && 
+        GetErrorLimit(mBest, mNumRefs, irank) < 0) break;
+      AddMatch(mBest, RefMatch(GetRefError(mCols, *pr, mTarget, mPa, mPb), 
+        irank, *pr), mNumRefs);
+    }
+  };
+  bool IsDone(double abound) const {
+    const double goodEnough = ReferenceFinder::sGoodEnoughError;
+    if (mBest.size() < mNumRefs) return false;
+    return abound > goodEnough && 
+      (mBest.back().mError <= goodEnough || abound > mBest.back().mError);
+  };
+
+private:
+  const RefColumns<R>& mCols;
+  const typename R::bare_t& mTarget;
+  const XYPt& mPa;
+  const XYPt& mPb;
+  size_t mNumRefs;
+  vector<RefMatch>& mBest;
+};
+
 
 /*****
-Return the aspect ratio of the rectangle, defined to be the smaller dimension
-divided by the larger dimension. If it's empty, return zero. If the rectangles
-is improperly defined, the aspect ratio may be negative.
+Find the numRefs marks in cols closest to point ap, best first, using grid, the
+RefMarkGrid of those marks. The marks are the ones that ScanBestRefs() would
+find, in the same order, but we only look at the cells of the grid around ap,
+one ring of cells at a time, until RefNearMatcher says we're done.
 *****/
-double XYRect::GetAspectRatio() const
+static void FindNearRefs(const RefMarkGrid& grid, 
+  const RefColumns<RefMark>& cols, const XYPt& ap, size_t numRefs, 
+  vector<RefMatch>& best)
 {
-  double wd = GetWidth();
-  double ht = GetHeight();
-  if (abs(wd) < EPS && abs(ht) < EPS) return 0;
-  if (abs(wd) <= abs(ht)) return wd / ht;
-  return ht / wd;
+  best.clear();
+  best.reserve(numRefs + 1);
+  if (numRefs == 0) return;
+  RefNearMatcher<RefMark> matcher(cols, ap, ap, ap, numRefs, best);
+  ForEachRing(grid, ap, matcher);
 }
 
 
 /*****
-Stream I/O for a XYRect spits out the values of bl and tr as a
-parenthesis-enclosed, comma-delimited pair, e.g., "((0,0),(1,1))".
+Find the numRefs lines in cols closest to line al, best first, using index, the
+RefLineIndex of those lines. The lines are the ones that ScanBestRefs() would
+find, in the same order, but we go through the buckets of the index in order of
+the lower bounds on their errors, and stop as soon as none of the rest could
+make the list, by the same reasoning as for marks. For the worst-case error, we
+clip al to the paper just once and compare its endpoints with the ones stored
+for each line.
 *****/
-ostream& operator<<(ostream& os, const XYRect& r)
+static void FindNearRefs(const RefLineIndex& index, 
+  const RefColumns<RefLine>& cols, const XYLine& al, size_t numRefs, 
+  vector<RefMatch>& best)
 {
-  return os << "(" << (r.bl) << "," << (r.tr) << ")";
+  XYPt pa, pb;
+  if (ReferenceFinder::sLineWorstCaseError && 
+    !ReferenceFinder::sPaper.ClipLine(al, pa, pb)) {
+    // If al misses the paper, every line is equally far away from it, so we
+    // might as well scan them all.
+    ScanBestRefs(cols, &al, 1, numRefs, &best);
+    return;
+  }
+  best.clear();
+  best.reserve(numRefs + 1);
+  if (numRefs == 0) return;
+  RefNearMatcher<RefLine> matcher(cols, al, pa, pb, numRefs, best);
+  ForEachBucket(index, al, pa, pb, matcher);
 }
 
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
-
-
-/******************************************************************************
-Section 2: classes that represent reference marks and lines on a piece of paper
-******************************************************************************/
-
 /**********
-class Paper - specialization of XYRect, used for representing the paper
+class RefBatchSearch - function object for ParallelFor() that finds the best
+refs for one chunk of a batch of targets. Nothing it does changes the database,
+so chunks can be searched at the same time. class R = RefMark or RefLine, class
+I = the index that goes with it.
 **********/
+template <class R, class I>
+class RefBatchSearch {
+public:
+  enum {CHUNK_SIZE = 64};   // targets per chunk
+  
+  RefBatchSearch(const I& aindex, const RefColumns<R>& acols, 
+    const vector<typename R::bare_t>& atargets, size_t anumRefs, 
+    vector<vector<RefMatch> >& abests) : 
+    mIndex(aindex), mCols(acols), mTargets(atargets), mNumRefs(anumRefs), 
+    mBests(abests) {};
+  size_t GetNumChunks() const {
+    return (mTargets.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  };
+  void operator()(size_t ichunk) {
+    // Search for the targets in chunk ichunk
+    size_t t0 = ichunk * CHUNK_SIZE;
+    size_t t1 = min(mTargets.size(), t0 + CHUNK_SIZE);
+    if (!ReferenceFinder::sUseSearchIndexes) {
+      ScanBestRefs(mCols, &mTargets[t0], t1 - t0, mNumRefs, &mBests[t0]);
+      return;
+    }
+    for (size_t t = t0; t < t1; t++) 
+      FindNearRefs(mIndex, mCols, mTargets[t], mNumRefs, mBests[t]);
+  };
+
+private:
+  const I& mIndex;
+  const RefColumns<R>& mCols;
+  const vector<typename R::bare_t>& mTargets;
+  size_t mNumRefs;
+  vector<vector<RefMatch> >& mBests;
+};
+
 
 /*****
-Constructor
+Return true if container rc has a ref with key akey. Within each rank the refs
+are sorted by key, so we can look for it one rank at a time.
 *****/
-Paper::Paper(double aWidth, double aHeight) :
-  XYRect(aWidth, aHeight)
+template <class R>
+static bool HasKey(const RefContainer<R>& rc, RefBase::key_t akey)
 {
-  SetSize(aWidth, aHeight);
+  const RefBase::key_t* keys = rc.cols.mKey.data();
+  for (size_t ir = 0; ir + 1 < rc.rankStart.size(); ir++) 
+    if (binary_search(keys + rc.rankStart[ir], keys + rc.rankStart[ir + 1], 
+      akey)) return true;
+  return false;
 }
 
 
 /*****
-Set the size of the paper and all of the incidental data
+Return how far a parent of a ref might be from a target, if the ref itself is
+aerror away from it: aerror * (ascale + acurve * aerror), or -1 if aerror is.
 *****/
-void Paper::SetSize(double aWidth, double aHeight)
+static double GetParentReach(double aerror, double ascale, double acurve)
 {
-  bl = XYPt(0, 0);
-  tr = XYPt(aWidth, aHeight);
-  mWidth= aWidth;
-  mHeight = aHeight;
-  mBotLeft = XYPt(0, 0);
-  mBotRight = XYPt(aWidth, 0);
-  mTopLeft = XYPt(0, aHeight);
-  mTopRight = XYPt(aWidth, aHeight);
-  mTopEdge = XYLine(mTopLeft, mTopRight);
-  mLeftEdge = XYLine(mBotLeft, mTopLeft);
-  mRightEdge = XYLine(mBotRight, mTopRight);
-  mBottomEdge = XYLine(mBotLeft, mBotRight);
-  mUpwardDiagonal = XYLine(mBotLeft, mTopRight);
-  mDownwardDiagonal = XYLine(mTopLeft, mBotRight);
+  if (aerror < 0) return -1;
+  return aerror * (ascale + acurve * aerror);
 }
 
 
 /*****
-Clip the line al to the paper, returning the endpoints of the clipped segment
-in ap1 and ap2. If the line misses the paper entirely, return false and leave
-ap1 and ap2 unchanged.
+struct RefNear - a row of a RefContainer whose ref lies close enough to a target
+that it might lead to a better match in a deeper search. They're sorted by rank
+and then by distance, so that the closest ones of each rank come first.
 *****/
-bool Paper::ClipLine(const XYLine& al, XYPt& ap1, XYPt& ap2) const
-{
-  // Start by collecting all points of intersection between the line and the
-  // four sides of the paper.
-  
-  unsigned npts = 0;      // counter for number of points of intersection
-  XYPt ipts[4];       // list of points of intersection
-  XYPt p;           // a scratch pad for intersection points
-  
-  if (mTopEdge.Intersects(al, p) && Encloses(p)) ipts[npts++] = p;
-  if (mLeftEdge.Intersects(al, p) && Encloses(p)) ipts[npts++] = p;
-  if (mRightEdge.Intersects(al, p) && Encloses(p)) ipts[npts++] = p;
-  if (mBottomEdge.Intersects(al, p) && Encloses(p)) ipts[npts++] = p;
+struct RefNear {
+  RefBase::rank_t mRank;
+  double mDistance;
+  RefBase::row_t mRow;
   
-  if (npts == 0) return false;  // line entirely misses the paper
-
-  // Now parameterize all four points along the line, recording the minimum
-  // and maximum parameter values.
-  
-  XYPt pt = al.d * al.u;          // a point on the line
-  XYPt up = al.u.Rotate90();        // a tangent to the line
-  double tmin =( ipts[0] - pt).Dot(up);
-  double tmax = tmin;
-  for (unsigned i = 1; i < npts; i++) {
-    double tt = (ipts[i] - pt).Dot(up);
-    if (tmin < tt) tmin = tt;
-    if (tmax > tt) tmax = tt;
+  RefNear(RefBase::rank_t arank, double adistance, RefBase::row_t arow) : 
+    mRank(arank), mDistance(adistance), mRow(arow) {};
+  bool operator<(const RefNear& rn) const {
+    if (mRank != rn.mRank) return mRank < rn.mRank;
+    if (mDistance != rn.mDistance) return mDistance < rn.mDistance;
+    return mRow < rn.mRow;
   };
-  
-  // Compute the endpoints from our parameter ranges.
-  
-  ap1 = pt + tmin * up;
-  ap2 = pt + tmax * up;
-  return true;
-}
+};
 
 
 /*****
-Return true if line al overlaps the paper in its interior. Return false if the
-line misses the paper entirely, only hits a corner, or only runs along an edge.
+Function object that orders RefNears by distance alone.
 *****/
-bool Paper::InteriorOverlaps(const XYLine& al) const
-{
-  XYPt pa, pb;                // endpoints of the fold line
-  if (!ClipLine(al, pa, pb)) return false;  // the line completely misses the paper
-  
-  if ((pa - pb).Mag() < EPS) return false;  // line hits at a single point (a corner)
-  
-  if (!GetBoundingBox(pa, pb).IsEmpty()) return true;  // bounding box has positive volume
-  
-  // If still here, then the bounding box must be a line, either the edge of the paper
-  // or a vertical or horizontal line in the interior. We can test for the latter by 
-  // seeing if the midpoint of the line lies fully in the interior of the paper.
-  
-  XYPt mp = MidPoint(pa, pb);
-  
-  if (mTopEdge.Intersects(mp) || mBottomEdge.Intersects(mp) || 
-    mLeftEdge.Intersects(mp) || mRightEdge.Intersects(mp)) return false;
-  
-  return true;
-}
+struct CompareNearDistance {
+  bool operator()(const RefNear& rn1, const RefNear& rn2) const {
+    if (rn1.mDistance != rn2.mDistance) return rn1.mDistance < rn2.mDistance;
+    return rn1.mRow < rn2.mRow;
+  };
+};
 
 
 /*****
-The line al divides the paper into two portions. Return true if either of the
-two qualifies as a skinny flap. "Skinny" means a triangle (or quad) whose
-aspect ratio falls below a minimum size.
+struct RefLinePair - the rows of two lines in the database whose intersection
+is a mark that isn't in the database. The lines are in the order that
+RefMark_Intersection::MakeAll() would pass them to the constructor: the one of
+lower rank first, or if they have the same rank, the one in the later row.
 *****/
-bool Paper::MakesSkinnyFlap(const XYLine& al) const 
-{
-  // Since "true" = "bad", we'll return true for any failures along the way due to bad
-  // input parameters.
-  
-  XYPt p1, p2;            // endpoints of the line al
-  ClipLine(al, p1, p2);       // get the endpoints of the fold line on the paper
-  
-  XYLine lb;              // perpendicular bisector of line segment p1-p2
-  lb.u = al.u.Rotate90();
-  lb.d = MidPoint(p1, p2).Dot(lb.u);
-  XYPt bp1, bp2;            // endpoints of the bisector
-  ClipLine(lb, bp1, bp2);       // get the endpoints of the bisector
+struct RefLinePair {
+  RefBase::row_t mRow1;
+  RefBase::row_t mRow2;
   
-  // Get the bounding box that contains the fold line and a point on either side of the
-  // fold line. If this bounding box is below the minimum aspect ratio, then it contains
-  // a flap that falls below the minimum aspect ratio, so we return true.
+  RefLinePair(const RefColumns<RefLine>& lines, RefBase::row_t arow1, 
+    RefBase::row_t arow2) : mRow1(arow1), mRow2(arow2) {
+    if (lines.mRank[mRow1] > lines.mRank[mRow2] || 
+      (lines.mRank[mRow1] == lines.mRank[mRow2] && mRow1 < mRow2)) 
+      swap(mRow1, mRow2);
+  };
+  bool operator==(const RefLinePair& lp) const {
+    return mRow1 == lp.mRow1 && mRow2 == lp.mRow2;
+  };
+  bool IsMadeBefore(const RefColumns<RefLine>& lines, 
+    const RefLinePair& lp) const {
+    // True if MakeAll() would make our mark before that of lp. It goes by the
+    // rank of the mark, then the rank of the first line, then the rows.
+    int rank = lines.mRank[mRow1] + lines.mRank[mRow2];
+    int lpRank = lines.mRank[lp.mRow1] + lines.mRank[lp.mRow2];
+    if (rank != lpRank) return rank < lpRank;
+    if (lines.mRank[mRow1] != lines.mRank[lp.mRow1]) 
+      return lines.mRank[mRow1] < lines.mRank[lp.mRow1];
+    if (mRow1 != lp.mRow1) return mRow1 < lp.mRow1;
+    return mRow2 < lp.mRow2;
+  };
+};
 
-  if (abs(GetBoundingBox(p1, p2, bp1).GetAspectRatio()) < ReferenceFinder::sMinAspectRatio) 
-    return true;
-  if (abs(GetBoundingBox(p1, p2, bp2).GetAspectRatio()) < ReferenceFinder::sMinAspectRatio) 
-    return true;
-  
-  // If we're still here, we didn't create any skinny flaps, so we're cool.
-  
-  return false;
+
+/*****
+Put the lines in lines that pass close enough to point ap into anear: the ones
+of each rank r up to maxRank that are no farther from ap than alimits[r]. If
+we're using the search indexes, only the buckets of index that could hold such
+a line are looked at.
+*****/
+static void FindNearLines(const RefLineIndex& index, 
+  const RefColumns<RefLine>& lines, const XYPt& ap, RefBase::rank_t maxRank, 
+  const vector<double>& alimits, vector<RefNear>& anear)
+{
+  typedef RefBase::row_t row_t;
+  anear.clear();
+  double limit = *max_element(alimits.begin(), alimits.end());
+  if (limit < 0) return;
+  if (ReferenceFinder::sUseSearchIndexes && !index.IsEmpty()) {
+    double angle = atan2(ap.y, ap.x);
+    for (size_t ib = 0; ib < index.GetNumBuckets(); ib++) {
+      if (index.GetDistanceBound(ib, ap, angle) > limit) continue;
+      for (const row_t* pr = index.BucketBegin(ib); pr != index.BucketEnd(ib); 
+        pr++) {
+        RefBase::rank_t irank = lines.mRank[*pr];
+        if (irank > maxRank) continue;
+        double dist = abs(ap.x * lines.mUx[*pr] + ap.y * lines.mUy[*pr] - 
+          lines.mD[*pr]);
+        if (dist <= alimits[irank]) anear.push_back(RefNear(irank, dist, *pr));
+      }
+    }
+    return;
+  }
+  for (size_t i = 0; i < lines.size(); i++) {
+    RefBase::rank_t irank = lines.mRank[i];
+    if (irank > maxRank) continue;
+    double dist = abs(ap.x * lines.mUx[i] + ap.y * lines.mUy[i] - lines.mD[i]);
+    if (dist <= alimits[irank]) anear.push_back(RefNear(irank, dist, row_t(i)));
+  }
 }
 
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
+/*****
+RefMatchList - the numRefs best matches for a target so far, as kept by
+AddMatch(), for FindIntersections(). RefFrontier (below) is the other kind of
+list it can fill.
+*****/
+struct RefMatchList {
+  vector<RefMatch>& mBest;
+  size_t mNumRefs;
+  
+  RefMatchList(vector<RefMatch>& abest, size_t anumRefs) : 
+    mBest(abest), mNumRefs(anumRefs) {};
+  double GetLimit(RefBase::rank_t arank) const {
+    return GetErrorLimit(mBest, mNumRefs, arank);
+  };
+  bool Add(const RefMatch& rm) {
+    // Return true if rm made the list.
+    if (mBest.size() >= mNumRefs && !(rm < mBest.back())) return false;
+    AddMatch(mBest, rm, mNumRefs);
+    return true;
+  };
+};
 
 
 /**********
-class RefBase - base class for a mark or line. 
+class RefFrontier - the best match for a target at each rank from 0 to maxRank,
+from which we get the frontier of refs that can't be beaten: the ones that are
+closer to the target than any ref of lower rank. Exact ties go to the lower
+row, as they do for RefMatch.
 **********/
+class RefFrontier {
+public:
+  RefFrontier(RefBase::rank_t amaxRank) {
+    for (RefBase::rank_t ir = 0; ir <= amaxRank; ir++) 
+      mBest.push_back(RefMatch(numeric_limits<double>::max(), ir, NO_ROW));
+  };
+  double GetLimit(RefBase::rank_t arank) const {
+    // The largest error that a ref of rank arank could have and still be on
+    // the frontier
+    double limit = mBest[arank].mError;
+    for (RefBase::rank_t ir = 0; ir < arank; ir++) 
+      limit = min(limit, mBest[ir].mError);
+    return limit;
+  };
+  double GetMaxLimit(RefBase::rank_t afirstRank) const {
+    // The largest limit of any rank from afirstRank on, or -1 if there are
+    // no such ranks
+    double limit = -1;
+    double below = numeric_limits<double>::max();
+    for (RefBase::rank_t ir = 0; ir < mBest.size(); ir++) {
+      if (ir >= afirstRank) limit = max(limit, min(below, mBest[ir].mError));
+      below = min(below, mBest[ir].mError);
+    }
+    return limit;
+  };
+  bool Add(const RefMatch& rm) {
+    // Return true if rm is now the best match of its rank.
+    RefMatch& rb = mBest[rm.mRank];
+    if (rm.mError > rb.mError || (rm.mError == rb.mError && rm.mRow > rb.mRow)) 
+      return false;
+    if (rm.mError > GetLimit(rm.mRank)) return false;
+    rb = rm;
+    return true;
+  };
+  void GetMatches(vector<RefMatch>& afrontier) const {
+    // Put the matches on the frontier into afrontier, lowest rank first.
+    afrontier.clear();
+    double below = numeric_limits<double>::max();
+    for (size_t ir = 0; ir < mBest.size(); ir++) {
+      if (mBest[ir].mRow == NO_ROW || mBest[ir].mError >= below) continue;
+      afrontier.push_back(mBest[ir]);
+      below = mBest[ir].mError;
+    }
+  };
+
+private:
+  static const RefBase::row_t NO_ROW = RefBase::row_t(-1);
+  vector<RefMatch> mBest;
+};
 
-/*
-Non-static member variables are:
-mRank - the rank, which is the number of creases that need to be made to define
-  it.
-mKey - a unique key that is used to efficiently store and search over marks and
-  lines. mKey is initialized to 0. If the object has been successfully
-  constructed, it will be set to an integer greater than 0, so mKey==0 is used
-  as a test for successful construction.
-mIndex - a counter used in constructing the verbal sequence; basically, it's
-  the order in which the object is created for a given folding sequence.
-Any subclasses of RefBase should be fairly lightweight because we'll be
-creating a couple hundred thousand of them during program initialization.
-*/
 
 /*****
-RefBase static member initialization
-*****/
-RefDgmr* RefBase::sDgmr;
-vector<RefBase*> RefBase::sSequence;
-vector<RefBase::DgmInfo> RefBase::sDgms;
+Put into alp the pair of lines that owns key akey among the marks of rank up
+to arank: of all the pairs whose marks have that key, the one that
+RefMark_Intersection::MakeAll() would make first, which is the one a built
+database would keep. alp starts out as one such pair. CalcKey() rounds a mark
+to the nearest point of the key grid, so both lines of any mark with that key
+pass within half a cell diagonal of the point, and we look at every pair of
+lines that pass within a full diagonal of it. A key on the top edge is also the
+key of the next point along the bottom edge (see RefMark::CalcKey()), so for
+those keys we look around both points.
+*****/
+static void FindKeyOwner(const RefLineIndex& index, 
+  const RefColumns<RefLine>& lines, RefBase::key_t akey, 
+  RefBase::rank_t arank, RefLinePair& alp)
+{
+  const int numX = ReferenceFinder::sNumX;
+  const int numY = ReferenceFinder::sNumY;
+  const double dx = ReferenceFinder::sPaper.mWidth / numX;
+  const double dy = ReferenceFinder::sPaper.mHeight / numY;
+  vector<double> limits(arank + 1, sqrt(dx * dx + dy * dy));
+  RefBase::key_t nx = (akey - 1) / numY;
+  RefBase::key_t ny = (akey - 1) % numY;
+  vector<XYPt> centers(1, XYPt(nx * dx, ny * dy));
+  if (ny == 0 && nx > 0) centers.push_back(XYPt((nx - 1) * dx, numY * dy));
+  vector<RefNear> near;
+  for (size_t ic = 0; ic < centers.size(); ic++) {
+    FindNearLines(index, lines, centers[ic], arank, limits, near);
+    for (size_t i = 0; i < near.size(); i++) 
+      for (size_t j = 0; j < i; j++) {
+        if (near[i].mRank + near[j].mRank > arank) continue;
+        RefLinePair lp(lines, near[i].mRow, near[j].mRow);
+        if (!lp.IsMadeBefore(lines, alp)) continue;
+        XYPt p;
+        if (RefMark_Intersection::CalcIntersection(lines.GetBare(lp.mRow1), 
+          lines.GetBare(lp.mRow2), p) && RefMark::CalcKey(p) == akey) 
+          alp = lp;
+      }
+  }
+}
 
 
-/*  Notes on Sequences.
-A ref (RefMark or RefLine) is typically defined in terms of other refs, going
-all the way back to RefMark_Original and RefLine_Original. The routine
-aRef->BuildAndNumberSequence() constructs an ordered list of all the refs that
-make up aRef. The ordering is such that ancestor refs come earlier in the list
-than refs derived from them. In addition to constructing the list,
-BuildAndNumberSequence also sets the mIndex variable of each non- original ref,
-so that each can be given a unique name (which depends on the index, and is a
-letter, A-J for lines, P-Z for points).
+/*****
+Add the intersections of pairs of lines that aren't already marks in the
+database to alist, the best matches for point ap so far (a RefMatchList or
+RefFrontier), up to rank maxRank. alist may already hold marks from the
+database, whose rows are less than marks.cols.size(); a new match gets row
+marks.cols.size() + k, where pairs[k] holds its lines. No objects are made and
+nothing in the database changes, so several of these can run at once.
+
+When several pairs of lines make marks with the same key, only the one the
+database would have kept had it been built this far can go in the list: the
+one of lowest rank, and then the one that RefMark_Intersection::MakeAll() would
+make first (see RefLinePair). Before a mark goes in, FindKeyOwner() looks at
+every pair that could make its key, so each new mark has the same lines, and
+the same directions, as in a built database. If the owner is some other pair,
+it will go in when we come to it, if it's close enough.
+
+A mark is on both of the lines it's made from, so neither line can be any
+farther from ap than the mark is. So we only need the lines close enough to
+ap for a mark of their rank to make the list, and we try their pairs in order
+of the rank of the mark, closest lines first, so that the list fills up with
+low-rank marks first and the limits tighten as quickly as they can.
+*****/
+template <class L>
+static void FindIntersections(const RefLineIndex& index, 
+  const RefColumns<RefLine>& lines, const RefContainer<RefMark>& marks, 
+  const XYPt& ap, RefBase::rank_t maxRank, L& alist, 
+  vector<RefLinePair>& pairs)
+{
+  typedef RefBase::rank_t rank_t;
+  typedef RefBase::row_t row_t;
+  vector<double> limits(maxRank + 1);
+  for (rank_t ir = 0; ir <= maxRank; ir++) 
+    limits[ir] = alist.GetLimit(ir);
+  vector<RefNear> near;
+  FindNearLines(index, lines, ap, maxRank, limits, near);
+  
+  // Group the lines by rank, closest first.
+  sort(near.begin(), near.end());
+  vector<size_t> nearStart(maxRank + 2, near.size());
+  for (size_t i = near.size(); i > 0; i--) 
+    for (rank_t ir = 0; ir <= near[i - 1].mRank; ir++) nearStart[ir] = i - 1;
+  
+  // The pair that owns each key we've looked for an owner of
+  typedef map<RefBase::key_t, RefLinePair> owner_map;
+  owner_map owners;
+  size_t firstRow = marks.cols.size();
+  for (rank_t arank = 0; arank <= maxRank; arank++) {
+    for (rank_t irank = 0; irank <= arank / 2; irank++) {
+      rank_t jrank = arank - irank;
+      double limit = alist.GetLimit(arank);
+      for (size_t i = nearStart[irank]; i < nearStart[irank + 1]; i++) {
+        if (near[i].mDistance > limit) break;
+        size_t jend = (irank == jrank) ? i : nearStart[jrank + 1];
+        for (size_t j = nearStart[jrank]; j < jend; j++) {
+          if (near[j].mDistance > limit) break;
+          RefLinePair lp(lines, near[i].mRow, near[j].mRow);
+          XYPt p;
+          if (!RefMark_Intersection::CalcIntersection(lines.GetBare(lp.mRow1), 
+            lines.GetBare(lp.mRow2), p)) continue;
+          RefBase::key_t key = RefMark::CalcKey(p);
+          if (HasKey(marks, key)) continue;
+          double dist = RefMark::DistanceBetween(p, ap);
+          owner_map::iterator io = owners.find(key);
+          if (io == owners.end()) {
+            // A mark that can't make the list doesn't need an owner.
+            if (dist > limit) continue;
+            RefLinePair owner = lp;
+            FindKeyOwner(index, lines, key, arank, owner);
+            io = owners.insert(make_pair(key, owner)).first;
+          }
+          if (!(io->second == lp)) continue;
+          RefMatch rm(dist, arank, row_t(firstRow + pairs.size()));
+          if (!alist.Add(rm)) continue;
+          pairs.push_back(lp);
+          limit = alist.GetLimit(arank);
+        }
+      }
+    }
+  }
+}
 
-This numbering scheme means that there can only be one sequence in existence at
-a time. To insure this, the sequence is constructed in the static RefBase
-member variable sSequence, which is public, so you can (if you like) read out
-this sequence.
-*/
 
 /*****
-Append to the end of sSequence pointers to all the marks and lines needed to
-create this mark or line. Default behavior is to append a pointer to self. A
-subclass line or mark made from others should call SequencePushUnique() for
-each of the elements that define it, and then call the RefBase method for
-itself.
+FindIntersections() for best, a list of the numRefs best matches for point ap.
 *****/
-void RefBase::SequencePushSelf()
+static void FindIntersections(const RefLineIndex& index, 
+  const RefColumns<RefLine>& lines, const RefContainer<RefMark>& marks, 
+  const XYPt& ap, RefBase::rank_t maxRank, size_t numRefs, 
+  vector<RefMatch>& best, vector<RefLinePair>& pairs)
 {
-  SequencePushUnique(this);
+  RefMatchList list(best, numRefs);
+  FindIntersections(index, lines, marks, ap, maxRank, list, pairs);
 }
 
 
 /*****
-Build a sequence (in sSequence) of all of the references that are needed to
-define this one; also set mIndex for each reference so that the relevant
-RefMarks and RefLines are sequentially numbered.
+Return the distance from ap to the nearest intersection of two lines in lines
+whose ranks add up to no more than maxRank, or dmin if none is any closer than
+that. This is FindIntersections() for statistics, where only the distance
+counts, so we try the closest lines first, whatever their rank.
 *****/
-void RefBase::BuildAndNumberSequence()
+static double FindNearestIntersection(const RefLineIndex& index, 
+  const RefColumns<RefLine>& lines, const XYPt& ap, RefBase::rank_t maxRank, 
+  double dmin)
 {
-  sSequence.clear();
-  SequencePushSelf(); 
-  RefMark::ResetCount();
-  RefLine::ResetCount();
-  for (size_t i = 0; i < sSequence.size(); i++) sSequence[i]->SetIndex();
+  vector<double> limits(maxRank + 1, dmin);
+  vector<RefNear> near;
+  FindNearLines(index, lines, ap, maxRank, limits, near);
+  sort(near.begin(), near.end(), CompareNearDistance());
+  for (size_t i = 0; i < near.size(); i++) {
+    if (near[i].mDistance > dmin) break;
+    XYLine li = lines.GetBare(near[i].mRow);
+    for (size_t j = 0; j < i; j++) {
+      if (near[i].mRank + near[j].mRank > maxRank) continue;
+      XYPt p;
+      if (RefMark_Intersection::CalcIntersection(li, 
+        lines.GetBare(near[j].mRow), p)) 
+        dmin = min(dmin, RefMark::DistanceBetween(p, ap));
+    }
+  }
+  return dmin;
 }
 
 
 /*****
-Put a statement about how to make this mark from its constituents to a stream.
-Overridden by most subclasses. Return true if we actually put something
-(original types will return false).
+Put the marks for matches abest into vm, starting at vm[0]. Matches found by
+FindIntersections() are made into RefMark_Intersections from the lines in
+apairs, and kept in vrefs.
 *****/
-bool RefBase::PutHowto(ostream& /* os */) const
+static void GetIntersectionRefs(RefContainer<RefMark>& marks, 
+  RefContainer<RefLine>& lines, RefVirtualRefs& vrefs, 
+  const vector<RefMatch>& abest, const vector<RefLinePair>& apairs, 
+  RefMark** vm)
 {
-  return false;
+  size_t firstRow = marks.cols.size();
+  for (size_t i = 0; i < abest.size(); i++) {
+    size_t row = abest[i].mRow;
+    if (row < firstRow) {
+      vm[i] = marks.GetObject(RefBase::row_t(row));
+      continue;
+    }
+    const RefLinePair& lp = apairs[row - firstRow];
+    vm[i] = vrefs.Get(RefMark_Intersection(lines.GetObject(lp.mRow1), 
+      lines.GetObject(lp.mRow2)), lp.mRow1, lp.mRow2);
+  }
 }
 
 
+/**********
+class RefIntersectionSearch - function object for ParallelFor() that does what
+RefBatchSearch does for marks, and then looks for the intersections of lines
+that could do better, as FindIntersections() does.
+**********/
+class RefIntersectionSearch {
+public:
+  enum {CHUNK_SIZE = 16};   // targets per chunk
+  
+  RefIntersectionSearch(const RefMarkGrid& agrid, 
+    const RefLineIndex& aindex, const RefContainer<RefMark>& amarks, 
+    const RefColumns<RefLine>& alines, const vector<XYPt>& atargets, 
+    RefBase::rank_t amaxRank, size_t anumRefs, 
+    vector<vector<RefMatch> >& abests, vector<vector<RefLinePair> >& apairs) :
+    mGrid(agrid), mIndex(aindex), mMarks(amarks), mLines(alines), 
+    mTargets(atargets), mMaxRank(amaxRank), mNumRefs(anumRefs), 
+    mBests(abests), mPairs(apairs) {};
+  size_t GetNumChunks() const {
+    return (mTargets.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  };
+  void operator()(size_t ichunk) {
+    // Search for the targets in chunk ichunk
+    size_t t0 = ichunk * CHUNK_SIZE;
+    size_t t1 = min(mTargets.size(), t0 + CHUNK_SIZE);
+    for (size_t t = t0; t < t1; t++) {
+      if (ReferenceFinder::sUseSearchIndexes) 
+        FindNearRefs(mGrid, mMarks.cols, mTargets[t], mNumRefs, mBests[t]);
+      else 
+        ScanBestRefs(mMarks.cols, &mTargets[t], 1, mNumRefs, &mBests[t]);
+      FindIntersections(mIndex, mLines, mMarks, mTargets[t], mMaxRank, 
+        mNumRefs, mBests[t], mPairs[t]);
+    }
+  };
+
+private:
+  const RefMarkGrid& mGrid;
+  const RefLineIndex& mIndex;
+  const RefContainer<RefMark>& mMarks;
+  const RefColumns<RefLine>& mLines;
+  const vector<XYPt>& mTargets;
+  RefBase::rank_t mMaxRank;
+  size_t mNumRefs;
+  vector<vector<RefMatch> >& mBests;
+  vector<vector<RefLinePair> >& mPairs;
+};
+
+
 /*****
-Send the full how-to sequence to the given stream.
+Put the refs for matches abest into vr, starting at vr[0] and making them into
+objects if necessary.
 *****/
-ostream& RefBase::PutHowtoSequence(ostream& os)
-{
-  BuildAndNumberSequence(); 
-  for (size_t i = 0; i < sSequence.size(); i++)
-    if (sSequence[i]->PutHowto(os)) os << "." << endl;
-  return os;
+template <class R>
+static void GetMatchedRefs(RefContainer<R>& rc, const vector<RefMatch>& abest, 
+  R** vr)
+{
+  for (size_t i = 0; i < abest.size(); i++) 
+    vr[i] = rc.GetObject(abest[i].mRow);
+}
+
+
+/*****
+The second half of a deeper search: try making a ref of class Rs from each pair
+of refs in anear, rows of container pc, and add the ones that are close enough
+to atarget to best, the numRefs best matches so far. The row of each match is
+its index in found, which holds the refs of all of the matches, starting with
+the ones that came from the database; the new ones are kept in vrefs, under
+the rows of their parents. A ref of class Rs has the ranks of both of its
+parents plus extraRank, and we only make refs up to maxRank.
+
+The pairs are tried in order of the rank they would make, so that the list
+fills up with low-rank refs first. Each parent has to be within reach of the
+target (see GetParentReach(), with ascale and acurve) for a ref that could
+still make the list, which is why anear only holds refs close to the target to
+begin with; as the list gets better, fewer and fewer pairs are worth trying.
+New refs whose keys are already in rc are skipped, since the database already
+has something just as good.
+*****/
+template <class Rs, class R, class P>
+static void FindDeeperRefs(RefContainer<R>& rc, RefContainer<P>& pc, 
+  const typename R::bare_t& atarget, vector<RefNear>& anear, 
+  double ascale, double acurve, RefBase::rank_t extraRank, 
+  RefBase::rank_t maxRank, size_t numRefs, vector<RefMatch>& best, 
+  vector<R*>& found, RefVirtualRefs& vrefs)
+{
+  typedef RefBase::rank_t rank_t;
+  typedef RefBase::row_t row_t;
+  if (maxRank < extraRank) return;
+  
+  // Group the refs by rank, closest first.
+  sort(anear.begin(), anear.end());
+  vector<size_t> nearStart(maxRank + 2, anear.size());
+  for (size_t i = anear.size(); i > 0; i--) 
+    for (rank_t ir = 0; ir <= anear[i - 1].mRank; ir++) nearStart[ir] = i - 1;
+  vector<P*> parents(anear.size(), static_cast<P*>(0));
+  
+  set<RefBase::key_t> keys;
+  for (rank_t arank = extraRank; arank <= maxRank; arank++) {
+    rank_t sumRank = arank - extraRank;
+    for (rank_t irank = 0; irank <= sumRank / 2; irank++) {
+      rank_t jrank = sumRank - irank;
+      double reach = GetParentReach(GetErrorLimit(best, numRefs, arank), 
+        ascale, acurve);
+      for (size_t i = nearStart[irank]; i < nearStart[irank + 1]; i++) {
+        if (anear[i].mDistance > reach) break;
+        size_t jend = (irank == jrank) ? i : nearStart[jrank + 1];
+        for (size_t j = nearStart[jrank]; j < jend; j++) {
+          if (anear[j].mDistance > reach) break;
+          if (!parents[i]) parents[i] = pc.GetObject(anear[i].mRow);
+          if (!parents[j]) parents[j] = pc.GetObject(anear[j].mRow);
+          Rs rs(parents[i], parents[j]);
+          if (rs.mKey == 0 || HasKey(rc, rs.mKey) || 
+            !keys.insert(rs.mKey).second) continue;
+          RefMatch rm(rs.DistanceTo(atarget), arank, row_t(found.size()));
+          if (best.size() >= numRefs && !(rm < best.back())) continue;
+          found.push_back(vrefs.Get(rs, anear[i].mRow, anear[j].mRow));
+          AddMatch(best, rm, numRefs);
+          reach = GetParentReach(GetErrorLimit(best, numRefs, arank), 
+            ascale, acurve);
+        }
+      }
+    }
+  }
 }
-    
 
-/*  Notes on diagrams.
-A DgmInfo is a very simple object that contains just a couple of bits of
-information necessary to construct a complete diagram from the list of refs
-contained in sSequence. Any diagram is a subsequence of sSequence, which, in
-effect, describes all the refs that are already on the paper as well as the
-ref(s) currently being made.
 
-DgmInfo.idef is the index of the first ref in sSequence that is defined in the
-current diagram.
+/*****
+Put the marks in cols that lie close enough to line al into anear: the ones of
+each rank r below areaches.size() that are no farther from al than areaches[r].
+If we're using the search indexes, only the cells of grid that al passes close
+enough to are looked at, a row at a time.
+*****/
+static void FindNearMarks(const RefMarkGrid& grid, 
+  const RefColumns<RefMark>& cols, const XYLine& al, 
+  const vector<double>& areaches, vector<RefNear>& anear)
+{
+  typedef RefBase::row_t row_t;
+  anear.clear();
+  if (areaches.empty()) return;
+  double reach = *max_element(areaches.begin(), areaches.end());
+  if (reach < 0) return;
+  if (ReferenceFinder::sUseSearchIndexes && !grid.IsEmpty()) {
+    for (int iy = 0; iy < grid.GetNumY(); iy++) {
+      int ixmin, ixmax;
+      grid.GetStripCells(iy, al, reach, ixmin, ixmax);
+      for (int ix = ixmin; ix <= ixmax; ix++) {
+        if (grid.GetDistanceBound(ix, iy, al) > reach) continue;
+        for (const row_t* pr = grid.CellBegin(ix, iy); 
+          pr != grid.CellEnd(ix, iy); pr++) {
+          size_t irank = cols.mRank[*pr];
+          if (irank >= areaches.size()) continue;
+          double dist = abs(al.u.x * cols.mX[*pr] + al.u.y * cols.mY[*pr] - 
+            al.d);
+          if (dist <= areaches[irank]) 
+            anear.push_back(RefNear(RefBase::rank_t(irank), dist, *pr));
+        }
+      }
+    }
+    return;
+  }
+  for (size_t i = 0; i < cols.size(); i++) {
+    size_t irank = cols.mRank[i];
+    if (irank >= areaches.size()) continue;
+    double dist = abs(al.u.x * cols.mX[i] + al.u.y * cols.mY[i] - al.d);
+    if (dist <= areaches[irank]) 
+      anear.push_back(RefNear(RefBase::rank_t(irank), dist, row_t(i)));
+  }
+}
 
-DgmInfo.iact is the index of the last ref that is defined in the current
-diagram, which is the action line, if this diagram includes an action line.
-idef <= iact.
-*/
 
 /*****
-Build a set of diagrams that describe how to fold this reference, by
-constructing a list of DgmInfo records (which refer to elements and
-subsequences of sSequence).
-*****/
-void RefBase::BuildDiagrams()
-{
-  sDgms.clear();
-  BuildAndNumberSequence();
-  
-  // Now, we need to note which elements of the sequence are action lines;
-  // there will be a diagram for each one of these.
-  size_t ss = sSequence.size();
-  for (size_t i = 0; i < ss; i++)
-    if (sSequence[i]->IsActionLine()) sDgms.push_back(DgmInfo(i, i));
-    
-  // We should always have at least one diagram, even if there was only one ref
-  // in sSequence (which happens if the ref was a RefMark_Original or
-  // RefLine_Original).
-  if (sDgms.size() == 0) sDgms.push_back(DgmInfo(0, 0));
-  
-  // And we make sure we have a diagram for the last ref in the sequence (which
-  // might not be the case if we ended with a RefMark or an original).
-  if (sDgms[sDgms.size() - 1].iact < ss - 1) sDgms.push_back(DgmInfo(0, ss - 1));
-  
-  // Now we go through and set the idef fields of each DgmInfo record.
-  size_t id = 0;
-  for (size_t i = 0; i < sDgms.size(); i++) {
-    sDgms[i].idef = id;
-    id = sDgms[i].iact + 1;
+Add the lines through two marks (RefLine_C2P_C2P) up to rank maxRank that
+aren't in the database to abest, the numRefs best matches for line al found in
+the database so far, and put the lines for the final list into vl, starting at
+vl[0]. Only the marks close enough to al are tried; the new lines are kept in
+vrefs.
+*****/
+static void AddDeeperLines(const RefMarkGrid& grid, 
+  RefContainer<RefMark>& marks, RefContainer<RefLine>& lines, 
+  RefVirtualRefs& vrefs, const XYLine& al, RefBase::rank_t maxRank, 
+  size_t numRefs, vector<RefMatch>& best, RefLine** vl)
+{
+  typedef RefBase::rank_t rank_t;
+  vector<RefLine*> found(best.size());
+  if (!best.empty()) GetMatchedRefs(lines, best, &found[0]);
+  for (size_t i = 0; i < best.size(); i++) best[i].mRow = RefBase::row_t(i);
+  
+  // Both marks lie on the new line, within the paper. With the worst-case
+  // error, they're no farther from al than the error of the line. With the
+  // Pythagorean error e, the farthest they can be from al is
+  // e * (1 + r + d * e), where r is the farthest the paper gets from the
+  // origin and d is |al.d|. If al misses the paper, though, no line is any
+  // better than any other.
+  const Paper& paper = ReferenceFinder::sPaper;
+  XYPt pa, pb;
+  bool worstCase = ReferenceFinder::sLineWorstCaseError;
+  if (!worstCase || paper.ClipLine(al, pa, pb)) {
+    double r = max_val(max_val(paper.mBotLeft.Mag(), paper.mBotRight.Mag()),
+      max_val(paper.mTopLeft.Mag(), paper.mTopRight.Mag()));
+    double scale = worstCase ? 1 : 1 + r;
+    double curve = worstCase ? 0 : abs(al.d);
+    vector<double> reaches(maxRank);
+    for (rank_t irank = 0; irank < maxRank; irank++) 
+      reaches[irank] = GetParentReach(GetErrorLimit(best, numRefs, 
+        rank_t(irank + 1)), scale, curve);
+    vector<RefNear> near;
+    FindNearMarks(grid, marks.cols, al, reaches, near);
+    FindDeeperRefs<RefLine_C2P_C2P>(lines, marks, al, near, scale, curve, 1, 
+      maxRank, numRefs, best, found, vrefs);
   }
+  for (size_t i = 0; i < best.size(); i++) vl[i] = found[best[i].mRow];
 }
 
 
 /*****
-Draw the paper
+If cache has the results of query aq, put them into vr and return true.
 *****/
-void RefBase::DrawPaper()
+template <class R>
+static bool GetCachedRefs(RefQueryCache& cache, const RefQueryCache::Query& aq, 
+  vector<R*>& vr)
 {
-  vector<XYPt> corners;
-  corners.push_back(ReferenceFinder::sPaper.mBotLeft);
-  corners.push_back(ReferenceFinder::sPaper.mBotRight);
-  corners.push_back(ReferenceFinder::sPaper.mTopRight);
-  corners.push_back(ReferenceFinder::sPaper.mTopLeft);
-  sDgmr->DrawPoly(corners, RefDgmr::POLYSTYLE_WHITE);
+  const vector<RefBase*>* refs = cache.Find(aq);
+  if (!refs) return false;
+  vr.resize(refs->size());
+  for (size_t i = 0; i < refs->size(); i++) vr[i] = static_cast<R*>((*refs)[i]);
+  return true;
 }
 
 
 /*****
-Draw the given diagram using the RefDgmr aDgmr.
+If cache has the results of query aq, put them into vr, starting at vr[0], and
+return true.
 *****/
-void RefBase::DrawDiagram(RefDgmr& aDgmr, const DgmInfo& aDgm)
+template <class R>
+static bool GetCachedRefs(RefQueryCache& cache, const RefQueryCache::Query& aq, 
+  R** vr)
 {
-  // Set the current RefDgmr to be aDgmr.
-  sDgmr = &aDgmr;
-  
-  // always draw the paper
-  DrawPaper();
-  
-  // Make a note of the action line ref
-  RefBase* ral = sSequence[aDgm.iact];
-  
-  // draw all refs specified by the DgmInfo. Most get drawn in normal style.
-  // The ref that is the action line (and all subsequent refs) get drawn in
-  // action style. Any refs that are used immediately by the action line get
-  // drawn in hilite style. Drawing for each diagram is done in multiple passes
-  // so that, for examples, labels end up on top of everything else.
-  for (short ipass = 0; ipass < NUM_PASSES; ipass++) {
-    for (size_t i = 0; i < aDgm.iact; i++) {
-      RefBase* rb = sSequence[i];
-      if ((i >= aDgm.idef && rb->IsDerived()) || ral->UsesImmediate(rb)) 
-        rb->DrawSelf(REFSTYLE_HILITE, ipass);
-      else rb->DrawSelf(REFSTYLE_NORMAL, ipass);
-    };
-    sSequence[aDgm.iact]->DrawSelf(REFSTYLE_ACTION, ipass);
-  }
+  const vector<RefBase*>* refs = cache.Find(aq);
+  if (!refs) return false;
+  for (size_t i = 0; i < refs->size(); i++) vr[i] = static_cast<R*>((*refs)[i]);
+  return true;
 }
 
 
 /*****
-Put the caption to a particular diagram to a stream. The caption consists of
-how-to for those refs that are part of the action. The output is created as a
-single string containing possibly multiple sentences.
+Put the results of query aq, the first numRefs refs of vr up to the first null
+one, into cache.
 *****/
-void RefBase::PutDiagramCaption(std::ostream& os, const DgmInfo& aDgm)
+template <class R>
+static void PutCachedRefs(RefQueryCache& cache, const RefQueryCache::Query& aq, 
+  R* const* vr, size_t numRefs)
 {
-  for (size_t i = aDgm.idef; i <= aDgm.iact; i++) {
-    sSequence[i]->PutHowto(os);
-    os << ". ";
-  }
+  vector<RefBase*> refs;
+  for (size_t i = 0; i < numRefs && vr[i]; i++) refs.push_back(vr[i]);
+  cache.Insert(aq, refs);
 }
 
 
 /*****
-Return true if this mark or line uses rb for immediate reference. "Immediate"
-means that if A uses B and B uses C, A->UsesImmediate(B) returns true but
-A->UsesImmediate(C) returns false. Default returns false; this will be used by
-original marks and lines.
+Find the best marks closest to a given point ap, storing the results in the
+vector vm, best first.
 *****/
-bool RefBase::UsesImmediate(RefBase* /* rb */) const
+void ReferenceFinder::FindBestMarks(const XYPt& ap, vector<RefMark*>& vm, 
+  short numMarks)
 {
-  return false;
+  sQueryCache.SetCapacity(sQueryCacheSize);
+  RefQueryCache::Query aq = GetQuery(ap, numMarks);
+  if (GetCachedRefs(sQueryCache, aq, vm)) return;
+  if (sVirtualMarks) 
+    FindDeeperMarks(ap, vm, numMarks, sMaxRank);
+  else {
+    size_t numRefs = size_t(numMarks);
+    vector<RefMatch> best;
+    if (sUseSearchIndexes) 
+      FindNearRefs(sMarkGrid, sBasisMarks.cols, ap, numRefs, best);
+    else 
+      ShardBestRefs(sBasisMarks.cols, ap, numRefs, best);
+    vm.resize(best.size());
+    if (!best.empty()) GetMatchedRefs(sBasisMarks, best, &vm[0]);
+  }
+  PutCachedRefs(sQueryCache, aq, vm.empty() ? 0 : &vm[0], vm.size());
 }
 
 
 /*****
-Return true if this is a derived (rather than an original) mark or line. Note
-that this is not the same as mRank!=0, because the diagonals have mRank==1 but
-are still considered original. Default is true since most objects will be
-derived.
+Find the best marks closest to each point in aps, numMarks per point, spreading
+the work over GetNumThreads() threads. The results for aps[i] go in
+vm[i * numMarks] through vm[(i + 1) * numMarks - 1], best first; if there are
+fewer marks than that, the rest are null.
 *****/
-bool RefBase::IsDerived() const
+void ReferenceFinder::FindBestMarks(const vector<XYPt>& aps, 
+  vector<RefMark*>& vm, short numMarks)
 {
-  return true;
+  size_t numRefs = size_t(numMarks);
+  vm.assign(aps.size() * numRefs, 0);
+  if (numRefs == 0) return;
+  if (sVirtualMarks) TrimVirtualRefs();
+  
+  // Only the targets that aren't in the cache need to be searched for.
+  sQueryCache.SetCapacity(sQueryCacheSize);
+  vector<RefQueryCache::Query> queries;
+  vector<XYPt> targets;
+  vector<RefMark**> slots;
+  for (size_t i = 0; i < aps.size(); i++) {
+    RefQueryCache::Query aq = GetQuery(aps[i], numMarks);
+    if (GetCachedRefs(sQueryCache, aq, &vm[i * numRefs])) continue;
+    queries.push_back(aq);
+    targets.push_back(aps[i]);
+    slots.push_back(&vm[i * numRefs]);
+  }
+  
+  vector<vector<RefMatch> > bests(targets.size());
+  if (sVirtualMarks) {
+    // The searches run in parallel, but the new marks are made one at a time.
+    vector<vector<RefLinePair> > pairs(targets.size());
+    RefIntersectionSearch search(sMarkGrid, sLineIndex, sBasisMarks, 
+      sBasisLines.cols, targets, sMaxRank, numRefs, bests, pairs);
+    ParallelFor(search, search.GetNumChunks());
+    for (size_t i = 0; i < targets.size(); i++) 
+      if (!bests[i].empty()) 
+        GetIntersectionRefs(sBasisMarks, sBasisLines, sVirtualRefs, bests[i], 
+          pairs[i], slots[i]);
+  }
+  else {
+    RefBatchSearch<RefMark, RefMarkGrid> search(sMarkGrid, sBasisMarks.cols, 
+      targets, numRefs, bests);
+    ParallelFor(search, search.GetNumChunks());
+    for (size_t i = 0; i < targets.size(); i++) 
+      if (!bests[i].empty()) 
+        GetMatchedRefs(sBasisMarks, bests[i], slots[i]);
+  }
+  for (size_t i = 0; i < targets.size(); i++) 
+    PutCachedRefs(sQueryCache, queries[i], slots[i], numRefs);
 }
 
 
 /*****
-Utility used by subclasses when they implement SequencePushSelf(). This insures
-that a given mark only gets a single label.
+Find the best lines closest to a given line al, storing the results in the
+vector vl, best first.
 *****/
-void RefBase::SequencePushUnique(RefBase* rb)
+void ReferenceFinder::FindBestLines(const XYLine& al, vector<RefLine*>& vl, 
+  short numLines)
 {
-  if (find(sSequence.begin(), sSequence.end(), rb) == sSequence.end()) 
-    sSequence.push_back(rb);
+  sQueryCache.SetCapacity(sQueryCacheSize);
+  RefQueryCache::Query aq = GetQuery(al, numLines);
+  if (GetCachedRefs(sQueryCache, aq, vl)) return;
+  if (sVirtualRefLine_C2P_C2P && sUseRefLine_C2P_C2P) 
+    FindDeeperLines(al, vl, numLines, sMaxRank);
+  else {
+    size_t numRefs = size_t(numLines);
+    vector<RefMatch> best;
+    if (sUseSearchIndexes) 
+      FindNearRefs(sLineIndex, sBasisLines.cols, al, numRefs, best);
+    else 
+      ShardBestRefs(sBasisLines.cols, al, numRefs, best);
+    vl.resize(best.size());
+    if (!best.empty()) GetMatchedRefs(sBasisLines, best, &vl[0]);
+  }
+  PutCachedRefs(sQueryCache, aq, vl.empty() ? 0 : &vl[0], vl.size());
 }
 
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
-
+/*****
+Find the best lines closest to each line in als, numLines per line, spreading
+the work over GetNumThreads() threads. The results for als[i] go in
+vl[i * numLines] through vl[(i + 1) * numLines - 1], best first; if there are
+fewer lines than that, the rest are null.
+*****/
+void ReferenceFinder::FindBestLines(const vector<XYLine>& als, 
+  vector<RefLine*>& vl, short numLines)
+{
+  size_t numRefs = size_t(numLines);
+  vl.assign(als.size() * numRefs, 0);
+  if (numRefs == 0) return;
+  bool virtualLines = sVirtualRefLine_C2P_C2P && sUseRefLine_C2P_C2P;
+  if (virtualLines) TrimVirtualRefs();
+  
+  // Only the targets that aren't in the cache need to be searched for.
+  sQueryCache.SetCapacity(sQueryCacheSize);
+  vector<RefQueryCache::Query> queries;
+  vector<XYLine> targets;
+  vector<RefLine**> slots;
+  for (size_t i = 0; i < als.size(); i++) {
+    RefQueryCache::Query aq = GetQuery(als[i], numLines);
+    if (GetCachedRefs(sQueryCache, aq, &vl[i * numRefs])) continue;
+    queries.push_back(aq);
+    targets.push_back(als[i]);
+    slots.push_back(&vl[i * numRefs]);
+  }
+  
+  vector<vector<RefMatch> > bests(targets.size());
+  RefBatchSearch<RefLine, RefLineIndex> search(sLineIndex, sBasisLines.cols, 
+    targets, numRefs, bests);
+  ParallelFor(search, search.GetNumChunks());
+  for (size_t i = 0; i < targets.size(); i++) {
+    // The lines through two marks make new objects, so they're found one 
+    // target at a time.
+    if (virtualLines) 
+      AddDeeperLines(sMarkGrid, sBasisMarks, sBasisLines, sVirtualRefs, 
+        targets[i], sMaxRank, numRefs, bests[i], slots[i]);
+    else if (!bests[i].empty()) 
+      GetMatchedRefs(sBasisLines, bests[i], slots[i]);
+    PutCachedRefs(sQueryCache, queries[i], slots[i], numRefs);
+  }
+}
 
-/**********
-class RefMark - base class for a mark on the paper. 
-**********/
 
 /*****
-RefMark static member initialization
+Return the highest rank that the container rc has room for, or 0 if it has
+none. This is the rank the database was built to, which sMaxRank may no longer
+be. The top rank of marks has no refs in it when sVirtualMarks is set.
 *****/
-RefBase::index_t RefMark::sCount = 0;   // Initialize class index
+template <class R>
+static RefBase::rank_t GetStoredRank(const RefContainer<R>& rc)
+{
+  return RefBase::rank_t(max(rc.rankStart.size(), size_t(2)) - 2);
+}
 
 
 /*****
-Calculate the key value used for distinguishing RefMarks. This should be called
-at the end of every constructor if the mark is valid (and not if it isn't).
+Return the highest rank that has any refs in the container rc, or 0 if it's
+empty. The top rank of marks is empty when sVirtualMarks is set.
 *****/
-void RefMark::FinishConstructor()
- {
-  const double fx = p.x / ReferenceFinder::sPaper.mWidth;  // fx is between 0 and 1
-  const double fy = p.y / ReferenceFinder::sPaper.mHeight; // fy is between 0 and 1
-
-  key_t nx = static_cast<key_t> (floor(0.5 + fx * ReferenceFinder::sNumX));
-  key_t ny = static_cast<key_t> (floor(0.5 + fy * ReferenceFinder::sNumY));
-  mKey = 1 + nx * ReferenceFinder::sNumY + ny;
+template <class R>
+static RefBase::rank_t GetTopRank(const RefContainer<R>& rc)
+{
+  size_t ir = rc.rankStart.size();
+  while (ir > 1 && rc.rankStart[ir - 1] == rc.rankStart[ir - 2]) ir--;
+  return RefBase::rank_t(ir > 1 ? ir - 2 : 0);
 }
 
 
 /*****
-Return the distance to a point ap. This is used when sorting marks by their
-distance from a given mark.
+Return the highest rank that FindDeeperMarks() can reach: that of a mark where
+two lines of the top rank in the database cross.
 *****/
-double RefMark::DistanceTo(const XYPt& ap) const
- {
-  return (p - ap).Mag();
- }
- 
+ReferenceFinder::rank_t ReferenceFinder::GetMaxDeeperMarkRank()
+{
+  return rank_t(2 * GetTopRank(sBasisLines));
+}
+
 
 /*****
-Return true if this mark is on the edge of the paper
+Return the highest rank that FindDeeperLines() can reach: that of the line
+through two marks of the top rank in the database.
 *****/
-bool RefMark::IsOnEdge() const
+ReferenceFinder::rank_t ReferenceFinder::GetMaxDeeperLineRank()
 {
-  return (ReferenceFinder::sPaper.mLeftEdge.Intersects(p) || 
-    ReferenceFinder::sPaper.mRightEdge.Intersects(p) ||
-    ReferenceFinder::sPaper.mTopEdge.Intersects(p) || 
-    ReferenceFinder::sPaper.mBottomEdge.Intersects(p));
+  return rank_t(1 + 2 * GetTopRank(sBasisMarks));
 }
 
 
 /*****
-Return false, since marks can never be actions
+Find the best marks closest to a given point ap, as FindBestMarks() does, but
+also look for marks up to rank maxRank that aren't in the database, storing
+the results in the vector vm, best first. Only the intersections of lines that
+pass close enough to ap are tried, and only the ones that make the list are
+made into objects, so this is practical for ranks well beyond sMaxRank. The
+new marks are kept as sMaxVirtualRefs describes.
+
+Only the lines in the database are intersected, so this goes just one
+construction past it: a mark whose lines are beyond the database themselves
+is never found, and the list can be worse than a database built to maxRank
+would give. For the same reason, maxRank is capped at GetMaxDeeperMarkRank().
 *****/
-bool RefMark::IsActionLine() const
+void ReferenceFinder::FindDeeperMarks(const XYPt& ap, vector<RefMark*>& vm, 
+  short numMarks, rank_t maxRank)
 {
-  return false;
+  maxRank = min(maxRank, GetMaxDeeperMarkRank());
+  TrimVirtualRefs();
+  size_t numRefs = size_t(numMarks);
+  vector<RefMatch> best;
+  if (sUseSearchIndexes) 
+    FindNearRefs(sMarkGrid, sBasisMarks.cols, ap, numRefs, best);
+  else 
+    ShardBestRefs(sBasisMarks.cols, ap, numRefs, best);
+  vector<RefLinePair> pairs;
+  FindIntersections(sLineIndex, sBasisLines.cols, sBasisMarks, ap, maxRank, 
+    numRefs, best, pairs);
+  vm.resize(best.size());
+  if (!best.empty()) 
+    GetIntersectionRefs(sBasisMarks, sBasisLines, sVirtualRefs, best, pairs, 
+      &vm[0]);
 }
 
 
 /*****
-Return the label for this mark.
+Find the best lines closest to a given line al, as FindBestLines() does, but
+also look for lines up to rank maxRank that aren't in the database, storing
+the results in the vector vl, best first. The new lines are the ones through
+two marks (RefLine_C2P_C2P), and only the marks close enough to al are tried.
+The new lines are kept as sMaxVirtualRefs describes.
+
+As with FindDeeperMarks(), only one construction past the database is tried:
+both marks must be in the database, and none of the other axioms (O2-O7) are
+used, so the list can be worse than a database built to maxRank would give.
+maxRank is capped at GetMaxDeeperLineRank().
 *****/
-const char RefMark::GetLabel() const
+void ReferenceFinder::FindDeeperLines(const XYLine& al, vector<RefLine*>& vl, 
+  short numLines, rank_t maxRank)
 {
-  return sLabels[mIndex - 1];
+  // Start with what's in the database.
+  maxRank = min(maxRank, GetMaxDeeperLineRank());
+  TrimVirtualRefs();
+  size_t numRefs = size_t(numLines);
+  vector<RefMatch> best;
+  if (sUseSearchIndexes) 
+    FindNearRefs(sLineIndex, sBasisLines.cols, al, numRefs, best);
+  else 
+    ShardBestRefs(sBasisLines.cols, al, numRefs, best);
+  vl.resize(numRefs);
+  if (numRefs > 0) 
+    AddDeeperLines(sMarkGrid, sBasisMarks, sBasisLines, sVirtualRefs, al, 
+      maxRank, numRefs, best, &vl[0]);
+  vl.resize(best.size());
 }
 
 
+/**********
+class RefFrontierMatcher - visitor for ForEachRing() and ForEachBucket() that
+adds the refs of rank afirstRank and up to a RefFrontier, and stops once none
+of the refs that are left could get onto it. class R = RefMark or RefLine.
+**********/
+template <class R>
+class RefFrontierMatcher {
+public:
+  RefFrontierMatcher(const RefColumns<R>& acols, 
+    const typename R::bare_t& atarget, const XYPt& apa, const XYPt& apb, 
+    RefBase::rank_t afirstRank, RefFrontier& afrontier) : 
+    mCols(acols), mTarget(atarget), mPa(apa), mPb(apb), 
+    mFirstRank(afirstRank), mFrontier(afrontier) {};
+  void Visit(const RefBase::row_t* abegin, const RefBase::row_t* aend) {
+    for (const RefBase::row_t* pr = abegin; pr != aend; pr++) {
+      RefBase::rank_t irank = mCols.mRank[*pr];
+      if (irank < mFirstRank) continue;
+      mFrontier.Add(RefMatch(GetRefError(mCols, *pr, mTarget, mPa, mPb), 
+        irank, *pr));
+    }
+  };
+  bool IsDone(double abound) const {
+    return abound > mFrontier.GetMaxLimit(mFirstRank);
+  };
+
+private:
+  const RefColumns<R>& mCols;
+  const typename R::bare_t& mTarget;
+  const XYPt& mPa;
+  const XYPt& mPb;
+  RefBase::rank_t mFirstRank;
+  RefFrontier& mFrontier;
+};
+
+
 /*****
-Put the name of this mark to a stream. Default behavior gives this mark a
-letter. Return true if we used a letter, false if something else (i.e., the
-name of a RefMark_Original).
+Add the refs in rows abegin up to (but not including) aend of cols to
+afrontier, working out their errors from atarget a block at a time, as
+ScanBestRefs() does.
 *****/
-bool RefMark::PutName(ostream& os) const
-{
-  os << "point " << GetLabel()
-#ifdef RF_PUT_KEY_IN_TEXT
-    << "[" << mKey << "]"
-#endif // RF_PUT_KEY_IN_TEXT
-  ;
-  return true;
+template <class R>
+static void ScanFrontierRefs(const RefColumns<R>& cols, 
+  const typename R::bare_t& atarget, size_t abegin, size_t aend, 
+  RefFrontier& afrontier)
+{
+  typedef RefBase::row_t row_t;
+  const size_t SCAN_BLOCK = 1024;
+  double errs[SCAN_BLOCK];
+  RefScan<R> scan(atarget);
+  for (size_t i0 = abegin; i0 < aend; i0 += SCAN_BLOCK) {
+    size_t i1 = min(aend, i0 + SCAN_BLOCK);
+    scan.GetErrors(cols, i0, i1, errs);
+    for (size_t i = i0; i < i1; i++) 
+      afrontier.Add(RefMatch(errs[i - i0], cols.mRank[i], row_t(i)));
+  }
 }
 
 
 /*****
-Put the distance from this mark to point ap to a stream.
+Return the first rank of rc whose refs are worth finding through a search
+index, rather than by scanning them all. Rank 0 and the other ranks at the
+bottom have so few refs that it's cheaper to scan them, and until we know how
+close they come, the index can't tell us which of the rest to skip.
 *****/
-void RefMark::PutDistanceAndRank(ostream& os, const XYPt& ap) const
+template <class R>
+static RefBase::rank_t GetFirstIndexedRank(const RefContainer<R>& rc)
 {
-  os.precision(4);
-  os.setf(ios_base::fixed, ios_base::floatfield);
-  os << "Solution " << p.Chop() << ": err = " << DistanceTo(ap) << " (rank " << 
-    mRank << ") ";
+  size_t numScanned = max(rc.rankStart[1], rc.cols.size() / 16);
+  size_t ir = 1;
+  while (ir + 1 < rc.rankStart.size() && rc.rankStart[ir + 1] <= numScanned) 
+    ir++;
+  return RefBase::rank_t(ir);
 }
-    
-    
+
+
 /*****
-Draw a RefMark in the indicated style
+Put the best match for point ap of each rank in marks into afrontier. The low
+ranks are scanned, and the rest are found by going through the cells of grid
+around ap until none of the marks left could get onto the frontier.
 *****/
-void RefMark::DrawSelf(RefStyle rstyle, short ipass) const
+static void FindFrontierRefs(const RefMarkGrid& grid, 
+  const RefContainer<RefMark>& marks, const XYPt& ap, RefFrontier& afrontier)
 {
-  switch(ipass) {
-    case PASS_POINTS:
-      {
-        switch(rstyle) {
-          case REFSTYLE_NORMAL:
-            sDgmr->DrawPt(p, RefDgmr::POINTSTYLE_NORMAL);
-            break;
-          case REFSTYLE_HILITE:
-            sDgmr->DrawPt(p, RefDgmr::POINTSTYLE_HILITE);
-            break;
-          case REFSTYLE_ACTION:
-            sDgmr->DrawPt(p, RefDgmr::POINTSTYLE_ACTION);
-            break;
-        }
-      };
-      break;
-      
-    case PASS_LABELS:
-      {
-      string sm(1, GetLabel());
-      switch(rstyle) {
-        case REFSTYLE_NORMAL:
-          // Normal points don't get labels drawn
-          break;
-        case REFSTYLE_HILITE:
-          sDgmr->DrawLabel(p, sm, RefDgmr::LABELSTYLE_HILITE);
-          break;
-        case REFSTYLE_ACTION:
-          sDgmr->DrawLabel(p, sm, RefDgmr::LABELSTYLE_ACTION);
-          break;
-      };
-      break;
-    }
-  }
+  RefBase::rank_t numRanks = RefBase::rank_t(marks.rankStart.size() - 1);
+  RefBase::rank_t firstRank = numRanks;
+  if (ReferenceFinder::sUseSearchIndexes && !grid.IsEmpty()) 
+    firstRank = GetFirstIndexedRank(marks);
+  ScanFrontierRefs(marks.cols, ap, 0, marks.rankStart[firstRank], afrontier);
+  if (firstRank >= numRanks) return;
+  RefFrontierMatcher<RefMark> matcher(marks.cols, ap, ap, ap, firstRank, 
+    afrontier);
+  ForEachRing(grid, ap, matcher);
 }
 
 
 /*****
-Most types of RefMark use the default method, which gives the mark an index
-from the class variable sCount and then bumps up the class variable.
+Put the best match for line al of each rank in lines into afrontier, the same
+way as for marks, using the buckets of index.
 *****/
-void RefMark::SetIndex()
+static void FindFrontierRefs(const RefLineIndex& index, 
+  const RefContainer<RefLine>& lines, const XYLine& al, 
+  RefFrontier& afrontier)
 {
-  mIndex = ++sCount;
+  RefBase::rank_t numRanks = RefBase::rank_t(lines.rankStart.size() - 1);
+  RefBase::rank_t firstRank = numRanks;
+  XYPt pa, pb;
+  if (ReferenceFinder::sUseSearchIndexes && !index.IsEmpty() && 
+    (!ReferenceFinder::sLineWorstCaseError || 
+    ReferenceFinder::sPaper.ClipLine(al, pa, pb))) 
+    firstRank = GetFirstIndexedRank(lines);
+  ScanFrontierRefs(lines.cols, al, 0, lines.rankStart[firstRank], afrontier);
+  if (firstRank >= numRanks) return;
+  RefFrontierMatcher<RefLine> matcher(lines.cols, al, pa, pb, firstRank, 
+    afrontier);
+  ForEachBucket(index, al, pa, pb, matcher);
 }
 
 
 /*****
-Reset the counter used for indexing marks in a sequence.
+Find the frontier of marks for point ap: the closest mark of rank 0, then the
+closest mark of any higher rank that is closer than that, and so on up to the
+rank the database was built to, storing the results in the vector vm, lowest
+rank first. Each mark is the simplest way of getting that close to ap, so the
+list shows what each extra fold buys. With sVirtualMarks, the marks that aren't
+in the database are included too.
 *****/
-void RefMark::ResetCount()
+void ReferenceFinder::FindFrontierMarks(const XYPt& ap, vector<RefMark*>& vm)
 {
-  sCount = 0;
+  rank_t maxRank = GetStoredRank(sBasisMarks);
+  RefFrontier frontier(maxRank);
+  FindFrontierRefs(sMarkGrid, sBasisMarks, ap, frontier);
+  vector<RefLinePair> pairs;
+  if (sVirtualMarks) {
+    TrimVirtualRefs();
+    FindIntersections(sLineIndex, sBasisLines.cols, sBasisMarks, ap, maxRank, 
+      frontier, pairs);
+  }
+  vector<RefMatch> best;
+  frontier.GetMatches(best);
+  vm.resize(best.size());
+  if (!best.empty()) 
+    GetIntersectionRefs(sBasisMarks, sBasisLines, sVirtualRefs, best, pairs, 
+      &vm[0]);
 }
 
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
+/*****
+Find the frontier of lines for line al, as FindFrontierMarks() does for marks,
+storing the results in the vector vl, lowest rank first. Only the lines in the
+database are considered, so with sVirtualRefLine_C2P_C2P, the lines through two
+marks are left out.
+*****/
+void ReferenceFinder::FindFrontierLines(const XYLine& al, vector<RefLine*>& vl)
+{
+  RefFrontier frontier(GetStoredRank(sBasisLines));
+  FindFrontierRefs(sLineIndex, sBasisLines, al, frontier);
+  vector<RefMatch> best;
+  frontier.GetMatches(best);
+  vl.resize(best.size());
+  if (!best.empty()) GetMatchedRefs(sBasisLines, best, &vl[0]);
+}
 
 
 /**********
-class RefMark_Original - Specialization of RefMark that represents a named mark
-(e.g., a corner).
+class RefRangeCollector - visitor for ForEachRing() and ForEachBucket() that
+keeps the rows of every cell or bucket that could hold a ref within aerror of
+the target.
 **********/
+class RefRangeCollector {
+public:
+  typedef pair<const RefBase::row_t*, const RefBase::row_t*> range_t;
+  
+  RefRangeCollector(double aerror, vector<range_t>& aranges) : 
+    mError(aerror), mRanges(aranges) {};
+  void Visit(const RefBase::row_t* abegin, const RefBase::row_t* aend) {
+    if (abegin != aend) mRanges.push_back(range_t(abegin, aend));
+  };
+  bool IsDone(double abound) const {
+    return abound > mError;
+  };
+
+private:
+  double mError;
+  vector<range_t>& mRanges;
+};
+
 
 /*****
-Constructor.
+Pass every ref in rc within aerror of atarget to rangeFn, one rank at a time,
+closest first within each rank. If aranges isn't null, the refs are the ones
+in its cells or buckets, whose rows are in order of rank, so we keep a place
+in each one and take the next rank from all of them in turn; otherwise we scan
+each rank of the columns. Either way, only the matches of the current rank are
+ever held at once, and only the ones passed to rangeFn are made into objects.
+For the worst-case error of a line, pa and pb are where atarget crosses the
+edges of the paper. class Fn = ReferenceFinder::MarkRangeFn or LineRangeFn.
 *****/
-RefMark_Original::RefMark_Original(const XYPt& ap, rank_t arank, string aName) : 
-  RefMark(ap, arank), mName(aName)
+template <class R, class Fn>
+static void StreamRangeRefs(RefContainer<R>& rc, 
+  const typename R::bare_t& atarget, const XYPt& pa, const XYPt& pb, 
+  double aerror, vector<RefRangeCollector::range_t>* aranges, Fn rangeFn, 
+  void* userData)
 {
-  FinishConstructor();
+  typedef RefBase::row_t row_t;
+  const size_t SCAN_BLOCK = 1024;
+  double errs[SCAN_BLOCK];
+  RefScan<R> scan(atarget);
+  vector<RefMatch> matches;
+  bool cancel = false;
+  for (size_t ir = 0; ir + 1 < rc.rankStart.size(); ir++) {
+    RefBase::rank_t irank = RefBase::rank_t(ir);
+    matches.clear();
+    if (aranges) {
+      for (size_t k = 0; k < aranges->size(); k++) {
+        const row_t*& pr = (*aranges)[k].first;
+        for (; pr != (*aranges)[k].second && rc.cols.mRank[*pr] == irank; 
+          pr++) {
+          double err = GetRefError(rc.cols, *pr, atarget, pa, pb);
+          if (err <= aerror) matches.push_back(RefMatch(err, irank, *pr));
+        }
+      }
+    }
+    else {
+      for (size_t i0 = rc.rankStart[ir]; i0 < rc.rankStart[ir + 1]; 
+        i0 += SCAN_BLOCK) {
+        size_t i1 = min(rc.rankStart[ir + 1], i0 + SCAN_BLOCK);
+        scan.GetErrors(rc.cols, i0, i1, errs);
+        for (size_t i = i0; i < i1; i++) 
+          if (errs[i - i0] <= aerror) 
+            matches.push_back(RefMatch(errs[i - i0], irank, row_t(i)));
+      }
+    }
+    sort(matches.begin(), matches.end());
+    for (size_t i = 0; i < matches.size(); i++) {
+      (*rangeFn)(rc.GetObject(matches[i].mRow), matches[i].mError, userData, 
+        cancel);
+      if (cancel) return;
+    }
+  }
 }
 
 
 /*****
-Return the label for this mark.
+Pass every mark within aerror of point ap to rangeFn, lowest rank first and
+closest first within each rank, along with its error. Only the marks in the
+database are considered. If we're using the search indexes, only the cells of
+the mark grid within aerror of ap are looked at.
 *****/
-const char RefMark_Original::GetLabel() const
+void ReferenceFinder::FindMarksInRange(const XYPt& ap, double aerror, 
+  MarkRangeFn rangeFn, void* userData)
 {
-  return 0; // originals get no labels
+  vector<RefRangeCollector::range_t> ranges;
+  bool useGrid = sUseSearchIndexes && !sMarkGrid.IsEmpty();
+  if (useGrid) {
+    RefRangeCollector collector(aerror, ranges);
+    ForEachRing(sMarkGrid, ap, collector);
+  }
+  StreamRangeRefs(sBasisMarks, ap, ap, ap, aerror, useGrid ? &ranges : 0, 
+    rangeFn, userData);
 }
 
 
 /*****
-Put the name of this mark to a stream. Override to put the string name (rather
-than a letter).
+Pass every line within aerror of line al to rangeFn, as FindMarksInRange()
+does for marks, using the buckets of the line index.
 *****/
-
-bool RefMark_Original::PutName(ostream& os) const
+void ReferenceFinder::FindLinesInRange(const XYLine& al, double aerror, 
+  LineRangeFn rangeFn, void* userData)
 {
-  os << mName;  // return the string
-  return false;
+  vector<RefRangeCollector::range_t> ranges;
+  XYPt pa, pb;
+  bool misses = sLineWorstCaseError && !sPaper.ClipLine(al, pa, pb);
+  bool useIndex = sUseSearchIndexes && !sLineIndex.IsEmpty() && !misses;
+  if (useIndex) {
+    RefRangeCollector collector(aerror, ranges);
+    ForEachBucket(sLineIndex, al, pa, pb, collector);
+  }
+  StreamRangeRefs(sBasisLines, al, pa, pb, aerror, useIndex ? &ranges : 0, 
+    rangeFn, userData);
 }
 
 
 /*****
-Draw this mark
+Find every mark in the database within aerror of line al, storing the results
+in the vector vm in order along al, from the first endpoint that
+Paper::ClipLine() returns to the second, using the same parameter along the
+line. If we're using the search indexes, only the cells of the mark grid in a
+strip along al are looked at, so the cost goes with the area of the strip
+rather than the size of the database.
 *****/
-void RefMark_Original::DrawSelf(RefStyle rstyle, short ipass) const
+void ReferenceFinder::FindMarksAlongLine(const XYLine& al, double aerror, 
+  vector<RefMark*>& vm)
 {
-  // Override the default because original marks don't get labels and are only
-  // drawn when they are hilited or action (in which case we still draw them
-  // hilited).
-  if ((ipass == PASS_POINTS) && 
-    (rstyle == REFSTYLE_HILITE || rstyle == REFSTYLE_ACTION)) 
-    sDgmr->DrawPt(p, RefDgmr::POINTSTYLE_HILITE);
-} 
+  vector<double> reaches(sBasisMarks.rankStart.size() - 1, aerror);
+  vector<RefNear> near;
+  FindNearMarks(sMarkGrid, sBasisMarks.cols, al, reaches, near);
+  
+  // ClipLine() puts the larger parameter first.
+  XYPt pt = al.d * al.u;
+  XYPt up = al.u.Rotate90();
+  vector<pair<double, RefBase::row_t> > order(near.size());
+  for (size_t i = 0; i < near.size(); i++) {
+    XYPt p = sBasisMarks.cols.GetBare(near[i].mRow);
+    order[i] = make_pair(-(p - pt).Dot(up), near[i].mRow);
+  }
+  sort(order.begin(), order.end());
+  vm.resize(order.size());
+  for (size_t i = 0; i < order.size(); i++) 
+    vm[i] = sBasisMarks.GetObject(order[i].second);
+}
 
 
 /*****
-Return false, since this is original
+Return true if ap is a valid mark. Return an error message if it isn't.
 *****/
-bool RefMark_Original::IsDerived() const
+bool ReferenceFinder::ValidateMark(const XYPt& ap, string& err)
 {
-  return false;
+  if (ap.x < 0 || ap.x > sPaper.mWidth) {
+    stringstream ss;
+    ss << "Error -- x coordinate should lie between 0 and " << 
+      sPaper.mWidth;
+    err = ss.str();
+    return false;
+  }
+  
+  if (ap.y < 0 || ap.y > sPaper.mHeight) {
+    stringstream ss;
+    ss << "Error -- y coordinate should lie between 0 and " << 
+      sPaper.mHeight;
+    err = ss.str();
+    return false;
+  }
+  return true;
 }
 
 
 /*****
-Overridden because we don't use an index for named marks.
+Validate the two entered points that define the line. Return an error message
+if they aren't distinct.
 *****/
-void RefMark_Original::SetIndex()
+bool ReferenceFinder::ValidateLine(const XYPt& ap1, const XYPt& ap2, 
+  string& err)
 {
-  mIndex = 0;
-};
+  if ((ap1 - ap2).Mag() > EPS) return true;
+  stringstream ss;
+  ss.precision(10);
+  ss << "Error -- the two points must be distinct (separated by at least " <<
+      EPS << ").";
+  err = ss.str();
+  return false;
+}
 
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
+/*****
+Return the distance from ap to the nearest mark in cols, using grid, the
+RefMarkGrid of those marks, to look only at the cells around ap. Rank doesn't
+matter here, so we can stop as soon as every cell we haven't looked at is
+farther away than the nearest mark so far.
+*****/
+static double FindNearestDistance(const RefMarkGrid& grid, 
+  const RefColumns<RefMark>& cols, const XYPt& ap)
+{
+  double dmin = numeric_limits<double>::max();
+  int cx, cy;
+  grid.GetCell(ap, cx, cy);
+  int numRings = grid.GetNumRings(cx, cy);
+  for (int k = 0; k < numRings; k++) {
+    int xmin = max(cx - k, 0);
+    int xmax = min(cx + k, grid.GetNumX() - 1);
+    int ymin = max(cy - k, 0);
+    int ymax = min(cy + k, grid.GetNumY() - 1);
+    for (int iy = ymin; iy <= ymax; iy++) {
+      bool wholeRow = (iy == cy - k || iy == cy + k);
+      for (int ix = xmin; ix <= xmax; ix++) {
+        if (!wholeRow && ix != cx - k && ix != cx + k) continue;
+        for (const RefBase::row_t* pr = grid.CellBegin(ix, iy); 
+          pr != grid.CellEnd(ix, iy); pr++) 
+          dmin = min(dmin, RefMark::DistanceBetween(cols.GetBare(*pr), ap));
+      }
+    }
+    if (grid.GetDistanceBeyond(ap, cx, cy, k) > dmin) break;
+  }
+  return dmin;
+}
+
+
+/*****
+Return a number in [0, 1) for statistics trial i, coordinate j (0 = x, 1 = y),
+from random number seed. Each number is a SplitMix64 hash of the seed and its
+own counter, so it doesn't depend on any of the others, or on which thread
+asks for it, or in what order.
+*****/
+static double GetTrialCoordinate(int seed, size_t i, int j)
+{
+  unsigned long long z = (unsigned long long)(unsigned int)(seed) + 
+    (2 * (unsigned long long)(i) + j + 1) * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z = z ^ (z >> 31);
+  return double(z >> 11) / 9007199254740992.0;  // top 53 bits / 2^53
+}
 
 
 /**********
-class RefMark_Intersection - Specialization of a RefMark for a mark defined by
-the intersection of 2 lines.
+class RefStatisticsTrials - function object for ParallelFor() that runs one
+chunk of the statistics trials, putting the error of trial i into errors[i].
+Every trial gets its own test point from GetTrialCoordinate(), so the errors
+come out the same no matter how the chunks are spread over threads. If we're
+using virtual marks, the intersections of lines up to rank maxRank count too.
 **********/
+class RefStatisticsTrials {
+public:
+  enum {CHUNK_SIZE = 256};  // trials per chunk
+  
+  RefStatisticsTrials(const RefMarkGrid& agrid, 
+    const RefColumns<RefMark>& acols, size_t afirst, size_t alast, 
+    vector<double>& aerrors, const RefLineIndex* aindex = 0, 
+    const RefColumns<RefLine>* alines = 0, RefBase::rank_t amaxRank = 0) : 
+    mGrid(agrid), mCols(acols), mFirst(afirst), mLast(alast), 
+    mErrors(aerrors), mIndex(aindex), mLines(alines), mMaxRank(amaxRank) {};
+  size_t GetNumChunks() const {
+    return (mLast - mFirst + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  };
+  void operator()(size_t ichunk) {
+    // Run the trials in chunk ichunk
+    size_t i0 = mFirst + ichunk * CHUNK_SIZE;
+    size_t i1 = min(mLast, i0 + CHUNK_SIZE);
+    bool useGrid = ReferenceFinder::sUseSearchIndexes && !mGrid.IsEmpty();
+    for (size_t i = i0; i < i1; i++) {
+      XYPt testPt(
+        GetTrialCoordinate(ReferenceFinder::sStatisticsSeed, i, 0) * 
+          ReferenceFinder::sPaper.mWidth, 
+        GetTrialCoordinate(ReferenceFinder::sStatisticsSeed, i, 1) * 
+          ReferenceFinder::sPaper.mHeight);
+      double error = numeric_limits<double>::max();
+      if (useGrid) 
+        error = FindNearestDistance(mGrid, mCols, testPt);
+      else for (size_t j = 0; j < mCols.size(); j++) 
+        error = min(error, 
+          RefMark::DistanceBetween(mCols.GetBare(RefBase::row_t(j)), testPt));
+      if (mIndex) 
+        error = FindNearestIntersection(*mIndex, *mLines, testPt, mMaxRank, 
+          error);
+      mErrors[i] = error;
+    }
+  };
+
+private:
+  const RefMarkGrid& mGrid;
+  const RefColumns<RefMark>& mCols;
+  size_t mFirst;
+  size_t mLast;
+  vector<double>& mErrors;
+  const RefLineIndex* mIndex;
+  const RefColumns<RefLine>* mLines;
+  RefBase::rank_t mMaxRank;
+};
+
 
 /*****
-Constructor.
+Compute statistics on the accuracy of the current set of marks for a randomly 
+chosen set of points and pass the results in our static string variable. The
+points come from sStatisticsSeed, so the same seed always gives the same
+results. The trials are run in rounds spread over GetNumThreads() threads;
+after each round we report its trials to the callback in order, which can stop
+us partway through a round just as it could stop the serial loop.
 *****/
-RefMark_Intersection::RefMark_Intersection(RefLine* arl1, RefLine* arl2) : 
-  RefMark(CalcMarkRank(arl1, arl2)), rl1(arl1), rl2(arl2)
+void ReferenceFinder::CalcStatistics()
 {
-  // Get references to constituent math types
-  
-  const XYLine& l1 = rl1->l;
-  const XYPt& u1 = rl1->l.u;
-//  const double& d1 = rl1->l.d;
-
-  const XYLine& l2 = rl2->l;
-  const XYPt& u2 = rl2->l.u;
-//  const double& d2 = rl2->l.d;  
-  
-  // If the lines don't intersect, it's not a valid point. If they do,
-  // assign the intersection to the member variable p.
+  const size_t ROUND_SIZE = 16384;    // trials per round
+  bool cancel = false;
+  if (sStatisticsFn) {
+    sStatisticsFn(StatisticsInfo(STATISTICS_BEGIN), 
+      sStatisticsUserData, cancel);
+  }
   
-  if (!l1.Intersects(l2, p)) return;
+  // Run a bunch of test cases on random points, noting for each one how close
+  // the nearest mark comes to it.
+  size_t numTrials = size_t(max(sNumTrials, 0));
+  vector<double> errors(numTrials);   // list of all errors
+  size_t actNumTrials = numTrials;
+  for (size_t first = 0; first < numTrials && !cancel; first += ROUND_SIZE) {
+    size_t last = min(numTrials, first + ROUND_SIZE);
+    RefStatisticsTrials trials(sMarkGrid, sBasisMarks.cols, first, last, 
+      errors, sVirtualMarks ? &sLineIndex : 0, &sBasisLines.cols, sMaxRank);
+    ParallelFor(trials, trials.GetNumChunks());
+    
+    // Report progress, and check for early termination from user
+    if (!sStatisticsFn) continue;
+    for (size_t i = first; i < last; i++) {
+      sStatisticsFn(StatisticsInfo(STATISTICS_WORKING, i, errors[i]), 
+        sStatisticsUserData, cancel);
+      if (cancel) {
+        actNumTrials = i + 1;
+        break;
+      }
+    }
+  }
+  errors.resize(actNumTrials);
   
-  // If the intersection point falls outside the square, it's not valid.
+  // Compute a bucket index for each error. Over the top goes into last
+  // bucket. Then record the error in the appropriate bucket.
+  vector<int> errBucket;              // number of errors in each bucket
+  errBucket.assign(sNumBuckets, 0);
+  for (size_t i = 0; i < errors.size(); i++) {
+    int errindex = int(errors[i] / sBucketSize);
+    if (errindex >= sNumBuckets) errindex = sNumBuckets - 1;
+    errBucket[errindex] += 1;
+  }
   
-  if (!ReferenceFinder::sPaper.Encloses(p)) return;
+  // Now compose a report of the results.
+  stringstream ss;
+  ss << fixed << showpoint << setprecision(1);
+  ss << "Distribution of errors for " << actNumTrials << " trials:" << endl;
+  int total = 0;
+  // Report the number of errors for each error bucket
+  for (int i = 0; i < sNumBuckets - 1; i++) {
+    total += errBucket[i];
+    ss << "error < " << 
+      setprecision(3) << sBucketSize * (i + 1) << 
+      " = " << total << " (" << 
+      setprecision(1) << 100. * double(total) / actNumTrials << 
+      "%)" << endl;
+  }
+  ss << "error > " << 
+    setprecision(3) << sBucketSize * (sNumBuckets - 1) << 
+    " = " << (actNumTrials - total) << " (" << 
+    setprecision(1) << 100. * double(actNumTrials - total) / actNumTrials << 
+    "%)" << endl;
+    
+  // Sort the errors and write percentiles of the errors into output string
+  if (!errors.empty()) {
+    sort(errors.begin(), errors.end());
+    ss << setprecision(4);
+    ss << endl << "Distribution of errors:" << endl;
+    ss << "10th percentile :" << errors[int(.10 * errors.size())] << endl;
+    ss << "20th percentile :" << errors[int(.20 * errors.size())] << endl;
+    ss << "50th percentile :" << errors[int(.50 * errors.size())] << endl;
+    ss << "80th percentile :" << errors[int(.80 * errors.size())] << endl;
+    ss << "90th percentile :" << errors[int(.90 * errors.size())] << endl;
+    ss << "95th percentile :" << errors[int(.95 * errors.size())] << endl;
+    ss << "99th percentile :" << errors[int(.99 * errors.size())] << endl;
+  }
   
-  // If the lines intersect at less than a 30 degree angle, we won't keep this 
-  // point because such intersections are imprecise to use as reference points.
+  sStatistics = ss.str();
   
-  if (abs(u1.Dot(u2.Rotate90())) < ReferenceFinder::sMinAngleSine) return;
-    
-  FinishConstructor();
+  // Call the callback for the final time, passing the string containing the
+  // results.
+  if (sStatisticsFn) {
+    sStatisticsFn(StatisticsInfo(STATISTICS_DONE), 
+      sStatisticsUserData, cancel);
+  }
 }
 
 
 /*****
-Return true if this mark uses rb for immediate reference.
+This routine builds Peter Messer's construction of  cube root of 2. Only used
+for testing, but I'll leave it in here for edification.
 *****/
-bool RefMark_Intersection::UsesImmediate(RefBase* rb) const
+void ReferenceFinder::MesserCubeRoot(ostream& os)
 {
-  return (rb == rl1 || rb == rl2);
-}
+  // Rank 0: Construct the four edges of the square.
+  RefLine *be, *le, *re, *te;
+  
+  ReferenceFinder::sBasisLines.Add(be = new RefLine_Original(
+    sPaper.mBottomEdge, 0, string("bottom edge")));
+  ReferenceFinder::sBasisLines.Add(le = new RefLine_Original(
+    sPaper.mLeftEdge, 0, string("left edge")));
+  ReferenceFinder::sBasisLines.Add(re = new RefLine_Original(
+    sPaper.mRightEdge, 0, string("right edge")));
+  ReferenceFinder::sBasisLines.Add(te = new RefLine_Original
+    (sPaper.mTopEdge, 0, string("top edge")));
 
+  // Rank 0: Construct the four corners of the square.
+  RefMark *blc, *brc, *tlc, *trc;
+  
+  ReferenceFinder::sBasisMarks.Add(blc = new RefMark_Original(
+  sPaper.mBotLeft, 0, string("bot left corner")));
+  ReferenceFinder::sBasisMarks.Add(brc = new RefMark_Original(
+  sPaper.mBotRight, 0, string("bot right corner")));
+  ReferenceFinder::sBasisMarks.Add(tlc = new RefMark_Original(
+  sPaper.mTopLeft, 0, string("top left corner")));
+  ReferenceFinder::sBasisMarks.Add(trc = new RefMark_Original(
+  sPaper.mTopRight, 0, string("top right corner")));
 
-/*****
-Build the folding sequence that constructs this object.
-*****/
-void RefMark_Intersection::SequencePushSelf()
-{
-  rl1->SequencePushSelf();
-  rl2->SequencePushSelf();
-  RefBase::SequencePushSelf();
+  // Create the endpoints of the two initial fold lines
+  RefMark *rma1, *rma2, *rmb1, *rmb2;
+  ReferenceFinder::sBasisMarks.Add(rma1 = new RefMark_Original(XYPt(0, 1./3), 0, 
+    string("(0, 1/3)")));
+  ReferenceFinder::sBasisMarks.Add(rma2 = new RefMark_Original(XYPt(1, 1./3), 0, 
+    string("(1, 1/3)")));
+  ReferenceFinder::sBasisMarks.Add(rmb1 = new RefMark_Original(XYPt(0, 2./3), 0, 
+    string("(0, 2/3)")));
+  ReferenceFinder::sBasisMarks.Add(rmb2 = new RefMark_Original(XYPt(1, 2./3), 0, 
+    string("(1, 2/3)")));
+
+  // Create and add the two initial fold lines.
+  RefLine *rla, *rlb;
+  ReferenceFinder::sBasisLines.Add(rla = new RefLine_C2P_C2P(rma1, rma2));
+  ReferenceFinder::sBasisLines.Add(rlb = new RefLine_C2P_C2P(rmb1, rmb2));
+  
+  // Construct the fold line
+  RefLine_P2L_P2L rlc(brc, le, rma2, rlb, 0);
+  
+  // Print the entire sequence
+  rlc.PutHowtoSequence(os);
+  
+  // quit the program
+  exit(1);
 }
 
 
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/******************************************************************************
+Section 1: lightweight classes that represent points and lines
+******************************************************************************/
+
+/**********
+class XYPt - a 2-vector that represents a point or 2-vector (direction vector).
+It is a lightweight mathematical object. Most operations are defined in the
+header, intended to be inlined for speed.
+**********/
+
 /*****
-Put a description of how to construct this mark to the stream.
+Stream I/O for a XYPt spits out the point as a parenthesis-enclosed,
+comma-delimited pair. 
 *****/
-bool RefMark_Intersection::PutHowto(ostream& os) const
+ostream& operator<<(ostream& os, const XYPt& p)
 {
-  os << "The intersection of ";
-  rl1->PutName(os);
-  os << " with ";
-  rl2->PutName(os);
-  os << " is ";
-  PutName(os);
-  if (ReferenceFinder::sClarifyVerbalAmbiguities) {
-    os.precision(4);
-    os.setf(ios_base::fixed, ios_base::floatfield);
-    os << " = " << p.Chop();
-  };
-  return true;
+  return os << "(" << (p.x) << "," << (p.y) << ")";
 }
 
 
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/**********
+class XYLine - a class for representing a line by a scalar d and the unit
+normal to the line, u, where the point d*u is the point on the line closest to
+the origin. Note that (d,u) and (-d,-u) represent the same line. If u isn't a
+unit vector, many things will break, so when in doubt, use Normalize() or
+NormalizeSelf().
+**********/
+
 /*****
-Go through existing lines and create RefMark_Intersections with rank equal to
-arank, up to a cumulative total of sMaxMarks.
+Stream I/O for a XYLine spits out the values of d and u as a
+parenthesis-enclosed, comma-delimited pair, e.g., "(0,(1,0))".
 *****/
-void RefMark_Intersection::MakeAll(rank_t arank)
+ostream& operator<<(ostream& os, const XYLine& l)
 {
-  for (rank_t irank = 0; irank <= arank / 2; irank++) {
-    rank_t jrank = arank - irank;
-    bool sameRank = (irank == jrank);
-    RefContainer<RefLine>::rank_iterator li = 
-      ReferenceFinder::sBasisLines.maps[irank].begin();
-    if (sameRank) li++;
-    while (li != ReferenceFinder::sBasisLines.maps[irank].end()) {
-      RefContainer<RefLine>::rank_iterator lj = 
-        ReferenceFinder::sBasisLines.maps[jrank].begin();
-      while (lj != (sameRank ? li : ReferenceFinder::sBasisLines.maps[jrank].end())) { 
-        if (ReferenceFinder::GetNumMarks() >= ReferenceFinder::sMaxMarks) return;
-        RefMark_Intersection rmi(li->second, lj->second);
-        ReferenceFinder::sBasisMarks.AddCopyIfValidAndUnique(rmi);
-        lj++;
-      };
-      li++;
-    }
-  } 
+  return os << "(" << (l.d) << "," << (l.u) << ")";
 }
 
 
@@ -1304,202 +3387,198 @@ void RefMark_Intersection::MakeAll(rank_t arank)
 
 
 /**********
-class RefLine - base class for a reference line. 
+class XYRect - a class for representing rectangles by two points, the bottom
+left and top right corners.
 **********/
 
 /*****
-RefLine static member initialization
+Return the aspect ratio of the rectangle, defined to be the smaller dimension
+divided by the larger dimension. If it's empty, return zero. If the rectangles
+is improperly defined, the aspect ratio may be negative.
 *****/
-RefBase::index_t RefLine::sCount = 0;   // Initialize class index
+double XYRect::GetAspectRatio() const
+{
+  double wd = GetWidth();
+  double ht = GetHeight();
+  if (abs(wd) < EPS && abs(ht) < EPS) return 0;
+  if (abs(wd) <= abs(ht)) return wd / ht;
+  return ht / wd;
+}
 
 
 /*****
-Calculate the key values used for sorting RefLines. Like its RefMark
-counterpart, this should be called at the end of every successfully constructed
-object, and it sets mKey to the proper value.
+Stream I/O for a XYRect spits out the values of bl and tr as a
+parenthesis-enclosed, comma-delimited pair, e.g., "((0,0),(1,1))".
 *****/
-void RefLine::FinishConstructor()
+ostream& operator<<(ostream& os, const XYRect& r)
 {
-  // resolve the ambiguity in line orientation by requiring d>=0.
-  if (l.d < 0) {
-    l.d = -l.d;
-    l.u.x = -l.u.x;
-    l.u.y = -l.u.y;
-  };
-  
-  double fa = (1. + atan2(l.u.y, l.u.x) / (3.14159265358979323)) / 2.0; // fa is between 0 & 1
-  const double dmax = sqrt(pow(ReferenceFinder::sPaper.mWidth, 2) + 
-    pow(ReferenceFinder::sPaper.mHeight, 2));
-  const double fd = l.d / dmax; // fd is between 0 and 1
-  
-  key_t nd = static_cast <key_t> (floor(0.5 + fd * ReferenceFinder::sNumD));
-  if (nd == 0) fa = fmod(2 * fa, 1);  // for d=0, we map alpha and pi+alpha to the same key
-  key_t na = static_cast <key_t> (floor(0.5 + fa * ReferenceFinder::sNumA));
-  mKey = 1 + na * ReferenceFinder::sNumD + nd;
+  return os << "(" << (r.bl) << "," << (r.tr) << ")";
 }
 
 
-/*****
-Return the "distance" between two lines.
-*****/
-double RefLine::DistanceTo(const XYLine& al) const
-{
-  if (ReferenceFinder::sLineWorstCaseError) {
-    // Use the worst-case separation between the endpoints of the two lines
-    // where they leave the paper.
-    XYPt p1a, p1b, p2a, p2b;
-    if (ReferenceFinder::sPaper.ClipLine(l, p1a, p1b) && 
-      ReferenceFinder::sPaper.ClipLine(al, p2a, p2b)) {
-      double err1 = max_val((p1a - p2a).Mag(), (p1b - p2b).Mag());
-      double err2 = max_val((p1a - p2b).Mag(), (p1b - p2a).Mag());
-      return min_val(err1, err2);
-    }
-    else {
-      return 1 / EPS; // lines don't intersect the paper, return very large number
-    }
-  }
-  else {
-    // Use the Pythagorean sum of the distance between the characteristic
-    // vectors of the tangent point and angle.
-    return sqrt(pow(l.u.Dot(al.u.Rotate90()), 2) + 
-      pow(l.d - al.d * l.u.Dot(al.u), 2));
-  }
-}
+#ifdef __MWERKS__
+#pragma mark -
+#endif
 
 
-/*****
-Return true if this RefLine is on the edge of the paper
-*****/
-bool RefLine::IsOnEdge() const
-{
-  return ((ReferenceFinder::sPaper.mLeftEdge == l) || 
-    (ReferenceFinder::sPaper.mTopEdge == l) ||
-    (ReferenceFinder::sPaper.mRightEdge == l) || 
-    (ReferenceFinder::sPaper.mBottomEdge == l));
-}
+/******************************************************************************
+Section 2: classes that represent reference marks and lines on a piece of paper
+******************************************************************************/
 
+/**********
+class Paper - specialization of XYRect, used for representing the paper
+**********/
 
 /*****
-Return true, since MOST Reflines are actions
+Constructor
 *****/
-bool RefLine::IsActionLine() const
+Paper::Paper(double aWidth, double aHeight) :
+  XYRect(aWidth, aHeight)
 {
-  return true;
+  SetSize(aWidth, aHeight);
 }
 
 
 /*****
-Return the label for this line.
+Set the size of the paper and all of the incidental data
 *****/
-const char RefLine::GetLabel() const
+void Paper::SetSize(double aWidth, double aHeight)
 {
-  return sLabels[mIndex - 1];
+  bl = XYPt(0, 0);
+  tr = XYPt(aWidth, aHeight);
+  mWidth= aWidth;
+  mHeight = aHeight;
+  mBotLeft = XYPt(0, 0);
+  mBotRight = XYPt(aWidth, 0);
+  mTopLeft = XYPt(0, aHeight);
+  mTopRight = XYPt(aWidth, aHeight);
+  mTopEdge = XYLine(mTopLeft, mTopRight);
+  mLeftEdge = XYLine(mBotLeft, mTopLeft);
+  mRightEdge = XYLine(mBotRight, mTopRight);
+  mBottomEdge = XYLine(mBotLeft, mBotRight);
+  mUpwardDiagonal = XYLine(mBotLeft, mTopRight);
+  mDownwardDiagonal = XYLine(mTopLeft, mBotRight);
 }
 
 
 /*****
-Put the name of this line to a stream. Default behavior gives this line a
-letter. Return true if we used a letter. (We'll return false if we use
-something else, i.e., a RefLine_Original).
+Clip the line al to the paper, returning the endpoints of the clipped segment
+in ap1 and ap2. If the line misses the paper entirely, return false and leave
+ap1 and ap2 unchanged.
 *****/
-bool RefLine::PutName(ostream& os) const
+bool Paper::ClipLine(const XYLine& al, XYPt& ap1, XYPt& ap2) const
 {
-  os << "line " << GetLabel()
-#ifdef RF_PUT_KEY_IN_TEXT
-    << "[" << mKey << "]"
-#endif // RF_PUT_KEY_IN_TEXT
-  ;
+  // Start by collecting all points of intersection between the line and the
+  // four sides of the paper.
+  
+  unsigned npts = 0;      // counter for number of points of intersection
+  XYPt ipts[4];       // list of points of intersection
+  XYPt p;           // a scratch pad for intersection points
+  
+  if (mTopEdge.Intersects(al, p) && Encloses(p)) ipts[npts++] = p;
+  if (mLeftEdge.Intersects(al, p) && Encloses(p)) ipts[npts++] = p;
+  if (mRightEdge.Intersects(al, p) && Encloses(p)) ipts[npts++] = p;
+  if (mBottomEdge.Intersects(al, p) && Encloses(p)) ipts[npts++] = p;
+  
+  if (npts == 0) return false;  // line entirely misses the paper
+
+  // Now parameterize all four points along the line, recording the minimum
+  // and maximum parameter values.
+  
+  XYPt pt = al.d * al.u;          // a point on the line
+  XYPt up = al.u.Rotate90();        // a tangent to the line
+  double tmin =( ipts[0] - pt).Dot(up);
+  double tmax = tmin;
+  for (unsigned i = 1; i < npts; i++) {
+    double tt = (ipts[i] - pt).Dot(up);
+    if (tmin < tt) tmin = tt;
+    if (tmax > tt) tmax = tt;
+  };
+  
+  // Compute the endpoints from our parameter ranges.
+  
+  ap1 = pt + tmin * up;
+  ap2 = pt + tmax * up;
   return true;
 }
 
 
 /*****
-Put the distance between this line and line al to a stream along with the rank
+Return true if line al overlaps the paper in its interior. Return false if the
+line misses the paper entirely, only hits a corner, or only runs along an edge.
 *****/
-void RefLine::PutDistanceAndRank(ostream& os, const XYLine& al) const
+bool Paper::InteriorOverlaps(const XYLine& al) const
 {
-  os.precision(4);
-  os.setf(ios_base::fixed, ios_base::floatfield);
-  os << "Solution " << l << ": err = " << DistanceTo(al) << " (rank " << 
-    mRank << ") ";
+  XYPt pa, pb;                // endpoints of the fold line
+  if (!ClipLine(al, pa, pb)) return false;  // the line completely misses the paper
+  return InteriorOverlaps(pa, pb);
 }
-    
-    
+
+
 /*****
-Draw a line in the given style.
+Same as above, for a line that's already been clipped to the paper; pa and pb
+are the endpoints that ClipLine() returned.
 *****/
-void RefLine::DrawSelf(RefStyle rstyle, short ipass) const
+bool Paper::InteriorOverlaps(const XYPt& pa, const XYPt& pb) const
 {
-  XYPt p1, p2;
-  ReferenceFinder::sPaper.ClipLine(l, p1, p2);
+  if ((pa - pb).Mag() < EPS) return false;  // line hits at a single point (a corner)
   
-  switch(ipass) {
-    case PASS_LINES:
-      {
-        switch (rstyle) {
-          case REFSTYLE_NORMAL:
-            sDgmr->DrawLine(p1, p2, RefDgmr::LINESTYLE_CREASE);
-            break;
-          default: ; // keep compiler happy
-        }
-      };
-      break;
-      
-    case PASS_HLINES: // hilited lines and action lines go on top of others
-      {
-        switch (rstyle) {
-          case REFSTYLE_HILITE:
-            sDgmr->DrawLine(p1, p2, RefDgmr::LINESTYLE_HILITE);
-            break;
-          case REFSTYLE_ACTION:
-            sDgmr->DrawLine(p1, p2, RefDgmr::LINESTYLE_VALLEY);
-            break;
-          default: ; // keep compiler happy
-        }
-      };
-      break;
-      
-    case PASS_LABELS:
-      {
-        XYPt mp = MidPoint(p1, p2); // label goes at the midpoint of the line
-        string sl(1, GetLabel());
-        switch (rstyle) {
-          case REFSTYLE_NORMAL:
-            // normal lines don't get labels
-            break;
-          case REFSTYLE_HILITE:
-            sDgmr->DrawLabel(mp, sl, RefDgmr::LABELSTYLE_HILITE);
-            break;
-          case REFSTYLE_ACTION:
-            sDgmr->DrawLabel(mp, sl, RefDgmr::LABELSTYLE_ACTION);
-            break;
-          default: ;// keep compiler happy
-        }
-      };
-      break;
-    default: ;// keep compiler happy
-  }
-  // Subclasses will add arrows for REFSTYLE_ACTION
+  if (!GetBoundingBox(pa, pb).IsEmpty()) return true;  // bounding box has positive volume
+  
+  // If still here, then the bounding box must be a line, either the edge of the paper
+  // or a vertical or horizontal line in the interior. We can test for the latter by 
+  // seeing if the midpoint of the line lies fully in the interior of the paper.
+  
+  XYPt mp = MidPoint(pa, pb);
+  
+  if (mTopEdge.Intersects(mp) || mBottomEdge.Intersects(mp) || 
+    mLeftEdge.Intersects(mp) || mRightEdge.Intersects(mp)) return false;
+  
+  return true;
 }
 
 
 /*****
-Most subclasses will use the default method, which sets the index from the
-class variable sCount and then bumps up the count.
+The line al divides the paper into two portions. Return true if either of the
+two qualifies as a skinny flap. "Skinny" means a triangle (or quad) whose
+aspect ratio falls below a minimum size.
 *****/
-
-void RefLine::SetIndex()
+bool Paper::MakesSkinnyFlap(const XYLine& al) const 
 {
-  mIndex = ++sCount;
+  // Since "true" = "bad", we'll return true for any failures along the way due to bad
+  // input parameters.
+  
+  XYPt p1, p2;            // endpoints of the line al
+  ClipLine(al, p1, p2);       // get the endpoints of the fold line on the paper
+  return MakesSkinnyFlap(al, p1, p2);
 }
 
 
 /*****
-Reset the class variable sCount to zero.
+Same as above, for a line that's already been clipped to the paper; p1 and p2
+are the endpoints that ClipLine() returned.
 *****/
-void RefLine::ResetCount()
+bool Paper::MakesSkinnyFlap(const XYLine& al, const XYPt& p1, 
+  const XYPt& p2) const
 {
-  sCount = 0;
+  XYLine lb;              // perpendicular bisector of line segment p1-p2
+  lb.u = al.u.Rotate90();
+  lb.d = MidPoint(p1, p2).Dot(lb.u);
+  XYPt bp1, bp2;            // endpoints of the bisector
+  ClipLine(lb, bp1, bp2);       // get the endpoints of the bisector
+  
+  // Get the bounding box that contains the fold line and a point on either side of the
+  // fold line. If this bounding box is below the minimum aspect ratio, then it contains
+  // a flap that falls below the minimum aspect ratio, so we return true.
+
+  if (abs(GetBoundingBox(p1, p2, bp1).GetAspectRatio()) < ReferenceFinder::sMinAspectRatio) 
+    return true;
+  if (abs(GetBoundingBox(p1, p2, bp2).GetAspectRatio()) < ReferenceFinder::sMinAspectRatio) 
+    return true;
+  
+  // If we're still here, we didn't create any skinny flaps, so we're cool.
+  
+  return false;
 }
 
 
@@ -1509,390 +3588,401 @@ void RefLine::ResetCount()
 
 
 /**********
-class RefLine_Original - Specialization of RefLine that represents a line that
-is the edge of the paper or an initial crease (like the diagonal).
+class RefBase - base class for a mark or line. 
 **********/
 
+/*
+Non-static member variables are:
+mRank - the rank, which is the number of creases that need to be made to define
+  it.
+mKey - a unique key that is used to efficiently store and search over marks and
+  lines. mKey is initialized to 0. If the object has been successfully
+  constructed, it will be set to an integer greater than 0, so mKey==0 is used
+  as a test for successful construction.
+mIndex - a counter used in constructing the verbal sequence; basically, it's
+  the order in which the object is created for a given folding sequence.
+Any subclasses of RefBase should be fairly lightweight because we'll be
+creating a couple hundred thousand of them during program initialization.
+*/
+
 /*****
-Constructor.
+RefBase static member initialization
 *****/
-RefLine_Original::RefLine_Original(const XYLine& al, rank_t arank, string aName) : 
-  RefLine(al, arank), mName(aName)
-{
-  FinishConstructor();
-}
+RefDgmr* RefBase::sDgmr;
+vector<RefBase*> RefBase::sSequence;
+vector<RefBase::DgmInfo> RefBase::sDgms;
+
+
+/*  Notes on Sequences.
+A ref (RefMark or RefLine) is typically defined in terms of other refs, going
+all the way back to RefMark_Original and RefLine_Original. The routine
+aRef->BuildAndNumberSequence() constructs an ordered list of all the refs that
+make up aRef. The ordering is such that ancestor refs come earlier in the list
+than refs derived from them. In addition to constructing the list,
+BuildAndNumberSequence also sets the mIndex variable of each non- original ref,
+so that each can be given a unique name (which depends on the index, and is a
+letter, A-J for lines, P-Z for points).
 
+This numbering scheme means that there can only be one sequence in existence at
+a time. To insure this, the sequence is constructed in the static RefBase
+member variable sSequence, which is public, so you can (if you like) read out
+this sequence.
+*/
 
 /*****
-Return false because RefLine_Originals aren't actions, they're present from the
-beginning.
+Append to the end of sSequence pointers to all the marks and lines needed to
+create this mark or line. Default behavior is to append a pointer to self. A
+subclass line or mark made from others should call SequencePushUnique() for
+each of the elements that define it, and then call the RefBase method for
+itself.
 *****/
-bool RefLine_Original::IsActionLine() const
+void RefBase::SequencePushSelf()
 {
-  return false;
+  SequencePushUnique(this);
 }
 
 
 /*****
-Return the label for this line.
+Build a sequence (in sSequence) of all of the references that are needed to
+define this one; also set mIndex for each reference so that the relevant
+RefMarks and RefLines are sequentially numbered.
 *****/
-const char RefLine_Original::GetLabel() const
+void RefBase::BuildAndNumberSequence()
 {
-  return 0; // originals get no label
+  sSequence.clear();
+  SequencePushSelf(); 
+  RefMark::ResetCount();
+  RefLine::ResetCount();
+  for (size_t i = 0; i < sSequence.size(); i++) sSequence[i]->SetIndex();
 }
 
 
 /*****
-Put the name to a stream. Override the default method to use the actual string
-name, rather than a letter. Return false since we didn't use a letter.
+Put a statement about how to make this mark from its constituents to a stream.
+Overridden by most subclasses. Return true if we actually put something
+(original types will return false).
 *****/
-
-bool RefLine_Original::PutName(ostream& os) const
+bool RefBase::PutHowto(ostream& /* os */) const
 {
-  os << mName;
   return false;
 }
 
 
 /*****
-Draw this line in the appropriate style
+Send the full how-to sequence to the given stream.
 *****/
-void RefLine_Original::DrawSelf(RefStyle rstyle, short ipass) const
+ostream& RefBase::PutHowtoSequence(ostream& os)
 {
-  // RefLine_Originals don't get labels, and they are REFSTYLE_ACTION, we
-  // still draw them hilited.
-  XYPt p1, p2;
-  ReferenceFinder::sPaper.ClipLine(l, p1, p2);
-  switch(ipass) {
-    case PASS_LINES:
-      switch (rstyle) {
-        case REFSTYLE_NORMAL:
-          sDgmr->DrawLine(p1, p2, RefDgmr::LINESTYLE_CREASE);
-          break;
-        default: ; // keep compiler happy
-      }
-      break;
-    case PASS_HLINES:
-      switch (rstyle) {
-        case REFSTYLE_HILITE:
-        case REFSTYLE_ACTION:
-          sDgmr->DrawLine(p1, p2, RefDgmr::LINESTYLE_HILITE);
-          break;
-        default: ; // keep compiler happy
-      }
-      break;
-    default: ; // keep compiler happy about unhandled cases
-  }
+  BuildAndNumberSequence(); 
+  for (size_t i = 0; i < sSequence.size(); i++)
+    if (sSequence[i]->PutHowto(os)) os << "." << endl;
+  return os;
 }
+    
+
+/*  Notes on diagrams.
+A DgmInfo is a very simple object that contains just a couple of bits of
+information necessary to construct a complete diagram from the list of refs
+contained in sSequence. Any diagram is a subsequence of sSequence, which, in
+effect, describes all the refs that are already on the paper as well as the
+ref(s) currently being made.
+
+DgmInfo.idef is the index of the first ref in sSequence that is defined in the
+current diagram.
 
+DgmInfo.iact is the index of the last ref that is defined in the current
+diagram, which is the action line, if this diagram includes an action line.
+idef <= iact.
+*/
 
 /*****
-Return false, since this is original
+Build a set of diagrams that describe how to fold this reference, by
+constructing a list of DgmInfo records (which refer to elements and
+subsequences of sSequence).
 *****/
-bool RefLine_Original::IsDerived() const
+void RefBase::BuildDiagrams()
 {
-  return false;
+  sDgms.clear();
+  BuildAndNumberSequence();
+  
+  // Now, we need to note which elements of the sequence are action lines;
+  // there will be a diagram for each one of these.
+  size_t ss = sSequence.size();
+  for (size_t i = 0; i < ss; i++)
+    if (sSequence[i]->IsActionLine()) sDgms.push_back(DgmInfo(i, i));
+    
+  // We should always have at least one diagram, even if there was only one ref
+  // in sSequence (which happens if the ref was a RefMark_Original or
+  // RefLine_Original).
+  if (sDgms.size() == 0) sDgms.push_back(DgmInfo(0, 0));
+  
+  // And we make sure we have a diagram for the last ref in the sequence (which
+  // might not be the case if we ended with a RefMark or an original).
+  if (sDgms[sDgms.size() - 1].iact < ss - 1) sDgms.push_back(DgmInfo(0, ss - 1));
+  
+  // Now we go through and set the idef fields of each DgmInfo record.
+  size_t id = 0;
+  for (size_t i = 0; i < sDgms.size(); i++) {
+    sDgms[i].idef = id;
+    id = sDgms[i].iact + 1;
+  }
 }
 
 
 /*****
-Set the index of this line. Override the default method to use an index of
-zero, since we've already got a name.
+Draw the paper
 *****/
-
-void RefLine_Original::SetIndex()
+void RefBase::DrawPaper()
 {
-  mIndex = 0;
+  vector<XYPt> corners;
+  corners.push_back(ReferenceFinder::sPaper.mBotLeft);
+  corners.push_back(ReferenceFinder::sPaper.mBotRight);
+  corners.push_back(ReferenceFinder::sPaper.mTopRight);
+  corners.push_back(ReferenceFinder::sPaper.mTopLeft);
+  sDgmr->DrawPoly(corners, RefDgmr::POLYSTYLE_WHITE);
 }
 
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
-
-
-/**********
-class RefLine_C2P_C2P - Huzita-Hatori Axiom O1
-Make a crease through two points p1 and p2.
-**********/
-
 /*****
-Constructor. Initialize with the two marks that this line connects.
+Draw the given diagram using the RefDgmr aDgmr.
 *****/
-RefLine_C2P_C2P::RefLine_C2P_C2P(RefMark* arm1, RefMark* arm2) : 
-  RefLine(CalcLineRank(arm1, arm2)), rm1(arm1), rm2(arm2)
+void RefBase::DrawDiagram(RefDgmr& aDgmr, const DgmInfo& aDgm)
 {
-  const XYPt& p1 = rm1->p;
-  const XYPt& p2 = rm2->p;
+  // Set the current RefDgmr to be aDgmr.
+  sDgmr = &aDgmr;
   
-  // Construct member data
-  l.u = (p2 - p1).Rotate90().Normalize();
-  l.d = .5 * (p1 + p2).Dot(l.u);
+  // always draw the paper
+  DrawPaper();
   
-  // Don't need to check visibility because this type is always visible.
-  // If this line creates a skinny flap, we won't use it.
-  if (ReferenceFinder::sPaper.MakesSkinnyFlap(l)) return;
+  // Make a note of the action line ref
+  RefBase* ral = sSequence[aDgm.iact];
   
-  // This type is always valid.
-  FinishConstructor();
+  // draw all refs specified by the DgmInfo. Most get drawn in normal style.
+  // The ref that is the action line (and all subsequent refs) get drawn in
+  // action style. Any refs that are used immediately by the action line get
+  // drawn in hilite style. Drawing for each diagram is done in multiple passes
+  // so that, for examples, labels end up on top of everything else.
+  for (short ipass = 0; ipass < NUM_PASSES; ipass++) {
+    for (size_t i = 0; i < aDgm.iact; i++) {
+      RefBase* rb = sSequence[i];
+      if ((i >= aDgm.idef && rb->IsDerived()) || ral->UsesImmediate(rb)) 
+        rb->DrawSelf(REFSTYLE_HILITE, ipass);
+      else rb->DrawSelf(REFSTYLE_NORMAL, ipass);
+    };
+    sSequence[aDgm.iact]->DrawSelf(REFSTYLE_ACTION, ipass);
+  }
 }
 
 
 /*****
-Return true if this line uses rb for immediate reference.
+Put the caption to a particular diagram to a stream. The caption consists of
+how-to for those refs that are part of the action. The output is created as a
+single string containing possibly multiple sentences.
 *****/
-bool RefLine_C2P_C2P::UsesImmediate(RefBase* rb) const
+void RefBase::PutDiagramCaption(std::ostream& os, const DgmInfo& aDgm)
 {
-  return (rb == rm1 || rb == rm2);
+  for (size_t i = aDgm.idef; i <= aDgm.iact; i++) {
+    sSequence[i]->PutHowto(os);
+    os << ". ";
+  }
 }
 
 
 /*****
-Build the folding sequence that constructs this object.
+Return true if this mark or line uses rb for immediate reference. "Immediate"
+means that if A uses B and B uses C, A->UsesImmediate(B) returns true but
+A->UsesImmediate(C) returns false. Default returns false; this will be used by
+original marks and lines.
 *****/
-void RefLine_C2P_C2P::SequencePushSelf()
+bool RefBase::UsesImmediate(RefBase* /* rb */) const
 {
-  rm1->SequencePushSelf();
-  rm2->SequencePushSelf();
-  RefBase::SequencePushSelf();
+  return false;
 }
 
 
 /*****
-Put the construction of this line to a stream.
+Return true if this is a derived (rather than an original) mark or line. Note
+that this is not the same as mRank!=0, because the diagonals have mRank==1 but
+are still considered original. Default is true since most objects will be
+derived.
 *****/
-bool RefLine_C2P_C2P::PutHowto(ostream& os) const
+bool RefBase::IsDerived() const
 {
-  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[01] ";
-  os << "Form a crease connecting ";
-  rm1->PutName(os);
-  os << " with ";
-  rm2->PutName(os);
-  os << ", making ";
-  PutName(os);
   return true;
 }
 
 
 /*****
-Draw this line, adding arrows if appropriate
+Utility used by subclasses when they implement SequencePushSelf(). This insures
+that a given mark only gets a single label.
 *****/
-void RefLine_C2P_C2P::DrawSelf(RefStyle rstyle, short ipass) const
+void RefBase::SequencePushUnique(RefBase* rb)
 {
-  // Call the inherited method to draw the line
-  RefLine::DrawSelf(rstyle, ipass);
+  if (find(sSequence.begin(), sSequence.end(), rb) == sSequence.end()) 
+    sSequence.push_back(rb);
+}
+
+
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/**********
+class RefMark - base class for a mark on the paper. 
+**********/
+
+/*****
+RefMark static member initialization
+*****/
+RefBase::index_t RefMark::sCount = 0;   // Initialize class index
+
+
+/*****
+Calculate the key value used for distinguishing RefMarks. This should be called
+at the end of every constructor if the mark is valid (and not if it isn't).
+*****/
+void RefMark::FinishConstructor()
+ {
+  mKey = CalcKey(p);
   
-  // If we're moving, we need arrows.
-  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
-  
-    // Get the endpoints of the fold
-    const XYPt& p1 = rm1->p;
-    const XYPt& p2 = rm2->p;
-    
-    // Get the perpendicular bisector of the fold
-    XYPt mp = MidPoint(p1, p2);
-    XYLine lb;
-    lb.u = l.u.Rotate90();
-    lb.d = mp.Dot(lb.u);
-    
-    // Get the points where the bisector crosses the paper
-    XYPt p3, p4;
-    ReferenceFinder::sPaper.ClipLine(lb, p3, p4);
-    
-    // Parameterize these points along the bisector. Don't care about sign.
-    double t3 = abs((p3 - mp).Dot(l.u));
-    double t4 = abs((p4 - mp).Dot(l.u));
-    
-    // Construct a new pair of points that mate when folded and that are
-    // guaranteed to lie within the paper.
-    XYPt dp;
-    if (t3 < t4) dp = t3 * l.u;
-    else dp = t4 * l.u;
-    p3 = mp + dp;
-    p4 = mp - dp;
-    
-    // Draw an arrow that connects these two points.
-    sDgmr->DrawFoldAndUnfoldArrow(p3, p4);
-  }
+  // Note whether the mark is on the edge of the paper, which we check for
+  // every alignment that uses it.
+  mOnEdge = (ReferenceFinder::sPaper.mLeftEdge.Intersects(p) || 
+    ReferenceFinder::sPaper.mRightEdge.Intersects(p) ||
+    ReferenceFinder::sPaper.mTopEdge.Intersects(p) || 
+    ReferenceFinder::sPaper.mBottomEdge.Intersects(p));
 }
 
 
 /*****
-Go through existing lines and marks and create RefLine_C2P_C2Ps with rank equal
-to arank, up to a cumulative total of sMaxLines.
+Return the key of a mark at point ap.
 *****/
-void RefLine_C2P_C2P::MakeAll(rank_t arank)
+RefBase::key_t RefMark::CalcKey(const XYPt& ap)
 {
-  for (rank_t irank = 0; irank <= (arank - 1) / 2; irank++) {
-    rank_t jrank = arank - irank - 1;
-    bool sameRank = (irank == jrank);
-    RefContainer<RefMark>::rank_iterator mi = 
-      ReferenceFinder::sBasisMarks.maps[irank].begin();
-    if (sameRank) mi++;
-    while (mi != ReferenceFinder::sBasisMarks.maps[irank].end()) {
-      RefContainer<RefMark>::rank_iterator mj = 
-        ReferenceFinder::sBasisMarks.maps[jrank].begin();
-      while (mj != (sameRank ? mi : ReferenceFinder::sBasisMarks.maps[jrank].end())) {
-        if (ReferenceFinder::GetNumLines() >= ReferenceFinder::sMaxLines) return;
-        RefLine_C2P_C2P rlc(mi->second, mj->second);
-        ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(rlc);
-        mj++;
-      };
-      mi++;
-    }
-  }
-}
-
+  const double fx = ap.x / ReferenceFinder::sPaper.mWidth;  // fx is between 0 and 1
+  const double fy = ap.y / ReferenceFinder::sPaper.mHeight; // fy is between 0 and 1
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
+  key_t nx = static_cast<key_t> (floor(0.5 + fx * ReferenceFinder::sNumX));
+  key_t ny = static_cast<key_t> (floor(0.5 + fy * ReferenceFinder::sNumY));
+  return 1 + nx * ReferenceFinder::sNumY + ny;
+}
 
 
-/**********
-class RefLine_P2P - Huzita-Hatori Axiom O2
-Bring p1 to p2.
-**********/
+/*****
+Return the distance between two points. This is used when sorting marks by
+their distance from a given mark.
+*****/
+double RefMark::DistanceBetween(const XYPt& ap1, const XYPt& ap2)
+ {
+  return (ap1 - ap2).Mag();
+ }
+ 
 
 /*****
-Constructor.
+Return false, since marks can never be actions
 *****/
-RefLine_P2P::RefLine_P2P(RefMark* arm1, RefMark* arm2) : 
-  RefLine(CalcLineRank(arm1, arm2)), rm1(arm1), rm2(arm2)
+bool RefMark::IsActionLine() const
 {
-  // Get references to points
-  XYPt& p1 = rm1->p;
-  XYPt& p2 = rm2->p;
-  
-  // Construct member data
-  l.u = (p2 - p1).Normalize();
-  l.d = .5 * (p1 + p2).Dot(l.u);
-  
-  // Check visibility
-  bool p1edge = arm1->IsOnEdge();
-  bool p2edge = arm2->IsOnEdge();
-  
-  if (ReferenceFinder::sVisibilityMatters) {
-    if (p1edge) mWhoMoves = WHOMOVES_P1;
-    else if (p2edge) mWhoMoves = WHOMOVES_P2;
-    else return;
-  }
-  else {
-    mWhoMoves = WHOMOVES_P1;
-  };
-  
-  // If this line creates a skinny flap, we won't use it.
-  if (ReferenceFinder::sPaper.MakesSkinnyFlap(l)) return;
-  
-  // Set the key.
-  FinishConstructor();
+  return false;
 }
 
 
 /*****
-Return true if this line uses rb for immediate reference.
+Return the label for this mark.
 *****/
-bool RefLine_P2P::UsesImmediate(RefBase* rb) const
+const char RefMark::GetLabel() const
 {
-  return (rb == rm1 || rb == rm2);
+  return sLabels[mIndex - 1];
 }
 
 
 /*****
-Build the folding sequence that constructs this object.
+Put the name of this mark to a stream. Default behavior gives this mark a
+letter. Return true if we used a letter, false if something else (i.e., the
+name of a RefMark_Original).
 *****/
-void RefLine_P2P::SequencePushSelf()
+bool RefMark::PutName(ostream& os) const
 {
-  switch (mWhoMoves) {
-    case WHOMOVES_P1:
-      rm2->SequencePushSelf();
-      rm1->SequencePushSelf();
-      break;
-    
-    case WHOMOVES_P2:
-      rm1->SequencePushSelf();
-      rm2->SequencePushSelf();
-      break;
-  };    
-  RefBase::SequencePushSelf();
+  os << "point " << GetLabel()
+#ifdef RF_PUT_KEY_IN_TEXT
+    << "[" << mKey << "]"
+#endif // RF_PUT_KEY_IN_TEXT
+  ;
+  return true;
 }
 
 
 /*****
-Put the construction of this line to a stream.
+Put the distance from this mark to point ap to a stream.
 *****/
-bool RefLine_P2P::PutHowto(ostream& os) const
+void RefMark::PutDistanceAndRank(ostream& os, const XYPt& ap) const
 {
-  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[02] ";
-  os << "Bring ";
-  switch (mWhoMoves) {
-    case WHOMOVES_P1:
-      rm1->PutName(os);
-      os << " to ";
-      rm2->PutName(os);
+  os.precision(4);
+  os.setf(ios_base::fixed, ios_base::floatfield);
+  os << "Solution " << p.Chop() << ": err = " << DistanceTo(ap) << " (rank " << 
+    mRank << ") ";
+}
+    
+    
+/*****
+Draw a RefMark in the indicated style
+*****/
+void RefMark::DrawSelf(RefStyle rstyle, short ipass) const
+{
+  switch(ipass) {
+    case PASS_POINTS:
+      {
+        switch(rstyle) {
+          case REFSTYLE_NORMAL:
+            sDgmr->DrawPt(p, RefDgmr::POINTSTYLE_NORMAL);
+            break;
+          case REFSTYLE_HILITE:
+            sDgmr->DrawPt(p, RefDgmr::POINTSTYLE_HILITE);
+            break;
+          case REFSTYLE_ACTION:
+            sDgmr->DrawPt(p, RefDgmr::POINTSTYLE_ACTION);
+            break;
+        }
+      };
       break;
       
-    case WHOMOVES_P2:
-      rm2->PutName(os);
-      os << " to ";
-      rm1->PutName(os);
+    case PASS_LABELS:
+      {
+      string sm(1, GetLabel());
+      switch(rstyle) {
+        case REFSTYLE_NORMAL:
+          // Normal points don't get labels drawn
+          break;
+        case REFSTYLE_HILITE:
+          sDgmr->DrawLabel(p, sm, RefDgmr::LABELSTYLE_HILITE);
+          break;
+        case REFSTYLE_ACTION:
+          sDgmr->DrawLabel(p, sm, RefDgmr::LABELSTYLE_ACTION);
+          break;
+      };
       break;
-  };
-  os << ", making ";
-  PutName(os);
-  return true;
+    }
+  }
 }
 
 
 /*****
-Draw this line, adding arrows if appropriate
+Most types of RefMark use the default method, which gives the mark an index
+from the class variable sCount and then bumps up the class variable.
 *****/
-void RefLine_P2P::DrawSelf(RefStyle rstyle, short ipass) const
+void RefMark::SetIndex()
 {
-  // Call inherited method to draw the lines
-  RefLine::DrawSelf(rstyle, ipass);
-  
-  // If we're moving, we need an arrow
-  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
-    XYPt& p1 = rm1->p;
-    XYPt& p2 = rm2->p;
-    switch (mWhoMoves) {
-      case WHOMOVES_P1:
-        sDgmr->DrawFoldAndUnfoldArrow(p1, p2);
-        break;
-      case WHOMOVES_P2:
-        sDgmr->DrawFoldAndUnfoldArrow(p2, p1);
-        break;
-    }
-  }
+  mIndex = ++sCount;
 }
-      
 
 
 /*****
-Go through existing lines and marks and create RefLine_P2Ps with rank equal to
-arank, up to a cumulative total of sMaxLines.
+Reset the counter used for indexing marks in a sequence.
 *****/
-void RefLine_P2P::MakeAll(rank_t arank)
+void RefMark::ResetCount()
 {
-  for (rank_t irank = 0; irank <= (arank - 1) / 2; irank++) {
-    rank_t jrank = arank - irank - 1;
-    bool sameRank = (irank == jrank);
-    RefContainer<RefMark>::rank_iterator mi = 
-      ReferenceFinder::sBasisMarks.maps[irank].begin();
-    if (sameRank) mi++;
-    while (mi != ReferenceFinder::sBasisMarks.maps[irank].end()) {
-      RefContainer<RefMark>::rank_iterator mj = 
-        ReferenceFinder::sBasisMarks.maps[jrank].begin();
-      while (mj != (sameRank ? mi : ReferenceFinder::sBasisMarks.maps[jrank].end())) {
-        if (ReferenceFinder::GetNumLines() >= ReferenceFinder::sMaxLines) return;
-        RefLine_P2P rlb(mi->second, mj->second);
-        ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(rlb);
-        mj++;
-      };
-      mi++;
-    }
-  }
+  sCount = 0;
 }
 
 
@@ -1902,225 +3992,82 @@ void RefLine_P2P::MakeAll(rank_t arank)
 
 
 /**********
-class RefLine_L2L - Huzita-Hatori Axiom O3 
-Bring line l1 to line l2.
+class RefMark_Original - Specialization of RefMark that represents a named mark
+(e.g., a corner).
 **********/
 
 /*****
-Constructor. iroot = 0 or 1.
+Constructor.
 *****/
+RefMark_Original::RefMark_Original(const XYPt& ap, rank_t arank, string aName) : 
+  RefMark(ap, arank), mName(aName)
+{
+  FinishConstructor();
+}
 
-RefLine_L2L::RefLine_L2L(RefLine* arl1, RefLine* arl2, short iroot) : 
-  RefLine(CalcLineRank(arl1, arl2)), rl1(arl1), rl2(arl2)
-{     
-  // Get references to lines
-  XYLine& l1 = rl1->l;
-  XYPt& u1 = l1.u;
-  double& d1 = l1.d;
-  XYLine& l2 = rl2->l;
-  XYPt& u2 = l2.u;
-  double& d2 = l2.d;
-  
-  // Parallel lines get handled specially. There's only one solution; we arbitrarily make
-  // it the iroot=0 solution.
-  if (l1.IsParallelTo(l2)) {
-    if (iroot == 0) {
-      l.u = u1;
-      l.d = .5 * (d1 + d2 * u2.Dot(u1));
-    }
-    else return; // iroot = 1 for parallel lines isn't a valid solution.
-  }
-  else {  // nonparallel lines
-  
-    // Construct the direction vector for the bisector, depending on the value of iroot.
-    if (iroot == 0) l.u = (u1 + u2).Normalize();
-    else l.u = (u1 - u2).Normalize();
-    
-    l.d = Intersection(l1, l2).Dot(l.u);
-  };
-  
-  // If the paper doesn't overlap the fold line, we're not valid.
-  if (!ReferenceFinder::sPaper.InteriorOverlaps(l)) return;
-  
-  // Check visibility
-  bool l1edge = arl1->IsOnEdge();
-  bool l2edge = arl2->IsOnEdge();
-  
-  if (ReferenceFinder::sVisibilityMatters) {
-    if (l1edge) mWhoMoves = WHOMOVES_L1;
-    else if (l2edge) mWhoMoves = WHOMOVES_L2;
-    else {
-      XYPt lp1, lp2;
-      ReferenceFinder::sPaper.ClipLine(l1, lp1, lp2);
-      if (ReferenceFinder::sPaper.Encloses(l.Fold(lp1)) && 
-        ReferenceFinder::sPaper.Encloses(l.Fold(lp2))) mWhoMoves = WHOMOVES_L1;
-      else {
-        ReferenceFinder::sPaper.ClipLine(l2, lp1, lp2);
-        if (ReferenceFinder::sPaper.Encloses(l.Fold(lp1)) && 
-          ReferenceFinder::sPaper.Encloses(l.Fold(lp2))) mWhoMoves = WHOMOVES_L2;
-        else return;
-      }
-    }
-  }
-  else {
-    mWhoMoves = WHOMOVES_L1;
-  };
-  
-  // If this line creates a skinny flap, we won't use it.
-  if (ReferenceFinder::sPaper.MakesSkinnyFlap(l)) return;
 
-  // Set the key.
-  FinishConstructor();
+/*****
+Return what this mark was made from.
+*****/
+RefBase::RefSource RefMark_Original::GetSource() const
+{
+  RefSource rs(REFTYPE_ORIGINAL);
+  rs.mName = &mName;
+  return rs;
 }
 
 
 /*****
-Return true if this line uses rb for immediate reference.
+Return the label for this mark.
 *****/
-bool RefLine_L2L::UsesImmediate(RefBase* rb) const
+const char RefMark_Original::GetLabel() const
 {
-  return (rb == rl1 || rb == rl2);
+  return 0; // originals get no labels
 }
 
 
 /*****
-Build the folding sequence that constructs this object.
+Put the name of this mark to a stream. Override to put the string name (rather
+than a letter).
 *****/
-void RefLine_L2L::SequencePushSelf()
+
+bool RefMark_Original::PutName(ostream& os) const
 {
-  switch (mWhoMoves) {
-    case WHOMOVES_L1:
-      rl2->SequencePushSelf();
-      rl1->SequencePushSelf();
-      break;
-    
-    case WHOMOVES_L2:
-      rl1->SequencePushSelf();
-      rl2->SequencePushSelf();
-      break;
-  };
-  RefBase::SequencePushSelf();
+  os << mName;  // return the string
+  return false;
 }
 
 
 /*****
-Put the construction of this line to a stream.
+Draw this mark
 *****/
-bool RefLine_L2L::PutHowto(ostream& os) const
+void RefMark_Original::DrawSelf(RefStyle rstyle, short ipass) const
 {
-  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[03] ";
-  os << "Fold ";
-  switch (mWhoMoves) {
-    case WHOMOVES_L1:
-      rl1->PutName(os);
-      os << " to ";
-      rl2->PutName(os);   
-      break;
-    
-    case WHOMOVES_L2:
-      rl2->PutName(os);
-      os << " to ";
-      rl1->PutName(os);   
-      break;
-  };
-  os << ", making ";
-  PutName(os);
-  if (ReferenceFinder::sClarifyVerbalAmbiguities) {
-    os << " through ";
-    
-    // Now we need to specify which of the two bisectors this is, which we do
-    // by specifying a point where the bisector hits the edge of the square.
-    XYPt p;
-    rl1->l.Intersects(rl2->l, p); // get the intersection of the two bisectors
-
-    XYPt pa, pb;
-    ReferenceFinder::sPaper.ClipLine(l, pa, pb);   // find where our fold line hits the paper.
-    
-    // Return the first point of intersection between the fold line and the edge of the
-    // paper that _isn't_ the intersection of the two bisectors.
-    os.precision(2);
-    os.setf(ios_base::fixed, ios_base::floatfield);
-	if (p == pa) {
-		os << pb.Chop();
-		return true;
-	}
-    os << pa.Chop();
-  };
-  return true;
-}
+  // Override the default because original marks don't get labels and are only
+  // drawn when they are hilited or action (in which case we still draw them
+  // hilited).
+  if ((ipass == PASS_POINTS) && 
+    (rstyle == REFSTYLE_HILITE || rstyle == REFSTYLE_ACTION)) 
+    sDgmr->DrawPt(p, RefDgmr::POINTSTYLE_HILITE);
+} 
 
 
 /*****
-Draw this line, adding arrows if appropriate
+Return false, since this is original
 *****/
-void RefLine_L2L::DrawSelf(RefStyle rstyle, short ipass) const
+bool RefMark_Original::IsDerived() const
 {
-  // Call inherited method to draw the lines
-  RefLine::DrawSelf(rstyle, ipass);
-  
-  // If we're moving, we need an arrow that brings two points from one line to
-  // two points on the other line. We need to pick points that are within the
-  // paper for both lines.
-  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
-      
-      XYLine& l1 = rl1->l;
-      XYLine& l2 = rl2->l;
-      XYPt p1a, p1b;
-      ReferenceFinder::sPaper.ClipLine(l1, p1a, p1b);  // endpoints of l1
-      XYPt p2a, p2b;
-      ReferenceFinder::sPaper.ClipLine(l2, p2a, p2b);  // endpoints of l2
-      p2a = l.Fold(p2a);                // flop l2 points onto l1
-      p2b = l.Fold(p2b);
-      XYPt du1 = l1.d * l1.u;       // a point on l1
-      XYPt up1 = l1.u.Rotate90();     // a tangent to l1
-      vector<double> tvals;       // holds parameterizations of the 4 points
-      tvals.push_back((p1a - du1).Dot(up1));  // parameterize p1a along l1
-      tvals.push_back((p1b - du1).Dot(up1));  // parameterize p1b along l1
-      tvals.push_back((p2a - du1).Dot(up1));  // parameterize p2a along l1
-      tvals.push_back((p2b - du1).Dot(up1));  // parameterize p2b along l1
-      sort(tvals.begin(), tvals.end());   // sort them in order; we want the middle 2
-      XYPt p1c = du1 + 0.5 * (tvals[1] + tvals[2]) * up1;
-      XYPt p2c = l.Fold(p1c);
-      switch(mWhoMoves) {
-        case WHOMOVES_L1:
-          sDgmr->DrawFoldAndUnfoldArrow(p1c, p2c);
-          break;
-        case WHOMOVES_L2:
-          sDgmr->DrawFoldAndUnfoldArrow(p1c, p2c);
-          break;
-      }
-  }
+  return false;
 }
 
 
 /*****
-Go through existing lines and marks and create RefLine_L2Ls with rank equal to
-arank up to a cumulative total of sMaxLines.
+Overridden because we don't use an index for named marks.
 *****/
-void RefLine_L2L::MakeAll(rank_t arank)
+void RefMark_Original::SetIndex()
 {
-  for (rank_t irank = 0; irank <= (arank - 1) / 2; irank++) {
-    rank_t jrank = arank - irank - 1;
-    bool sameRank = (irank == jrank);
-    RefContainer<RefLine>::rank_iterator li = 
-      ReferenceFinder::sBasisLines.maps[irank].begin();
-    if (sameRank) li++;
-    while (li != ReferenceFinder::sBasisLines.maps[irank].end()) {
-      RefContainer<RefLine>::rank_iterator lj = 
-        ReferenceFinder::sBasisLines.maps[jrank].begin();
-      while (lj != (sameRank ? li : ReferenceFinder::sBasisLines.maps[jrank].end())) {
-        if (ReferenceFinder::GetNumLines() >= ReferenceFinder::sMaxLines) return;
-        RefLine_L2L rls1(li->second, lj->second, 0);
-        ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(rls1);
-        if (ReferenceFinder::GetNumLines() >= ReferenceFinder::sMaxLines) return;
-        RefLine_L2L rls2(li->second, lj->second, 1);
-        ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(rls2);
-        lj++;
-      };
-      li++;
-    }
-  }
-}
+  mIndex = 0;
+};
 
 
 #ifdef __MWERKS__
@@ -2129,119 +4076,132 @@ void RefLine_L2L::MakeAll(rank_t arank)
 
 
 /**********
-class RefLine_L2L_C2P - Huzita-Hatori Axiom O4
-Bring line l1 to itself so that the crease goes through point p1
+class RefMark_Intersection - Specialization of a RefMark for a mark defined by
+the intersection of 2 lines.
 **********/
 
 /*****
 Constructor.
 *****/
-RefLine_L2L_C2P::RefLine_L2L_C2P(RefLine* arl1, RefMark* arm1) : 
-  RefLine(CalcLineRank(arl1, arm1)), rl1(arl1), rm1(arm1)
-{     
-  // Get references to line and mark
-  XYPt& u1 = rl1->l.u;
-  double& d1 = rl1->l.d;
-  XYPt& p1 = rm1->p;
-  
-  // Construct the direction vector and distance scalar for the fold line.
-  l.u = u1.Rotate90();
-  l.d = p1.Dot(l.u);
+RefMark_Intersection::RefMark_Intersection(RefLine* arl1, RefLine* arl2) : 
+  RefMark(CalcMarkRank(arl1, arl2)), rl1(arl1), rl2(arl2)
+{
+  if (!CalcIntersection(rl1->l, rl2->l, p)) return;
+  FinishConstructor();
+}
 
-  // The intersection of the fold line with line l1 must be enclosed in the paper.
-  // That point is the projection of p1 onto line l1.
-  XYPt p1p = p1 + (d1 - (p1.Dot(u1))) * u1;
-  if (!ReferenceFinder::sPaper.Encloses(p1p)) return;
+
+/*****
+Put the intersection of lines l1 and l2 in ap, and return true if it would
+make a valid RefMark_Intersection. Also used to try out intersections of lines
+without making any objects.
+*****/
+bool RefMark_Intersection::CalcIntersection(const XYLine& l1, 
+  const XYLine& l2, XYPt& ap)
+{
+  // If the lines don't intersect, it's not a valid point. If they do,
+  // assign the intersection to ap.
   
-  // Don't need to check visibility, this kind is always visible.
-  // If this line creates a skinny flap, we won't use it.
-  if (ReferenceFinder::sPaper.MakesSkinnyFlap(l)) return;
+  if (!l1.Intersects(l2, ap)) return false;
   
-  // Set the key.
-  FinishConstructor();
+  // If the intersection point falls outside the square, it's not valid.
+  
+  if (!ReferenceFinder::sPaper.Encloses(ap)) return false;
+  
+  // If the lines intersect at less than a 30 degree angle, we won't keep this 
+  // point because such intersections are imprecise to use as reference points.
+  
+  return abs(l1.u.Dot(l2.u.Rotate90())) >= ReferenceFinder::sMinAngleSine;
 }
 
 
 /*****
-Return true if this line uses rb for immediate reference.
+Return what this mark was made from.
 *****/
-bool RefLine_L2L_C2P::UsesImmediate(RefBase* rb) const
+RefBase::RefSource RefMark_Intersection::GetSource() const
 {
-  return (rb == rl1 || rb == rm1);
+  RefSource rs(REFTYPE_INTERSECTION);
+  rs.mParents[0] = rl1;
+  rs.mParents[1] = rl2;
+  return rs;
+}
+
+
+/*****
+Return true if this mark uses rb for immediate reference.
+*****/
+bool RefMark_Intersection::UsesImmediate(RefBase* rb) const
+{
+  return (rb == rl1 || rb == rl2);
 }
 
 
 /*****
 Build the folding sequence that constructs this object.
 *****/
-void RefLine_L2L_C2P::SequencePushSelf()
+void RefMark_Intersection::SequencePushSelf()
 {
-  rm1->SequencePushSelf();
   rl1->SequencePushSelf();
+  rl2->SequencePushSelf();
   RefBase::SequencePushSelf();
 }
 
 
 /*****
-Put the construction of this line to a stream.
+Put a description of how to construct this mark to the stream.
 *****/
-bool RefLine_L2L_C2P::PutHowto(ostream& os) const
+bool RefMark_Intersection::PutHowto(ostream& os) const
 {
-  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[04] ";
-  os << "Fold ";
+  os << "The intersection of ";
   rl1->PutName(os);
-  os << " onto itself, making ";
+  os << " with ";
+  rl2->PutName(os);
+  os << " is ";
   PutName(os);
-  os << " through ";
-  rm1->PutName(os);
+  if (ReferenceFinder::sClarifyVerbalAmbiguities) {
+    os.precision(4);
+    os.setf(ios_base::fixed, ios_base::floatfield);
+    os << " = " << p.Chop();
+  };
   return true;
 }
 
 
 /*****
-Draw this line, adding arrows if appropriate
+Go through existing lines and create RefMark_Intersections with rank equal to
+arank; the work goes into schedule as.
 *****/
-void RefLine_L2L_C2P::DrawSelf(RefStyle rstyle, short ipass) const
+void RefMark_Intersection::MakeAll(rank_t arank, RefSchedule& as)
 {
-  // Call inherited method to draw the lines
-  RefLine::DrawSelf(rstyle, ipass);
-  
-  // If we're moving, we need an arrow
-  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
-      
-      XYPt p1, p2;
-      XYLine& l1 = rl1->l;
-      ReferenceFinder::sPaper.ClipLine(l1, p1, p2);  // get endpts of the reference line
-      XYPt pi = Intersection(l, l1);          // intersection w/ fold line
-      XYPt u1p = l1.u.Rotate90();           // tangent to reference line
-      double t1 = abs((p1 - pi).Dot(u1p));
-      double t2 = abs((p2 - pi).Dot(u1p));
-      double tmin = t1 < t2 ? t1 : t2;
-      sDgmr->DrawFoldAndUnfoldArrow(pi + tmin * u1p, pi - tmin * u1p);
+  vector<RefTask> tasks;
+  for (rank_t irank = 0; irank <= arank / 2; irank++) {
+    rank_t jrank = arank - irank;
+    size_t ni = ReferenceFinder::sBasisLines.GetRank(irank).size();
+    size_t nj = ReferenceFinder::sBasisLines.GetRank(jrank).size();
+    ReferenceFinder::AddTasks(tasks, RefTask(irank, jrank), ni, 
+      (irank == jrank) ? 0.5 * (nj - 1) : nj);
   }
+  as.Add<RefMark_Intersection>(tasks, ReferenceFinder::sBasisMarks, 
+    1.0);
 }
 
 
 /*****
-Go through existing lines and marks and create RefLine_L2L_C2Ps with rank equal
-to arank up to a cumulative total of sMaxLines.
+Create the RefMark_Intersections for one RefTask made by MakeAll().
 *****/
-void RefLine_L2L_C2P::MakeAll(rank_t arank)
+void RefMark_Intersection::DoTask(const RefTask& at, 
+  RefCandidates<RefMark_Intersection>& ac)
 {
-  for (rank_t irank = 0; irank <= (arank - 1); irank++) {
-    rank_t jrank = arank - irank - 1;
-    RefContainer<RefLine>::rank_iterator li = 
-      ReferenceFinder::sBasisLines.maps[irank].begin();
-    while (li != ReferenceFinder::sBasisLines.maps[irank].end()) {
-      RefContainer<RefMark>::rank_iterator mj = 
-        ReferenceFinder::sBasisMarks.maps[jrank].begin();
-      while (mj != ReferenceFinder::sBasisMarks.maps[jrank].end()) {
-        if (ReferenceFinder::GetNumLines() >= ReferenceFinder::sMaxLines) return;
-        RefLine_L2L_C2P rls1(li->second, mj->second);
-        ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(rls1);
-        mj++;
-      };
-      li++;
+  rank_t irank = at.mRanks[0];
+  rank_t jrank = at.mRanks[1];
+  bool sameRank = (irank == jrank);
+  RefRange<RefLine> li = ReferenceFinder::sBasisLines.GetRank(irank);
+  RefRange<RefLine> lj = ReferenceFinder::sBasisLines.GetRank(jrank);
+  for (size_t i = at.mBegin; i < at.mEnd; i++) {
+    size_t jend = sameRank ? i : lj.size();
+    for (size_t j = 0; j < jend; j++) {
+      RefMark_Intersection rmi(li[i], lj[j]);
+      ReferenceFinder::sBasisMarks.AddCandidate(rmi, ac);
     }
   }
 }
@@ -2253,193 +4213,237 @@ void RefLine_L2L_C2P::MakeAll(rank_t arank)
 
 
 /**********
-class RefLine_P2L_C2P - Huzita-Hatori Axiom O5. 
-Bring point p1 to line l1 so that the crease passes through point p2.
+class RefLine - base class for a reference line. 
 **********/
 
 /*****
-Constructor. iroot can be 0 or 1.
+RefLine static member initialization
 *****/
-RefLine_P2L_C2P::RefLine_P2L_C2P(RefMark* arm1, RefLine* arl1, RefMark* arm2, short iroot) :
-  RefLine(CalcLineRank(arm1, arl1, arm2)), rm1(arm1), rl1(arl1), rm2(arm2)
-{
-  // Get references to the points and lines.
-  XYPt& p1 = rm1->p;
-  XYLine& l1 = rl1->l;
-  XYPt& u1 = l1.u;
-  double& d1 = l1.d;
-  XYPt& p2 = rm2->p;
+RefBase::index_t RefLine::sCount = 0;   // Initialize class index
 
-  // If either point is already on the line, then this isn't interesting, i.e., it's
-  // a trivial Haga construction.
-  if (l1.Intersects(p1) || l1.Intersects(p2)) return;
-  
-  // Construct the line.
-  double a = d1 - p2.Dot(u1);
-  double b2 = (p2 - p1).Mag2() - a * a;
-  
-  if (b2 < 0) return;   // no solution for negative b2 (implies imaginary b)
-  
-  double b = sqrt(b2);
-  if ((b < EPS) && (iroot == 1)) return;  // degenerate case, there's only one solution
-  
-  // Construct the image of p1 (p1p), which depends on which root we're after.
-  XYPt u1p = u1.Rotate90();
-  XYPt p1p = p2 + a * u1;
-  if (iroot == 0) p1p += b * u1p;
-  else p1p -= b * u1p;
-  
-  // Validate; the point of incidence must lie within the square.
-  if (!ReferenceFinder::sPaper.Encloses(p1p)) return;
+
+/*****
+Calculate the key values used for sorting RefLines. Like its RefMark
+counterpart, this should be called at the end of every successfully constructed
+object, and it sets mKey to the proper value.
+*****/
+void RefLine::FinishConstructor()
+{
+  // resolve the ambiguity in line orientation by requiring d>=0. Clipping the
+  // flipped line gives the same endpoints in the opposite order, so we swap
+  // them too.
+  if (l.d < 0) {
+    l.d = -l.d;
+    l.u.x = -l.u.x;
+    l.u.y = -l.u.y;
+    swap(ep1, ep2);
+  };
   
-  // Construct member data.
-  l.u = (p1p - p1).Normalize();
-  l.d = p2.Dot(l.u);
+  double fa = (1. + atan2(l.u.y, l.u.x) / (3.14159265358979323)) / 2.0; // fa is between 0 & 1
+  const double dmax = sqrt(pow(ReferenceFinder::sPaper.mWidth, 2) + 
+    pow(ReferenceFinder::sPaper.mHeight, 2));
+  const double fd = l.d / dmax; // fd is between 0 and 1
   
-  // Check visibility.
-  bool p1edge = arm1->IsOnEdge();
-  bool l1edge = arl1->IsOnEdge();
+  key_t nd = static_cast <key_t> (floor(0.5 + fd * ReferenceFinder::sNumD));
+  if (nd == 0) fa = fmod(2 * fa, 1);  // for d=0, we map alpha and pi+alpha to the same key
+  key_t na = static_cast <key_t> (floor(0.5 + fa * ReferenceFinder::sNumA));
+  mKey = 1 + na * ReferenceFinder::sNumD + nd;
   
-  if (ReferenceFinder::sVisibilityMatters) {
-    if (p1edge) mWhoMoves = WHOMOVES_P1;
-    else if (l1edge) mWhoMoves = WHOMOVES_L1;
-    else return;
+  // Note whether the line is one of the edges of the paper.
+  mOnEdge = ((ReferenceFinder::sPaper.mLeftEdge == l) || 
+    (ReferenceFinder::sPaper.mTopEdge == l) ||
+    (ReferenceFinder::sPaper.mRightEdge == l) || 
+    (ReferenceFinder::sPaper.mBottomEdge == l));
+}
+
+
+/*****
+Find the endpoints ep1 and ep2 where this line leaves the paper, and return
+false if it misses the paper entirely. Constructors call this once, before
+FinishConstructor(); everything after that uses the stored endpoints.
+*****/
+bool RefLine::ClipToPaper()
+{
+  return ReferenceFinder::sPaper.ClipLine(l, ep1, ep2);
+}
+
+
+/*****
+Return the "distance" between this line and line al. In worst-case mode, only
+al has to be clipped to the paper, since we already know our own endpoints.
+*****/
+double RefLine::DistanceTo(const XYLine& al) const
+{
+  if (ReferenceFinder::sLineWorstCaseError) {
+    XYPt pa, pb;
+    if (!ReferenceFinder::sPaper.ClipLine(al, pa, pb)) return 1 / EPS;
+    return DistanceBetween(ep1, ep2, pa, pb);
+  }
+  return DistanceBetween(l, al);
+}
+
+
+/*****
+Return the "distance" between two lines.
+*****/
+double RefLine::DistanceBetween(const XYLine& al1, const XYLine& al2)
+{
+  if (ReferenceFinder::sLineWorstCaseError) {
+    // Use the worst-case separation between the endpoints of the two lines
+    // where they leave the paper.
+    XYPt p1a, p1b, p2a, p2b;
+    if (ReferenceFinder::sPaper.ClipLine(al1, p1a, p1b) && 
+      ReferenceFinder::sPaper.ClipLine(al2, p2a, p2b)) {
+      return DistanceBetween(p1a, p1b, p2a, p2b);
+    }
+    else {
+      return 1 / EPS; // lines don't intersect the paper, return very large number
+    }
   }
   else {
-    mWhoMoves = WHOMOVES_P1;
-  };
-  
-  // If this line creates a skinny flap, we won't use it.
-  if (ReferenceFinder::sPaper.MakesSkinnyFlap(l)) return;
-  
-  // Set the key.
-  FinishConstructor();
+    // Use the Pythagorean sum of the distance between the characteristic
+    // vectors of the tangent point and angle.
+    return sqrt(pow(al1.u.Dot(al2.u.Rotate90()), 2) + 
+      pow(al1.d - al2.d * al1.u.Dot(al2.u), 2));
+  }
 }
 
 
 /*****
-Return true if this line uses rb for immediate reference.
+Return the worst-case separation between two clipped lines, the first with
+endpoints p1a and p1b and the second with endpoints p2a and p2b, pairing up the
+endpoints whichever way gives the smaller result.
 *****/
-bool RefLine_P2L_C2P::UsesImmediate(RefBase* rb) const
+double RefLine::DistanceBetween(const XYPt& p1a, const XYPt& p1b, 
+  const XYPt& p2a, const XYPt& p2b)
 {
-  return (rb == rl1 || rb == rm1 || rb == rm2);
+  double err1 = max_val((p1a - p2a).Mag(), (p1b - p2b).Mag());
+  double err2 = max_val((p1a - p2b).Mag(), (p1b - p2a).Mag());
+  return min_val(err1, err2);
 }
 
 
 /*****
-Build the folding sequence that constructs this object.
+Return true, since MOST Reflines are actions
 *****/
-void RefLine_P2L_C2P::SequencePushSelf()
+bool RefLine::IsActionLine() const
 {
-  rm2->SequencePushSelf();
-  switch (mWhoMoves) {
-    case WHOMOVES_P1:
-      rl1->SequencePushSelf();
-      rm1->SequencePushSelf();
-      break;
-      
-    case WHOMOVES_L1:
-      rm1->SequencePushSelf();
-      rl1->SequencePushSelf();
+  return true;
+}
 
-      break;
-  };
-  RefBase::SequencePushSelf();
+
+/*****
+Return the label for this line.
+*****/
+const char RefLine::GetLabel() const
+{
+  return sLabels[mIndex - 1];
 }
 
 
 /*****
-Put the name of this line to a stream.
+Put the name of this line to a stream. Default behavior gives this line a
+letter. Return true if we used a letter. (We'll return false if we use
+something else, i.e., a RefLine_Original).
 *****/
-bool RefLine_P2L_C2P::PutHowto(ostream& os) const
+bool RefLine::PutName(ostream& os) const
 {
-  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[05] ";
-  os << "Bring ";
-  switch (mWhoMoves) {
-    case WHOMOVES_P1:
-      rm1->PutName(os);
-      os << " to ";
-      rl1->PutName(os);
-      break;
-    
-    case WHOMOVES_L1:
-      rl1->PutName(os);
-      os << " to ";
-      rm1->PutName(os);
-      break;
-  };
-  if (ReferenceFinder::sClarifyVerbalAmbiguities) {   
-    os << " so the crease goes through ";
-    rm2->PutName(os);
-  };
-  os << ", making ";
-  PutName(os);
+  os << "line " << GetLabel()
+#ifdef RF_PUT_KEY_IN_TEXT
+    << "[" << mKey << "]"
+#endif // RF_PUT_KEY_IN_TEXT
+  ;
   return true;
 }
 
 
 /*****
-Draw this line, adding arrows if appropriate
+Put the distance between this line and line al to a stream along with the rank
 *****/
-void RefLine_P2L_C2P::DrawSelf(RefStyle rstyle, short ipass) const
+void RefLine::PutDistanceAndRank(ostream& os, const XYLine& al) const
 {
-  // Call inherited method to draw the lines
-  
-  RefLine::DrawSelf(rstyle, ipass);
-  
-  // If we're moving, we need an arrow
+  os.precision(4);
+  os.setf(ios_base::fixed, ios_base::floatfield);
+  os << "Solution " << l << ": err = " << DistanceTo(al) << " (rank " << 
+    mRank << ") ";
+}
+    
+    
+/*****
+Draw a line in the given style.
+*****/
+void RefLine::DrawSelf(RefStyle rstyle, short ipass) const
+{
+  const XYPt& p1 = ep1;
+  const XYPt& p2 = ep2;
   
-  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
+  switch(ipass) {
+    case PASS_LINES:
+      {
+        switch (rstyle) {
+          case REFSTYLE_NORMAL:
+            sDgmr->DrawLine(p1, p2, RefDgmr::LINESTYLE_CREASE);
+            break;
+          default: ; // keep compiler happy
+        }
+      };
+      break;
       
-    XYPt& p1 = rm1->p;
-    XYPt p1f = l.Fold(p1);
-    switch (mWhoMoves) {
-      case WHOMOVES_P1:
-        sDgmr->DrawFoldAndUnfoldArrow(p1, p1f);
-        break;
-      case WHOMOVES_L1:
-        sDgmr->DrawFoldAndUnfoldArrow(p1f, p1);
-        break;
-    }
+    case PASS_HLINES: // hilited lines and action lines go on top of others
+      {
+        switch (rstyle) {
+          case REFSTYLE_HILITE:
+            sDgmr->DrawLine(p1, p2, RefDgmr::LINESTYLE_HILITE);
+            break;
+          case REFSTYLE_ACTION:
+            sDgmr->DrawLine(p1, p2, RefDgmr::LINESTYLE_VALLEY);
+            break;
+          default: ; // keep compiler happy
+        }
+      };
+      break;
+      
+    case PASS_LABELS:
+      {
+        XYPt mp = MidPoint(p1, p2); // label goes at the midpoint of the line
+        string sl(1, GetLabel());
+        switch (rstyle) {
+          case REFSTYLE_NORMAL:
+            // normal lines don't get labels
+            break;
+          case REFSTYLE_HILITE:
+            sDgmr->DrawLabel(mp, sl, RefDgmr::LABELSTYLE_HILITE);
+            break;
+          case REFSTYLE_ACTION:
+            sDgmr->DrawLabel(mp, sl, RefDgmr::LABELSTYLE_ACTION);
+            break;
+          default: ;// keep compiler happy
+        }
+      };
+      break;
+    default: ;// keep compiler happy
   }
+  // Subclasses will add arrows for REFSTYLE_ACTION
 }
 
 
 /*****
-Go through existing lines and marks and create RefLine_P2L_C2Ps with rank equal
-arank up to a cumulative total of sMaxLines.
+Most subclasses will use the default method, which sets the index from the
+class variable sCount and then bumps up the count.
 *****/
-void RefLine_P2L_C2P::MakeAll(rank_t arank)
+
+void RefLine::SetIndex()
 {
-  for (rank_t irank = 0; irank <= (arank - 1); irank++)
-    for (rank_t jrank = 0; jrank <= (arank - 1 - irank); jrank++) {
-      rank_t krank = arank - irank - jrank - 1;
-      RefContainer<RefMark>::rank_iterator mi = 
-        ReferenceFinder::sBasisMarks.maps[irank].begin();
-      while (mi != ReferenceFinder::sBasisMarks.maps[irank].end()) {
-        RefContainer<RefLine>::rank_iterator lj = 
-          ReferenceFinder::sBasisLines.maps[jrank].begin();
-        while (lj != ReferenceFinder::sBasisLines.maps[jrank].end()) {
-          RefContainer<RefMark>::rank_iterator mk = 
-            ReferenceFinder::sBasisMarks.maps[krank].begin();
-          while (mk != ReferenceFinder::sBasisMarks.maps[krank].end()) {
-            if ((irank != krank) || (mi != mk)) {   // only cmpr iterators if same container
-              if (ReferenceFinder::GetNumLines() >= 
-                ReferenceFinder::sMaxLines) return;
-              RefLine_P2L_C2P rlh1(mi->second, lj->second, mk->second, 0);
-              ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(rlh1);
-              if (ReferenceFinder::GetNumLines() >= 
-                ReferenceFinder::sMaxLines) return;
-              RefLine_P2L_C2P rlh2(mi->second, lj->second, mk->second, 1);
-              ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(rlh1);
-            };
-            mk++;
-          };
-          lj++;
-        };
-        mi++;
-      }
-    }
+  mIndex = ++sCount;
+}
+
+
+/*****
+Reset the class variable sCount to zero.
+*****/
+void RefLine::ResetCount()
+{
+  sCount = 0;
 }
 
 
@@ -2449,29 +4453,1084 @@ void RefLine_P2L_C2P::MakeAll(rank_t arank)
 
 
 /**********
-class RefLine_P2L_P2L - Huzita-Hatori Axiom O6.
-Bring point p1 to line l1 and point p2 to line l2.
+class RefLine_Original - Specialization of RefLine that represents a line that
+is the edge of the paper or an initial crease (like the diagonal).
 **********/
 
 /*****
-* RefLine_P2L_P2L static member initialization
+Constructor.
 *****/
-short RefLine_P2L_P2L::order = 0;
-short RefLine_P2L_P2L::irootMax = 0;
-
-double RefLine_P2L_P2L::q1 = 0;
-double RefLine_P2L_P2L::q2 = 0;
-
-double RefLine_P2L_P2L::S = 0;
-double RefLine_P2L_P2L::Sr = 0;
-double RefLine_P2L_P2L::Si = 0;
-double RefLine_P2L_P2L::U = 0;
+RefLine_Original::RefLine_Original(const XYLine& al, rank_t arank, string aName) : 
+  RefLine(al, arank), mName(aName)
+{
+  ClipToPaper();
+  FinishConstructor();
+}
 
 
 /*****
-Take the cube root; works for both positive and negative numbers
+Return what this line was made from.
 *****/
-double CubeRoot(double x)
+RefBase::RefSource RefLine_Original::GetSource() const
+{
+  RefSource rs(REFTYPE_ORIGINAL);
+  rs.mName = &mName;
+  return rs;
+}
+
+
+/*****
+Return false because RefLine_Originals aren't actions, they're present from the
+beginning.
+*****/
+bool RefLine_Original::IsActionLine() const
+{
+  return false;
+}
+
+
+/*****
+Return the label for this line.
+*****/
+const char RefLine_Original::GetLabel() const
+{
+  return 0; // originals get no label
+}
+
+
+/*****
+Put the name to a stream. Override the default method to use the actual string
+name, rather than a letter. Return false since we didn't use a letter.
+*****/
+
+bool RefLine_Original::PutName(ostream& os) const
+{
+  os << mName;
+  return false;
+}
+
+
+/*****
+Draw this line in the appropriate style
+*****/
+void RefLine_Original::DrawSelf(RefStyle rstyle, short ipass) const
+{
+  // RefLine_Originals don't get labels, and they are REFSTYLE_ACTION, we
+  // still draw them hilited.
+  const XYPt& p1 = ep1;
+  const XYPt& p2 = ep2;
+  switch(ipass) {
+    case PASS_LINES:
+      switch (rstyle) {
+        case REFSTYLE_NORMAL:
+          sDgmr->DrawLine(p1, p2, RefDgmr::LINESTYLE_CREASE);
+          break;
+        default: ; // keep compiler happy
+      }
+      break;
+    case PASS_HLINES:
+      switch (rstyle) {
+        case REFSTYLE_HILITE:
+        case REFSTYLE_ACTION:
+          sDgmr->DrawLine(p1, p2, RefDgmr::LINESTYLE_HILITE);
+          break;
+        default: ; // keep compiler happy
+      }
+      break;
+    default: ; // keep compiler happy about unhandled cases
+  }
+}
+
+
+/*****
+Return false, since this is original
+*****/
+bool RefLine_Original::IsDerived() const
+{
+  return false;
+}
+
+
+/*****
+Set the index of this line. Override the default method to use an index of
+zero, since we've already got a name.
+*****/
+
+void RefLine_Original::SetIndex()
+{
+  mIndex = 0;
+}
+
+
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/**********
+class RefLine_C2P_C2P - Huzita-Hatori Axiom O1
+Make a crease through two points p1 and p2.
+**********/
+
+/*****
+Constructor. Initialize with the two marks that this line connects.
+*****/
+RefLine_C2P_C2P::RefLine_C2P_C2P(RefMark* arm1, RefMark* arm2) : 
+  RefLine(CalcLineRank(arm1, arm2)), rm1(arm1), rm2(arm2)
+{
+  const XYPt& p1 = rm1->p;
+  const XYPt& p2 = rm2->p;
+  
+  // Construct member data
+  l.u = (p2 - p1).Rotate90().Normalize();
+  l.d = .5 * (p1 + p2).Dot(l.u);
+  
+  // Don't need to check visibility because this type is always visible.
+  // If this line misses the paper or creates a skinny flap, we won't use it.
+  if (!ClipToPaper() || 
+    ReferenceFinder::sPaper.MakesSkinnyFlap(l, ep1, ep2)) return;
+  
+  // This type is always valid.
+  FinishConstructor();
+}
+
+
+/*****
+Return what this line was made from.
+*****/
+RefBase::RefSource RefLine_C2P_C2P::GetSource() const
+{
+  RefSource rs(REFTYPE_C2P_C2P);
+  rs.mParents[0] = rm1;
+  rs.mParents[1] = rm2;
+  return rs;
+}
+
+
+/*****
+Return true if this line uses rb for immediate reference.
+*****/
+bool RefLine_C2P_C2P::UsesImmediate(RefBase* rb) const
+{
+  return (rb == rm1 || rb == rm2);
+}
+
+
+/*****
+Build the folding sequence that constructs this object.
+*****/
+void RefLine_C2P_C2P::SequencePushSelf()
+{
+  rm1->SequencePushSelf();
+  rm2->SequencePushSelf();
+  RefBase::SequencePushSelf();
+}
+
+
+/*****
+Put the construction of this line to a stream.
+*****/
+bool RefLine_C2P_C2P::PutHowto(ostream& os) const
+{
+  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[01] ";
+  os << "Form a crease connecting ";
+  rm1->PutName(os);
+  os << " with ";
+  rm2->PutName(os);
+  os << ", making ";
+  PutName(os);
+  return true;
+}
+
+
+/*****
+Draw this line, adding arrows if appropriate
+*****/
+void RefLine_C2P_C2P::DrawSelf(RefStyle rstyle, short ipass) const
+{
+  // Call the inherited method to draw the line
+  RefLine::DrawSelf(rstyle, ipass);
+  
+  // If we're moving, we need arrows.
+  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
+  
+    // Get the endpoints of the fold
+    const XYPt& p1 = rm1->p;
+    const XYPt& p2 = rm2->p;
+    
+    // Get the perpendicular bisector of the fold
+    XYPt mp = MidPoint(p1, p2);
+    XYLine lb;
+    lb.u = l.u.Rotate90();
+    lb.d = mp.Dot(lb.u);
+    
+    // Get the points where the bisector crosses the paper
+    XYPt p3, p4;
+    ReferenceFinder::sPaper.ClipLine(lb, p3, p4);
+    
+    // Parameterize these points along the bisector. Don't care about sign.
+    double t3 = abs((p3 - mp).Dot(l.u));
+    double t4 = abs((p4 - mp).Dot(l.u));
+    
+    // Construct a new pair of points that mate when folded and that are
+    // guaranteed to lie within the paper.
+    XYPt dp;
+    if (t3 < t4) dp = t3 * l.u;
+    else dp = t4 * l.u;
+    p3 = mp + dp;
+    p4 = mp - dp;
+    
+    // Draw an arrow that connects these two points.
+    sDgmr->DrawFoldAndUnfoldArrow(p3, p4);
+  }
+}
+
+
+/*****
+Go through existing marks and create RefLine_C2P_C2Ps with rank equal
+to arank; the work goes into schedule as.
+*****/
+void RefLine_C2P_C2P::MakeAll(rank_t arank, RefSchedule& as)
+{
+  vector<RefTask> tasks;
+  for (rank_t irank = 0; irank <= (arank - 1) / 2; irank++) {
+    rank_t jrank = arank - irank - 1;
+    size_t ni = ReferenceFinder::sBasisMarks.GetRank(irank).size();
+    size_t nj = ReferenceFinder::sBasisMarks.GetRank(jrank).size();
+    ReferenceFinder::AddTasks(tasks, RefTask(irank, jrank), ni, 
+      ((irank == jrank) ? 0.5 * (nj - 1) : nj));
+  }
+  as.Add<RefLine_C2P_C2P>(tasks, ReferenceFinder::sBasisLines, 
+    ReferenceFinder::sAxiomQuota[0]);
+}
+
+
+/*****
+Create the RefLine_C2P_C2Ps for one RefTask made by MakeAll().
+*****/
+void RefLine_C2P_C2P::DoTask(const RefTask& at, RefCandidates<RefLine_C2P_C2P>& ac)
+{
+  rank_t irank = at.mRanks[0];
+  rank_t jrank = at.mRanks[1];
+  bool sameRank = (irank == jrank);
+  RefRange<RefMark> mi = ReferenceFinder::sBasisMarks.GetRank(irank);
+  RefRange<RefMark> mj = ReferenceFinder::sBasisMarks.GetRank(jrank);
+  for (size_t i = at.mBegin; i < at.mEnd; i++) {
+    size_t jend = sameRank ? i : mj.size();
+    for (size_t j = 0; j < jend; j++) {
+      RefLine_C2P_C2P rlc(mi[i], mj[j]);
+      ReferenceFinder::sBasisLines.AddCandidate(rlc, ac);
+    }
+  }
+}
+
+
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/**********
+class RefLine_P2P - Huzita-Hatori Axiom O2
+Bring p1 to p2.
+**********/
+
+/*****
+Constructor.
+*****/
+RefLine_P2P::RefLine_P2P(RefMark* arm1, RefMark* arm2) : 
+  RefLine(CalcLineRank(arm1, arm2)), rm1(arm1), rm2(arm2)
+{
+  // Get references to points
+  XYPt& p1 = rm1->p;
+  XYPt& p2 = rm2->p;
+  
+  // Construct member data
+  l.u = (p2 - p1).Normalize();
+  l.d = .5 * (p1 + p2).Dot(l.u);
+  
+  // Check visibility
+  bool p1edge = arm1->IsOnEdge();
+  bool p2edge = arm2->IsOnEdge();
+  
+  if (ReferenceFinder::sVisibilityMatters) {
+    if (p1edge) mWhoMoves = WHOMOVES_P1;
+    else if (p2edge) mWhoMoves = WHOMOVES_P2;
+    else return;
+  }
+  else {
+    mWhoMoves = WHOMOVES_P1;
+  };
+  
+  // If this line misses the paper or creates a skinny flap, we won't use it.
+  if (!ClipToPaper() || 
+    ReferenceFinder::sPaper.MakesSkinnyFlap(l, ep1, ep2)) return;
+  
+  // Set the key.
+  FinishConstructor();
+}
+
+
+/*****
+Return what this line was made from.
+*****/
+RefBase::RefSource RefLine_P2P::GetSource() const
+{
+  RefSource rs(REFTYPE_P2P);
+  rs.mParents[0] = rm1;
+  rs.mParents[1] = rm2;
+  return rs;
+}
+
+
+/*****
+Return true if this line uses rb for immediate reference.
+*****/
+bool RefLine_P2P::UsesImmediate(RefBase* rb) const
+{
+  return (rb == rm1 || rb == rm2);
+}
+
+
+/*****
+Build the folding sequence that constructs this object.
+*****/
+void RefLine_P2P::SequencePushSelf()
+{
+  switch (mWhoMoves) {
+    case WHOMOVES_P1:
+      rm2->SequencePushSelf();
+      rm1->SequencePushSelf();
+      break;
+    
+    case WHOMOVES_P2:
+      rm1->SequencePushSelf();
+      rm2->SequencePushSelf();
+      break;
+  };    
+  RefBase::SequencePushSelf();
+}
+
+
+/*****
+Put the construction of this line to a stream.
+*****/
+bool RefLine_P2P::PutHowto(ostream& os) const
+{
+  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[02] ";
+  os << "Bring ";
+  switch (mWhoMoves) {
+    case WHOMOVES_P1:
+      rm1->PutName(os);
+      os << " to ";
+      rm2->PutName(os);
+      break;
+      
+    case WHOMOVES_P2:
+      rm2->PutName(os);
+      os << " to ";
+      rm1->PutName(os);
+      break;
+  };
+  os << ", making ";
+  PutName(os);
+  return true;
+}
+
+
+/*****
+Draw this line, adding arrows if appropriate
+*****/
+void RefLine_P2P::DrawSelf(RefStyle rstyle, short ipass) const
+{
+  // Call inherited method to draw the lines
+  RefLine::DrawSelf(rstyle, ipass);
+  
+  // If we're moving, we need an arrow
+  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
+    XYPt& p1 = rm1->p;
+    XYPt& p2 = rm2->p;
+    switch (mWhoMoves) {
+      case WHOMOVES_P1:
+        sDgmr->DrawFoldAndUnfoldArrow(p1, p2);
+        break;
+      case WHOMOVES_P2:
+        sDgmr->DrawFoldAndUnfoldArrow(p2, p1);
+        break;
+    }
+  }
+}
+      
+
+
+/*****
+Go through existing marks and create RefLine_P2Ps with rank equal
+to arank; the work goes into schedule as.
+*****/
+void RefLine_P2P::MakeAll(rank_t arank, RefSchedule& as)
+{
+  vector<RefTask> tasks;
+  for (rank_t irank = 0; irank <= (arank - 1) / 2; irank++) {
+    rank_t jrank = arank - irank - 1;
+    size_t ni = ReferenceFinder::sBasisMarks.GetRank(irank).size();
+    size_t nj = ReferenceFinder::sBasisMarks.GetRank(jrank).size();
+    ReferenceFinder::AddTasks(tasks, RefTask(irank, jrank), ni, 
+      ((irank == jrank) ? 0.5 * (nj - 1) : nj));
+  }
+  as.Add<RefLine_P2P>(tasks, ReferenceFinder::sBasisLines, 
+    ReferenceFinder::sAxiomQuota[1]);
+}
+
+
+/*****
+Create the RefLine_P2Ps for one RefTask made by MakeAll().
+*****/
+void RefLine_P2P::DoTask(const RefTask& at, RefCandidates<RefLine_P2P>& ac)
+{
+  rank_t irank = at.mRanks[0];
+  rank_t jrank = at.mRanks[1];
+  bool sameRank = (irank == jrank);
+  RefRange<RefMark> mi = ReferenceFinder::sBasisMarks.GetRank(irank);
+  RefRange<RefMark> mj = ReferenceFinder::sBasisMarks.GetRank(jrank);
+  for (size_t i = at.mBegin; i < at.mEnd; i++) {
+    size_t jend = sameRank ? i : mj.size();
+    for (size_t j = 0; j < jend; j++) {
+      RefLine_P2P rlb(mi[i], mj[j]);
+      ReferenceFinder::sBasisLines.AddCandidate(rlb, ac);
+    }
+  }
+}
+
+
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/**********
+class RefLine_L2L - Huzita-Hatori Axiom O3 
+Bring line l1 to line l2.
+**********/
+
+/*****
+Constructor. iroot = 0 or 1.
+*****/
+
+RefLine_L2L::RefLine_L2L(RefLine* arl1, RefLine* arl2, short iroot) : 
+  RefLine(CalcLineRank(arl1, arl2)), rl1(arl1), rl2(arl2), mRoot(iroot)
+{     
+  // Get references to lines
+  XYLine& l1 = rl1->l;
+  XYPt& u1 = l1.u;
+  double& d1 = l1.d;
+  XYLine& l2 = rl2->l;
+  XYPt& u2 = l2.u;
+  double& d2 = l2.d;
+  
+  // Parallel lines get handled specially. There's only one solution; we arbitrarily make
+  // it the iroot=0 solution.
+  if (l1.IsParallelTo(l2)) {
+    if (iroot == 0) {
+      l.u = u1;
+      l.d = .5 * (d1 + d2 * u2.Dot(u1));
+    }
+    else return; // iroot = 1 for parallel lines isn't a valid solution.
+  }
+  else {  // nonparallel lines
+  
+    // Construct the direction vector for the bisector, depending on the value of iroot.
+    if (iroot == 0) l.u = (u1 + u2).Normalize();
+    else l.u = (u1 - u2).Normalize();
+    
+    l.d = Intersection(l1, l2).Dot(l.u);
+  };
+  
+  // If the paper doesn't overlap the fold line, we're not valid.
+  if (!ClipToPaper() || 
+    !ReferenceFinder::sPaper.InteriorOverlaps(ep1, ep2)) return;
+  
+  // Check visibility
+  bool l1edge = arl1->IsOnEdge();
+  bool l2edge = arl2->IsOnEdge();
+  
+  if (ReferenceFinder::sVisibilityMatters) {
+    if (l1edge) mWhoMoves = WHOMOVES_L1;
+    else if (l2edge) mWhoMoves = WHOMOVES_L2;
+    else {
+      if (ReferenceFinder::sPaper.Encloses(l.Fold(rl1->ep1)) && 
+        ReferenceFinder::sPaper.Encloses(l.Fold(rl1->ep2))) 
+        mWhoMoves = WHOMOVES_L1;
+      else if (ReferenceFinder::sPaper.Encloses(l.Fold(rl2->ep1)) && 
+        ReferenceFinder::sPaper.Encloses(l.Fold(rl2->ep2))) 
+        mWhoMoves = WHOMOVES_L2;
+      else return;
+    }
+  }
+  else {
+    mWhoMoves = WHOMOVES_L1;
+  };
+  
+  // If this line creates a skinny flap, we won't use it.
+  if (ReferenceFinder::sPaper.MakesSkinnyFlap(l, ep1, ep2)) return;
+
+  // Set the key.
+  FinishConstructor();
+}
+
+
+/*****
+Return what this line was made from.
+*****/
+RefBase::RefSource RefLine_L2L::GetSource() const
+{
+  RefSource rs(REFTYPE_L2L, mRoot);
+  rs.mParents[0] = rl1;
+  rs.mParents[1] = rl2;
+  return rs;
+}
+
+
+/*****
+Return true if this line uses rb for immediate reference.
+*****/
+bool RefLine_L2L::UsesImmediate(RefBase* rb) const
+{
+  return (rb == rl1 || rb == rl2);
+}
+
+
+/*****
+Build the folding sequence that constructs this object.
+*****/
+void RefLine_L2L::SequencePushSelf()
+{
+  switch (mWhoMoves) {
+    case WHOMOVES_L1:
+      rl2->SequencePushSelf();
+      rl1->SequencePushSelf();
+      break;
+    
+    case WHOMOVES_L2:
+      rl1->SequencePushSelf();
+      rl2->SequencePushSelf();
+      break;
+  };
+  RefBase::SequencePushSelf();
+}
+
+
+/*****
+Put the construction of this line to a stream.
+*****/
+bool RefLine_L2L::PutHowto(ostream& os) const
+{
+  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[03] ";
+  os << "Fold ";
+  switch (mWhoMoves) {
+    case WHOMOVES_L1:
+      rl1->PutName(os);
+      os << " to ";
+      rl2->PutName(os);   
+      break;
+    
+    case WHOMOVES_L2:
+      rl2->PutName(os);
+      os << " to ";
+      rl1->PutName(os);   
+      break;
+  };
+  os << ", making ";
+  PutName(os);
+  if (ReferenceFinder::sClarifyVerbalAmbiguities) {
+    os << " through ";
+    
+    // Now we need to specify which of the two bisectors this is, which we do
+    // by specifying a point where the bisector hits the edge of the square.
+    XYPt p;
+    rl1->l.Intersects(rl2->l, p); // get the intersection of the two bisectors
+
+    const XYPt& pa = ep1;   // where our fold line hits the paper.
+    const XYPt& pb = ep2;
+    
+    // Return the first point of intersection between the fold line and the edge of the
+    // paper that _isn't_ the intersection of the two bisectors.
+    os.precision(2);
+    os.setf(ios_base::fixed, ios_base::floatfield);
+	if (p == pa) {
+		os << pb.Chop();
+		return true;
+	}
+    os << pa.Chop();
+  };
+  return true;
+}
+
+
+/*****
+Draw this line, adding arrows if appropriate
+*****/
+void RefLine_L2L::DrawSelf(RefStyle rstyle, short ipass) const
+{
+  // Call inherited method to draw the lines
+  RefLine::DrawSelf(rstyle, ipass);
+  
+  // If we're moving, we need an arrow that brings two points from one line to
+  // two points on the other line. We need to pick points that are within the
+  // paper for both lines.
+  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
+      
+      XYLine& l1 = rl1->l;
+      XYPt p1a = rl1->ep1;              // endpoints of l1
+      XYPt p1b = rl1->ep2;
+      XYPt p2a = l.Fold(rl2->ep1);      // endpoints of l2, flopped onto l1
+      XYPt p2b = l.Fold(rl2->ep2);
+      XYPt du1 = l1.d * l1.u;       // a point on l1
+      XYPt up1 = l1.u.Rotate90();     // a tangent to l1
+      vector<double> tvals;       // holds parameterizations of the 4 points
+      tvals.push_back((p1a - du1).Dot(up1));  // parameterize p1a along l1
+      tvals.push_back((p1b - du1).Dot(up1));  // parameterize p1b along l1
+      tvals.push_back((p2a - du1).Dot(up1));  // parameterize p2a along l1
+      tvals.push_back((p2b - du1).Dot(up1));  // parameterize p2b along l1
+      sort(tvals.begin(), tvals.end());   // sort them in order; we want the middle 2
+      XYPt p1c = du1 + 0.5 * (tvals[1] + tvals[2]) * up1;
+      XYPt p2c = l.Fold(p1c);
+      switch(mWhoMoves) {
+        case WHOMOVES_L1:
+          sDgmr->DrawFoldAndUnfoldArrow(p1c, p2c);
+          break;
+        case WHOMOVES_L2:
+          sDgmr->DrawFoldAndUnfoldArrow(p1c, p2c);
+          break;
+      }
+  }
+}
+
+
+/*****
+Go through existing lines and create RefLine_L2Ls with rank equal
+to arank; the work goes into schedule as.
+*****/
+void RefLine_L2L::MakeAll(rank_t arank, RefSchedule& as)
+{
+  vector<RefTask> tasks;
+  for (rank_t irank = 0; irank <= (arank - 1) / 2; irank++) {
+    rank_t jrank = arank - irank - 1;
+    size_t ni = ReferenceFinder::sBasisLines.GetRank(irank).size();
+    size_t nj = ReferenceFinder::sBasisLines.GetRank(jrank).size();
+    ReferenceFinder::AddTasks(tasks, RefTask(irank, jrank), ni, 
+      2 * ((irank == jrank) ? 0.5 * (nj - 1) : nj));
+  }
+  as.Add<RefLine_L2L>(tasks, ReferenceFinder::sBasisLines, 
+    ReferenceFinder::sAxiomQuota[2]);
+}
+
+
+/*****
+Create the RefLine_L2Ls for one RefTask made by MakeAll().
+*****/
+void RefLine_L2L::DoTask(const RefTask& at, RefCandidates<RefLine_L2L>& ac)
+{
+  rank_t irank = at.mRanks[0];
+  rank_t jrank = at.mRanks[1];
+  bool sameRank = (irank == jrank);
+  RefRange<RefLine> li = ReferenceFinder::sBasisLines.GetRank(irank);
+  RefRange<RefLine> lj = ReferenceFinder::sBasisLines.GetRank(jrank);
+  for (size_t i = at.mBegin; i < at.mEnd; i++) {
+    size_t jend = sameRank ? i : lj.size();
+    for (size_t j = 0; j < jend; j++) {
+      RefLine_L2L rls1(li[i], lj[j], 0);
+      ReferenceFinder::sBasisLines.AddCandidate(rls1, ac);
+      RefLine_L2L rls2(li[i], lj[j], 1);
+      ReferenceFinder::sBasisLines.AddCandidate(rls2, ac);
+    }
+  }
+}
+
+
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/**********
+class RefLine_L2L_C2P - Huzita-Hatori Axiom O4
+Bring line l1 to itself so that the crease goes through point p1
+**********/
+
+/*****
+Constructor.
+*****/
+RefLine_L2L_C2P::RefLine_L2L_C2P(RefLine* arl1, RefMark* arm1) : 
+  RefLine(CalcLineRank(arl1, arm1)), rl1(arl1), rm1(arm1)
+{     
+  // Get references to line and mark
+  XYPt& u1 = rl1->l.u;
+  double& d1 = rl1->l.d;
+  XYPt& p1 = rm1->p;
+  
+  // Construct the direction vector and distance scalar for the fold line.
+  l.u = u1.Rotate90();
+  l.d = p1.Dot(l.u);
+
+  // The intersection of the fold line with line l1 must be enclosed in the paper.
+  // That point is the projection of p1 onto line l1.
+  XYPt p1p = p1 + (d1 - (p1.Dot(u1))) * u1;
+  if (!ReferenceFinder::sPaper.Encloses(p1p)) return;
+  
+  // Don't need to check visibility, this kind is always visible.
+  // If this line misses the paper or creates a skinny flap, we won't use it.
+  if (!ClipToPaper() || 
+    ReferenceFinder::sPaper.MakesSkinnyFlap(l, ep1, ep2)) return;
+  
+  // Set the key.
+  FinishConstructor();
+}
+
+
+/*****
+Return what this line was made from.
+*****/
+RefBase::RefSource RefLine_L2L_C2P::GetSource() const
+{
+  RefSource rs(REFTYPE_L2L_C2P);
+  rs.mParents[0] = rl1;
+  rs.mParents[1] = rm1;
+  return rs;
+}
+
+
+/*****
+Return true if this line uses rb for immediate reference.
+*****/
+bool RefLine_L2L_C2P::UsesImmediate(RefBase* rb) const
+{
+  return (rb == rl1 || rb == rm1);
+}
+
+
+/*****
+Build the folding sequence that constructs this object.
+*****/
+void RefLine_L2L_C2P::SequencePushSelf()
+{
+  rm1->SequencePushSelf();
+  rl1->SequencePushSelf();
+  RefBase::SequencePushSelf();
+}
+
+
+/*****
+Put the construction of this line to a stream.
+*****/
+bool RefLine_L2L_C2P::PutHowto(ostream& os) const
+{
+  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[04] ";
+  os << "Fold ";
+  rl1->PutName(os);
+  os << " onto itself, making ";
+  PutName(os);
+  os << " through ";
+  rm1->PutName(os);
+  return true;
+}
+
+
+/*****
+Draw this line, adding arrows if appropriate
+*****/
+void RefLine_L2L_C2P::DrawSelf(RefStyle rstyle, short ipass) const
+{
+  // Call inherited method to draw the lines
+  RefLine::DrawSelf(rstyle, ipass);
+  
+  // If we're moving, we need an arrow
+  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
+      
+      const XYPt& p1 = rl1->ep1;        // endpts of the reference line
+      const XYPt& p2 = rl1->ep2;
+      XYLine& l1 = rl1->l;
+      XYPt pi = Intersection(l, l1);          // intersection w/ fold line
+      XYPt u1p = l1.u.Rotate90();           // tangent to reference line
+      double t1 = abs((p1 - pi).Dot(u1p));
+      double t2 = abs((p2 - pi).Dot(u1p));
+      double tmin = t1 < t2 ? t1 : t2;
+      sDgmr->DrawFoldAndUnfoldArrow(pi + tmin * u1p, pi - tmin * u1p);
+  }
+}
+
+
+/*****
+Go through existing lines and marks and create RefLine_L2L_C2Ps with rank equal
+to arank; the work goes into schedule as.
+*****/
+void RefLine_L2L_C2P::MakeAll(rank_t arank, RefSchedule& as)
+{
+  vector<RefTask> tasks;
+  for (rank_t irank = 0; irank <= (arank - 1); irank++) {
+    rank_t jrank = arank - irank - 1;
+    ReferenceFinder::AddTasks(tasks, RefTask(irank, jrank), 
+      ReferenceFinder::sBasisLines.GetRank(irank).size(), 
+      ReferenceFinder::sBasisMarks.GetRank(jrank).size());
+  }
+  as.Add<RefLine_L2L_C2P>(tasks, ReferenceFinder::sBasisLines, 
+    ReferenceFinder::sAxiomQuota[3]);
+}
+
+
+/*****
+Create the RefLine_L2L_C2Ps for one RefTask made by MakeAll().
+*****/
+void RefLine_L2L_C2P::DoTask(const RefTask& at, 
+  RefCandidates<RefLine_L2L_C2P>& ac)
+{
+  RefRange<RefLine> li = ReferenceFinder::sBasisLines.GetRank(at.mRanks[0]);
+  RefRange<RefMark> mj = ReferenceFinder::sBasisMarks.GetRank(at.mRanks[1]);
+  for (size_t i = at.mBegin; i < at.mEnd; i++)
+    for (size_t j = 0; j < mj.size(); j++) {
+      RefLine_L2L_C2P rls1(li[i], mj[j]);
+      ReferenceFinder::sBasisLines.AddCandidate(rls1, ac);
+    }
+}
+
+
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/**********
+class RefLine_P2L_C2P - Huzita-Hatori Axiom O5. 
+Bring point p1 to line l1 so that the crease passes through point p2.
+**********/
+
+/*****
+Constructor. iroot can be 0 or 1.
+*****/
+RefLine_P2L_C2P::RefLine_P2L_C2P(RefMark* arm1, RefLine* arl1, RefMark* arm2, short iroot) :
+  RefLine(CalcLineRank(arm1, arl1, arm2)), rm1(arm1), rl1(arl1), rm2(arm2),
+  mRoot(iroot)
+{
+  // Get references to the points and lines.
+  XYPt& p1 = rm1->p;
+  XYLine& l1 = rl1->l;
+  XYPt& u1 = l1.u;
+  double& d1 = l1.d;
+  XYPt& p2 = rm2->p;
+
+  // If either point is already on the line, then this isn't interesting, i.e., it's
+  // a trivial Haga construction.
+  if (l1.Intersects(p1) || l1.Intersects(p2)) return;
+  
+  // Construct the line.
+  double a = d1 - p2.Dot(u1);
+  double b2 = (p2 - p1).Mag2() - a * a;
+  
+  if (b2 < 0) return;   // no solution for negative b2 (implies imaginary b)
+  
+  double b = sqrt(b2);
+  if ((b < EPS) && (iroot == 1)) return;  // degenerate case, there's only one solution
+  
+  // Construct the image of p1 (p1p), which depends on which root we're after.
+  XYPt u1p = u1.Rotate90();
+  XYPt p1p = p2 + a * u1;
+  if (iroot == 0) p1p += b * u1p;
+  else p1p -= b * u1p;
+  
+  // Validate; the point of incidence must lie within the square.
+  if (!ReferenceFinder::sPaper.Encloses(p1p)) return;
+  
+  // Construct member data.
+  l.u = (p1p - p1).Normalize();
+  l.d = p2.Dot(l.u);
+  
+  // Check visibility.
+  bool p1edge = arm1->IsOnEdge();
+  bool l1edge = arl1->IsOnEdge();
+  
+  if (ReferenceFinder::sVisibilityMatters) {
+    if (p1edge) mWhoMoves = WHOMOVES_P1;
+    else if (l1edge) mWhoMoves = WHOMOVES_L1;
+    else return;
+  }
+  else {
+    mWhoMoves = WHOMOVES_P1;
+  };
+  
+  // If this line misses the paper or creates a skinny flap, we won't use it.
+  if (!ClipToPaper() || 
+    ReferenceFinder::sPaper.MakesSkinnyFlap(l, ep1, ep2)) return;
+  
+  // Set the key.
+  FinishConstructor();
+}
+
+
+/*****
+Return what this line was made from.
+*****/
+RefBase::RefSource RefLine_P2L_C2P::GetSource() const
+{
+  RefSource rs(REFTYPE_P2L_C2P, mRoot);
+  rs.mParents[0] = rm1;
+  rs.mParents[1] = rl1;
+  rs.mParents[2] = rm2;
+  return rs;
+}
+
+
+/*****
+Return true if this line uses rb for immediate reference.
+*****/
+bool RefLine_P2L_C2P::UsesImmediate(RefBase* rb) const
+{
+  return (rb == rl1 || rb == rm1 || rb == rm2);
+}
+
+
+/*****
+Build the folding sequence that constructs this object.
+*****/
+void RefLine_P2L_C2P::SequencePushSelf()
+{
+  rm2->SequencePushSelf();
+  switch (mWhoMoves) {
+    case WHOMOVES_P1:
+      rl1->SequencePushSelf();
+      rm1->SequencePushSelf();
+      break;
+      
+    case WHOMOVES_L1:
+      rm1->SequencePushSelf();
+      rl1->SequencePushSelf();
+
+      break;
+  };
+  RefBase::SequencePushSelf();
+}
+
+
+/*****
+Put the name of this line to a stream.
+*****/
+bool RefLine_P2L_C2P::PutHowto(ostream& os) const
+{
+  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[05] ";
+  os << "Bring ";
+  switch (mWhoMoves) {
+    case WHOMOVES_P1:
+      rm1->PutName(os);
+      os << " to ";
+      rl1->PutName(os);
+      break;
+    
+    case WHOMOVES_L1:
+      rl1->PutName(os);
+      os << " to ";
+      rm1->PutName(os);
+      break;
+  };
+  if (ReferenceFinder::sClarifyVerbalAmbiguities) {   
+    os << " so the crease goes through ";
+    rm2->PutName(os);
+  };
+  os << ", making ";
+  PutName(os);
+  return true;
+}
+
+
+/*****
+Draw this line, adding arrows if appropriate
+*****/
+void RefLine_P2L_C2P::DrawSelf(RefStyle rstyle, short ipass) const
+{
+  // Call inherited method to draw the lines
+  
+  RefLine::DrawSelf(rstyle, ipass);
+  
+  // If we're moving, we need an arrow
+  
+  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
+      
+    XYPt& p1 = rm1->p;
+    XYPt p1f = l.Fold(p1);
+    switch (mWhoMoves) {
+      case WHOMOVES_P1:
+        sDgmr->DrawFoldAndUnfoldArrow(p1, p1f);
+        break;
+      case WHOMOVES_L1:
+        sDgmr->DrawFoldAndUnfoldArrow(p1f, p1);
+        break;
+    }
+  }
+}
+
+
+/*****
+Go through existing lines and marks and create RefLine_P2L_C2Ps with rank equal
+arank; the work goes into schedule as.
+*****/
+void RefLine_P2L_C2P::MakeAll(rank_t arank, RefSchedule& as)
+{
+  vector<RefTask> tasks;
+  for (rank_t irank = 0; irank <= (arank - 1); irank++)
+    for (rank_t jrank = 0; jrank <= (arank - 1 - irank); jrank++) {
+      rank_t krank = arank - irank - jrank - 1;
+      ReferenceFinder::AddTasks(tasks, RefTask(irank, jrank, krank), 
+        ReferenceFinder::sBasisMarks.GetRank(irank).size(), 
+        2. * ReferenceFinder::sBasisLines.GetRank(jrank).size() * 
+        ReferenceFinder::sBasisMarks.GetRank(krank).size());
+    }
+  as.Add<RefLine_P2L_C2P>(tasks, ReferenceFinder::sBasisLines, 
+    ReferenceFinder::sAxiomQuota[4]);
+}
+
+
+/*****
+Create the RefLine_P2L_C2Ps for one RefTask made by MakeAll(). If visibility
+matters, either p1 or l1 has to be on the edge, so when p1 isn't, we only try
+the edge lines for l1. Those come in the same order as in the full list, so
+we make the same lines, in the same order, as if we'd tried them all.
+*****/
+void RefLine_P2L_C2P::DoTask(const RefTask& at, 
+  RefCandidates<RefLine_P2L_C2P>& ac)
+{
+  bool visibilityMatters = ReferenceFinder::sVisibilityMatters;
+  RefRange<RefMark> mi = ReferenceFinder::sBasisMarks.GetRank(at.mRanks[0]);
+  RefRange<RefLine> ljAll = 
+    ReferenceFinder::sBasisLines.GetRank(at.mRanks[1]);
+  RefRange<RefLine> ljEdges = 
+    ReferenceFinder::sBasisLines.GetRankEdges(at.mRanks[1]);
+  RefRange<RefMark> mk = ReferenceFinder::sBasisMarks.GetRank(at.mRanks[2]);
+  for (size_t i = at.mBegin; i < at.mEnd; i++) {
+    const RefRange<RefLine>& lj = 
+      (visibilityMatters && !mi[i]->IsOnEdge()) ? ljEdges : ljAll;
+    for (size_t j = 0; j < lj.size(); j++)
+      for (size_t k = 0; k < mk.size(); k++) {
+        if (mi[i] == mk[k]) continue;
+        RefLine_P2L_C2P rlh1(mi[i], lj[j], mk[k], 0);
+        ReferenceFinder::sBasisLines.AddCandidate(rlh1, ac);
+        RefLine_P2L_C2P rlh2(mi[i], lj[j], mk[k], 1);
+        ReferenceFinder::sBasisLines.AddCandidate(rlh2, ac);
+      }
+  }
+}
+
+
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/**********
+class RefLine_P2L_P2L - Huzita-Hatori Axiom O6.
+Bring point p1 to line l1 and point p2 to line l2.
+**********/
+
+/*****
+Take the cube root; works for both positive and negative numbers
+*****/
+double CubeRoot(double x)
 {
   if (x >= 0) return pow(x, 1./3);
   else return -pow(-x, 1./3);
@@ -2479,778 +5538,1971 @@ double CubeRoot(double x)
 
 
 /*****
-Constructor. Variable iroot can be 0, 1, or 2.
+Find all of the fold lines that bring point p1 to line l1 and point p2 to line
+l2. This is by far the most complex alignment, and it involves the solution of
+a cubic equation, which we solve just once for all of its roots. The folds that
+keep the images of both points on the paper go into folds, in order of the
+roots they came from.
+*****/
+void RefLine_P2L_P2L::SolveFolds(const XYPt& p1, const XYLine& l1, 
+  const XYPt& p2, const XYLine& l2, Folds& folds)
+{
+  folds.mNum = 0;
+  const XYPt& u1 = l1.u;
+  const double& d1 = l1.d;
+  const XYPt& u2 = l2.u;
+  const double& d2 = l2.d;
+  XYPt u1p = u1.Rotate90(); // we'll need this later.
+  
+  // First, some trivial checks; we can't have p1 already on l1, or p2 already
+  // on l2.
+  if (l1.Intersects(p1)) return;
+  if (l2.Intersects(p2)) return;
+  
+  // Also make sure we're using distinct points and lines.
+  if ((p1 == p2) || (l1 == l2)) return;
+  
+  // Now construct the terms of the cubic equation.
+  XYPt v1 = p1 + d1 * u1 - 2 * p2;
+  XYPt v2 = d1 * u1 - p1;
+
+  double c1 = p2.Dot(u2) - d2;
+  double c2 = 2 * v2.Dot(u1p);
+  double c3 = v2.Dot(v2);
+  double c4 = (v1 + v2).Dot(u1p);
+  double c5 = v1.Dot(v2);
+  double c6 = u1p.Dot(u2);
+  double c7 = v2.Dot(u2);
+  
+  // the equation is a * r^3 + b * r^2 + c * r + d == 0
+  double a = c6;
+  double b = c1 + c4 * c6 + c7;
+  double c = c1 * c2 + c5 * c6 + c4 * c7;
+  double d = c1 * c3 + c5 * c7;
+  
+  // Collect the roots of the equation. How many there are, and how we find
+  // them, depends on the order of the equation.
+  double roots[3];
+  short numRoots = 0;
+  if (abs(a) > EPS) {
+    // cubic equation, has 1, 2, or 3 roots. Construct coefficients that give
+    // the roots from Cardano's formula.
+    double a2 = b / a;
+    double a1 = c / a;
+    double a0 = d / a;
+    
+    double Q = (3 * a1 - pow(a2, 2)) / 9;
+    double R = (9 * a2 * a1 - 27 * a0 - 2 * pow(a2, 3)) / 54;
+    double D = pow(Q, 3) + pow(R, 2);
+    double U = -a2 / 3;
+    
+    // The number of roots depends on the value of D, which is zero for a
+    // double root. Rounding can leave it a little either side of zero, so
+    // it's compared with the size of the terms it comes from, not with EPS:
+    // when Q and R are small, D can be under EPS even for three roots that
+    // are well apart.
+    double Dtol = 1.0e-12 * (abs(pow(Q, 3)) + pow(R, 2));
+    if (D > Dtol) {
+      // one root
+      double rD = sqrt(D);
+      double S = CubeRoot(R + rD);
+      double T = CubeRoot(R - rD);
+      roots[numRoots++] = U + S + T;
+    }
+    else if (D >= -Dtol) {
+      // two roots
+      double S = CubeRoot(R);
+      roots[numRoots++] = U + 2 * S;
+      roots[numRoots++] = U - S;
+    }
+    else {
+      // D < 0, three roots
+      double rD = sqrt(-D);
+      double phi = atan2(rD, R) / 3;
+      double rS = pow(pow(R, 2) - D, 1./6);
+      double Sr = rS * cos(phi);
+      double Si = rS * sin(phi);
+      roots[numRoots++] = U + 2 * Sr;
+      roots[numRoots++] = U - Sr - sqrt(3.) * Si;
+      roots[numRoots++] = U - Sr + sqrt(3.) * Si;
+    }
+  }
+  else if (abs(b) > EPS) {
+    // quadratic equation has 0, 1 or 2 roots
+    double disc = pow(c, 2) - 4 * b * d;
+    double q1 = -c / (2 * b);
+    if (disc < 0) {
+      // no roots
+    }
+    else if (abs(disc) < EPS) {
+      // 1 degenerate root
+      roots[numRoots++] = q1;
+    }
+    else {
+      // 2 roots
+      double q2 = sqrt(disc) / (2 * b);
+      roots[numRoots++] = q1 + q2;
+      roots[numRoots++] = q1 - q2;
+    }
+  }
+  else if (abs(c) > EPS) {
+    // linear equation has 1 root
+    roots[numRoots++] = -d / c;
+  }
+  // otherwise the equation is ill-formed (no variables!) and has no roots.
+  
+  // Each root gives a fold line, which must still be validated.
+  for (short iroot = 0; iroot < numRoots; iroot++) {
+    XYPt p1p = d1 * u1 + roots[iroot] * u1p;  // image of p1 in fold line
+    if (p1p == p1) continue;    // we only consider p1 off of the fold line
+    
+    XYLine& fold = folds.mLine[folds.mNum];
+    fold.u = (p1p - p1).Normalize();          // normal to fold line
+    fold.d = fold.u.Dot(MidPoint(p1p, p1));   // d-parameter of fold line
+    XYPt p2p = p2 + 2 * (fold.d - p2.Dot(fold.u)) * fold.u;  // image of p2
+    
+    // Validate; the images of p1 and p2 must lie within the square.
+    if (!ReferenceFinder::sPaper.Encloses(p1p) || 
+      !ReferenceFinder::sPaper.Encloses(p2p)) continue;
+    folds.mRoot[folds.mNum++] = iroot;
+  }
+}
+
+
+/*****
+Constructor. Variable iroot can be 0, 1, or 2, and picks out the fold line from
+the corresponding root of the equation, if there is one.
+*****/
+RefLine_P2L_P2L::RefLine_P2L_P2L(RefMark* arm1, RefLine* arl1, RefMark* arm2, 
+  RefLine* arl2, short iroot) : 
+  RefLine(CalcLineRank(arm1, arl1, arm2, arl2)), 
+  rm1(arm1), 
+  rl1(arl1), 
+  rm2(arm2), 
+  rl2(arl2),
+  mRoot(iroot)
+{
+  Folds folds;
+  SolveFolds(rm1->p, rl1->l, rm2->p, rl2->l, folds);
+  for (short i = 0; i < folds.mNum; i++) 
+    if (folds.mRoot[i] == iroot) SetFold(folds.mLine[i]);
+}
+
+
+/*****
+Constructor. Use fold number ifold from folds, which SolveFolds() found for
+these same points and lines.
+*****/
+RefLine_P2L_P2L::RefLine_P2L_P2L(RefMark* arm1, RefLine* arl1, RefMark* arm2, 
+  RefLine* arl2, const Folds& folds, short ifold) : 
+  RefLine(CalcLineRank(arm1, arl1, arm2, arl2)), 
+  rm1(arm1), 
+  rl1(arl1), 
+  rm2(arm2), 
+  rl2(arl2),
+  mRoot(folds.mRoot[ifold])
+{
+  SetFold(folds.mLine[ifold]);
+}
+
+
+/*****
+Finish constructing this line from one of the folds found by SolveFolds(),
+checking its visibility and the flaps that it makes.
+*****/
+void RefLine_P2L_P2L::SetFold(const XYLine& fold)
+{
+  l = fold;
+  const XYPt& p1 = rm1->p;
+  const XYPt& p2 = rm2->p;
+  
+  // Validate visibility; we require that the alignment be visible even with
+  // opaque paper. Meaning that the moving parts must be edge points or edge
+  // lines.
+  
+  // Note whether p1 and p2 are on the same side of the fold line. If they are,
+  // then either both points move or both lines move. If they're not, then one
+  // of each moves.
+  
+  bool sameSide = ((p1.Dot(l.u) - l.d) * (p2.Dot(l.u) - l.d) >= 0);
+  
+  // Note which points and lines are on the edge of the paper
+  bool p1edge = rm1->IsOnEdge();
+  bool p2edge = rm2->IsOnEdge();
+  bool l1edge = rl1->IsOnEdge();
+  bool l2edge = rl2->IsOnEdge();
+  
+  // Now, check the visibility of this alignment and use it to specify which
+  // parts move
+  if (ReferenceFinder::sVisibilityMatters) {
+    if (sameSide)
+      if (p1edge && p2edge) mWhoMoves = WHOMOVES_P1P2;
+      else if (l1edge && l2edge) mWhoMoves = WHOMOVES_L1L2;
+      else return;
+    else
+      if (p1edge && l2edge) mWhoMoves = WHOMOVES_P1L2;
+      else if (p2edge && l1edge) mWhoMoves = WHOMOVES_P2L1;
+      else return;
+  }
+  else {
+    if (sameSide) mWhoMoves = WHOMOVES_P1P2;
+    else mWhoMoves = WHOMOVES_P1L2;
+  };
+  
+  // If this line misses the paper or creates a skinny flap, we won't use it.
+  if (!ClipToPaper() || 
+    ReferenceFinder::sPaper.MakesSkinnyFlap(l, ep1, ep2)) return;
+  
+  // Set the key.
+  FinishConstructor();
+}
+
+
+/*****
+Return what this line was made from.
+*****/
+RefBase::RefSource RefLine_P2L_P2L::GetSource() const
+{
+  RefSource rs(REFTYPE_P2L_P2L, mRoot);
+  rs.mParents[0] = rm1;
+  rs.mParents[1] = rl1;
+  rs.mParents[2] = rm2;
+  rs.mParents[3] = rl2;
+  return rs;
+}
+
+
+/*****
+Return true if this line uses rb for immediate reference.
+*****/
+bool RefLine_P2L_P2L::UsesImmediate(RefBase* rb) const
+{
+  return (rb == rl1 || rb == rm1 || rb == rl2 || rb == rm2);
+}
+
+
+/*****
+Build the folding sequence that constructs this object.
+*****/
+void RefLine_P2L_P2L::SequencePushSelf()
+{
+  switch (mWhoMoves) {
+    case WHOMOVES_P1P2:
+      rl2->SequencePushSelf();
+      rl1->SequencePushSelf();
+      rm2->SequencePushSelf();
+      rm1->SequencePushSelf();
+      break;
+      
+    case WHOMOVES_L1L2:
+      rm2->SequencePushSelf();
+      rm1->SequencePushSelf();
+      rl2->SequencePushSelf();
+      rl1->SequencePushSelf();
+      break;
+    
+    case WHOMOVES_P1L2:
+      rm2->SequencePushSelf();
+      rl1->SequencePushSelf();
+      rl2->SequencePushSelf();
+      rm1->SequencePushSelf();
+      break;
+    
+    case WHOMOVES_P2L1:
+      rl2->SequencePushSelf();
+      rm1->SequencePushSelf();
+      rl1->SequencePushSelf();
+      rm2->SequencePushSelf();
+      break;
+  };
+  RefBase::SequencePushSelf();
+}
+
+
+/*****
+Put the name of this line to a stream.
+*****/
+bool RefLine_P2L_P2L::PutHowto(ostream& os) const
+{
+  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[06] ";
+  os.precision(2);
+  os.setf(ios_base::fixed, ios_base::floatfield);
+  os << "Bring ";
+  switch (mWhoMoves) {
+    case WHOMOVES_P1P2:
+      rm1->PutName(os);
+      os << " to ";
+      rl1->PutName(os);
+      if (ReferenceFinder::sClarifyVerbalAmbiguities)
+        os << " at point " << l.Fold(rm1->p).Chop();
+      os << " and ";
+      rm2->PutName(os);
+      os << " to ";
+      rl2->PutName(os);
+      break;
+    
+    case WHOMOVES_L1L2:
+      rl1->PutName(os);
+      if (ReferenceFinder::sClarifyVerbalAmbiguities)
+        os << " so that point " << l.Fold(rm1->p).Chop();
+      os << " touches ";
+      rm1->PutName(os);
+      os << " and ";
+      rl2->PutName(os);
+      os << " to ";
+      rm2->PutName(os);
+      break;
+    
+    case WHOMOVES_P1L2:
+      rm1->PutName(os);
+      os << " to ";
+      rl1->PutName(os);
+      if (ReferenceFinder::sClarifyVerbalAmbiguities)
+        os << " at point " << l.Fold(rm1->p).Chop();
+      os << " and ";
+      rl2->PutName(os);
+      os << " to ";
+      rm2->PutName(os);
+      break;
+    
+    case WHOMOVES_P2L1:
+      rl1->PutName(os);
+      os << " to ";
+      rm1->PutName(os);
+      os << " and ";
+      rm2->PutName(os);
+      os << " to ";
+      rl2->PutName(os);
+      if (ReferenceFinder::sClarifyVerbalAmbiguities)
+        os << " at point " << l.Fold(rm2->p).Chop();
+      break;
+  };
+  os << ", making ";
+  PutName(os);
+  return true;
+}
+
+
+/*****
+Draw this line, adding arrows if appropriate
+*****/
+void RefLine_P2L_P2L::DrawSelf(RefStyle rstyle, short ipass) const
+{
+  // Call inherited method to draw the lines
+  RefLine::DrawSelf(rstyle, ipass);
+  
+  // If we're moving, we need an arrow
+  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
+      
+        XYPt& p1a = rm1->p;
+        XYPt p1b = l.Fold(p1a);
+        XYPt& p2a = rm2->p;
+        XYPt p2b = l.Fold(p2a);
+    switch (mWhoMoves) {
+      case WHOMOVES_P1P2:
+        sDgmr->DrawFoldAndUnfoldArrow(p1a, p1b);
+        sDgmr->DrawFoldAndUnfoldArrow(p2a, p2b);
+        break;
+        
+      case WHOMOVES_L1L2:
+        sDgmr->DrawFoldAndUnfoldArrow(p1b, p1a);
+        sDgmr->DrawFoldAndUnfoldArrow(p2b, p2a);
+        break;
+      
+      case WHOMOVES_P1L2:
+        sDgmr->DrawFoldAndUnfoldArrow(p1a, p1b);
+        sDgmr->DrawFoldAndUnfoldArrow(p2b, p2a);
+        break;
+      
+      case WHOMOVES_P2L1:
+        sDgmr->DrawFoldAndUnfoldArrow(p1b, p1a);
+        sDgmr->DrawFoldAndUnfoldArrow(p2a, p2b);
+        break;
+    }
+  }
+}
+
+
+/*****
+Go through existing lines and marks and create RefLine_P2L_P2Ls with rank equal
+arank; the work goes into schedule as.
+*****/
+void RefLine_P2L_P2L::MakeAll(rank_t arank, RefSchedule& as)
+{
+  vector<RefTask> tasks;
+  // psrank == sum of ranks of the two points
+  // lsrank == sum of ranks of the two lines
+  for (rank_t psrank = 0; psrank <= (arank - 1); psrank++)
+    for (rank_t lsrank = 0; lsrank <= (arank - 1) - psrank; lsrank++)
+
+      // point order doesn't matter, so rank(pt[i]) will always be <= rank(pt[j])
+      for (rank_t irank = 0; irank <= psrank / 2; irank++) {
+        rank_t jrank = psrank - irank;
+        size_t ni = ReferenceFinder::sBasisMarks.GetRank(irank).size();
+        size_t nj = ReferenceFinder::sBasisMarks.GetRank(jrank).size();
+        double npts = (irank == jrank) ? 0.5 * (nj - 1) : nj;
+        
+        // line order does matter, so both lines vary over all ranks
+        for (rank_t krank = 0; krank <= lsrank; krank++)
+          for (rank_t lrank = 0; lrank <= lsrank - krank; lrank++)
+            ReferenceFinder::AddTasks(tasks, 
+              RefTask(irank, jrank, krank, lrank), ni, 3. * npts * 
+              ReferenceFinder::sBasisLines.GetRank(krank).size() * 
+              ReferenceFinder::sBasisLines.GetRank(lrank).size());
+      }
+  as.Add<RefLine_P2L_P2L>(tasks, ReferenceFinder::sBasisLines, 
+    ReferenceFinder::sAxiomQuota[5]);
+}
+
+
+/*****
+Create the RefLine_P2L_P2Ls for one RefTask made by MakeAll(). We solve for
+all of the folds for a given set of points and lines at once, and only make
+lines from the ones that the solver keeps.
+
+If visibility matters, the alignment can only be made if both points, both
+lines, p1 and l2, or p2 and l1 are on the edge of the paper. So if p1 isn't on
+the edge, l1 must be, and if p2 isn't, l2 must be; for those we only try the
+edge lines, which come in the same order as in the full lists. We make the
+same lines, in the same order, as if we'd tried every line, without solving
+for any of the alignments that can't be seen.
+*****/
+void RefLine_P2L_P2L::DoTask(const RefTask& at, 
+  RefCandidates<RefLine_P2L_P2L>& ac)
+{
+  bool visibilityMatters = ReferenceFinder::sVisibilityMatters;
+  bool psameRank = (at.mRanks[0] == at.mRanks[1]);
+  RefRange<RefMark> mi = ReferenceFinder::sBasisMarks.GetRank(at.mRanks[0]);
+  RefRange<RefMark> mj = ReferenceFinder::sBasisMarks.GetRank(at.mRanks[1]);
+  RefRange<RefLine> lkAll = 
+    ReferenceFinder::sBasisLines.GetRank(at.mRanks[2]);
+  RefRange<RefLine> lkEdges = 
+    ReferenceFinder::sBasisLines.GetRankEdges(at.mRanks[2]);
+  RefRange<RefLine> llAll = 
+    ReferenceFinder::sBasisLines.GetRank(at.mRanks[3]);
+  RefRange<RefLine> llEdges = 
+    ReferenceFinder::sBasisLines.GetRankEdges(at.mRanks[3]);
+  for (size_t i = at.mBegin; i < at.mEnd; i++) {
+    size_t jend = psameRank ? i : mj.size();
+    const RefRange<RefLine>& lk = 
+      (visibilityMatters && !mi[i]->IsOnEdge()) ? lkEdges : lkAll;
+    for (size_t j = 0; j < jend; j++) {
+      const RefRange<RefLine>& ll = 
+        (visibilityMatters && !mj[j]->IsOnEdge()) ? llEdges : llAll;
+      for (size_t k = 0; k < lk.size(); k++)
+        for (size_t l = 0; l < ll.size(); l++) {
+          if (lk[k] == ll[l]) continue;
+          Folds folds;
+          SolveFolds(mi[i]->p, lk[k]->l, mj[j]->p, ll[l]->l, folds);
+          for (short n = 0; n < folds.mNum; n++) {
+            RefLine_P2L_P2L rlp(mi[i], lk[k], mj[j], ll[l], folds, n);
+            ReferenceFinder::sBasisLines.AddCandidate(rlp, ac);
+          }
+        }
+    }
+  }
+}
+
+
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/**********
+class RefLine_L2L_P2L - Huzita-Hatori Axiom O7 (Hatori's Axiom).
+Bring line l1 onto itself so that point p1 falls on line l2.
+**********/
+
+/*****
+Constructor. iroot can be 0 or 1.
+*****/
+RefLine_L2L_P2L::RefLine_L2L_P2L(RefLine* arl1, RefMark* arm1, RefLine* arl2) :
+  RefLine(CalcLineRank(arl1, arm1, arl2)), rl1(arl1), rm1(arm1), rl2(arl2)
+{
+  // Get references
+  XYLine& l1 = rl1->l;
+  XYPt& u1 = l1.u;
+  double& d1 = l1.d;
+  XYPt& p1 = rm1->p;
+  XYLine& l2 = rl2->l;
+  XYPt& u2 = l2.u;
+  
+  // Construct direction vector and distance scalar
+  l.u = u2.Rotate90();
+  
+  double uf1 = l.u.Dot(u1);
+  if (abs(uf1) < EPS) return; // parallel lines, no solution
+  
+  l.d = (d1 + 2 * p1.Dot(l.u) * uf1 - p1.Dot(u1)) / (2 * uf1);
+  
+  // Make sure point of intersection of fold with l2 lies within the paper.
+  XYPt pt = Intersection(l, l2);
+  if (!ReferenceFinder::sPaper.Encloses(pt)) return;
+  
+  // Make sure point of incidence of p1 on l1 lies within the paper.
+  XYPt p1p = l.Fold(p1);
+  if (!ReferenceFinder::sPaper.Encloses(p1p)) return;
+  
+  // Make sure p1 isn't already on l1 (in which case the alignment is ill-defined).
+  if (l1.Intersects(p1)) return;
+  
+  // Check visibility.
+  bool p1edge = arm1->IsOnEdge();
+  bool l1edge = arl1->IsOnEdge();
+  
+  // Find where the fold line leaves the paper.
+  if (!ClipToPaper()) return;
+  
+  if (ReferenceFinder::sVisibilityMatters) {
+    double t1 = (ep1 - pt).Dot(l.u);
+    double t2 = (ep2 - pt).Dot(l.u);
+    double tp = (p1 - pt).Dot(l.u);
+    if ((t1 * tp) < 0) {
+      double ti = t2;
+      t2 = t1;
+      t1 = ti;
+    };  // now t1 is the parameter for the endpoint on the p1 side of l2.
+    if (p1edge && (abs(t1) <= abs(t2))) mWhoMoves = WHOMOVES_P1;
+    else if (l1edge && (abs(t1) >= abs(t2))) mWhoMoves = WHOMOVES_L1;
+    else return;
+  }
+  else {
+    mWhoMoves = WHOMOVES_P1;
+  };
+    
+  // If this line creates a skinny flap, we won't use it.
+  if (ReferenceFinder::sPaper.MakesSkinnyFlap(l, ep1, ep2)) return;
+  
+  // Set the key.
+  FinishConstructor();
+}
+
+
+/*****
+Return what this line was made from.
+*****/
+RefBase::RefSource RefLine_L2L_P2L::GetSource() const
+{
+  RefSource rs(REFTYPE_L2L_P2L);
+  rs.mParents[0] = rl1;
+  rs.mParents[1] = rm1;
+  rs.mParents[2] = rl2;
+  return rs;
+}
+
+
+/*****
+Return true if this line uses rb for immediate reference.
+*****/
+bool RefLine_L2L_P2L::UsesImmediate(RefBase* rb) const
+{
+  return (rb == rl1 || rb == rm1 || rb == rl2);
+}
+
+
+/*****
+Build the folding sequence that constructs this object.
+*****/
+void RefLine_L2L_P2L::SequencePushSelf()
+{
+  switch (mWhoMoves) {
+    case WHOMOVES_P1:
+      rl1->SequencePushSelf();
+      rm1->SequencePushSelf();
+      break;
+
+    case WHOMOVES_L1:
+      rm1->SequencePushSelf();
+      rl1->SequencePushSelf();
+      break;
+  };
+  rl2->SequencePushSelf(); 
+  RefBase::SequencePushSelf();
+}
+      
+
+/*****
+Put the name of this line to a stream.
+*****/
+bool RefLine_L2L_P2L::PutHowto(ostream& os) const
+{
+  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[07] ";
+  os << "Bring ";
+  rl2->PutName(os);
+  os << " onto itself so that ";
+  switch (mWhoMoves) {
+    case WHOMOVES_P1:
+      rm1->PutName(os);
+      os << " touches ";
+      rl1->PutName(os);
+      break;
+    
+    case WHOMOVES_L1:
+      rl1->PutName(os);
+      os << " touches ";
+      rm1->PutName(os);
+      break;
+  };
+  os << ", making ";
+  PutName(os);
+  return true;
+}
+
+
+/*****
+Draw this line, adding arrows if appropriate
+*****/
+void RefLine_L2L_P2L::DrawSelf(RefStyle rstyle, short ipass) const
+{
+  // Call inherited method to draw the lines
+  RefLine::DrawSelf(rstyle, ipass);
+  
+  // If we're moving, we need an arrow
+  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
+      
+    // Draw line-to-itself arrow
+    const XYPt& p1 = rl2->ep1;        // endpts of the reference line
+    const XYPt& p2 = rl2->ep2;
+    XYLine& l2 = rl2->l;
+    XYPt pi = Intersection(l, l2);          // intersection w/ fold line
+    XYPt u1p = l2.u.Rotate90();           // tangent to reference line
+    double t1 = abs((p1 - pi).Dot(u1p));
+    double t2 = abs((p2 - pi).Dot(u1p));
+    double tmin = t1 < t2 ? t1 : t2;
+    sDgmr->DrawFoldAndUnfoldArrow(pi + tmin * u1p, pi - tmin * u1p);
+    
+    // Draw point-to-line arrow
+    XYPt& p3 = rm1->p;
+    XYPt p3p = l.Fold(p3);
+    switch(mWhoMoves) {
+      case WHOMOVES_P1:
+        sDgmr->DrawFoldAndUnfoldArrow(p3, p3p);
+        break;
+      case WHOMOVES_L1:
+        sDgmr->DrawFoldAndUnfoldArrow(p3p, p3);
+        break;
+    }
+  }
+}
+
+
+/*****
+Go through existing lines and marks and create RefLine_L2L_P2Ls with rank equal
+arank; the work goes into schedule as.
+*****/
+void RefLine_L2L_P2L::MakeAll(rank_t arank, RefSchedule& as)
+{
+  vector<RefTask> tasks;
+  for (rank_t irank = 0; irank <= (arank - 1); irank++)
+    for (rank_t jrank = 0; jrank <= (arank - 1 - irank); jrank++) {
+      rank_t krank = arank - irank - jrank - 1;
+      ReferenceFinder::AddTasks(tasks, RefTask(irank, jrank, krank), 
+        ReferenceFinder::sBasisLines.GetRank(irank).size(), 
+        double(ReferenceFinder::sBasisMarks.GetRank(jrank).size()) * 
+        ReferenceFinder::sBasisLines.GetRank(krank).size());
+    }
+  as.Add<RefLine_L2L_P2L>(tasks, ReferenceFinder::sBasisLines, 
+    ReferenceFinder::sAxiomQuota[6]);
+}
+
+
+/*****
+Create the RefLine_L2L_P2Ls for one RefTask made by MakeAll(). If visibility
+matters, either l1 or p1 has to be on the edge, so when l1 isn't, we only try
+the edge marks for p1, in the same order as in the full list.
+*****/
+void RefLine_L2L_P2L::DoTask(const RefTask& at, 
+  RefCandidates<RefLine_L2L_P2L>& ac)
+{
+  bool visibilityMatters = ReferenceFinder::sVisibilityMatters;
+  RefRange<RefLine> li = ReferenceFinder::sBasisLines.GetRank(at.mRanks[0]);
+  RefRange<RefMark> mjAll = 
+    ReferenceFinder::sBasisMarks.GetRank(at.mRanks[1]);
+  RefRange<RefMark> mjEdges = 
+    ReferenceFinder::sBasisMarks.GetRankEdges(at.mRanks[1]);
+  RefRange<RefLine> lk = ReferenceFinder::sBasisLines.GetRank(at.mRanks[2]);
+  for (size_t i = at.mBegin; i < at.mEnd; i++) {
+    const RefRange<RefMark>& mj = 
+      (visibilityMatters && !li[i]->IsOnEdge()) ? mjEdges : mjAll;
+    for (size_t j = 0; j < mj.size(); j++)
+      for (size_t k = 0; k < lk.size(); k++) {
+        if (li[i] == lk[k]) continue;
+        RefLine_L2L_P2L rlh1(li[i], mj[j], lk[k]);
+        ReferenceFinder::sBasisLines.AddCandidate(rlh1, ac);
+      }
+  }
+}
+
+
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/******************************************************************************
+Section 3: containers for collections of marks and lines These containers are
+templated on the object type; we use the same type for both RefMarks and
+RefLines.
+******************************************************************************/
+
+/**********
+class RefKeySet - the set of keys used by a RefContainer, in a hash table with
+a bit-array prefilter.
+**********/
+
+/*****
+Constructor.
+*****/
+RefKeySet::RefKeySet() : mSize(0)
+{
+  Resize(10);
+}
+
+
+/*****
+Add a key to the set, growing the table when it gets half full. The key must
+not be 0 and must not already be present.
+*****/
+void RefKeySet::Insert(key_t akey)
+{
+  if (2 * (mSize + 1) > mSlots.size()) Resize(mBits + 1);
+  size_t i = SlotHash(akey);
+  while (mSlots[i] != 0) i = (i + 1) & mMask;
+  mSlots[i] = akey;
+  unsigned f = FilterHash(akey);
+  mFilter[f >> 3] |= (unsigned char)(1 << (f & 7));
+  mSize++;
+}
+
+
+/*****
+Remove all keys and release the memory.
+*****/
+void RefKeySet::Clear()
+{
+  vector<key_t>().swap(mSlots);
+  vector<unsigned char>().swap(mFilter);
+  mSize = 0;
+  Resize(10);
+}
+
+
+/*****
+Change the table to 2^abits slots and reinsert all the keys.
+*****/
+void RefKeySet::Resize(int abits)
+{
+  vector<key_t> oldSlots(size_t(1) << abits, key_t(0));
+  oldSlots.swap(mSlots);
+  mFilter.assign(mSlots.size(), 0);
+  mBits = abits;
+  mMask = mSlots.size() - 1;
+  mSize = 0;
+  for (size_t i = 0; i < oldSlots.size(); i++)
+    if (oldSlots[i] != 0) Insert(oldSlots[i]);
+}
+
+
+#ifdef __MWERKS__
+#pragma mark -
+#endif
+
+
+/**********
+class RefSlab - storage for the objects of one class Rs, constructed in chunks
+of memory that can be kept for reuse when the objects are thrown away.
+**********/
+
+/*****
+Destructor. Destroy all objects and release the memory.
+*****/
+template <class Rs>
+RefSlab<Rs>::~RefSlab()
+{
+  Release();
+}
+
+
+/*****
+Construct a copy of ars in the slab and return a pointer to it. We start a new
+chunk when the current one is full, reusing a chunk we already have if there
+is one.
+*****/
+template <class Rs>
+Rs* RefSlab<Rs>::New(const Rs& ars)
+{
+  if (mChunks.empty() || mUsed == ChunkSize(mChunk)) {
+    if (!mChunks.empty()) {
+      mChunk++;
+      mUsed = 0;
+    }
+    if (mChunk == mChunks.size())
+      mChunks.push_back(::operator new(ChunkSize(mChunk) * sizeof(Rs)));
+  }
+  return new (static_cast<Rs*>(mChunks[mChunk]) + mUsed++) Rs(ars);
+}
+
+
+/*****
+Throw away all the objects in the slab. Unless the class needs its destructor
+called, this takes time proportional to the number of chunks, not objects.
+*****/
+template <class Rs>
+void RefSlab<Rs>::Clear()
+{
+  if (RefSlabTraits<Rs>::NEEDS_DESTRUCTOR && !mChunks.empty())
+    for (size_t k = 0; k <= mChunk; k++) {
+      Rs* rs = static_cast<Rs*>(mChunks[k]);
+      size_t n = (k == mChunk) ? mUsed : ChunkSize(k);
+      for (size_t i = 0; i < n; i++) rs[i].~Rs();
+    }
+  mChunk = 0;
+  mUsed = 0;
+}
+
+
+/*****
+Throw away all the objects in the slab and free its memory.
+*****/
+template <class Rs>
+void RefSlab<Rs>::Release()
+{
+  Clear();
+  for (size_t k = 0; k < mChunks.size(); k++) ::operator delete(mChunks[k]);
+  mChunks.clear();
+}
+
+
+/**********
+class RefArena - owner of all of the marks and lines that currently exist.
+**********/
+
+/*****
+Throw away all the marks and lines, keeping the memory for the next ones.
+*****/
+void RefArena::Clear()
+{
+  mMark_Original.Clear();
+  mMark_Intersection.Clear();
+  mLine_Original.Clear();
+  mLine_C2P_C2P.Clear();
+  mLine_P2P.Clear();
+  mLine_L2L.Clear();
+  mLine_L2L_C2P.Clear();
+  mLine_P2L_C2P.Clear();
+  mLine_P2L_P2L.Clear();
+  mLine_L2L_P2L.Clear();
+}
+
+
+/*****
+Throw away all the marks and lines and free the memory they used.
+*****/
+void RefArena::Release()
+{
+  mMark_Original.Release();
+  mMark_Intersection.Release();
+  mLine_Original.Release();
+  mLine_C2P_C2P.Release();
+  mLine_P2P.Release();
+  mLine_L2L.Release();
+  mLine_L2L_C2P.Release();
+  mLine_P2L_C2P.Release();
+  mLine_P2L_P2L.Release();
+  mLine_L2L_P2L.Release();
+}
+
+
+/**********
+class RefVirtualRefs - the refs that searches make from refs in the database.
+**********/
+
+/*****
+Return the copy of ars, which was made from the refs in rows arow1 and arow2,
+making it if there isn't one yet.
+*****/
+template <class Rs>
+Rs* RefVirtualRefs::Get(const Rs& ars, row_t arow1, row_t arow2)
+{
+  Rs*& rs = GetMap(static_cast<Rs*>(0))[row_pair(arow1, arow2)];
+  if (!rs) {
+    rs = GetSlab(static_cast<Rs*>(0)).New(ars);
+    mSize++;
+  }
+  return rs;
+}
+
+
+/*****
+Throw away all the refs, keeping the memory for the next ones.
+*****/
+void RefVirtualRefs::Clear()
+{
+  mMark_Intersection.Clear();
+  mMarks_Intersection.clear();
+  mLine_C2P_C2P.Clear();
+  mLines_C2P_C2P.clear();
+  mSize = 0;
+}
+
+
+/**********
+class RefColumns - compact storage for the marks or lines in a RefContainer.
+**********/
+
+/*****
+Append the fields that marks and lines have in common, and what the ref was made
+from. Its parents must already be in their containers.
+*****/
+void RefColumnsBase::Append(const RefBase* ar)
+{
+  RefBase::RefSource rs = ar->GetSource();
+  mRank.push_back(ar->mRank);
+  mKey.push_back(ar->mKey);
+  mType.push_back((unsigned char)(rs.mType));
+  if (rs.mType == RefBase::REFTYPE_ORIGINAL) {
+    mAux.push_back((unsigned char)(mNames.size()));
+    mNames.push_back(*rs.mName);
+  }
+  else
+    mAux.push_back((unsigned char)(rs.mRoot));
+  for (int k = 0; k < mNumParents; k++)
+    mParents[k].push_back(rs.mParents[k] ? rs.mParents[k]->mRow : 0);
+}
+
+
+/*****
+Keep only the first n rows, along with the names of the originals among them.
+*****/
+void RefColumnsBase::Resize(size_t n)
+{
+  size_t numNames = 0;
+  for (size_t i = 0; i < n; i++) 
+    if (mType[i] == RefBase::REFTYPE_ORIGINAL) numNames++;
+  mNames.resize(numNames);
+  mRank.resize(n);
+  mKey.resize(n);
+  mType.resize(n);
+  mAux.resize(n);
+  for (int k = 0; k < mNumParents; k++) mParents[k].resize(n);
+}
+
+
+/*****
+Append a mark.
+*****/
+void RefColumns<RefMark>::Append(const RefMark* ar)
+{
+  RefColumnsBase::Append(ar);
+  mX.push_back(ar->p.x);
+  mY.push_back(ar->p.y);
+}
+
+
+/*****
+Keep only the first n marks.
+*****/
+void RefColumns<RefMark>::Resize(size_t n)
+{
+  RefColumnsBase::Resize(n);
+  mX.resize(n);
+  mY.resize(n);
+}
+
+
+/*****
+Append a line.
+*****/
+void RefColumns<RefLine>::Append(const RefLine* ar)
+{
+  RefColumnsBase::Append(ar);
+  mD.push_back(ar->l.d);
+  mUx.push_back(ar->l.u.x);
+  mUy.push_back(ar->l.u.y);
+  mX1.push_back(ar->ep1.x);
+  mY1.push_back(ar->ep1.y);
+  mX2.push_back(ar->ep2.x);
+  mY2.push_back(ar->ep2.y);
+}
+
+
+/*****
+Keep only the first n lines.
+*****/
+void RefColumns<RefLine>::Resize(size_t n)
+{
+  RefColumnsBase::Resize(n);
+  mD.resize(n);
+  mUx.resize(n);
+  mUy.resize(n);
+  mX1.resize(n);
+  mY1.resize(n);
+  mX2.resize(n);
+  mY2.resize(n);
+}
+
+
+/**********
+class RefContainer - a container for storing RefMark* and RefLine*, sorted by
+rank and within each rank by key, so that all the objects of a given rank form
+one contiguous run. The mKey member variable is used to keep the objects
+unique; only one object is stored per key. class R = RefMark or RefLine
+**********/
+
+/*****
+Constructor. Initialize arrays.
+*****/
+template <class R>
+RefContainer<R>::RefContainer()
+{
+  // make room for the start of each rank that we will create
+  rankStart.resize(2 + ReferenceFinder::sMaxRank, 0);
+  edgeStart.resize(2 + ReferenceFinder::sMaxRank, 0);
+}
+
+
+/*****
+Check the validity and uniqueness of object ars of type Rs (descended from type
+R), and if it passes, add it to the container. Used by all the MakeAll()
+functions. Note that we use the default (compiler-generated) copy constructor,
+which is OK since our objects only contain POD, pointers that we WANT
+blind-copied, and/or strings (which know how to copy themselves).
+*****/
+template <class R>
+template <class Rs>
+void RefContainer<R>::AddCopyIfValidAndUnique(const Rs& ars)
+{
+  // The ref is valid (fully constructed) if its key is something other than 0.
+  // It's unique if the container doesn't already have one with the same key.
+  // The copy lives in the arena, which frees it once the database is built.
+  if (ars.mKey != 0 && !Contains(&ars)) Add(ReferenceFinder::sArena.New(ars));
+}
+
+
+/*****
+Check the validity and uniqueness of object ars as above, and if it passes, add
+a copy of it to the list of candidates ac. Used by all the DoTask() functions,
+which may run on several threads at once, so this doesn't change the container.
+The candidates still have to go through AddCopyIfValidAndUnique(), since two of
+them may share a key.
+*****/
+template <class R>
+template <class Rs>
+void RefContainer<R>::AddCandidate(const Rs& ars, RefCandidates<Rs>& ac) const
+{
+  if (ars.mKey != 0 && !Contains(&ars)) ac.push_back(ars);
+  ac.mNumTried++;
+}
+
+
+/*****
+Rebuild all arrays and related counters.
+*****/
+template <class R>
+void RefContainer<R>::Rebuild()
+{
+  this->resize(0);
+  buffer.resize(0);
+  keys.Clear();
+  made.clear();
+  cols.Resize(0);
+  rankStart.assign(2 + ReferenceFinder::sMaxRank, 0);
+  edges.clear();
+  edgeStart.assign(2 + ReferenceFinder::sMaxRank, 0);
+}
+
+
+/*****
+Add an element to the array; to be called only if an equivalent element isn't
+already present anywhere. To avoid corrupting iterators, we add the new element
+to the buffer; it will get added to the main container on the next call to
+FlushBuffer().
+*****/
+template<class R>
+void RefContainer<R>::Add(R* ar)
+{
+  buffer.push_back(ar);
+  keys.Insert(ar->mKey);
+}
+
+
+/*****
+Function objects that compare refs by rank, then by key; and refs to ranks.
+*****/
+template <class R>
+class CompareRankAndKey {
+public:
+  bool operator()(const R* r1, const R* r2) const {
+    if (r1->mRank != r2->mRank) return r1->mRank < r2->mRank;
+    return r1->mKey < r2->mKey;
+  };
+  bool operator()(const R* r1, size_t arank) const {
+    return r1->mRank < arank;
+  };
+};
+
+
+/*****
+Put the contents of the buffer into the main container. The buffer may not
+hold anything of lower rank than what's already in the container, so the
+container stays sorted by rank, and then by key within each rank.
+*****/
+template <class R>
+void RefContainer<R>::FlushBuffer()
+{
+  if (buffer.empty()) return;
+  sort(buffer.begin(), buffer.end(), CompareRankAndKey<R>());
+  size_t firstRank = buffer.front()->mRank;
+  for (size_t i = 0; i < buffer.size(); i++) {
+    buffer[i]->mRow = row_t(this->size());
+    this->push_back(buffer[i]);
+    cols.Append(buffer[i]);
+  }
+  buffer.clear();
+  
+  // Find where each rank now starts.
+  for (size_t ir = firstRank; ir < rankStart.size(); ir++)
+    rankStart[ir] = size_t(lower_bound(this->begin(), this->end(), ir, 
+      CompareRankAndKey<R>()) - this->begin());
+  FindEdges(firstRank);
+}
+
+
+/*****
+List the objects of rank firstRank and up that lie on the edge of the paper,
+by rank, in the same order as in the container. The lists for lower ranks are
+left as they are.
+*****/
+template <class R>
+void RefContainer<R>::FindEdges(size_t firstRank)
+{
+  edgeStart.resize(rankStart.size(), 0);
+  edges.resize(edgeStart[firstRank]);
+  for (size_t ir = firstRank; ir + 1 < rankStart.size(); ir++) {
+    edgeStart[ir] = edges.size();
+    for (size_t i = rankStart[ir]; i < rankStart[ir + 1]; i++) 
+      if ((*this)[i]->IsOnEdge()) edges.push_back((*this)[i]);
+  }
+  edgeStart.back() = edges.size();
+}
+
+
+/*****
+Remove all objects of rank higher than arank, including anything left in the
+buffer, and make room for ranks up to the current sMaxRank. Used to pick up an
+existing database where its last complete rank left off.
+*****/
+template <class R>
+void RefContainer<R>::Truncate(RefBase::rank_t arank)
+{
+  size_t newSize = rankStart[arank + 1];
+  cols.Resize(newSize);
+  if (this->size() > newSize) this->resize(newSize);
+  buffer.clear();
+  made.clear();
+  rankStart.resize(2 + ReferenceFinder::sMaxRank);
+  for (size_t ir = arank + 1; ir < rankStart.size(); ir++) 
+    rankStart[ir] = newSize;
+  edges.clear();
+  edgeStart.assign(2 + ReferenceFinder::sMaxRank, 0);
+}
+
+
+/*****
+Function object for RefColumns::ForEachColumn() that makes sure each column
+has values of its own, rather than being a view of a snapshot.
+*****/
+struct OwnColumn {
+  template <class T>
+  void Column(RefColumn<T>& ac) {ac.Own();};
+};
+
+
+/*****
+Get ready to add to an existing database: copy any columns that are views of a
+snapshot, put all the keys back in the key set, and make the object in every
+row again.
+*****/
+template <class R>
+void RefContainer<R>::Expand()
+{
+  OwnColumn owner;
+  cols.ForEachColumn(owner);
+  made.clear();
+  this->assign(cols.size(), static_cast<R*>(0));
+  keys.Clear();
+  for (size_t i = 0; i < cols.size(); i++) keys.Insert(cols.mKey[i]);
+  for (size_t i = 0; i < cols.size(); i++) GetObject(row_t(i));
+  FindEdges(0);
+}
+
+
+/*****
+Once the database is built, let go of the objects and the key set, which take
+up much more room than the columns. Objects are made again as they're needed.
+*****/
+template <class R>
+void RefContainer<R>::Compact()
+{
+  vector<R*>().swap(*this);
+  vector<R*>().swap(buffer);
+  vector<R*>().swap(edges);
+  edgeStart.assign(edgeStart.size(), 0);
+  keys.Clear();
+  made.clear();
+}
+
+
+/*****
+Return the ref in row i, making it from the columns if it doesn't exist yet.
 *****/
-RefLine_P2L_P2L::RefLine_P2L_P2L(RefMark* arm1, RefLine* arl1, RefMark* arm2, 
-  RefLine* arl2, short iroot) : 
-  RefLine(CalcLineRank(arm1, arl1, arm2, arl2)), 
-  rm1(arm1), 
-  rl1(arl1), 
-  rm2(arm2), 
-  rl2(arl2)
+template <class R>
+R* RefContainer<R>::GetObject(row_t i)
 {
-  // Get references to the points and lines involved in the construction
-  XYPt& p1 = rm1->p;
-  XYLine& l1 = rl1->l;
-  XYPt& u1 = l1.u;
-  double& d1 = l1.d;
-  XYPt& p2 = rm2->p;
-  XYLine& l2 = rl2->l;
-  XYPt& u2 = l2.u;
-  double& d2 = l2.d;
-
-  // This is by far the most complex alignment, and it involves the solution of
-  // a cubic equation.
-  XYPt u1p = u1.Rotate90(); // we'll need this later.
-  
-  // First, some trivial checks; we can't have p1 already on l1, or p2 already
-  // on l2.
-  if (l1.Intersects(p1)) return;
-  if (l2.Intersects(p2)) return;
-  
-  // Also make sure we're using distinct points and lines.
-  if ((p1 == p2) || (l1 == l2)) return;
-  
-  // Now construct the terms of the cubic equation. These are stored in static
-  // member variables during the iroot==0 construction; if iroot==1 or 2, we
-  // used the stored values.
-  double rc = 0;  // this will hold the root of the cubic equation after this switch(iroot).
-  switch (iroot) {
-    case 0:
-      { 
-        // case iroot==0 computes a bunch of quantities that are used for all roots.
-        // Some of these get stored in private static member variables.
-        XYPt v1 = p1 + d1 * u1 - 2 * p2;
-        XYPt v2 = d1 * u1 - p1;
-
-        double c1 = p2.Dot(u2) - d2;
-        double c2 = 2 * v2.Dot(u1p);
-        double c3 = v2.Dot(v2);
-        double c4 = (v1 + v2).Dot(u1p);
-        double c5 = v1.Dot(v2);
-        double c6 = u1p.Dot(u2);
-        double c7 = v2.Dot(u2);
-        
-        // the equation is a * r^3 + b * r^2 + c * r + d == 0
-        double a = c6;
-        double b = c1 + c4 * c6 + c7;
-        double c = c1 * c2 + c5 * c6 + c4 * c7;
-        double d = c1 * c3 + c5 * c7;
-    
-        // compute the order of the equation
-        if (abs(a) > EPS) order = 3;    // cubic equation
-        else if (abs(b) > EPS) order = 2; // quadratic equation
-        else if (abs(c) > EPS) order = 1; // linear equation
-        else order = 0;           // ill-formed equation (no variables!)
-        
-        // what we do next depends on the order of the equation.
-        switch(order) {
-          case 0:       // ill-formed equation has 0 roots
-            return;
-          
-          case 1:       // linear equation has 1 root
-            {
-              rc = -d / c;
-            }
-            break;
-          
-          case 2:       // quadratic equation has 0, 1 or 2 roots
-            {       
-              double disc = pow(c, 2) - 4 * b * d;
-              q1 = -c / (2 * b);
-              if (disc < 0) {
-                irootMax = -1;        // no roots
-                return;
-              }
-              else if (abs(disc) < EPS) {
-                irootMax = 0;       // 1 degenerate root
-                rc = q1;          // and here it is
-              }
-              else {
-                irootMax = 1;       // 2 roots
-                q2 = sqrt(disc) / (2 * b);
-                rc = q1 + q2;       // and here's the first
-              }
-            }
-            break;
-        
-          case 3:       // cubic equation, has 1, 2, or 3 roots
-            {
-              // Construct coefficients that give the roots from Cardano's formula.
-              double a2 = b / a;
-              double a1 = c / a;
-              double a0 = d / a;
-              
-              double Q = (3 * a1 - pow(a2, 2)) / 9;
-              double R = (9 * a2 * a1 - 27 * a0 - 2 * pow(a2, 3)) / 54;
-              double D = pow(Q, 3) + pow(R, 2);
-              U = -a2 / 3;
-              
-              // The number of roots depends on the value of D.
-              
-              if (D > 0) {
-                irootMax = 0;       // one root
-                double rD = sqrt(D);
-                S = CubeRoot(R + rD);
-                double T = CubeRoot(R - rD);
-                rc = U + S + T;       // and here it is.
-              }
-              else if (abs(D) < EPS) {
-                irootMax = 1;       // two roots
-                S = pow(R, 1./3);
-                rc = U + 2 * S;       // here's the first
-              }
-              else { // D < 0
-                irootMax = 2;       // three roots
-                double rD = sqrt(-D);
-                double phi = atan2(rD, R) / 3;
-                double rS = pow(pow(R, 2) - D, 1./6);
-                Sr = rS * cos(phi);
-                Si = rS * sin(phi);
-                rc = U + 2 * Sr;      // here's the first
-              }
-            }
-            break;  // end of case 3 of order
-          }
-      }   
-      break;  // end of case 0 of iroot
-    // for the other two roots, we'll rely on the fact that the coefficients
-    // of the equation and first root have already been constructed.
-    case 1: // of iroot, meaning we're looking for the second root
-    
-      if (irootMax < 1) return;
-      switch(order) {
-        case 2:
-          rc = q1 - q2;   // second root of a quadratic
-          break;
-        
-        case 3:         // second root of a cubic
-          if (irootMax == 1)
-            rc = U - S;
-          else // irootMax == 2
-            rc = U - Sr - sqrt(3.) * Si;
-          break;
-      };
-      break;  // end of case 1 of iroot
-    
-    case 2: // of iroot, meaning we're looking for the third root
-    
-      if (irootMax < 2) return;
-      switch(order) {
-        case 3:         // third root of a cubic
-          rc = U - Sr + sqrt(3.) * Si;
-          break;
-      };
-      break;  // end of case 2 of iroot
-      
-  };  // end of switch(iroot).
-  
-  // If we're here, rc contains a root of the equation, which must still be validated.
-  XYPt p1p = d1 * u1 + rc * u1p;          // image of p1 in fold line
-  
-  if (p1p == p1) return;              // we only consider p1 off of the fold line
-  
-  l.u = (p1p - p1).Normalize();         // normal to fold line
-  l.d = l.u.Dot(MidPoint(p1p, p1));       // d-parameter of fold line
-  XYPt p2p = p2 + 2 * (l.d - p2.Dot(l.u)) * l.u;  // image of p2 in fold line
-  
-  // Validate; the images of p1 and p2 must lie within the square.
-  if (!ReferenceFinder::sPaper.Encloses(p1p) || 
-    !ReferenceFinder::sPaper.Encloses(p2p)) return;
-  
-  // Validate visibility; we require that the alignment be visible even with
-  // opaque paper. Meaning that the moving parts must be edge points or edge
-  // lines.
-  
-  // Note whether p1 and p2 are on the same side of the fold line. If they are,
-  // then either both points move or both lines move. If they're not, then one
-  // of each moves.
-  
-  bool sameSide = ((p1.Dot(l.u) - l.d) * (p2.Dot(l.u) - l.d) >= 0);
-  
-  // Note which points and lines are on the edge of the paper
-  bool p1edge = rm1->IsOnEdge();
-  bool p2edge = rm2->IsOnEdge();
-  bool l1edge = rl1->IsOnEdge();
-  bool l2edge = rl2->IsOnEdge();
-  
-  // Now, check the visibility of this alignment and use it to specify which
-  // parts move
-  if (ReferenceFinder::sVisibilityMatters) {
-    if (sameSide)
-      if (p1edge && p2edge) mWhoMoves = WHOMOVES_P1P2;
-      else if (l1edge && l2edge) mWhoMoves = WHOMOVES_L1L2;
-      else return;
-    else
-      if (p1edge && l2edge) mWhoMoves = WHOMOVES_P1L2;
-      else if (p2edge && l1edge) mWhoMoves = WHOMOVES_P2L1;
-      else return;
+  // While we're building, there's a place for every object in the container.
+  if (!this->empty()) {
+    R*& ar = (*this)[i];
+    if (!ar) ar = MakeObject(i);
+    return ar;
   }
-  else {
-    if (sameSide) mWhoMoves = WHOMOVES_P1P2;
-    else mWhoMoves = WHOMOVES_P1L2;
-  };
-  
-  // If this line creates a skinny flap, we won't use it.
-  if (ReferenceFinder::sPaper.MakesSkinnyFlap(l)) return;
   
-  // Set the key.
-  FinishConstructor();
+  // Otherwise, we keep the ones that have been asked for.
+  R*& ar = made[i];
+  if (!ar) ar = MakeObject(i);
+  return ar;
 }
 
 
 /*****
-Return true if this line uses rb for immediate reference.
+Make the mark in row i by calling the constructor for its class with the refs
+it was originally made from, which gives exactly the same mark.
 *****/
-bool RefLine_P2L_P2L::UsesImmediate(RefBase* rb) const
+template <>
+RefMark* RefContainer<RefMark>::MakeObject(row_t i)
 {
-  return (rb == rl1 || rb == rm1 || rb == rl2 || rb == rm2);
+  RefContainer<RefLine>& lines = ReferenceFinder::sBasisLines;
+  row_t r0 = cols.mParents[0][i];   // rows of the refs it was made from
+  row_t r1 = cols.mParents[1][i];
+  RefMark* rm = 0;
+  switch (cols.mType[i]) {
+    case RefBase::REFTYPE_ORIGINAL:
+      rm = ReferenceFinder::sArena.New(RefMark_Original(cols.GetBare(i), 
+        cols.mRank[i], cols.mNames[cols.mAux[i]]));
+      break;
+    case RefBase::REFTYPE_INTERSECTION:
+      rm = ReferenceFinder::sArena.New(RefMark_Intersection(
+        lines.GetObject(r0), lines.GetObject(r1)));
+      break;
+  }
+  rm->mRow = i;
+  return rm;
 }
 
 
 /*****
-Build the folding sequence that constructs this object.
+Make the line in row i by calling the constructor for its class with the refs
+it was originally made from, which gives exactly the same line.
 *****/
-void RefLine_P2L_P2L::SequencePushSelf()
+template <>
+RefLine* RefContainer<RefLine>::MakeObject(row_t i)
 {
-  switch (mWhoMoves) {
-    case WHOMOVES_P1P2:
-      rl2->SequencePushSelf();
-      rl1->SequencePushSelf();
-      rm2->SequencePushSelf();
-      rm1->SequencePushSelf();
+  RefContainer<RefLine>& lines = *this;
+  RefContainer<RefMark>& marks = ReferenceFinder::sBasisMarks;
+  row_t r0 = cols.mParents[0][i];   // rows of the refs it was made from
+  row_t r1 = cols.mParents[1][i];
+  row_t r2 = cols.mParents[2][i];
+  row_t r3 = cols.mParents[3][i];
+  short iroot = cols.mAux[i];
+  RefLine* rl = 0;
+  switch (cols.mType[i]) {
+    case RefBase::REFTYPE_ORIGINAL:
+      rl = ReferenceFinder::sArena.New(RefLine_Original(cols.GetBare(i), 
+        cols.mRank[i], cols.mNames[cols.mAux[i]]));
       break;
-      
-    case WHOMOVES_L1L2:
-      rm2->SequencePushSelf();
-      rm1->SequencePushSelf();
-      rl2->SequencePushSelf();
-      rl1->SequencePushSelf();
+    case RefBase::REFTYPE_C2P_C2P:
+      rl = ReferenceFinder::sArena.New(RefLine_C2P_C2P(
+        marks.GetObject(r0), marks.GetObject(r1)));
       break;
-    
-    case WHOMOVES_P1L2:
-      rm2->SequencePushSelf();
-      rl1->SequencePushSelf();
-      rl2->SequencePushSelf();
-      rm1->SequencePushSelf();
+    case RefBase::REFTYPE_P2P:
+      rl = ReferenceFinder::sArena.New(RefLine_P2P(
+        marks.GetObject(r0), marks.GetObject(r1)));
       break;
-    
-    case WHOMOVES_P2L1:
-      rl2->SequencePushSelf();
-      rm1->SequencePushSelf();
-      rl1->SequencePushSelf();
-      rm2->SequencePushSelf();
+    case RefBase::REFTYPE_L2L:
+      rl = ReferenceFinder::sArena.New(RefLine_L2L(
+        lines.GetObject(r0), lines.GetObject(r1), iroot));
       break;
-  };
-  RefBase::SequencePushSelf();
+    case RefBase::REFTYPE_L2L_C2P:
+      rl = ReferenceFinder::sArena.New(RefLine_L2L_C2P(
+        lines.GetObject(r0), marks.GetObject(r1)));
+      break;
+    case RefBase::REFTYPE_P2L_C2P:
+      rl = ReferenceFinder::sArena.New(RefLine_P2L_C2P(
+        marks.GetObject(r0), lines.GetObject(r1), marks.GetObject(r2), iroot));
+      break;
+    case RefBase::REFTYPE_P2L_P2L:
+      rl = ReferenceFinder::sArena.New(RefLine_P2L_P2L(
+        marks.GetObject(r0), lines.GetObject(r1), marks.GetObject(r2), 
+        lines.GetObject(r3), iroot));
+      break;
+    case RefBase::REFTYPE_L2L_P2L:
+      rl = ReferenceFinder::sArena.New(RefLine_L2L_P2L(
+        lines.GetObject(r0), marks.GetObject(r1), lines.GetObject(r2)));
+      break;
+  }
+  rl->mRow = i;
+  return rl;
 }
 
 
+/**********
+class RefSnapshot - a database snapshot file mapped into memory
+**********/
+
 /*****
-Put the name of this line to a stream.
+Constructor
 *****/
-bool RefLine_P2L_P2L::PutHowto(ostream& os) const
+RefSnapshot::RefSnapshot() : 
+  mData(0), 
+  mSize(0), 
+  mFile(0), 
+  mMapping(0)
 {
-  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[06] ";
-  os.precision(2);
-  os.setf(ios_base::fixed, ios_base::floatfield);
-  os << "Bring ";
-  switch (mWhoMoves) {
-    case WHOMOVES_P1P2:
-      rm1->PutName(os);
-      os << " to ";
-      rl1->PutName(os);
-      if (ReferenceFinder::sClarifyVerbalAmbiguities)
-        os << " at point " << l.Fold(rm1->p).Chop();
-      os << " and ";
-      rm2->PutName(os);
-      os << " to ";
-      rl2->PutName(os);
-      break;
-    
-    case WHOMOVES_L1L2:
-      rl1->PutName(os);
-      if (ReferenceFinder::sClarifyVerbalAmbiguities)
-        os << " so that point " << l.Fold(rm1->p).Chop();
-      os << " touches ";
-      rm1->PutName(os);
-      os << " and ";
-      rl2->PutName(os);
-      os << " to ";
-      rm2->PutName(os);
-      break;
-    
-    case WHOMOVES_P1L2:
-      rm1->PutName(os);
-      os << " to ";
-      rl1->PutName(os);
-      if (ReferenceFinder::sClarifyVerbalAmbiguities)
-        os << " at point " << l.Fold(rm1->p).Chop();
-      os << " and ";
-      rl2->PutName(os);
-      os << " to ";
-      rm2->PutName(os);
-      break;
-    
-    case WHOMOVES_P2L1:
-      rl1->PutName(os);
-      os << " to ";
-      rm1->PutName(os);
-      os << " and ";
-      rm2->PutName(os);
-      os << " to ";
-      rl2->PutName(os);
-      if (ReferenceFinder::sClarifyVerbalAmbiguities)
-        os << " at point " << l.Fold(rm2->p).Chop();
-      break;
-  };
-  os << ", making ";
-  PutName(os);
+}
+
+
+/*****
+Destructor
+*****/
+RefSnapshot::~RefSnapshot()
+{
+  Close();
+}
+
+
+/*****
+Map the file at path read-only into memory. Return false if it doesn't exist, is
+empty, or can't be read.
+*****/
+bool RefSnapshot::Open(const string& path)
+{
+  Close();
+#if defined(_WIN32)
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, 
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+  if (file == INVALID_HANDLE_VALUE) return false;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0 || 
+    (unsigned long long)(size.QuadPart) > size_t(-1)) {
+    CloseHandle(file);
+    return false;
+  }
+  HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+  const void* data = 
+    mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : 0;
+  if (!data) {
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+  mFile = file;
+  mMapping = mapping;
+  mData = static_cast<const char*>(data);
+  mSize = size_t(size.QuadPart);
+#elif defined(RF_USE_MMAP)
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0 || 
+    (unsigned long long)(st.st_size) > size_t(-1)) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(0, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);    // the mapping keeps the file open
+  if (data == MAP_FAILED) return false;
+  mMapping = data;
+  mData = static_cast<const char*>(data);
+  mSize = size_t(st.st_size);
+#else
+  ifstream fin(path.c_str(), ios::in | ios::binary);
+  if (!fin.good()) return false;
+  fin.seekg(0, ios::end);
+  streamoff size = fin.tellg();
+  if (size <= 0) return false;
+  fin.seekg(0, ios::beg);
+  mBuffer.resize(size_t(size));
+  fin.read(&mBuffer[0], streamsize(size));
+  if (!fin.good()) {
+    vector<char>().swap(mBuffer);
+    return false;
+  }
+  mData = &mBuffer[0];
+  mSize = mBuffer.size();
+#endif
   return true;
 }
 
 
 /*****
-Draw this line, adding arrows if appropriate
+Unmap the file, if there is one. Nothing may still be using its contents.
 *****/
-void RefLine_P2L_P2L::DrawSelf(RefStyle rstyle, short ipass) const
+void RefSnapshot::Close()
 {
-  // Call inherited method to draw the lines
-  RefLine::DrawSelf(rstyle, ipass);
-  
-  // If we're moving, we need an arrow
-  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
-      
-        XYPt& p1a = rm1->p;
-        XYPt p1b = l.Fold(p1a);
-        XYPt& p2a = rm2->p;
-        XYPt p2b = l.Fold(p2a);
-    switch (mWhoMoves) {
-      case WHOMOVES_P1P2:
-        sDgmr->DrawFoldAndUnfoldArrow(p1a, p1b);
-        sDgmr->DrawFoldAndUnfoldArrow(p2a, p2b);
-        break;
-        
-      case WHOMOVES_L1L2:
-        sDgmr->DrawFoldAndUnfoldArrow(p1b, p1a);
-        sDgmr->DrawFoldAndUnfoldArrow(p2b, p2a);
-        break;
-      
-      case WHOMOVES_P1L2:
-        sDgmr->DrawFoldAndUnfoldArrow(p1a, p1b);
-        sDgmr->DrawFoldAndUnfoldArrow(p2b, p2a);
-        break;
-      
-      case WHOMOVES_P2L1:
-        sDgmr->DrawFoldAndUnfoldArrow(p1b, p1a);
-        sDgmr->DrawFoldAndUnfoldArrow(p2a, p2b);
-        break;
-    }
+#if defined(_WIN32)
+  if (mData) UnmapViewOfFile(mData);
+  if (mMapping) CloseHandle(HANDLE(mMapping));
+  if (mFile) CloseHandle(HANDLE(mFile));
+#elif defined(RF_USE_MMAP)
+  if (mMapping) munmap(mMapping, mSize);
+#endif
+  vector<char>().swap(mBuffer);
+  mData = 0;
+  mSize = 0;
+  mFile = 0;
+  mMapping = 0;
+}
+
+
+/*****
+Exchange files with another snapshot. Views of either stay valid.
+*****/
+void RefSnapshot::Swap(RefSnapshot& as)
+{
+  swap(mData, as.mData);
+  swap(mSize, as.mSize);
+  swap(mFile, as.mFile);
+  swap(mMapping, as.mMapping);
+  mBuffer.swap(as.mBuffer);
+}
+
+
+/**********
+class RefMarkGrid - a grid of cells over the marks in the database
+**********/
+
+/*****
+Constructor
+*****/
+RefMarkGrid::RefMarkGrid() : 
+  mLeft(0), 
+  mBottom(0), 
+  mCellWidth(1), 
+  mCellHeight(1), 
+  mNumX(0), 
+  mNumY(0)
+{
+}
+
+
+/*****
+Index the marks in cols. The grid just covers all of them, with cells that are
+close to square, and about 4 marks to a cell if they're spread out evenly.
+*****/
+void RefMarkGrid::Build(const RefColumns<RefMark>& cols)
+{
+  Clear();
+  size_t n = cols.size();
+  if (n == 0) return;
+  double left = cols.mX[0];
+  double right = left;
+  double bottom = cols.mY[0];
+  double top = bottom;
+  for (size_t i = 1; i < n; i++) {
+    left = min(left, cols.mX[i]);
+    right = max(right, cols.mX[i]);
+    bottom = min(bottom, cols.mY[i]);
+    top = max(top, cols.mY[i]);
   }
+  double width = max(right - left, EPS);
+  double height = max(top - bottom, EPS);
+  double numCells = max(double(n) / 4, 1.0);
+  mLeft = left;
+  mBottom = bottom;
+  mNumX = int(min(ceil(sqrt(numCells * width / height)), numCells));
+  mNumY = int(min(ceil(sqrt(numCells * height / width)), numCells));
+  mNumX = max(mNumX, 1);
+  mNumY = max(mNumY, 1);
+  mCellWidth = width / mNumX;
+  mCellHeight = height / mNumY;
+  
+  // Count the marks in each cell, then sort their rows by cell.
+  vector<row_t> cellOf(n);
+  mCellStart.assign(size_t(mNumX) * size_t(mNumY) + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    int ix, iy;
+    GetCell(cols.GetBare(row_t(i)), ix, iy);
+    cellOf[i] = row_t(iy * mNumX + ix);
+    mCellStart[cellOf[i] + 1]++;
+  }
+  for (size_t c = 1; c < mCellStart.size(); c++) 
+    mCellStart[c] += mCellStart[c - 1];
+  vector<row_t> next(mCellStart.begin(), mCellStart.end() - 1);
+  mRows.resize(n);
+  for (size_t i = 0; i < n; i++) mRows[next[cellOf[i]]++] = row_t(i);
 }
 
 
 /*****
-Go through existing lines and marks and create RefLine_P2L_P2Ls with rank equal
-arank up to a cumulative total of sMaxLines.
+Forget all of the marks.
 *****/
-void RefLine_P2L_P2L::MakeAll(rank_t arank)
+void RefMarkGrid::Clear()
 {
-  // psrank == sum of ranks of the two points
-  // lsrank == sum of ranks of the two lines
-  for (rank_t psrank = 0; psrank <= (arank - 1); psrank++)
-    for (rank_t lsrank = 0; lsrank <= (arank - 1) - psrank; lsrank++)
-
-      // point order doesn't matter, so rank(pt[i]) will always be <= rank(pt[j])
-      for (rank_t irank = 0; irank <= psrank / 2; irank++) {
-        rank_t jrank = psrank - irank;
-        bool psameRank = (irank == jrank);
-        
-        // line order does matter, so both lines vary over all ranks
-        for (rank_t krank = 0; krank <= lsrank; krank++)
-          for (rank_t lrank = 0; lrank <= lsrank - krank; lrank++) {
-    
-            // iterate over all combinations of points & lines with given rank
-            RefContainer<RefMark>::rank_iterator mi = 
-              ReferenceFinder::sBasisMarks.maps[irank].begin();
-            if (psameRank) mi++;
-            while (mi != ReferenceFinder::sBasisMarks.maps[irank].end()) {
-              RefContainer<RefMark>::rank_iterator mj = 
-                ReferenceFinder::sBasisMarks.maps[jrank].begin();
-              while (mj != (psameRank ? mi : 
-                ReferenceFinder::sBasisMarks.maps[jrank].end())) {
-                RefContainer<RefLine>::rank_iterator lk = 
-                  ReferenceFinder::sBasisLines.maps[krank].begin();
-                while (lk != ReferenceFinder::sBasisLines.maps[krank].end()) {
-                  RefContainer<RefLine>::rank_iterator ll = 
-                    ReferenceFinder::sBasisLines.maps[lrank].begin();
-                  while (ll != ReferenceFinder::sBasisLines.maps[lrank].end()) {
-                    if ((krank != lrank) || (lk != ll)) {   // cmpr iterators only if same container
-                      if (ReferenceFinder::GetNumLines() >= 
-                        ReferenceFinder::sMaxLines) return;
-                      RefLine_P2L_P2L rlp0(mi->second, lk->second, 
-                        mj->second, ll->second, 0);
-                      ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(
-                        rlp0);
-                      if (ReferenceFinder::GetNumLines() >= 
-                        ReferenceFinder::sMaxLines) return;
-                      RefLine_P2L_P2L rlp1(mi->second, lk->second, 
-                        mj->second, ll->second, 1);
-                      ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(
-                        rlp1);
-                      if (ReferenceFinder::GetNumLines() >= 
-                        ReferenceFinder::sMaxLines) return;
-                      RefLine_P2L_P2L rlp2(mi->second, lk->second, 
-                        mj->second, ll->second, 2);
-                      ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(
-                        rlp2);
-                    };
-                    ll++;
-                  };
-                  lk++;
-                };
-                mj++;
-              };
-              mi++;
-            }
-          }
-        }
+  vector<row_t>().swap(mCellStart);
+  vector<row_t>().swap(mRows);
+  mNumX = mNumY = 0;
 }
 
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
+/*****
+Find the cell that contains point ap, or the nearest one if ap lies outside of
+the grid.
+*****/
+void RefMarkGrid::GetCell(const XYPt& ap, int& ix, int& iy) const
+{
+  double fx = floor((ap.x - mLeft) / mCellWidth);
+  double fy = floor((ap.y - mBottom) / mCellHeight);
+  ix = int(max(0.0, min(fx, double(mNumX - 1))));
+  iy = int(max(0.0, min(fy, double(mNumY - 1))));
+}
 
 
-/**********
-class RefLine_L2L_P2L - Huzita-Hatori Axiom O7 (Hatori's Axiom).
-Bring line l1 onto itself so that point p1 falls on line l2.
-**********/
+/*****
+Return the number of rings of cells around cell (ix, iy), counting the cell
+itself as ring 0, that it takes to cover the whole grid.
+*****/
+int RefMarkGrid::GetNumRings(int ix, int iy) const
+{
+  return 1 + max(max(ix, mNumX - 1 - ix), max(iy, mNumY - 1 - iy));
+}
+
 
 /*****
-Constructor. iroot can be 0 or 1.
+Return a lower bound on the distance from ap to any mark that lies outside of
+the first k rings of cells around cell (ix, iy).
 *****/
-RefLine_L2L_P2L::RefLine_L2L_P2L(RefLine* arl1, RefMark* arm1, RefLine* arl2) :
-  RefLine(CalcLineRank(arl1, arm1, arl2)), rl1(arl1), rm1(arm1), rl2(arl2)
+double RefMarkGrid::GetDistanceBeyond(const XYPt& ap, int ix, int iy, 
+  int k) const
 {
-  // Get references
-  XYLine& l1 = rl1->l;
-  XYPt& u1 = l1.u;
-  double& d1 = l1.d;
-  XYPt& p1 = rm1->p;
-  XYLine& l2 = rl2->l;
-  XYPt& u2 = l2.u;
-  
-  // Construct direction vector and distance scalar
-  l.u = u2.Rotate90();
-  
-  double uf1 = l.u.Dot(u1);
-  if (abs(uf1) < EPS) return; // parallel lines, no solution
-  
-  l.d = (d1 + 2 * p1.Dot(l.u) * uf1 - p1.Dot(u1)) / (2 * uf1);
-  
-  // Make sure point of intersection of fold with l2 lies within the paper.
-  XYPt pt = Intersection(l, l2);
-  if (!ReferenceFinder::sPaper.Encloses(pt)) return;
-  
-  // Make sure point of incidence of p1 on l1 lies within the paper.
-  XYPt p1p = l.Fold(p1);
-  if (!ReferenceFinder::sPaper.Encloses(p1p)) return;
+  double d = numeric_limits<double>::max();
+  if (ix - k > 0) d = min(d, ap.x - (mLeft + (ix - k) * mCellWidth));
+  if (ix + k < mNumX - 1) d = min(d, mLeft + (ix + k + 1) * mCellWidth - ap.x);
+  if (iy - k > 0) d = min(d, ap.y - (mBottom + (iy - k) * mCellHeight));
+  if (iy + k < mNumY - 1) 
+    d = min(d, mBottom + (iy + k + 1) * mCellHeight - ap.y);
   
-  // Make sure p1 isn't already on l1 (in which case the alignment is ill-defined).
-  if (l1.Intersects(p1)) return;
+  // A mark right on the edge of a cell could have been rounded into the cell
+  // on either side, so leave a little slack.
+  return d - 1.0e-9 * (mCellWidth + mCellHeight);
+}
+
+
+/*****
+Return a lower bound on the distance from line al to any mark in cell (ix, iy):
+zero if al crosses the cell, otherwise the distance to its nearest corner.
+*****/
+double RefMarkGrid::GetDistanceBound(int ix, int iy, const XYLine& al) const
+{
+  double x0 = mLeft + ix * mCellWidth;
+  double y0 = mBottom + iy * mCellHeight;
+  double dx = al.u.x * mCellWidth;
+  double dy = al.u.y * mCellHeight;
+  double d = al.u.x * x0 + al.u.y * y0 - al.d;
+  double dmin = d + min(dx, 0.0) + min(dy, 0.0);
+  double dmax = d + max(dx, 0.0) + max(dy, 0.0);
+  double bound = (dmin > 0) ? dmin : ((dmax < 0) ? -dmax : 0);
   
-  // Check visibility.
-  bool p1edge = arm1->IsOnEdge();
-  bool l1edge = arl1->IsOnEdge();
+  // Leave the same slack as GetDistanceBeyond() for marks on a cell's edge.
+  return bound - 1.0e-9 * (mCellWidth + mCellHeight);
+}
+
+
+/*****
+Put the range of cells in row iy that could hold a mark within awidth of line
+al into ixmin through ixmax; if there aren't any, ixmin > ixmax. Walking the
+rows this way visits the cells of a strip along al without looking at the rest
+of the grid.
+*****/
+void RefMarkGrid::GetStripCells(int iy, const XYLine& al, double awidth, 
+  int& ixmin, int& ixmax) const
+{
+  // Leave the same slack as GetDistanceBeyond() for marks on a cell's edge.
+  double w = awidth + 1.0e-9 * (mCellWidth + mCellHeight);
   
-  if (ReferenceFinder::sVisibilityMatters) {
-    XYPt lp1, lp2;
-    ReferenceFinder::sPaper.ClipLine(l, lp1, lp2);
-    double t1 = (lp1 - pt).Dot(l.u);
-    double t2 = (lp2 - pt).Dot(l.u);
-    double tp = (p1 - pt).Dot(l.u);
-    if ((t1 * tp) < 0) {
-      double ti = t2;
-      t2 = t1;
-      t1 = ti;
-    };  // now t1 is the parameter for the endpoint on the p1 side of l2.
-    if (p1edge && (abs(t1) <= abs(t2))) mWhoMoves = WHOMOVES_P1;
-    else if (l1edge && (abs(t1) >= abs(t2))) mWhoMoves = WHOMOVES_L1;
-    else return;
+  // A mark (x, y) in the row is within w of al if u.x * x lies between lo and
+  // hi for some y in the row.
+  double y0 = mBottom + iy * mCellHeight;
+  double c0 = min(al.u.y * y0, al.u.y * (y0 + mCellHeight)) - al.d;
+  double c1 = max(al.u.y * y0, al.u.y * (y0 + mCellHeight)) - al.d;
+  double lo = -w - c1;
+  double hi = w - c0;
+  ixmin = 0;
+  ixmax = mNumX - 1;
+  if (abs(al.u.x) < EPS) {
+    // al runs along the row, so it takes in all of the row or none of it.
+    double ux0 = al.u.x * mLeft;
+    double ux1 = al.u.x * (mLeft + mNumX * mCellWidth);
+    if (max(ux0, ux1) < lo || min(ux0, ux1) > hi) ixmin = mNumX;
+    return;
   }
-  else {
-    mWhoMoves = WHOMOVES_P1;
-  };
-    
-  // If this line creates a skinny flap, we won't use it.
-  if (ReferenceFinder::sPaper.MakesSkinnyFlap(l)) return;  
-  
-  // Set the key.
-  FinishConstructor();
+  double x0 = lo / al.u.x;
+  double x1 = hi / al.u.x;
+  if (x0 > x1) swap(x0, x1);
+  
+  // Marks on the far edge of the grid are counted in its last cell.
+  double fx0 = floor((x0 - mLeft) / mCellWidth);
+  double fx1 = floor((x1 - mLeft) / mCellWidth);
+  if (fx1 < 0 || fx0 > mNumX) {
+    ixmin = mNumX;
+    return;
+  }
+  ixmin = int(max(0.0, fx0));
+  ixmax = int(min(double(mNumX - 1), fx1));
 }
 
 
+/**********
+class RefLineIndex - buckets of lines, by angle and distance from the origin
+**********/
+
 /*****
-Return true if this line uses rb for immediate reference.
+Constructor
 *****/
-bool RefLine_L2L_P2L::UsesImmediate(RefBase* rb) const
+RefLineIndex::RefLineIndex()
 {
-  return (rb == rl1 || rb == rm1 || rb == rl2);
 }
 
 
 /*****
-Build the folding sequence that constructs this object.
+Index the lines in cols. The buckets are the non-empty cells of a grid over
+angle and distance, with about 64 lines to a cell if they're spread out evenly.
+Both errors change about as much with the angle in radians as with the
+distance, so the cells are close to square in those units.
 *****/
-void RefLine_L2L_P2L::SequencePushSelf()
+void RefLineIndex::Build(const RefColumns<RefLine>& cols)
 {
-  switch (mWhoMoves) {
-    case WHOMOVES_P1:
-      rl1->SequencePushSelf();
-      rm1->SequencePushSelf();
-      break;
-
-    case WHOMOVES_L1:
-      rm1->SequencePushSelf();
-      rl1->SequencePushSelf();
-      break;
-  };
-  rl2->SequencePushSelf(); 
-  RefBase::SequencePushSelf();
+  Clear();
+  size_t n = cols.size();
+  if (n == 0) return;
+  const double pi = 3.14159265358979323;
+  double dmax = EPS;
+  for (size_t i = 0; i < n; i++) dmax = max(dmax, cols.mD[i]);
+  double numCells = max(double(n) / 64, 1.0);
+  int numA = int(max(ceil(sqrt(numCells * 2 * pi / dmax)), 1.0));
+  int numD = int(max(ceil(sqrt(numCells * dmax / (2 * pi))), 1.0));
+  
+  // Count the lines in each cell, then sort their rows by cell.
+  vector<row_t> cellOf(n);
+  vector<double> angleOf(n);
+  vector<row_t> cellStart(size_t(numA) * size_t(numD) + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    angleOf[i] = atan2(cols.mUy[i], cols.mUx[i]);
+    double fa = (angleOf[i] + pi) / (2 * pi);
+    double fd = cols.mD[i] / dmax;
+    int ia = max(0, min(int(floor(fa * numA)), numA - 1));
+    int id = max(0, min(int(floor(fd * numD)), numD - 1));
+    cellOf[i] = row_t(ia * numD + id);
+    cellStart[cellOf[i] + 1]++;
+  }
+  for (size_t c = 1; c < cellStart.size(); c++) 
+    cellStart[c] += cellStart[c - 1];
+  vector<row_t> next(cellStart.begin(), cellStart.end() - 1);
+  mRows.resize(n);
+  for (size_t i = 0; i < n; i++) mRows[next[cellOf[i]]++] = row_t(i);
+  
+  // Each cell with any lines in it becomes a bucket.
+  for (size_t c = 0; c + 1 < cellStart.size(); c++) {
+    if (cellStart[c] == cellStart[c + 1]) continue;
+    mBucketStart.push_back(cellStart[c]);
+    for (row_t j = cellStart[c]; j < cellStart[c + 1]; j++) {
+      row_t i = mRows[j];
+      XYLine l = cols.GetBare(i);
+      double angle = angleOf[i];
+      if (j == cellStart[c]) {
+        mBuckets.push_back(Bucket(angle, l, cols.GetEnd1(i), cols.GetEnd2(i)));
+        continue;
+      }
+      Bucket& b = mBuckets.back();
+      if (b.mMinAngle > angle) {
+        b.mMinAngle = angle;
+        b.mMinU = l.u;
+      }
+      if (b.mMaxAngle < angle) {
+        b.mMaxAngle = angle;
+        b.mMaxU = l.u;
+      }
+      b.mMinD = min(b.mMinD, l.d);
+      b.mMaxD = max(b.mMaxD, l.d);
+      b.mEnds1.Include(cols.GetEnd1(i));
+      b.mEnds2.Include(cols.GetEnd2(i));
+    }
+  }
+  mBucketStart.push_back(row_t(n));
 }
-      
+
 
 /*****
-Put the name of this line to a stream.
+Forget all of the lines.
 *****/
-bool RefLine_L2L_P2L::PutHowto(ostream& os) const
+void RefLineIndex::Clear()
 {
-  if (ReferenceFinder::sAxiomsInVerbalDirections) os << "[07] ";
-  os << "Bring ";
-  rl2->PutName(os);
-  os << " onto itself so that ";
-  switch (mWhoMoves) {
-    case WHOMOVES_P1:
-      rm1->PutName(os);
-      os << " touches ";
-      rl1->PutName(os);
-      break;
-    
-    case WHOMOVES_L1:
-      rl1->PutName(os);
-      os << " touches ";
-      rm1->PutName(os);
-      break;
-  };
-  os << ", making ";
-  PutName(os);
-  return true;
+  vector<Bucket>().swap(mBuckets);
+  vector<row_t>().swap(mBucketStart);
+  vector<row_t>().swap(mRows);
 }
 
 
 /*****
-Draw this line, adding arrows if appropriate
+Return a lower bound on the Pythagorean error between line al, whose normal
+has angle aangle, and any line in bucket i. The error is the square root of
+sin(a)^2 + (d - al.d * cos(a))^2, where a is the angle between the two normals
+and d is the distance of the line in the bucket, so we find the smallest that
+each term could be over the ranges of a and d.
 *****/
-void RefLine_L2L_P2L::DrawSelf(RefStyle rstyle, short ipass) const
+double RefLineIndex::GetLowerBound(size_t i, const XYLine& al, 
+  double aangle) const
 {
-  // Call inherited method to draw the lines
-  RefLine::DrawSelf(rstyle, ipass);
+  const double pi = 3.14159265358979323;
+  const Bucket& b = mBuckets[i];
+  double a0 = b.mMinAngle - aangle;
+  double a1 = b.mMaxAngle - aangle;
   
-  // If we're moving, we need an arrow
-  if ((ipass == PASS_ARROWS) && (rstyle == REFSTYLE_ACTION)) {
-      
-    // Draw line-to-itself arrow
-    XYPt p1, p2;
-    XYLine& l2 = rl2->l;
-    ReferenceFinder::sPaper.ClipLine(l2, p1, p2);  // get endpts of the reference line
-    XYPt pi = Intersection(l, l2);          // intersection w/ fold line
-    XYPt u1p = l2.u.Rotate90();           // tangent to reference line
-    double t1 = abs((p1 - pi).Dot(u1p));
-    double t2 = abs((p2 - pi).Dot(u1p));
-    double tmin = t1 < t2 ? t1 : t2;
-    sDgmr->DrawFoldAndUnfoldArrow(pi + tmin * u1p, pi - tmin * u1p);
-    
-    // Draw point-to-line arrow
-    XYPt& p3 = rm1->p;
-    XYPt p3p = l.Fold(p3);
-    switch(mWhoMoves) {
-      case WHOMOVES_P1:
-        sDgmr->DrawFoldAndUnfoldArrow(p3, p3p);
-        break;
-      case WHOMOVES_L1:
-        sDgmr->DrawFoldAndUnfoldArrow(p3p, p3);
-        break;
-    }
-  }
+  // The sines and cosines of a at the ends of its range, from the ones we
+  // saved for the bucket.
+  double s0 = b.mMinU.y * al.u.x - b.mMinU.x * al.u.y;
+  double c0 = b.mMinU.x * al.u.x + b.mMinU.y * al.u.y;
+  double s1 = b.mMaxU.y * al.u.x - b.mMaxU.x * al.u.y;
+  double c1 = b.mMaxU.x * al.u.x + b.mMaxU.y * al.u.y;
+  
+  // Between its extremes, each function is monotonic, so unless the range of
+  // angles takes in one of the extremes, the ends of the range are the limits.
+  double s2min = 0;
+  if (floor(a1 / pi) < ceil(a0 / pi)) s2min = min(s0 * s0, s1 * s1);
+  double cmax = 1;
+  if (floor(a1 / (2 * pi)) < ceil(a0 / (2 * pi))) cmax = max(c0, c1);
+  double cmin = -1;
+  if (floor((a1 - pi) / (2 * pi)) < ceil((a0 - pi) / (2 * pi))) 
+    cmin = min(c0, c1);
+  double t0 = al.d * (al.d >= 0 ? cmin : cmax);
+  double t1 = al.d * (al.d >= 0 ? cmax : cmin);
+  double gap = max(0.0, max(b.mMinD - t1, t0 - b.mMaxD));
+  
+  // The angles aren't exact, so leave a little slack.
+  return sqrt(s2min + gap * gap) - 1.0e-9;
 }
 
 
 /*****
-Go through existing lines and marks and create RefLine_L2L_P2Ls with rank equal
-arank up to a cumulative total of sMaxLines.
+Return the distance from ap to the nearest point of rectangle ar.
 *****/
-void RefLine_L2L_P2L::MakeAll(rank_t arank)
+static double DistanceToRect(const XYRect& ar, const XYPt& ap)
 {
-  for (rank_t irank = 0; irank <= (arank - 1); irank++)
-    for (rank_t jrank = 0; jrank <= (arank - 1 - irank); jrank++) {
-      rank_t krank = arank - irank - jrank - 1;
-      RefContainer<RefLine>::rank_iterator li = 
-        ReferenceFinder::sBasisLines.maps[irank].begin();
-      while (li != ReferenceFinder::sBasisLines.maps[irank].end()) {
-        RefContainer<RefMark>::rank_iterator mj = 
-          ReferenceFinder::sBasisMarks.maps[jrank].begin();
-        while (mj != ReferenceFinder::sBasisMarks.maps[jrank].end()) {
-          RefContainer<RefLine>::rank_iterator lk = 
-            ReferenceFinder::sBasisLines.maps[krank].begin();
-          while (lk != ReferenceFinder::sBasisLines.maps[krank].end()) {
-            if ((irank != krank) || (li != lk)) {
-              if (ReferenceFinder::GetNumLines() >= 
-                ReferenceFinder::sMaxLines) return;
-              RefLine_L2L_P2L rlh1(li->second, mj->second, lk->second);
-              ReferenceFinder::sBasisLines.AddCopyIfValidAndUnique(rlh1);
-            };
-            lk++;
-          };
-          mj++;
-        };
-        li++;
-      }
-    }
+  double dx = max(0.0, max(ar.bl.x - ap.x, ap.x - ar.tr.x));
+  double dy = max(0.0, max(ar.bl.y - ap.y, ap.y - ar.tr.y));
+  return XYPt(dx, dy).Mag();
 }
 
 
-#ifdef __MWERKS__
-#pragma mark -
-#endif
+/*****
+Return a lower bound on the worst-case error between a line whose endpoints on
+the paper are apa and apb and any line in bucket i. Each endpoint of a line in
+the bucket is at least as far away as the box it lies in.
+*****/
+double RefLineIndex::GetLowerBound(size_t i, const XYPt& apa, 
+  const XYPt& apb) const
+{
+  const Bucket& b = mBuckets[i];
+  double err1 = max_val(DistanceToRect(b.mEnds1, apa), 
+    DistanceToRect(b.mEnds2, apb));
+  double err2 = max_val(DistanceToRect(b.mEnds1, apb), 
+    DistanceToRect(b.mEnds2, apa));
+  return min_val(err1, err2);
+}
 
 
-/******************************************************************************
-Section 3: containers for collections of marks and lines These containers are
-templated on the object type; we use the same type for both RefMarks and
-RefLines.
-******************************************************************************/
+/*****
+Return a lower bound on the distance from point ap, which is at angle aangle
+from the origin, to any line in bucket i. A line whose normal is at angle a is
+|ap.Mag() * cos(a - aangle) - d| away, and we bound the cosine the same way as
+for the Pythagorean error.
+*****/
+double RefLineIndex::GetDistanceBound(size_t i, const XYPt& ap, 
+  double aangle) const
+{
+  const double pi = 3.14159265358979323;
+  const Bucket& b = mBuckets[i];
+  double a0 = b.mMinAngle - aangle;
+  double a1 = b.mMaxAngle - aangle;
+  double r = ap.Mag();
+  double t0 = b.mMinU.Dot(ap);
+  double t1 = b.mMaxU.Dot(ap);
+  double tmax = r;
+  if (floor(a1 / (2 * pi)) < ceil(a0 / (2 * pi))) tmax = max(t0, t1);
+  double tmin = -r;
+  if (floor((a1 - pi) / (2 * pi)) < ceil((a0 - pi) / (2 * pi))) 
+    tmin = min(t0, t1);
+  double gap = max(0.0, max(b.mMinD - tmax, tmin - b.mMaxD));
+  
+  // The angles aren't exact, so leave a little slack.
+  return gap - 1.0e-9;
+}
+
 
 /**********
-class RefContainer - a container for storing RefMark* and RefLine* that
-organizes them by rank and within a rank, uses a map<R*> to store them. The
-mKey member variable is used as the key in the map; only one object is stored
-per key. class R = RefMark or RefLine
+class RefQueryCache - the results of recent searches, by target
 **********/
 
+const size_t RefQueryCache::NONE;
+
+
 /*****
-Constructor. Initialize arrays.
+Return true if two queries would get the same results.
 *****/
-template <class R>
-RefContainer<R>::RefContainer() : rcsz(0), rcbz(0)
+bool RefQueryCache::Query::operator==(const Query& aq) const
 {
-  // expand our map array to hold all the ranks that we will create
-  maps.resize(1 + ReferenceFinder::sMaxRank);
+  return mType == aq.mType && mCoords[0] == aq.mCoords[0] && 
+    mCoords[1] == aq.mCoords[1] && mNumRefs == aq.mNumRefs && 
+    mWorstCase == aq.mWorstCase && mGoodEnough == aq.mGoodEnough && 
+    mGeneration == aq.mGeneration;
 }
 
 
 /*****
-Check the validity and uniqueness of object ars of type Rs (descended from type
-R), and if it passes, add it to the container. Used by all the MakeAll()
-functions. Note that we use the default (compiler-generated) copy constructor,
-which is OK since our objects only contain POD, pointers that we WANT
-blind-copied, and/or strings (which know how to copy themselves).
+Return a hash of the target of the query; queries for the same target with
+different settings are rare enough to share a bucket.
 *****/
-template <class R>
-template <class Rs>
-void RefContainer<R>::AddCopyIfValidAndUnique(const Rs& ars)
+size_t RefQueryCache::Query::Hash() const
 {
-  // The ref is valid (fully constructed) if its key is something other than 0.
-  // It's unique if the container doesn't already have one with the same key in
-  // one of the rank maps.
-  if (ars.mKey != 0 && !Contains(&ars)) Add(new Rs(ars));
-  ReferenceFinder::CheckDatabaseStatus();  // report progress if appropriate
+  unsigned long long h = (unsigned long long)(mCoords[0]) * 
+    0x9E3779B97F4A7C15ULL;
+  h = (h ^ (unsigned long long)(mCoords[1])) * 0xC2B2AE3D27D4EB4FULL;
+  h = (h ^ (unsigned long long)(2 * mNumRefs + mType)) * 0x9E3779B97F4A7C15ULL;
+  return size_t(h ^ (h >> 32));
+}
+
+
+/*****
+Constructor
+*****/
+RefQueryCache::RefQueryCache() : 
+  mCapacity(0), 
+  mNewest(NONE), 
+  mOldest(NONE), 
+  mGeneration(0), 
+  mNumHits(0), 
+  mNumMisses(0)
+{
+}
 
+
+/*****
+Keep the results of no more than acapacity queries, forgetting all of them if
+that's a change.
+*****/
+void RefQueryCache::SetCapacity(size_t acapacity)
+{
+  if (acapacity == mCapacity) return;
+  mCapacity = acapacity;
+  Clear();
 }
 
 
 /*****
-Rebuild all arrays and related counters.
+Forget all of the results. The hits and misses keep counting.
 *****/
-template <class R>
-void RefContainer<R>::Rebuild()
+void RefQueryCache::Clear()
 {
-  rcsz = 0;
-  rcbz = 0;
-  this->resize(0);
-  maps.resize(0);
-  maps.resize(1 + ReferenceFinder::sMaxRank);
+  vector<Entry>().swap(mEntries);
+  size_t numBuckets = 1;
+  while (numBuckets < 2 * mCapacity) numBuckets *= 2;
+  mBuckets.assign(mCapacity > 0 ? numBuckets : 0, NONE);
+  mNewest = mOldest = NONE;
 }
 
 
 /*****
-Return true if the container (or the buffer) contain an equivalent object.
+Return the results of query aq, or null if they're not in the cache. Results
+from any other generation of the database are thrown out first.
 *****/
-template <class R>
-bool RefContainer<R>::Contains(const R* ar) const
+const vector<RefBase*>* RefQueryCache::Find(const Query& aq)
 {
-  // go through each rank and look for an object with the same key. If we find one,
-  // return true.
-  for (size_t ir = 0; ir < maps.size(); ir++) {
-    if (maps[ir].count(ar->mKey)) return true;
+  if (mCapacity == 0) return 0;
+  if (aq.mGeneration != mGeneration) {
+    Clear();
+    mGeneration = aq.mGeneration;
   }
-  
-  // Also check the buffer.
-  if (buffer.count(ar->mKey)) return true;
-  
-  // Still here? then we didn't find it.
-  return false;
+  size_t b = aq.Hash() & (mBuckets.size() - 1);
+  for (size_t i = mBuckets[b]; i != NONE; i = mEntries[i].mNext) {
+    if (!(mEntries[i].mQuery == aq)) continue;
+    Unlink(i);
+    LinkNewest(i);
+    mNumHits++;
+    return &mEntries[i].mRefs;
+  }
+  mNumMisses++;
+  return 0;
 }
 
 
 /*****
-Add an element to the array; to be called only if an equivalent element isn't
-already present anywhere. To avoid corrupting iterators, we add the new element
-to the buffer; it will get added to the main container on the next call to
-FlushBuffer().
+Keep arefs as the results of query aq, making room by forgetting the least
+recently used results if the cache is full.
 *****/
-template<class R>
-void RefContainer<R>::Add(R* ar)
+void RefQueryCache::Insert(const Query& aq, const vector<RefBase*>& arefs)
 {
-  // Add it to the buffer and increment the buffer size.
-  buffer.insert(typename map_t::value_type(ar->mKey, ar));
-  rcbz++;
+  if (mCapacity == 0) return;
+  if (aq.mGeneration != mGeneration) {
+    Clear();
+    mGeneration = aq.mGeneration;
+  }
+  size_t mask = mBuckets.size() - 1;
+  size_t i;
+  if (mEntries.size() < mCapacity) {
+    i = mEntries.size();
+    mEntries.push_back(Entry());
+  }
+  else {
+    // Take the oldest entry out of its bucket and reuse it.
+    i = mOldest;
+    Unlink(i);
+    size_t* pi = &mBuckets[mEntries[i].mQuery.Hash() & mask];
+    while (*pi != i) pi = &mEntries[*pi].mNext;
+    *pi = mEntries[i].mNext;
+  }
+  Entry& e = mEntries[i];
+  e.mQuery = aq;
+  e.mRefs = arefs;
+  size_t b = aq.Hash() & mask;
+  e.mNext = mBuckets[b];
+  mBuckets[b] = i;
+  LinkNewest(i);
 }
 
 
 /*****
-Put the contents of the buffer into the main container.
+Take entry i out of the order of use.
 *****/
-template <class R>
-void RefContainer<R>::FlushBuffer()
+void RefQueryCache::Unlink(size_t i)
 {
-  // Make room for the buffer in the sortable list.
-  
-  reserve(this->size() + rcbz);
-  
-  // Go through the buffer and add each element to the appropriate rank in the main container.
-  
-  rank_iterator bi = buffer.begin();
-  while (bi != buffer.end()) {
-    R*& rr = bi->second;        // get pointer to each new element
-    maps[rr->mRank].insert(*bi);    // add to the map of the appropriate rank
-    push_back(rr);            // also add to our sortable list
-    rcsz++;               // increment our size counter
-    bi++;               // increment the buffer iterator
-  };
-  buffer.clear();             // clear the buffer
-  rcbz = 0;
+  Entry& e = mEntries[i];
+  if (e.mNewer != NONE) mEntries[e.mNewer].mOlder = e.mOlder;
+  else mNewest = e.mOlder;
+  if (e.mOlder != NONE) mEntries[e.mOlder].mNewer = e.mNewer;
+  else mOldest = e.mNewer;
 }
 
 
 /*****
-Clear the map arrays. Called when they're no longer needed.
+Put entry i first in the order of use.
 *****/
-template <class R>
-void RefContainer<R>::ClearMaps()
+void RefQueryCache::LinkNewest(size_t i)
 {
-  for (size_t ir = 0; ir < maps.size(); ir++) maps[ir].clear();
+  Entry& e = mEntries[i];
+  e.mOlder = mNewest;
+  e.mNewer = NONE;
+  if (mNewest != NONE) mEntries[mNewest].mNewer = i;
+  else mOldest = i;
+  mNewest = i;
 }
 
 
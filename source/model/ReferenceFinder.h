@@ -5,7 +5,7 @@ Purpose:      Header for ReferenceFinder generic model
 Author:       Robert J. Lang
 Modified by:  
 Created:      2006-04-22
-Copyright:    1999-2007 Robert J. Lang. All Rights Reserved.
+Copyright:    �1999-2007 Robert J. Lang. All Rights Reserved.
 ******************************************************************************/
  
 #ifndef _REFERENCEFINDER_H_
@@ -23,6 +23,14 @@ Copyright:    
 // be helpful in debugging.
 //#define RF_PUT_KEY_IN_TEXT
 
+// If this symbol is defined, the database is built (and searched) using
+// multiple threads; see ReferenceFinder::sNumThreads. It is defined by default
+// for compilers that provide C++11 threads. Define RF_NO_THREADS to turn it off.
+#if !defined(RF_USE_THREADS) && !defined(RF_NO_THREADS) && \
+  (__cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900))
+  #define RF_USE_THREADS
+#endif
+
 /******************************************************************************
 Section 1: lightweight classes that represent points and lines.
 ******************************************************************************/
@@ -280,12 +288,18 @@ public:
   
   bool ClipLine(const XYLine& al, XYPt& ap1, XYPt& ap2) const;
   bool InteriorOverlaps(const XYLine& al) const;
+  bool InteriorOverlaps(const XYPt& ap1, const XYPt& ap2) const;
   bool MakesSkinnyFlap(const XYLine& al) const;
+  bool MakesSkinnyFlap(const XYLine& al, const XYPt& ap1, 
+    const XYPt& ap2) const;
   
   void DrawSelf();
 };
 
 class RefDgmr;  // forward declaration, see Section 5 below
+struct RefTask; // forward declarations, see Section 3 below
+template <class Rs> class RefCandidates;
+class RefSchedule;
 
 /**********
 class RefBase - base class for a mark or line. 
@@ -293,10 +307,34 @@ class RefBase - base class for a mark or line.
 class RefBase {
 public:
   typedef unsigned short rank_t;
-  typedef int key_t;
+  typedef long long key_t;      // 64 bits, so fine quantizations fit
+  typedef unsigned int row_t;   // 32-bit position in a RefContainer
   
   rank_t mRank;         // rank of this mark or line
-  key_t mKey;           // key used for maps within RefContainers
+  key_t mKey;           // key used to keep RefContainers unique
+  row_t mRow;           // position of this mark or line in its RefContainer
+
+  enum RefType {          // which of the RefMark_* or RefLine_* classes
+    REFTYPE_ORIGINAL,
+    REFTYPE_INTERSECTION,
+    REFTYPE_C2P_C2P,
+    REFTYPE_P2P,
+    REFTYPE_L2L,
+    REFTYPE_L2L_C2P,
+    REFTYPE_P2L_C2P,
+    REFTYPE_P2L_P2L,
+    REFTYPE_L2L_P2L
+  };
+  struct RefSource {      // what a ref was made from; enough to make it again
+    RefType mType;        // class of the ref
+    short mRoot;          // which solution, for classes with more than one
+    const std::string* mName; // name, for originals
+    RefBase* mParents[4]; // refs passed to the constructor, in order
+    RefSource(RefType atype, short aroot = 0) : 
+      mType(atype), mRoot(aroot), mName(0) {
+      for (int i = 0; i < 4; i++) mParents[i] = 0;
+    };
+  };
 
   static std::vector<RefBase*> sSequence; // a sequence of refs that fully define a ref
 
@@ -310,6 +348,7 @@ public:
 protected:
   typedef short index_t;        // type for indices
   index_t mIndex;               // used to label this ref in a folding sequence
+  bool mOnEdge;                 // true = lies on the edge of the paper
   
   static RefDgmr* sDgmr;        // object that draws diagrams
   static bool sClarifyVerbalAmbiguities;// true = clarify ambiguous verbal instructions
@@ -325,13 +364,17 @@ protected:
   }; // drawing order
   
 public:
-  RefBase(rank_t arank = 0) : mRank(arank), mKey(0), mIndex(0) {}    
+  RefBase(rank_t arank = 0) : mRank(arank), mKey(0), mRow(0), mIndex(0), 
+    mOnEdge(false) {}    
   virtual ~RefBase() {}
 
   // routines for building a sequence of refs
   virtual void SequencePushSelf();
   void BuildAndNumberSequence();
   
+  // routine for recording how the ref was made
+  virtual RefSource GetSource() const = 0;
+  
   // routine for creating a text description of how to fold a ref
   virtual const char GetLabel() const = 0;
   virtual bool PutName(std::ostream& os) const = 0;
@@ -375,9 +418,11 @@ public:
   RefMark(const XYPt& ap, rank_t arank) : RefBase(arank), p(ap) {}
   
   void FinishConstructor();
+  static key_t CalcKey(const XYPt& ap);
   
-  double DistanceTo(const XYPt& ap) const;
-  bool IsOnEdge() const;    
+  double DistanceTo(const XYPt& ap) const {return DistanceBetween(p, ap);};
+  static double DistanceBetween(const XYPt& ap1, const XYPt& ap2);
+  bool IsOnEdge() const {return mOnEdge;};
   bool IsActionLine() const;
 
   const char GetLabel() const;
@@ -406,6 +451,7 @@ private:
   
 public:
   RefMark_Original(const XYPt& ap, rank_t arank, std::string aName);
+  RefSource GetSource() const;
 
   const char GetLabel() const;
   bool PutName(std::ostream& os) const;
@@ -429,11 +475,15 @@ public:
   RefLine* rl2;   // second line
   
   RefMark_Intersection(RefLine* al1, RefLine* al2);
+  static bool CalcIntersection(const XYLine& al1, const XYLine& al2, 
+    XYPt& ap);
+  RefSource GetSource() const;
 
   bool UsesImmediate(RefBase* rb) const;
   void SequencePushSelf();      
   bool PutHowto(std::ostream& os) const;
-  static void MakeAll(rank_t arank);
+  static void MakeAll(rank_t arank, RefSchedule& as);
+  static void DoTask(const RefTask& at, RefCandidates<RefMark_Intersection>& ac);
 };
 
 
@@ -444,6 +494,8 @@ class RefLine : public RefBase {
 public: 
   typedef XYLine bare_t;    // type of bare object that a RefLine represents
   bare_t l;         // the line this contains
+  XYPt ep1;         // where l leaves the paper, found once by ClipToPaper()
+  XYPt ep2;         // and the other end
 private:
   static index_t sCount;    // class index, used for numbering sequences of lines
   static char sLabels[];    // labels for lines, indexed by sCount
@@ -454,7 +506,10 @@ public:
 
   void FinishConstructor();
   double DistanceTo(const XYLine& al) const;
-  bool IsOnEdge() const;
+  static double DistanceBetween(const XYLine& al1, const XYLine& al2);
+  static double DistanceBetween(const XYPt& ap1a, const XYPt& ap1b, 
+    const XYPt& ap2a, const XYPt& ap2b);
+  bool IsOnEdge() const {return mOnEdge;};
   bool IsActionLine() const;
 
   const char GetLabel() const;
@@ -470,6 +525,7 @@ protected:
   static rank_t CalcLineRank(const RefBase* ar1, const RefBase* ar2, 
     const RefBase* ar3, const RefBase* ar4) {
     return 1 + ar1->mRank + ar2->mRank + ar3->mRank + ar4->mRank;}
+  bool ClipToPaper();
   void SetIndex();
 
 private:
@@ -488,6 +544,7 @@ private:
   
 public:
   RefLine_Original(const XYLine& al, rank_t arank, std::string aName);
+  RefSource GetSource() const;
 
   bool IsActionLine() const;
   const char GetLabel() const;
@@ -510,12 +567,14 @@ public:
   RefMark* rm2;       // to another mark
   
   RefLine_C2P_C2P(RefMark* arm1, RefMark* arm2);
+  RefSource GetSource() const;
 
   bool UsesImmediate(RefBase* rb) const;
   void SequencePushSelf();
   bool PutHowto(std::ostream& os) const;
   void DrawSelf(RefStyle rstyle, short ipass) const;
-  static void MakeAll(rank_t arank);
+  static void MakeAll(rank_t arank, RefSchedule& as);
+  static void DoTask(const RefTask& at, RefCandidates<RefLine_C2P_C2P>& ac);
 };
 
 
@@ -537,12 +596,14 @@ private:
 
 public:
   RefLine_P2P(RefMark* arm1, RefMark* arm2);
+  RefSource GetSource() const;
   
   bool UsesImmediate(RefBase* rb) const;
   void SequencePushSelf();
   bool PutHowto(std::ostream& os) const;
   void DrawSelf(RefStyle rstyle, short ipass) const;
-  static void MakeAll(rank_t arank);
+  static void MakeAll(rank_t arank, RefSchedule& as);
+  static void DoTask(const RefTask& at, RefCandidates<RefLine_P2P>& ac);
 };
 
 
@@ -561,15 +622,18 @@ private:
     WHOMOVES_L2
   };  
   WhoMoves mWhoMoves;
+  short mRoot;        // which of the solutions this line is
 
 public: 
   RefLine_L2L(RefLine* arl1, RefLine* arl2, short iroot);
+  RefSource GetSource() const;
   
   bool UsesImmediate(RefBase* rb) const;
   void SequencePushSelf();
   bool PutHowto(std::ostream& os) const;
   void DrawSelf(RefStyle rstyle, short ipass) const;
-  static void MakeAll(rank_t arank);
+  static void MakeAll(rank_t arank, RefSchedule& as);
+  static void DoTask(const RefTask& at, RefCandidates<RefLine_L2L>& ac);
 };
 
 
@@ -583,12 +647,14 @@ public:
   RefMark* rm1;       // so that the crease runs through another point.
   
   RefLine_L2L_C2P(RefLine* arl1, RefMark* arm1);
+  RefSource GetSource() const;
   
   bool UsesImmediate(RefBase* rb) const;
   void SequencePushSelf();
   bool PutHowto(std::ostream& os) const;
   void DrawSelf(RefStyle rstyle, short ipass) const;
-  static void MakeAll(rank_t arank);
+  static void MakeAll(rank_t arank, RefSchedule& as);
+  static void DoTask(const RefTask& at, RefCandidates<RefLine_L2L_C2P>& ac);
 };
 
 
@@ -608,15 +674,18 @@ private:
     WHOMOVES_L1
   };  
   WhoMoves mWhoMoves;
+  short mRoot;        // which of the solutions this line is
   
 public:
   RefLine_P2L_C2P(RefMark* arm1, RefLine* arl1, RefMark* arm2, short iroot);
+  RefSource GetSource() const;
   
   bool UsesImmediate(RefBase* rb) const;
   void SequencePushSelf();
   bool PutHowto(std::ostream& os) const;
   void DrawSelf(RefStyle rstyle, short ipass) const;
-  static void MakeAll(rank_t arank);
+  static void MakeAll(rank_t arank, RefSchedule& as);
+  static void DoTask(const RefTask& at, RefCandidates<RefLine_P2L_C2P>& ac);
 };
 
 
@@ -631,18 +700,14 @@ public:
   RefMark* rm2;       // and another point...
   RefLine* rl2;       // to another line.
 
-private:
-  static short order;     // the order of the equation
-  static short irootMax;    // maximum value of iroot, = ((# of roots) - 1)
+  // The fold lines that solve the alignment for one set of points and lines
+  struct Folds {
+    short mNum;           // how many folds there are
+    short mRoot[3];       // which root of the equation each fold came from
+    XYLine mLine[3];      // the folds themselves
+  };
 
-  static double q1;     // used for quadratic equation solutions
-  static double q2;
-  
-  static double S;      // used for cubic equation solutions
-  static double Sr;
-  static double Si;
-  static double U;
-  
+private:
   enum WhoMoves {
     WHOMOVES_P1P2,
     WHOMOVES_L1L2,
@@ -650,15 +715,24 @@ private:
     WHOMOVES_P2L1
   };  
   WhoMoves mWhoMoves;
+  short mRoot;        // which of the solutions this line is
   
 public:   
   RefLine_P2L_P2L(RefMark* arm1, RefLine* arl1, RefMark* arm2, RefLine* arl2, short iroot);
+  RefLine_P2L_P2L(RefMark* arm1, RefLine* arl1, RefMark* arm2, RefLine* arl2, 
+    const Folds& folds, short ifold);
+  static void SolveFolds(const XYPt& p1, const XYLine& l1, const XYPt& p2, 
+    const XYLine& l2, Folds& folds);
+  RefSource GetSource() const;
   
   bool UsesImmediate(RefBase* rb) const;
   void SequencePushSelf();
   bool PutHowto(std::ostream& os) const;
   void DrawSelf(RefStyle rstyle, short ipass) const;
-  static void MakeAll(rank_t arank);
+  static void MakeAll(rank_t arank, RefSchedule& as);
+  static void DoTask(const RefTask& at, RefCandidates<RefLine_P2L_P2L>& ac);
+private:
+  void SetFold(const XYLine& fold);
 };
 
 
@@ -680,12 +754,14 @@ private:
   
 public:
   RefLine_L2L_P2L(RefLine* arl1, RefMark* arm1, RefLine* arl2);
+  RefSource GetSource() const;
   
   bool UsesImmediate(RefBase* rb) const;
   void SequencePushSelf();
   bool PutHowto(std::ostream& os) const;
   void DrawSelf(RefStyle rstyle, short ipass) const;
-  static void MakeAll(rank_t arank);
+  static void MakeAll(rank_t arank, RefSchedule& as);
+  static void DoTask(const RefTask& at, RefCandidates<RefLine_L2L_P2L>& ac);
 };
 
 
@@ -699,27 +775,471 @@ Section 3: container for collections of marks and lines and their construction
 ******************************************************************************/
 
 /**********
-class RefContainer - Container for marks and lines.
+struct RefTask - a slice of the work done by one of the MakeAll() routines: a
+combination of ranks for the objects in each of its loops, and a range of
+indices for the outermost loop.
+**********/
+struct RefTask {
+  RefBase::rank_t mRanks[4];  // ranks of the objects in each loop
+  std::size_t mBegin;         // first index of the outermost loop
+  std::size_t mEnd;           // one past the last index of the outermost loop
+  
+  RefTask(RefBase::rank_t r0 = 0, RefBase::rank_t r1 = 0, 
+    RefBase::rank_t r2 = 0, RefBase::rank_t r3 = 0) : mBegin(0), mEnd(0) {
+    mRanks[0] = r0; mRanks[1] = r1; mRanks[2] = r2; mRanks[3] = r3;
+  };
+};
+
+
+/**********
+class RefCandidates - the valid candidates found by one RefTask, in the order
+in which they were constructed, plus a count of everything that was tried.
+class Rs = one of the RefMark_* or RefLine_* classes.
+**********/
+template <class Rs>
+class RefCandidates : public std::vector<Rs> {
+public:
+  std::size_t mNumTried;    // number of candidates constructed
+  RefCandidates() : mNumTried(0) {};
+};
+
+
+/**********
+class RefSchedule - the work of the MakeAll() routines for one rank. Each
+MakeAll() adds its tasks as one entry, along with the largest share of the
+room left in the container that its objects may take. Run() then runs the
+entries in the order they were added, either each one to the end or taking
+turns a batch at a time, until the container is full.
+**********/
+template <class R> class RefContainer;
+
+class RefSchedule {
+public:
+  RefSchedule() {};
+  ~RefSchedule();
+  template <class Rs, class R>
+  void Add(const std::vector<RefTask>& tasks, RefContainer<R>& rc, 
+    double quota);
+  void Run(std::size_t maxSize, bool takeTurns);
+
+private:
+  class Entry;                    // defined in ReferenceFinder.cpp
+  template <class Rs, class R> class EntryOf;
+  std::vector<Entry*> mEntries;   // owned
+  
+  RefSchedule(const RefSchedule&);
+  RefSchedule& operator=(const RefSchedule&);
+};
+
+
+/**********
+class RefKeySet - the set of keys in use in a RefContainer. Keys are stored in
+an open-addressing hash table with linear probing. In front of the table sits a
+bit array several times larger than the table has slots, with one bit set per
+key; most absent keys are rejected by that bit without touching the table.
+Key 0 (the key of an invalid object) is never stored.
+**********/
+class RefKeySet {
+public:
+  typedef RefBase::key_t key_t;
+  
+  RefKeySet();
+  
+  std::size_t size() const {return mSize;};
+  bool Contains(key_t akey) const {
+    if (mSize == 0) return false;
+    unsigned f = FilterHash(akey);
+    if (!(mFilter[f >> 3] & (1 << (f & 7)))) return false;
+    for (std::size_t i = SlotHash(akey); ; i = (i + 1) & mMask) {
+      if (mSlots[i] == akey) return true;
+      if (mSlots[i] == 0) return false;
+    }
+  };
+  void Insert(key_t akey);
+  void Clear();
+  
+private:
+  std::vector<key_t> mSlots;          // hash table, 0 = empty slot
+  std::vector<unsigned char> mFilter; // bit array, 8 bits per slot
+  std::size_t mSize;                  // number of keys stored
+  std::size_t mMask;                  // (number of slots) - 1
+  int mBits;                          // log2(number of slots)
+  
+  // Multiplicative hashes of the key; the top bits are the best mixed.
+  unsigned long long Mix(key_t akey, unsigned long long m) const {
+    return (unsigned long long)(akey) * m;};
+  std::size_t SlotHash(key_t akey) const {
+    return std::size_t(Mix(akey, 0x9E3779B97F4A7C15ULL) >> (64 - mBits));};
+  unsigned FilterHash(key_t akey) const {
+    return unsigned(Mix(akey, 0xC2B2AE3D27D4EB4FULL) >> (61 - mBits));};
+  void Resize(int abits);
+};
+
+
+/**********
+class RefRange - a view of a contiguous run of objects in a RefContainer, e.g.
+all of the objects of one rank.
+**********/
+template <class R>
+class RefRange {
+public:
+  RefRange(R* const* abegin = 0, std::size_t asize = 0) : 
+    mBegin(abegin), mSize(asize) {};
+  std::size_t size() const {return mSize;};
+  R* operator[](std::size_t i) const {return mBegin[i];};
+private:
+  R* const* mBegin;
+  std::size_t mSize;
+};
+
+
+/**********
+class RefSlab - storage for the objects of one class Rs. Objects are copied into
+large chunks of memory by bumping a pointer, and are thrown away all at once by
+Clear(), which keeps the chunks for reuse, or by Release(), which gives them
+back. class Rs = one of the RefMark_* or RefLine_* classes.
+**********/
+template <class Rs>
+class RefSlab {
+public:
+  RefSlab() : mChunk(0), mUsed(0) {};
+  ~RefSlab();
+
+  Rs* New(const Rs& ars);     // construct a copy of ars in the slab
+  void Clear();               // destroy all objects, keep the memory
+  void Release();             // destroy all objects, free the memory
+
+private:
+  std::vector<void*> mChunks; // chunk k holds ChunkSize(k) objects
+  std::size_t mChunk;         // chunk currently being filled
+  std::size_t mUsed;          // objects used in that chunk
+
+  static std::size_t ChunkSize(std::size_t k) {
+    // Chunks start small, since some classes have only a few objects.
+    return k < 8 ? std::size_t(64) << k : std::size_t(64) << 8;};
+
+  RefSlab(const RefSlab&);
+  RefSlab& operator=(const RefSlab&);
+};
+
+
+/**********
+class RefSlabTraits - tells RefSlab whether objects of class Rs must have their
+destructor run when they're thrown away. Only the original marks and lines
+own anything (their names); for everything else the destructor does nothing,
+so the slab doesn't bother calling it.
+**********/
+template <class Rs>
+struct RefSlabTraits {
+  enum {NEEDS_DESTRUCTOR = false};
+};
+
+template <>
+struct RefSlabTraits<RefMark_Original> {
+  enum {NEEDS_DESTRUCTOR = true};
+};
+
+template <>
+struct RefSlabTraits<RefLine_Original> {
+  enum {NEEDS_DESTRUCTOR = true};
+};
+
+
+/**********
+class RefArena - owner of all of the marks and lines that currently exist, with
+one RefSlab for each of the RefMark_* and RefLine_* classes.
+**********/
+class RefArena {
+public:
+  RefArena() {};
+
+  template <class Rs>
+  Rs* New(const Rs& ars) {    // construct a copy of ars in the arena
+    return GetSlab(static_cast<Rs*>(0)).New(ars);};
+  void Clear();               // destroy all objects, keep the memory
+  void Release();             // destroy all objects, free the memory
+
+private:
+  RefSlab<RefMark_Original> mMark_Original;
+  RefSlab<RefMark_Intersection> mMark_Intersection;
+  RefSlab<RefLine_Original> mLine_Original;
+  RefSlab<RefLine_C2P_C2P> mLine_C2P_C2P;
+  RefSlab<RefLine_P2P> mLine_P2P;
+  RefSlab<RefLine_L2L> mLine_L2L;
+  RefSlab<RefLine_L2L_C2P> mLine_L2L_C2P;
+  RefSlab<RefLine_P2L_C2P> mLine_P2L_C2P;
+  RefSlab<RefLine_P2L_P2L> mLine_P2L_P2L;
+  RefSlab<RefLine_L2L_P2L> mLine_L2L_P2L;
+
+  // Select the slab for a class; the argument is only used for its type.
+  RefSlab<RefMark_Original>& GetSlab(RefMark_Original*) {
+    return mMark_Original;};
+  RefSlab<RefMark_Intersection>& GetSlab(RefMark_Intersection*) {
+    return mMark_Intersection;};
+  RefSlab<RefLine_Original>& GetSlab(RefLine_Original*) {
+    return mLine_Original;};
+  RefSlab<RefLine_C2P_C2P>& GetSlab(RefLine_C2P_C2P*) {
+    return mLine_C2P_C2P;};
+  RefSlab<RefLine_P2P>& GetSlab(RefLine_P2P*) {
+    return mLine_P2P;};
+  RefSlab<RefLine_L2L>& GetSlab(RefLine_L2L*) {
+    return mLine_L2L;};
+  RefSlab<RefLine_L2L_C2P>& GetSlab(RefLine_L2L_C2P*) {
+    return mLine_L2L_C2P;};
+  RefSlab<RefLine_P2L_C2P>& GetSlab(RefLine_P2L_C2P*) {
+    return mLine_P2L_C2P;};
+  RefSlab<RefLine_P2L_P2L>& GetSlab(RefLine_P2L_P2L*) {
+    return mLine_P2L_P2L;};
+  RefSlab<RefLine_L2L_P2L>& GetSlab(RefLine_L2L_P2L*) {
+    return mLine_L2L_P2L;};
+
+  RefArena(const RefArena&);
+  RefArena& operator=(const RefArena&);
+};
+
+
+/**********
+class RefVirtualRefs - the marks and lines that searches make from refs in the
+database, without adding them to it: RefMark_Intersections of two lines and
+RefLine_C2P_C2Ps through two marks. Each is kept under the rows of the two refs
+it was made from, so that making the same one again gives back the same object.
+They have slabs of their own, so that they can all be thrown away at once
+without touching the database.
+**********/
+class RefVirtualRefs {
+public:
+  typedef RefBase::row_t row_t;
+  
+  RefVirtualRefs() : mSize(0) {};
+  
+  // The copy of ars, which was made from the refs in rows arow1 and arow2
+  template <class Rs>
+  Rs* Get(const Rs& ars, row_t arow1, row_t arow2);
+  std::size_t size() const {return mSize;};
+  void Clear();               // destroy all objects, keep the memory
+  
+private:
+  typedef std::pair<row_t, row_t> row_pair;
+  std::size_t mSize;          // number of objects
+  RefSlab<RefMark_Intersection> mMark_Intersection;
+  std::map<row_pair, RefMark_Intersection*> mMarks_Intersection;
+  RefSlab<RefLine_C2P_C2P> mLine_C2P_C2P;
+  std::map<row_pair, RefLine_C2P_C2P*> mLines_C2P_C2P;
+  
+  // Select the slab and map for a class; the argument is only used for its
+  // type.
+  RefSlab<RefMark_Intersection>& GetSlab(RefMark_Intersection*) {
+    return mMark_Intersection;};
+  std::map<row_pair, RefMark_Intersection*>& GetMap(RefMark_Intersection*) {
+    return mMarks_Intersection;};
+  RefSlab<RefLine_C2P_C2P>& GetSlab(RefLine_C2P_C2P*) {
+    return mLine_C2P_C2P;};
+  std::map<row_pair, RefLine_C2P_C2P*>& GetMap(RefLine_C2P_C2P*) {
+    return mLines_C2P_C2P;};
+  
+  RefVirtualRefs(const RefVirtualRefs&);
+  RefVirtualRefs& operator=(const RefVirtualRefs&);
+};
+
+
+/**********
+class RefColumn - one column of a RefColumns. Normally a column keeps its values
+in a vector of its own, but it can also be a view of values that belong to
+something else, namely a database snapshot that has been mapped into memory.
+The values of a view are copied only if the column has to be changed.
+**********/
+template <class T>
+class RefColumn {
+public:
+  RefColumn() : mData(0), mSize(0), mIsView(false) {};
+  
+  const T& operator[](std::size_t i) const {return mData[i];};
+  std::size_t size() const {return mSize;};
+  const T* data() const {return mData;};
+  
+  void push_back(const T& t) {
+    Own();
+    mOwn.push_back(t);
+    Update();
+  };
+  void resize(std::size_t n) {
+    if (mIsView && n != 0 && n <= mSize) mSize = n; // views can get shorter
+    else {
+      if (n != 0) Own();
+      mIsView = false;
+      mOwn.resize(n);
+      Update();
+    }
+  };
+  void View(const T* adata, std::size_t n) {
+    // Use n values that belong to something else
+    std::vector<T>().swap(mOwn);
+    mData = adata;
+    mSize = n;
+    mIsView = true;
+  };
+  void Own() {
+    // Make sure the values belong to this column
+    if (!mIsView) return;
+    mOwn.assign(mData, mData + mSize);
+    mIsView = false;
+    Update();
+  };
+  
+private:
+  std::vector<T> mOwn;        // the values, unless this is a view
+  const T* mData;             // the first value
+  std::size_t mSize;          // number of values
+  bool mIsView;               // true = the values belong to something else
+  
+  void Update() {
+    mData = mOwn.empty() ? 0 : &mOwn[0];
+    mSize = mOwn.size();
+  };
+  RefColumn(const RefColumn&);
+  RefColumn& operator=(const RefColumn&);
+};
+
+
+/**********
+class RefColumns - compact storage for the marks or lines in a RefContainer, 
+with one array ("column") per field. Row i describes the ref at position i in
+the container: its rank, key, and class, which solution it is (or for an
+original, which name it has), and the rows of the refs it was made from. That's
+enough to make the ref again, so the refs themselves only need to exist while
+the database is being built, or when they're asked for. The coordinates have
+columns of their own so that searches can run straight through them.
+class R = RefMark or RefLine; each has its own specialization.
+**********/
+class RefColumnsBase {
+public:
+  typedef RefBase::rank_t rank_t;
+  typedef RefBase::key_t key_t;
+  typedef RefBase::row_t row_t;
+  enum {MAX_PARENTS = 4};
+  
+  RefColumn<rank_t> mRank;            // rank of each ref
+  RefColumn<key_t> mKey;              // key of each ref
+  RefColumn<unsigned char> mType;     // RefBase::RefType of each ref
+  RefColumn<unsigned char> mAux;      // solution, or index into mNames
+  RefColumn<row_t> mParents[MAX_PARENTS]; // rows of the refs it was made from
+  std::vector<std::string> mNames;    // names of the originals
+  
+  std::size_t size() const {return mRank.size();};
+  
+  template <class V>
+  void ForEachColumn(V& av) {
+    // Pass each column in turn to av.Column()
+    av.Column(mRank);
+    av.Column(mKey);
+    av.Column(mType);
+    av.Column(mAux);
+    for (int k = 0; k < mNumParents; k++) av.Column(mParents[k]);
+  };
+  
+protected:
+  RefColumnsBase(int anumParents) : mNumParents(anumParents) {};
+  void Append(const RefBase* ar);
+  void Resize(std::size_t n);
+  
+private:
+  int mNumParents;                    // parent columns used by this class
+};
+
+template <class R>
+class RefColumns;
+
+template <>
+class RefColumns<RefMark> : public RefColumnsBase {
+public:
+  RefColumn<double> mX;               // coordinates of each mark
+  RefColumn<double> mY;
+  
+  RefColumns() : RefColumnsBase(2) {};
+  XYPt GetBare(row_t i) const {return XYPt(mX[i], mY[i]);};
+  template <class V>
+  void ForEachColumn(V& av) {
+    RefColumnsBase::ForEachColumn(av);
+    av.Column(mX);
+    av.Column(mY);
+  };
+  void Append(const RefMark* ar);
+  void Resize(std::size_t n);
+};
+
+template <>
+class RefColumns<RefLine> : public RefColumnsBase {
+public:
+  RefColumn<double> mD;               // distance of each line from the origin
+  RefColumn<double> mUx;              // and its unit normal
+  RefColumn<double> mUy;
+  RefColumn<double> mX1;              // where each line leaves the paper
+  RefColumn<double> mY1;
+  RefColumn<double> mX2;
+  RefColumn<double> mY2;
+  
+  RefColumns() : RefColumnsBase(4) {};
+  XYLine GetBare(row_t i) const {return XYLine(mD[i], XYPt(mUx[i], mUy[i]));};
+  XYPt GetEnd1(row_t i) const {return XYPt(mX1[i], mY1[i]);};
+  XYPt GetEnd2(row_t i) const {return XYPt(mX2[i], mY2[i]);};
+  template <class V>
+  void ForEachColumn(V& av) {
+    RefColumnsBase::ForEachColumn(av);
+    av.Column(mD);
+    av.Column(mUx);
+    av.Column(mUy);
+    av.Column(mX1);
+    av.Column(mY1);
+    av.Column(mX2);
+    av.Column(mY2);
+  };
+  void Append(const RefLine* ar);
+  void Resize(std::size_t n);
+};
+
+
+/**********
+class RefContainer - Container for marks and lines. The database itself is kept
+in the columns. While it's being built, the container also holds every ref as
+an object, in the same order; once it's built, the objects are released, and
+GetObject() makes them again as needed.
 **********/
 template<class R>
 class RefContainer : public std::vector<R*> {
 public:
-  typedef std::map<typename R::key_t, R*> map_t;  // typedef for map holding R*
-  std::vector<map_t> maps;      // Holds maps of objects, one for each rank
-  std::size_t rcsz;         // current number of elements in the rank maps
-  map_t buffer;           // used to accumulate new objects
-  std::size_t rcbz;         // current size of buffer
-
-  typedef typename map_t::iterator rank_iterator; // for iterating through individual ranks
+  typedef RefBase::row_t row_t;
+  
+  RefColumns<R> cols;       // all of the refs, sorted by rank and key
+  RefKeySet keys;           // keys of all objects, including the buffer
+  std::vector<std::size_t> rankStart; // objects of rank r start at [rankStart[r]]
+  std::vector<R*> edges;        // objects on the edge of the paper, by rank
+  std::vector<std::size_t> edgeStart; // edges of rank r start at edges[edgeStart[r]]
+  std::vector<R*> buffer;       // used to accumulate new objects
+  std::map<row_t, R*> made;     // objects made on request, by row
   
 public:
   std::size_t GetTotalSize() const {
     // Total number of elements, all ranks
-    return rcsz + rcbz;
+    return cols.size() + buffer.size();
+  };
+  RefRange<R> GetRank(RefBase::rank_t arank) const {
+    // All objects of the given rank (not counting the buffer)
+    if (rankStart[arank + 1] == rankStart[arank]) return RefRange<R>();
+    return RefRange<R>(&(*this)[rankStart[arank]], 
+      rankStart[arank + 1] - rankStart[arank]);
+  };
+  RefRange<R> GetRankEdges(RefBase::rank_t arank) const {
+    // The objects of the given rank that lie on the edge of the paper
+    if (edgeStart[arank + 1] == edgeStart[arank]) return RefRange<R>();
+    return RefRange<R>(&edges[edgeStart[arank]], 
+      edgeStart[arank + 1] - edgeStart[arank]);
   };
+  R* GetObject(row_t i);    // the ref in row i, made if necessary
 
   template <class Rs>
   void AddCopyIfValidAndUnique(const Rs& ars);  // add a copy of ars if valid and unique
+  template <class Rs>
+  void AddCandidate(const Rs& ars, RefCandidates<Rs>& ac) const; // same, for a RefTask
 
 private:
   friend class ReferenceFinder;   // only class that gets to use these methods
@@ -727,10 +1247,196 @@ private:
   RefContainer();           // Constructor
 
   void Rebuild();        // Re-initialize with new values
-  bool Contains(const R* ar) const; // True if an equivalent element already exists
+  bool Contains(const R* ar) const { // True if an equivalent element already exists
+    return keys.Contains(ar->mKey);};
   void Add(R* ar);          // Add an element to the array
   void FlushBuffer();         // Add the contents of the buffer to the container
-  void ClearMaps();         // Clear the map arrays when no longer needed
+  void FindEdges(std::size_t firstRank); // List the edges of firstRank and up
+  void Truncate(RefBase::rank_t arank); // Remove everything above rank arank
+  void Expand();            // Make all objects again, for building
+  void Compact();           // Release all objects once the build is done
+  R* MakeObject(row_t i);   // Make the ref in row i from the columns
+};
+
+template <> RefMark* RefContainer<RefMark>::MakeObject(row_t i);
+template <> RefLine* RefContainer<RefLine>::MakeObject(row_t i);
+
+
+/**********
+class RefSnapshot - a database snapshot file, mapped read-only into memory so
+that the columns of the database can be views of it. Several processes can
+share the same mapping. On platforms where files can't be mapped, the file is
+read into memory instead.
+**********/
+class RefSnapshot {
+public:
+  RefSnapshot();
+  ~RefSnapshot();
+  
+  bool Open(const std::string& path);   // map the whole file
+  void Close();                         // unmap it
+  void Swap(RefSnapshot& as);           // exchange files with another
+  const char* GetData() const {return mData;};
+  std::size_t GetSize() const {return mSize;};
+  
+private:
+  const char* mData;        // start of the file in memory
+  std::size_t mSize;        // size of the file
+  void* mFile;              // platform-specific handles
+  void* mMapping;
+  std::vector<char> mBuffer;  // contents of the file, if it couldn't be mapped
+
+  RefSnapshot(const RefSnapshot&);
+  RefSnapshot& operator=(const RefSnapshot&);
+};
+
+
+/**********
+class RefMarkGrid - a uniform grid of cells laid over the marks in the database,
+so that a search only has to look at the marks near its target. Each cell lists
+the rows of the marks that fall within it. Searches work outward from the cell
+of the target, one ring of cells at a time.
+**********/
+class RefMarkGrid {
+public:
+  typedef RefBase::row_t row_t;
+  
+  RefMarkGrid();
+  void Build(const RefColumns<RefMark>& cols);  // index all of these marks
+  void Clear();
+  bool IsEmpty() const {return mRows.empty();};
+  
+  void GetCell(const XYPt& ap, int& ix, int& iy) const; // cell nearest to ap
+  const row_t* CellBegin(int ix, int iy) const {
+    // First row in cell (ix, iy)
+    return &mRows[0] + mCellStart[iy * mNumX + ix];
+  };
+  const row_t* CellEnd(int ix, int iy) const {
+    // One past the last row in cell (ix, iy)
+    return &mRows[0] + mCellStart[iy * mNumX + ix + 1];
+  };
+  int GetNumX() const {return mNumX;};
+  int GetNumY() const {return mNumY;};
+  int GetNumRings(int ix, int iy) const;  // rings needed to cover the grid
+  double GetDistanceBeyond(const XYPt& ap, int ix, int iy, int k) const;
+  double GetDistanceBound(int ix, int iy, const XYLine& al) const;
+  void GetStripCells(int iy, const XYLine& al, double awidth, int& ixmin, 
+    int& ixmax) const;    // cells in row iy within awidth of al
+  
+private:
+  double mLeft;             // lower left corner of the grid
+  double mBottom;
+  double mCellWidth;        // size of each cell
+  double mCellHeight;
+  int mNumX;                // number of cells across
+  int mNumY;                // and up
+  std::vector<row_t> mCellStart;  // cell i starts at mRows[mCellStart[i]]
+  std::vector<row_t> mRows;       // rows of all of the marks, cell by cell
+};
+
+
+/**********
+class RefLineIndex - the lines in the database, sorted into buckets by the angle
+of their normal and their distance from the origin, the same two quantities
+that make up their keys. Each bucket also records the range of angles and
+distances of its lines and boxes around their endpoints, which is enough to
+put a lower bound on the error of every line in the bucket, in either error
+mode, without looking at any of them. Searches look at the buckets in order of
+their bounds and stop when no bucket that's left could make a difference.
+**********/
+class RefLineIndex {
+public:
+  typedef RefBase::row_t row_t;
+  
+  RefLineIndex();
+  void Build(const RefColumns<RefLine>& cols);  // index all of these lines
+  void Clear();
+  bool IsEmpty() const {return mRows.empty();};
+  
+  std::size_t GetNumBuckets() const {return mBuckets.size();};
+  const row_t* BucketBegin(std::size_t i) const {
+    // First row in bucket i
+    return &mRows[0] + mBucketStart[i];
+  };
+  const row_t* BucketEnd(std::size_t i) const {
+    // One past the last row in bucket i
+    return &mRows[0] + mBucketStart[i + 1];
+  };
+  double GetLowerBound(std::size_t i, const XYLine& al, double aangle) const;
+  double GetLowerBound(std::size_t i, const XYPt& apa, const XYPt& apb) const;
+  double GetDistanceBound(std::size_t i, const XYPt& ap, double aangle) const;
+  
+private:
+  struct Bucket {
+    double mMinAngle;       // range of atan2(u.y, u.x) over the lines
+    double mMaxAngle;
+    XYPt mMinU;             // the normals at either end of that range
+    XYPt mMaxU;
+    double mMinD;           // range of d
+    double mMaxD;
+    XYRect mEnds1;          // box around the first endpoints
+    XYRect mEnds2;          // and the second ones
+    Bucket(double aangle, const XYLine& al, const XYPt& ap1, const XYPt& ap2) : 
+      mMinAngle(aangle), mMaxAngle(aangle), mMinU(al.u), mMaxU(al.u), 
+      mMinD(al.d), mMaxD(al.d), mEnds1(ap1), mEnds2(ap2) {};
+  };
+  std::vector<Bucket> mBuckets;     // the buckets that have lines in them
+  std::vector<row_t> mBucketStart;  // bucket i starts at mRows[mBucketStart[i]]
+  std::vector<row_t> mRows;         // rows of the lines, bucket by bucket
+};
+
+
+/**********
+class RefQueryCache - the results of the most recent searches, so that asking
+for the same target again only costs a lookup in a hash table. Targets are
+rounded to the same grid as the keys of the marks or lines, so targets closer
+together than that share their results. Each query also records everything
+else the results depend on, including the generation of the database they came
+from; results from any other generation are thrown out. Once the cache is
+full, the least recently used results make room for new ones.
+**********/
+class RefQueryCache {
+public:
+  struct Query {
+    int mType;                  // 0 = marks, 1 = lines
+    long long mCoords[2];       // target, rounded to the key grid
+    short mNumRefs;             // number of refs asked for
+    bool mWorstCase;            // error metric for lines
+    double mGoodEnough;         // error below which rank comes first
+    unsigned long mGeneration;  // database the results came from
+    
+    bool operator==(const Query& aq) const;
+    std::size_t Hash() const;
+  };
+  
+  RefQueryCache();
+  void SetCapacity(std::size_t acapacity);  // most results to keep
+  void Clear();
+  const std::vector<RefBase*>* Find(const Query& aq);
+  void Insert(const Query& aq, const std::vector<RefBase*>& arefs);
+  std::size_t GetNumHits() const {return mNumHits;};
+  std::size_t GetNumMisses() const {return mNumMisses;};
+  
+private:
+  static const std::size_t NONE = std::size_t(-1);  // no entry
+  struct Entry {
+    Query mQuery;
+    std::vector<RefBase*> mRefs;
+    std::size_t mNext;    // next entry in the same bucket
+    std::size_t mNewer;   // entries in order of use, both ways
+    std::size_t mOlder;
+  };
+  std::vector<Entry> mEntries;
+  std::vector<std::size_t> mBuckets;  // first entry in each bucket
+  std::size_t mCapacity;
+  std::size_t mNewest;                // most recently used entry
+  std::size_t mOldest;                // least recently used entry
+  unsigned long mGeneration;          // generation of all of the entries
+  std::size_t mNumHits;
+  std::size_t mNumMisses;
+  
+  void Unlink(std::size_t i);
+  void LinkNewest(std::size_t i);
 };
 
 
@@ -752,6 +1458,7 @@ class ReferenceFinder {
 public:
   typedef RefBase::rank_t rank_t;   // we use ranks, too
   typedef RefBase::key_t key_t;     // and keys
+  typedef RefBase::row_t row_t;     // and rows
 
   // Publicly accessible settings. Users can set these directly before calling
   // MakeAllMarksAndLines().
@@ -768,11 +1475,17 @@ public:
   static rank_t sMaxRank;         // maximum rank to create
   static std::size_t sMaxLines;   // maximum number of lines to create
   static std::size_t sMaxMarks;   // maximum number of marks to create
-  
-  static key_t sNumX;
-  static key_t sNumY;
-  static key_t sNumA;
-  static key_t sNumD;
+  static std::size_t sMaxBytes;   // most memory for marks and lines, 0 = any
+  static double sRankQuota;       // most of the room left one rank may take
+  static double sAxiomQuota[7];   // most of a rank's room each of O1-O7 may take
+  static bool sAxiomsTakeTurns;   // true = O1-O7 build in turns, not in order
+  static bool sVirtualMarks;      // true = top-rank marks are made when searched
+  static bool sVirtualRefLine_C2P_C2P;  // true = O1 lines are made when searched
+  
+  static int sNumX;
+  static int sNumY;
+  static int sNumA;
+  static int sNumD;
   
   static double sGoodEnoughError; // tolerable error in a mark or line
   static double sMinAspectRatio;  // minimum aspect ratio for a triangular flap
@@ -780,6 +1493,11 @@ public:
   static bool sVisibilityMatters; // restrict to what can be made w/ opaque paper
   static bool sLineWorstCaseError;// true = use worst-case error vs Pythagorean
   static int sDatabaseStatusSkip;       // frequency that sDatabaseFn gets called
+  static int sNumThreads;         // threads to use for building, 0 = all processors
+  static std::string sDatabaseFile; // snapshot of the database, "" = none
+  static bool sUseSearchIndexes;  // false = searches scan every ref
+  static std::size_t sQueryCacheSize; // most search results to keep, 0 = none
+  static std::size_t sMaxVirtualRefs; // most refs made by searches to keep
   
   static bool sClarifyVerbalAmbiguities;
   static bool sAxiomsInVerbalDirections;
@@ -787,6 +1505,7 @@ public:
   static int sNumBuckets;       // how many error buckets to use
   static double sBucketSize;    // size of each bucket
   static int sNumTrials;        // number of test cases total
+  static int sStatisticsSeed;   // seed for the random test points
   static std::string sStatistics;  // Results of statistical analysis
 
   // Getters
@@ -796,13 +1515,18 @@ public:
   static std::size_t GetNumMarks() {
     return sBasisMarks.GetTotalSize();
   };
+  static std::size_t GetNumThreads();
+  static std::string GetBudgetReport(); // memory used by each kind of ref
+  static std::size_t GetNumCacheHits() {return sQueryCache.GetNumHits();};
+  static std::size_t GetNumCacheMisses() {return sQueryCache.GetNumMisses();};
+  static std::size_t GetNumVirtualRefs() {return sVirtualRefs.size();};
   
   // Check key sizes against type size
   static bool LineKeySizeOK() {
-    return sNumA < std::numeric_limits<key_t>::max() / sNumD;
+    return key_t(sNumA) < std::numeric_limits<key_t>::max() / sNumD;
   };
   static bool MarkKeySizeOK() {
-  return sNumX < std::numeric_limits<key_t>::max() / sNumY;
+  return key_t(sNumX) < std::numeric_limits<key_t>::max() / sNumY;
   };
   
   // Support for a callback function to show progress during initialization
@@ -838,7 +1562,7 @@ public:
     sDatabaseUserData = userData;
   };
 
-  // Complete reinitialization of the database
+  // Build the database, extending the existing one if only sMaxRank changed
   static void MakeAllMarksAndLines();
 
   // Functions for searching for the best marks and/or lines
@@ -846,6 +1570,40 @@ public:
     short numMarks);
   static void FindBestLines(const XYLine& al, std::vector<RefLine*>& vl, 
     short numLines);
+  static void FindBestMarks(const std::vector<XYPt>& aps, 
+    std::vector<RefMark*>& vm, short numMarks);
+  static void FindBestLines(const std::vector<XYLine>& als, 
+    std::vector<RefLine*>& vl, short numLines);
+  
+  // Deeper searches also try refs up to maxRank that aren't in the database,
+  // but only one construction past it: marks where two stored lines cross,
+  // and O1 lines through two stored marks. Refs whose parents aren't stored
+  // themselves, and lines made by O2-O7, are never tried, so the results can
+  // be worse than those of a database built to maxRank. maxRank is capped at
+  // the highest rank that one construction can reach, as given by
+  // GetMaxDeeperMarkRank() and GetMaxDeeperLineRank().
+  static void FindDeeperMarks(const XYPt& ap, std::vector<RefMark*>& vm, 
+    short numMarks, rank_t maxRank);
+  static void FindDeeperLines(const XYLine& al, std::vector<RefLine*>& vl, 
+    short numLines, rank_t maxRank);
+  static rank_t GetMaxDeeperMarkRank();
+  static rank_t GetMaxDeeperLineRank();
+  static void FindFrontierMarks(const XYPt& ap, std::vector<RefMark*>& vm);
+  static void FindFrontierLines(const XYLine& al, std::vector<RefLine*>& vl);
+  
+  // Range searches pass every ref within error of the target to a callback,
+  // lowest rank first and closest first within a rank. Setting cancel to true
+  // ends the search.
+  typedef void (*MarkRangeFn)(RefMark* rm, double error, void* userData, 
+    bool& cancel);
+  typedef void (*LineRangeFn)(RefLine* rl, double error, void* userData, 
+    bool& cancel);
+  static void FindMarksInRange(const XYPt& ap, double error, 
+    MarkRangeFn rangeFn, void* userData = 0);
+  static void FindLinesInRange(const XYLine& al, double error, 
+    LineRangeFn rangeFn, void* userData = 0);
+  static void FindMarksAlongLine(const XYLine& al, double error, 
+    std::vector<RefMark*>& vm);
 
   // Utility routines for validating user input
   static bool ValidateMark(const XYPt& ap, std::string& err);
@@ -889,6 +1647,45 @@ public:
 private:
   static RefContainer<RefLine> sBasisLines;  // all lines
   static RefContainer<RefMark> sBasisMarks;  // all marks
+  static RefArena sArena;           // owner of all marks and lines
+  static RefSnapshot sSnapshot;     // file that the columns may be views of
+  static RefMarkGrid sMarkGrid;     // where the marks are, for searching
+  static RefLineIndex sLineIndex;   // and the lines
+  static RefQueryCache sQueryCache; // results of recent searches
+  static RefVirtualRefs sVirtualRefs; // refs made by searches
+  static unsigned long sGeneration; // changes whenever the database does
+  
+  // Everything other than sMaxRank that affects the contents of the database;
+  // if none of it changes, an existing database can be extended.
+  struct DatabaseSettings {
+    double mWidth;
+    double mHeight;
+    bool mUseRefLine[7];
+    std::size_t mMaxLines;
+    std::size_t mMaxMarks;
+    std::size_t mMaxBytes;
+    double mRankQuota;
+    double mAxiomQuota[7];
+    bool mAxiomsTakeTurns;
+    bool mVirtualMarks;
+    bool mVirtualRefLine_C2P_C2P;
+    int mNumX;
+    int mNumY;
+    int mNumA;
+    int mNumD;
+    double mMinAspectRatio;
+    double mMinAngleSine;
+    bool mVisibilityMatters;
+    
+    DatabaseSettings();       // captures the current settings
+    bool operator==(const DatabaseSettings& ds) const;
+    unsigned long long GetFingerprint() const;  // hash of the settings
+  };
+  static DatabaseSettings sDatabaseSettings;  // settings of the current database
+  static rank_t sNumRanks;          // number of complete ranks in the database
+  
+  static bool LoadDatabase(const DatabaseSettings& settings, rank_t minRanks);
+  static void SaveDatabase();
 
   class EXC_HALT {};          // exception for user cancellation
   static rank_t sCurRank;       // the rank that we're currently working on
@@ -898,8 +1695,17 @@ private:
   static StatisticsFn sStatisticsFn;
   static void* sStatisticsUserData;
   
-  static void CheckDatabaseStatus();    // called by RefContainer<>
+  static void CheckDatabaseStatus(std::size_t numTried = 1);
   static void MakeAllMarksAndLinesOfRank(rank_t arank);
+  static void MakeAllMarksOfRank(rank_t arank);
+  static bool HasVirtualMarks(rank_t arank);
+  static void AddTasks(std::vector<RefTask>& tasks, const RefTask& at,
+    std::size_t numOuter, double numInner);
+  static void GetBudgets(std::size_t& maxLines, std::size_t& maxMarks);
+  static std::size_t GetRankLimit(std::size_t size, std::size_t budget);
+  static RefQueryCache::Query GetQuery(const XYPt& ap, short numRefs);
+  static RefQueryCache::Query GetQuery(const XYLine& al, short numRefs);
+  static void TrimVirtualRefs();
   
   // You should never create an instance of this class
   ReferenceFinder();
@@ -916,6 +1722,7 @@ private:
   friend class RefLine_P2L_C2P;
   friend class RefLine_P2L_P2L;
   friend class RefLine_L2L_P2L;
+  friend class RefSchedule;
   
 //  friend class PSStreamDgmr;  // TBD, does this need to be a friend?
   friend class RefContainer<RefLine>;
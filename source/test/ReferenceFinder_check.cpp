@@ -0,0 +1,881 @@
+/******************************************************************************
+File:         ReferenceFinder_check.cpp
+Project:      ReferenceFinder 4.x
+Purpose:      Checks for the ReferenceFinder model
+Created:      2026-10-16
+******************************************************************************/
+ 
+#include "ReferenceFinder.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+
+/*****
+Every check builds this database: marks and lines up to rank 5, cut off at
+60000 of each, so that the budget comes into play as well as the axioms.
+*****/
+const ReferenceFinder::rank_t CHECK_RANK = 5;
+const size_t CHECK_MAX_REFS = 60000;
+const size_t CHECK_NUM_LINES = 60000;
+const size_t CHECK_NUM_MARKS = 57964;
+
+// Errors may differ from the known ones by no more than this
+const double CHECK_TOLERANCE = 1.0e-12;
+
+
+/*****
+The best marks for a few points, and lines for a few lines, as found in the
+database above, best first.
+*****/
+struct MarkCheck {
+  double mX, mY;                  // target
+  int mRank;                      // rank, key and error of the mark found
+  RefBase::key_t mKey;
+  double mError;
+};
+
+const MarkCheck MARK_CHECKS[] = {
+  {0.5, 0.5, 2, 12502501LL, 0},
+  {0.5, 0.5, 5, 12502497LL, 0.00081703169983077251},
+  {0.5, 0.5, 5, 12482501LL, 0.00081703169983082802},
+  {0.3, 0.7, 4, 7533495LL, 0.0016442120939110067},
+  {0.3, 0.7, 4, 7473507LL, 0.0016809710854085438},
+  {0.3, 0.7, 4, 7463509LL, 0.0021437474815311289},
+  {0.123, 0.456, 5, 3057281LL, 0.00084141258578280544},
+  {0.123, 0.456, 5, 3052278LL, 0.0010893803548069887},
+  {0.123, 0.456, 5, 3067290LL, 0.0018064423990671683},
+  {0.9, 0.1, 5, 22500501LL, 1.1443916996305594e-16},
+  {0.9, 0.1, 5, 22495502LL, 0.00031191279184187659},
+  {0.9, 0.1, 5, 22490503LL, 0.00050326560460554253}
+};
+
+struct LineCheck {
+  double mX1, mY1, mX2, mY2;      // two points on the target
+  int mRank;                      // rank, key and error of the line found
+  RefBase::key_t mKey;
+  double mError;
+};
+
+const LineCheck LINE_CHECKS[] = {
+  {0.2, 0, 0.7, 1, 5, 10675644LL, 0.004068591728169646},
+  {0.2, 0, 0.7, 1, 4, 10675653LL, 0.0056046467595683713},
+  {0.2, 0, 0.7, 1, 5, 10685639LL, 0.0083894477145133317},
+  {0, 0.333, 1, 0.25, 4, 18396160LL, 0.01000686474533205},
+  {0, 0.333, 1, 0.25, 4, 18446127LL, 0.013532886037625647},
+  {0, 0.333, 1, 0.25, 4, 18491126LL, 0.014216043274138446},
+  {0.1, 0.9, 0.8, 0.05, 4, 15242291LL, 0.0021172499175474702},
+  {0.1, 0.9, 0.8, 0.05, 4, 15242290LL, 0.0025539284003409657},
+  {0.1, 0.9, 0.8, 0.05, 4, 15257297LL, 0.0029284330620997223}
+};
+
+const size_t NUM_PER_TARGET = 3;  // refs found for each target
+
+
+static int sNumFailed = 0;        // number of checks that failed
+
+
+/*****
+Report whether the check called name passed.
+*****/
+static void Check(bool passed, const char* name)
+{
+  if (passed) return;
+  cout << "FAILED: " << name << endl;
+  sNumFailed++;
+}
+
+
+/*****
+Return true if ref ar has rank arank, key akey and error aerror from target at.
+*****/
+template <class R>
+static bool IsRef(const R* ar, const typename R::bare_t& at, int arank, 
+  RefBase::key_t akey, double aerror)
+{
+  return ar && ar->mRank == arank && ar->mKey == akey && 
+    fabs(ar->DistanceTo(at) - aerror) <= CHECK_TOLERANCE;
+}
+
+
+/*****
+Build the check database from scratch.
+*****/
+static void BuildDatabase()
+{
+  ReferenceFinder::sMaxRank = CHECK_RANK;
+  ReferenceFinder::sMaxLines = CHECK_MAX_REFS;
+  ReferenceFinder::sMaxMarks = CHECK_MAX_REFS;
+  ReferenceFinder::MakeAllMarksAndLines();
+}
+
+
+/*****
+Build the check database again with the same settings, by cutting it back to
+rank 0 so that every rank above that gets built over.
+*****/
+static void RebuildDatabase()
+{
+  ReferenceFinder::sMaxRank = 0;
+  ReferenceFinder::MakeAllMarksAndLines();
+  BuildDatabase();
+}
+
+
+/*****
+Put a summary of the database into vk: its size and the keys of the best marks
+and lines for a grid of targets.
+*****/
+static void GetSummary(vector<RefBase::key_t>& vk)
+{
+  const int NUM_STEPS = 10;       // targets across and up
+  vk.clear();
+  vk.push_back(RefBase::key_t(ReferenceFinder::GetNumLines()));
+  vk.push_back(RefBase::key_t(ReferenceFinder::GetNumMarks()));
+  for (int ix = 0; ix < NUM_STEPS; ix++) 
+    for (int iy = 0; iy < NUM_STEPS; iy++) {
+      XYPt pp((ix + 0.37) / NUM_STEPS, (iy + 0.61) / NUM_STEPS);
+      vector<RefMark*> vm;
+      ReferenceFinder::FindBestMarks(pp, vm, NUM_PER_TARGET);
+      for (size_t j = 0; j < vm.size(); j++) vk.push_back(vm[j]->mKey);
+      vector<RefLine*> vl;
+      ReferenceFinder::FindBestLines(XYLine(pp, XYPt(1 - pp.y, pp.x)), vl, 
+        NUM_PER_TARGET);
+      for (size_t j = 0; j < vl.size(); j++) vk.push_back(vl[j]->mKey);
+    }
+}
+
+
+/*****
+Check that the database doesn't depend on the number of threads it's built
+on, when the axioms take turns and the budget runs out partway through a rank.
+*****/
+static void CheckThreads()
+{
+  const int NUM_THREADS = 4;
+  ReferenceFinder::sAxiomsTakeTurns = true;
+  ReferenceFinder::sNumThreads = 1;
+  BuildDatabase();
+  vector<RefBase::key_t> vk1;
+  GetSummary(vk1);
+  ReferenceFinder::sNumThreads = NUM_THREADS;
+  RebuildDatabase();
+  vector<RefBase::key_t> vkn;
+  GetSummary(vkn);
+  Check(vk1 == vkn, "same database on 1 and several threads");
+  ReferenceFinder::sAxiomsTakeTurns = false;
+  ReferenceFinder::sNumThreads = 0;
+}
+
+
+/*****
+What BuildStatusFn() has seen of a build, and when it should cancel it.
+*****/
+struct BuildStatus {
+  int mFirstRank;                 // lowest rank worked on, or -1 if none
+  int mCancelRank;                // rank to cancel the build partway through
+  int mNumCalls;                  // calls so far while working on that rank
+  int mCancelCalls;               // calls to cancel after, or 0 to not cancel
+};
+
+
+/*****
+DatabaseFn for the checks below, which keeps track of the BuildStatus that
+userData points to.
+*****/
+static void BuildStatusFn(ReferenceFinder::DatabaseInfo info, void* userData, 
+  bool& cancel)
+{
+  if (info.mStatus != ReferenceFinder::DATABASE_WORKING) return;
+  BuildStatus& bs = *static_cast<BuildStatus*>(userData);
+  if (bs.mFirstRank < 0 || info.mRank < bs.mFirstRank) 
+    bs.mFirstRank = info.mRank;
+  if (info.mRank == bs.mCancelRank && ++bs.mNumCalls == bs.mCancelCalls) 
+    cancel = true;
+}
+
+
+/*****
+Check that raising sMaxRank builds only the new ranks, and gives the same
+database as building from scratch; and that after a build is cancelled partway
+through a rank, the next one picks up from the last complete rank.
+*****/
+static void CheckIncrementalBuilds()
+{
+  const int NUM_CANCEL_CALLS = 3; // status calls before cancelling
+  int statusSkip = ReferenceFinder::sDatabaseStatusSkip;
+  ReferenceFinder::sDatabaseStatusSkip = 1000;
+  RebuildDatabase();
+  vector<RefBase::key_t> vk0;
+  GetSummary(vk0);
+  
+  ReferenceFinder::sMaxRank = 0;
+  ReferenceFinder::MakeAllMarksAndLines();
+  ReferenceFinder::sMaxRank = CHECK_RANK - 1;
+  ReferenceFinder::MakeAllMarksAndLines();
+  BuildStatus bs = {-1, -1, 0, 0};
+  ReferenceFinder::SetDatabaseFn(BuildStatusFn, &bs);
+  BuildDatabase();
+  vector<RefBase::key_t> vk1;
+  GetSummary(vk1);
+  Check(bs.mFirstRank == CHECK_RANK && vk1 == vk0, 
+    "database extended by a rank");
+  
+  ReferenceFinder::sMaxRank = CHECK_RANK - 1;
+  ReferenceFinder::MakeAllMarksAndLines();
+  BuildStatus bc = {-1, CHECK_RANK, 0, NUM_CANCEL_CALLS};
+  ReferenceFinder::SetDatabaseFn(BuildStatusFn, &bc);
+  BuildDatabase();
+  Check(bc.mNumCalls == NUM_CANCEL_CALLS && 
+    ReferenceFinder::GetNumMarks() < CHECK_NUM_MARKS, 
+    "database cancelled partway through a rank");
+  bs.mFirstRank = -1;
+  ReferenceFinder::SetDatabaseFn(BuildStatusFn, &bs);
+  BuildDatabase();
+  GetSummary(vk1);
+  Check(bs.mFirstRank == CHECK_RANK && vk1 == vk0, 
+    "database built again after a cancel");
+  
+  ReferenceFinder::SetDatabaseFn(0);
+  ReferenceFinder::sDatabaseStatusSkip = statusSkip;
+}
+
+
+/*****
+Replace file afile with a copy that has one byte of its body changed. The copy
+is renamed into place, so a snapshot that's still mapped isn't touched.
+*****/
+static bool CorruptFile(const string& afile)
+{
+  ifstream fin(afile.c_str(), ios::in | ios::binary);
+  string contents((istreambuf_iterator<char>(fin)), 
+    istreambuf_iterator<char>());
+  fin.close();
+  if (contents.empty()) return false;
+  contents[contents.size() / 2] ^= 0x10;
+  string tempFile = afile + ".bad";
+  ofstream fout(tempFile.c_str(), ios::out | ios::binary | ios::trunc);
+  fout.write(contents.data(), streamsize(contents.size()));
+  fout.close();
+  return !fout.fail() && rename(tempFile.c_str(), afile.c_str()) == 0;
+}
+
+
+/*****
+Check that a database saved to sDatabaseFile is loaded back rather than built
+again, that it gives the same results, and that a snapshot with a changed byte
+is passed over and the database built instead.
+*****/
+static void CheckSnapshots()
+{
+  const string DATABASE_FILE = "ReferenceFinder_check.db";
+  int statusSkip = ReferenceFinder::sDatabaseStatusSkip;
+  ReferenceFinder::sDatabaseStatusSkip = 1000;
+  remove(DATABASE_FILE.c_str());
+  ReferenceFinder::sDatabaseFile = DATABASE_FILE;
+  RebuildDatabase();
+  vector<RefBase::key_t> vk0;
+  GetSummary(vk0);
+  
+  ReferenceFinder::sMaxRank = 0;
+  ReferenceFinder::MakeAllMarksAndLines();
+  BuildStatus bs = {-1, -1, 0, 0};
+  ReferenceFinder::SetDatabaseFn(BuildStatusFn, &bs);
+  BuildDatabase();
+  vector<RefBase::key_t> vk1;
+  GetSummary(vk1);
+  Check(bs.mFirstRank < 0 && vk1 == vk0, "database loaded from a snapshot");
+  
+  bool corrupted = CorruptFile(DATABASE_FILE);
+  ReferenceFinder::sMaxRank = 0;
+  ReferenceFinder::MakeAllMarksAndLines();
+  BuildDatabase();
+  GetSummary(vk1);
+  Check(corrupted && bs.mFirstRank > 0 && vk1 == vk0, 
+    "database built again over a bad snapshot");
+  
+  ReferenceFinder::SetDatabaseFn(0);
+  ReferenceFinder::sDatabaseFile = "";
+  ReferenceFinder::sDatabaseStatusSkip = statusSkip;
+  remove(DATABASE_FILE.c_str());
+}
+
+
+/*****
+Put a description of each mark in vm, the best marks for target at, into vs:
+its rank and key, the keys of the refs it was made from, and the directions
+for folding it. Marks of the same rank and error are equally good, and the
+order they come in isn't part of what we check, so they're put in order of
+their descriptions; and if the list is full, which of the marks tied with the
+last one made it isn't either, so those are left out.
+*****/
+static void GetMarkDescriptions(const XYPt& at, const vector<RefMark*>& vm, 
+  size_t numRefs, vector<string>& vs)
+{
+  size_t first = vs.size();
+  size_t num = vm.size();
+  while (vm.size() == numRefs && num > 0 && 
+    vm[num - 1]->mRank == vm.back()->mRank && 
+    vm[num - 1]->DistanceTo(at) == vm.back()->DistanceTo(at)) num--;
+  for (size_t i = 0; i < num; i++) {
+    ostringstream os;
+    os << vm[i]->mRank << ' ' << vm[i]->mKey;
+    RefBase::RefSource rs = vm[i]->GetSource();
+    for (int k = 0; k < 4; k++) 
+      if (rs.mParents[k]) os << ' ' << rs.mParents[k]->mKey;
+    os << endl;
+    vm[i]->PutHowtoSequence(os);
+    vs.push_back(os.str());
+  }
+  for (size_t i = 0; i < num; ) {
+    size_t j = i + 1;
+    while (j < num && vm[j]->mRank == vm[i]->mRank && 
+      vm[j]->DistanceTo(at) == vm[i]->DistanceTo(at)) j++;
+    sort(vs.begin() + first + i, vs.begin() + first + j);
+    i = j;
+  }
+}
+
+
+/*****
+Check that the marks made when searched for, with virtual marks, are the same
+marks, made from the same lines, as a full build would have stored, for a grid
+of targets.
+*****/
+static void CheckVirtualMarks()
+{
+  const int NUM_STEPS = 40;       // targets across and up
+  const size_t NUM_REFS = 5;      // marks found for each target
+  vector<string> vsFull, vsVirtual;
+  for (int virt = 0; virt < 2; virt++) {
+    ReferenceFinder::sVirtualMarks = (virt == 1);
+    BuildDatabase();
+    vector<string>& vs = virt ? vsVirtual : vsFull;
+    for (int ix = 0; ix < NUM_STEPS; ix++) 
+      for (int iy = 0; iy < NUM_STEPS; iy++) {
+        XYPt pp((ix + 0.5) / NUM_STEPS, (iy + 0.5) / NUM_STEPS);
+        vector<RefMark*> vm;
+        ReferenceFinder::FindBestMarks(pp, vm, NUM_REFS);
+        GetMarkDescriptions(pp, vm, NUM_REFS, vs);
+      }
+  }
+  ReferenceFinder::sVirtualMarks = false;
+  Check(vsFull == vsVirtual, "virtual marks match a full build");
+}
+
+
+/*****
+Put the keys of the frontier of marks for point ap and of lines for line al
+into vk.
+*****/
+static void GetFrontierKeys(const XYPt& ap, const XYLine& al, 
+  vector<RefBase::key_t>& vk)
+{
+  vk.clear();
+  vector<RefMark*> vm;
+  ReferenceFinder::FindFrontierMarks(ap, vm);
+  for (size_t i = 0; i < vm.size(); i++) vk.push_back(vm[i]->mKey);
+  vector<RefLine*> vl;
+  ReferenceFinder::FindFrontierLines(al, vl);
+  for (size_t i = 0; i < vl.size(); i++) vk.push_back(vl[i]->mKey);
+}
+
+
+/*****
+Check that frontier searches go up to the rank the database was built to, not
+to sMaxRank, which may have changed since, with and without virtual marks.
+*****/
+static void CheckFrontiers()
+{
+  XYPt pp(0.123, 0.456);
+  XYLine ll(XYPt(0.2, 0), XYPt(0.7, 1));
+  bool passed = true;
+  for (int virt = 0; virt < 2; virt++) {
+    ReferenceFinder::sVirtualMarks = (virt == 1);
+    BuildDatabase();
+    vector<RefBase::key_t> vk0, vk1, vk2;
+    GetFrontierKeys(pp, ll, vk0);
+    ReferenceFinder::sMaxRank = CHECK_RANK - 3;
+    GetFrontierKeys(pp, ll, vk1);
+    ReferenceFinder::sMaxRank = CHECK_RANK + 2;
+    GetFrontierKeys(pp, ll, vk2);
+    ReferenceFinder::sMaxRank = CHECK_RANK;
+    if (vk0.size() < 4 || vk1 != vk0 || vk2 != vk0) passed = false;
+  }
+  ReferenceFinder::sVirtualMarks = false;
+  Check(passed, "frontiers after sMaxRank changes");
+}
+
+
+/*****
+Check that the marks and lines made by searches are made only once for each
+pair of refs they're made from, and that no more than sMaxVirtualRefs of them
+are kept from one search to the next: marks with virtual marks, and lines in
+deeper searches.
+*****/
+static void CheckVirtualRefs()
+{
+  const size_t MAX_REFS = 50;     // refs made by searches to keep
+  const int NUM_TARGETS = 500;    // targets to search for
+  const short NUM_REFS = 5;       // refs found for each target
+  ReferenceFinder::sVirtualMarks = true;
+  BuildDatabase();
+  size_t cacheSize = ReferenceFinder::sQueryCacheSize;
+  size_t maxRefs = ReferenceFinder::sMaxVirtualRefs;
+  ReferenceFinder::sQueryCacheSize = 0;
+  XYPt pp(0.123, 0.456);
+  vector<RefMark*> vm1, vm2;
+  ReferenceFinder::FindBestMarks(pp, vm1, NUM_REFS);
+  size_t numMade = ReferenceFinder::GetNumVirtualRefs();
+  ReferenceFinder::FindBestMarks(pp, vm2, NUM_REFS);
+  Check(numMade > 0 && vm1 == vm2 && 
+    ReferenceFinder::GetNumVirtualRefs() == numMade, 
+    "the same virtual marks for the same target");
+  XYLine ll(XYPt(0.2, 0), XYPt(0.7, 1));
+  vector<RefLine*> vl1, vl2;
+  ReferenceFinder::FindDeeperLines(ll, vl1, NUM_REFS, CHECK_RANK + 1);
+  numMade = ReferenceFinder::GetNumVirtualRefs();
+  ReferenceFinder::FindDeeperLines(ll, vl2, NUM_REFS, CHECK_RANK + 1);
+  Check(vl1 == vl2 && ReferenceFinder::GetNumVirtualRefs() == numMade, 
+    "the same deeper lines for the same target");
+  
+  ReferenceFinder::sQueryCacheSize = cacheSize;
+  ReferenceFinder::sMaxVirtualRefs = MAX_REFS;
+  // Before each search, there are fewer than MAX_REFS refs, so afterwards
+  // there are fewer than that plus the most that one search made.
+  size_t mostKept = 0;
+  size_t mostMade = 0;
+  for (int i = 0; i < NUM_TARGETS; i++) {
+    XYPt pi((i % 23 + 0.5) / 23, (i % 29 + 0.5) / 29);
+    for (int k = 0; k < 2; k++) {
+      size_t numBefore = ReferenceFinder::GetNumVirtualRefs();
+      if (k == 0) ReferenceFinder::FindBestMarks(pi, vm1, NUM_REFS);
+      else ReferenceFinder::FindDeeperLines(XYLine(pi, XYPt(1 - pi.y, pi.x)), 
+        vl1, NUM_REFS, CHECK_RANK + 1);
+      size_t numAfter = ReferenceFinder::GetNumVirtualRefs();
+      mostKept = max(mostKept, numAfter);
+      if (numAfter >= numBefore) 
+        mostMade = max(mostMade, numAfter - numBefore);
+    }
+  }
+  Check(mostKept < MAX_REFS + mostMade, "most virtual refs kept");
+  ReferenceFinder::sMaxVirtualRefs = maxRefs;
+  ReferenceFinder::sVirtualMarks = false;
+}
+
+
+/*****
+Check that deeper searches go no further than one construction past the
+database, however high a rank they're asked for.
+*****/
+static void CheckDeeperRanks()
+{
+  const short NUM_REFS = 5;       // refs found for each target
+  ReferenceFinder::rank_t markRank = ReferenceFinder::GetMaxDeeperMarkRank();
+  ReferenceFinder::rank_t lineRank = ReferenceFinder::GetMaxDeeperLineRank();
+  Check(markRank == 2 * CHECK_RANK && lineRank == 1 + 2 * CHECK_RANK, 
+    "highest ranks of deeper searches");
+  
+  XYPt pp(0.123, 0.456);
+  vector<RefMark*> vm1, vm2;
+  ReferenceFinder::FindDeeperMarks(pp, vm1, NUM_REFS, markRank);
+  ReferenceFinder::FindDeeperMarks(pp, vm2, NUM_REFS, 100);
+  bool passed = (vm1.size() == size_t(NUM_REFS) && vm1 == vm2);
+  for (size_t i = 0; passed && i < vm2.size(); i++) 
+    passed = (vm2[i]->mRank <= markRank);
+  Check(passed, "FindDeeperMarks() past the highest rank");
+  
+  XYLine ll(XYPt(0.2, 0), XYPt(0.7, 1));
+  vector<RefLine*> vl1, vl2;
+  ReferenceFinder::FindDeeperLines(ll, vl1, NUM_REFS, lineRank);
+  ReferenceFinder::FindDeeperLines(ll, vl2, NUM_REFS, 100);
+  passed = (vl1.size() == size_t(NUM_REFS) && vl1 == vl2);
+  for (size_t i = 0; passed && i < vl2.size(); i++) 
+    passed = (vl2[i]->mRank <= lineRank);
+  Check(passed, "FindDeeperLines() past the highest rank");
+}
+
+
+/*****
+Return how far the fold al takes point ap from line al2, signed.
+*****/
+static double GetFoldError(const XYLine& al, const XYPt& ap, const XYLine& al2)
+{
+  return al.Fold(ap).Dot(al2.u) - al2.d;
+}
+
+
+/*****
+Put into afold the fold that takes point ap1 to the point at distance at along
+line al1, and return how far it takes point ap2 from line al2. Where that's
+zero, afold is an O6 fold.
+*****/
+static double GetAlignment(const XYPt& ap1, const XYLine& al1, 
+  const XYPt& ap2, const XYLine& al2, double at, XYLine& afold)
+{
+  XYPt pp = al1.d * al1.u + at * al1.u.Rotate90();
+  afold.u = (pp - ap1).Normalize();
+  afold.d = afold.u.Dot(MidPoint(pp, ap1));
+  return GetFoldError(afold, ap2, al2);
+}
+
+
+/*****
+Return true if point ap is inside the paper and clear of its edges.
+*****/
+static bool IsWellInside(const XYPt& ap)
+{
+  const double MARGIN = 1.0e-6;
+  return ap.x > MARGIN && ap.x < ReferenceFinder::sPaper.mWidth - MARGIN && 
+    ap.y > MARGIN && ap.y < ReferenceFinder::sPaper.mHeight - MARGIN;
+}
+
+
+/*****
+Return true if the O6 folds found for points ap1, ap2 and lines al1, al2 are
+right: each one takes the points onto the lines, and every fold that a scan
+along al1 turns up, with both images well inside the paper, is among them. A
+point that's already on its line gets no folds at all.
+*****/
+static bool CheckFoldsFound(const XYPt& ap1, const XYLine& al1, 
+  const XYPt& ap2, const XYLine& al2, const RefLine_P2L_P2L::Folds& afolds)
+{
+  const double TOLERANCE = 1.0e-6;  // error allowed in a fold
+  const int NUM_STEPS = 1000;       // steps in the scan along al1
+  if (al1.Intersects(ap1) || al2.Intersects(ap2)) return afolds.mNum == 0;
+  for (short n = 0; n < afolds.mNum; n++) 
+    if (fabs(GetFoldError(afolds.mLine[n], ap1, al1)) > TOLERANCE || 
+      fabs(GetFoldError(afolds.mLine[n], ap2, al2)) > TOLERANCE || 
+      (n > 0 && afolds.mRoot[n] <= afolds.mRoot[n - 1])) return false;
+  
+  // Look for a change of sign in how far the fold takes ap2 from al2, and
+  // narrow each one down to the fold it brackets.
+  double reach = sqrt(pow(ReferenceFinder::sPaper.mWidth, 2) + 
+    pow(ReferenceFinder::sPaper.mHeight, 2));
+  XYLine fold;
+  double t0 = -reach;
+  double e0 = GetAlignment(ap1, al1, ap2, al2, t0, fold);
+  for (int i = 1; i <= NUM_STEPS; i++) {
+    double t1 = -reach + 2 * reach * i / NUM_STEPS;
+    double e1 = GetAlignment(ap1, al1, ap2, al2, t1, fold);
+    if ((e0 < 0) != (e1 < 0)) {
+      double ta = t0, tb = t1;
+      for (int j = 0; j < 60; j++) {
+        double tm = (ta + tb) / 2;
+        if ((GetAlignment(ap1, al1, ap2, al2, tm, fold) < 0) == (e0 < 0)) 
+          ta = tm;
+        else tb = tm;
+      }
+      GetAlignment(ap1, al1, ap2, al2, ta, fold);
+      XYPt pp1 = fold.Fold(ap1);
+      if (IsWellInside(pp1) && IsWellInside(fold.Fold(ap2))) {
+        // A triple root only narrows down to about the cube root of the
+        // rounding error.
+        bool found = false;
+        for (short n = 0; !found && n < afolds.mNum; n++) 
+          found = (afolds.mLine[n].Fold(ap1) - pp1).Mag() < 1.0e-4;
+        if (!found) return false;
+      }
+    }
+    t0 = t1;
+    e0 = e1;
+  }
+  return true;
+}
+
+
+/*****
+Check the O6 folds that SolveFolds() finds for every pair of points and lines
+from a grid, and that remaking a line from its root number, as the database
+does, gives the same line as the fold it came from.
+*****/
+static void CheckFolds()
+{
+  const int NUM_DIVS = 4;         // points and lines are this many per side
+  vector<RefMark_Original> marks;
+  vector<RefLine_Original> lines;
+  for (int i = 0; i <= NUM_DIVS; i++) {
+    double f = double(i) / NUM_DIVS;
+    for (int j = 0; j <= NUM_DIVS; j++) 
+      marks.push_back(RefMark_Original(XYPt(f, double(j) / NUM_DIVS), 0, ""));
+    lines.push_back(RefLine_Original(XYLine(XYPt(f, 0), XYPt(f, 1)), 0, ""));
+    lines.push_back(RefLine_Original(XYLine(XYPt(0, f), XYPt(1, f)), 0, ""));
+  }
+  lines.push_back(RefLine_Original(XYLine(XYPt(0, 0), XYPt(1, 1)), 0, ""));
+  lines.push_back(RefLine_Original(XYLine(XYPt(0, 1), XYPt(1, 0)), 0, ""));
+  lines.push_back(RefLine_Original(XYLine(XYPt(0, 0.25), XYPt(1, 0.6)), 0, ""));
+  lines.push_back(RefLine_Original(XYLine(XYPt(0.1, 0), XYPt(0.7, 1)), 0, ""));
+  
+  bool foundPassed = true;
+  bool remadePassed = true;
+  for (size_t i = 0; i < marks.size(); i++) 
+    for (size_t k = 0; k < lines.size(); k++) 
+      for (size_t j = 0; j < marks.size(); j++) 
+        for (size_t l = 0; l < lines.size(); l++) {
+          RefMark* rm1 = &marks[i];
+          RefLine* rl1 = &lines[k];
+          RefMark* rm2 = &marks[j];
+          RefLine* rl2 = &lines[l];
+          if (rm1 == rm2 || rl1 == rl2) continue;
+          RefLine_P2L_P2L::Folds folds;
+          RefLine_P2L_P2L::SolveFolds(rm1->p, rl1->l, rm2->p, rl2->l, folds);
+          if (!CheckFoldsFound(rm1->p, rl1->l, rm2->p, rl2->l, folds)) 
+            foundPassed = false;
+          for (short iroot = 0; iroot < 3; iroot++) {
+            RefLine_P2L_P2L rlr(rm1, rl1, rm2, rl2, iroot);
+            short n = 0;
+            while (n < folds.mNum && folds.mRoot[n] != iroot) n++;
+            if (n == folds.mNum) {
+              if (rlr.mKey != 0) remadePassed = false;
+              continue;
+            }
+            RefLine_P2L_P2L rlf(rm1, rl1, rm2, rl2, folds, n);
+            if (rlr.mKey != rlf.mKey || !(rlr.l == folds.mLine[n])) 
+              remadePassed = false;
+          }
+        }
+  Check(foundPassed, "folds found by SolveFolds()");
+  Check(remadePassed, "O6 lines remade from their roots");
+  
+  // A double root of the cubic, where R < 0, gives the fold x = 1/4 as well
+  // as the single root's fold.
+  XYLine l1(XYPt(0.5, 0), XYPt(0.5, 1));
+  XYLine l2(XYPt(0, 1), XYPt(1, 0));
+  RefLine_P2L_P2L::Folds folds;
+  RefLine_P2L_P2L::SolveFolds(XYPt(0, 0.25), l1, XYPt(0, 0.5), l2, folds);
+  Check(folds.mNum == 2 && folds.mRoot[1] == 1 && 
+    folds.mLine[1] == XYLine(XYPt(0.25, 0), XYPt(0.25, 1)), 
+    "O6 folds from a double root");
+}
+
+
+/*****
+A ref found by a range search, and what it's ordered by: rank, then error,
+then row.
+*****/
+template <class R>
+struct RangeRef {
+  R* mRef;
+  double mError;
+  
+  RangeRef(R* ar, double aerror) : mRef(ar), mError(aerror) {};
+  bool operator<(const RangeRef& rr) const {
+    if (mRef->mRank != rr.mRef->mRank) return mRef->mRank < rr.mRef->mRank;
+    if (mError != rr.mError) return mError < rr.mError;
+    return mRef->mRow < rr.mRef->mRow;
+  };
+};
+
+
+/*****
+MarkRangeFn or LineRangeFn for the checks below, which adds each ref to the
+vector of RangeRef<R> that userData points to.
+*****/
+template <class R>
+static void CollectRangeFn(R* ar, double error, void* userData, bool&)
+{
+  static_cast<vector<RangeRef<R> >*>(userData)->push_back(
+    RangeRef<R>(ar, error));
+}
+
+
+/*****
+Return true if vr, which a range search found within aerror of target at, has
+just the refs in vall that are that close, in order, with the same errors as
+the refs give themselves.
+*****/
+template <class R>
+static bool IsRangeFound(const vector<RangeRef<R> >& vall, 
+  const typename R::bare_t& at, double aerror, const vector<RangeRef<R> >& vr)
+{
+  vector<RangeRef<R> > vb;
+  for (size_t i = 0; i < vall.size(); i++) {
+    double err = vall[i].mRef->DistanceTo(at);
+    if (err <= aerror) vb.push_back(RangeRef<R>(vall[i].mRef, err));
+  }
+  sort(vb.begin(), vb.end());
+  if (vb.size() != vr.size()) return false;
+  for (size_t i = 0; i < vb.size(); i++) 
+    if (vb[i].mRef != vr[i].mRef || 
+      fabs(vb[i].mError - vr[i].mError) > CHECK_TOLERANCE) return false;
+  return true;
+}
+
+
+/*****
+Check FindMarksInRange() and FindLinesInRange() against every ref in the
+database, with and without the search indexes and for both kinds of line
+error.
+*****/
+static void CheckRanges()
+{
+  const double HUGE_ERROR = 1.0e30; // takes in the whole database
+  const XYPt MARK_TARGETS[] = {XYPt(0.5, 0.5), XYPt(0.123, 0.456), 
+    XYPt(0, 0), XYPt(1, 0.3)};
+  const double MARK_ERRORS[] = {0.01, 0.02, 0.05, 0.003};
+  const XYLine LINE_TARGETS[] = {XYLine(XYPt(0.2, 0), XYPt(0.7, 1)), 
+    XYLine(XYPt(0, 0.333), XYPt(1, 0.25)), XYLine(XYPt(0, 0), XYPt(1, 1)), 
+    XYLine(XYPt(0.5, 0), XYPt(0.5, 1)), XYLine(XYPt(1.2, 0), XYPt(1.3, 1))};
+  const double LINE_ERRORS[] = {0.01, 0.02, 0.005, 0.02, 0.25};
+  bool useIndexes = ReferenceFinder::sUseSearchIndexes;
+  bool worstCase = ReferenceFinder::sLineWorstCaseError;
+  
+  ReferenceFinder::sUseSearchIndexes = false;
+  vector<RangeRef<RefMark> > allMarks;
+  ReferenceFinder::FindMarksInRange(XYPt(0, 0), HUGE_ERROR, 
+    CollectRangeFn<RefMark>, &allMarks);
+  vector<RangeRef<RefLine> > allLines;
+  ReferenceFinder::FindLinesInRange(XYLine(XYPt(0, 0), XYPt(1, 1)), 
+    HUGE_ERROR, CollectRangeFn<RefLine>, &allLines);
+  Check(allMarks.size() == ReferenceFinder::GetNumMarks() && 
+    allLines.size() == ReferenceFinder::GetNumLines(), 
+    "range searches over the whole database");
+  
+  bool marksPassed = true;
+  bool linesPassed = true;
+  for (int k = 0; k < 4; k++) {
+    ReferenceFinder::sUseSearchIndexes = (k % 2 == 0);
+    ReferenceFinder::sLineWorstCaseError = (k / 2 == 0);
+    for (size_t i = 0; i < sizeof(MARK_ERRORS) / sizeof(double); i++) {
+      vector<RangeRef<RefMark> > vm;
+      ReferenceFinder::FindMarksInRange(MARK_TARGETS[i], MARK_ERRORS[i], 
+        CollectRangeFn<RefMark>, &vm);
+      if (!IsRangeFound(allMarks, MARK_TARGETS[i], MARK_ERRORS[i], vm)) 
+        marksPassed = false;
+    }
+    for (size_t i = 0; i < sizeof(LINE_ERRORS) / sizeof(double); i++) {
+      vector<RangeRef<RefLine> > vl;
+      ReferenceFinder::FindLinesInRange(LINE_TARGETS[i], LINE_ERRORS[i], 
+        CollectRangeFn<RefLine>, &vl);
+      if (!IsRangeFound(allLines, LINE_TARGETS[i], LINE_ERRORS[i], vl)) 
+        linesPassed = false;
+    }
+  }
+  Check(marksPassed, "FindMarksInRange()");
+  Check(linesPassed, "FindLinesInRange()");
+  ReferenceFinder::sUseSearchIndexes = useIndexes;
+  ReferenceFinder::sLineWorstCaseError = worstCase;
+}
+
+
+/*****
+Check FindMarksAlongLine() against every mark in the database, with and without
+the search indexes: for the edges, the diagonals, lines parallel to the axes
+and a slanted one, a line off the paper, and a line so nearly horizontal that
+it takes in whole rows of cells of the mark grid or none of them.
+*****/
+static void CheckMarksAlongLines()
+{
+  const XYLine LINE_TARGETS[] = {XYLine(XYPt(0, 0), XYPt(1, 0)), 
+    XYLine(XYPt(0, 0), XYPt(0, 1)), XYLine(XYPt(1, 0), XYPt(1, 1)), 
+    XYLine(XYPt(0, 1), XYPt(1, 1)), XYLine(XYPt(0, 0), XYPt(1, 1)), 
+    XYLine(XYPt(0, 1), XYPt(1, 0)), XYLine(XYPt(0.5, 0), XYPt(0.5, 1)), 
+    XYLine(XYPt(0, 0.25), XYPt(1, 0.25)), XYLine(XYPt(0.2, 0), XYPt(0.7, 1)), 
+    XYLine(XYPt(1.2, 0), XYPt(1.3, 1)), 
+    XYLine(XYPt(0, 0.3), XYPt(1, 0.3 + 1.0e-9))};
+  const double ERRORS[] = {0.002, 0.01, 0.25};
+  bool useIndexes = ReferenceFinder::sUseSearchIndexes;
+  ReferenceFinder::sUseSearchIndexes = false;
+  vector<RangeRef<RefMark> > allMarks;
+  ReferenceFinder::FindMarksInRange(XYPt(0, 0), 1.0e30, 
+    CollectRangeFn<RefMark>, &allMarks);
+  
+  bool passed = true;
+  for (int k = 0; k < 2; k++) {
+    ReferenceFinder::sUseSearchIndexes = (k == 0);
+    for (size_t i = 0; i < sizeof(LINE_TARGETS) / sizeof(XYLine); i++) 
+      for (size_t j = 0; j < sizeof(ERRORS) / sizeof(double); j++) {
+        // The marks close enough, in order along the line.
+        const XYLine& al = LINE_TARGETS[i];
+        XYPt pt = al.d * al.u;
+        XYPt up = al.u.Rotate90();
+        vector<pair<pair<double, RefBase::row_t>, RefMark*> > vb;
+        for (size_t n = 0; n < allMarks.size(); n++) {
+          RefMark* rm = allMarks[n].mRef;
+          if (abs(rm->p.Dot(al.u) - al.d) <= ERRORS[j]) 
+            vb.push_back(make_pair(make_pair(-(rm->p - pt).Dot(up), 
+              rm->mRow), rm));
+        }
+        sort(vb.begin(), vb.end());
+        vector<RefMark*> vm;
+        ReferenceFinder::FindMarksAlongLine(al, ERRORS[j], vm);
+        bool same = (vm.size() == vb.size());
+        for (size_t n = 0; same && n < vm.size(); n++) 
+          same = (vm[n] == vb[n].second);
+        if (!same) passed = false;
+      }
+  }
+  Check(passed, "FindMarksAlongLine()");
+  ReferenceFinder::sUseSearchIndexes = useIndexes;
+}
+
+
+/*****
+Check the size of the database and the best marks and lines for the targets
+above.
+*****/
+static void CheckSearches()
+{
+  Check(ReferenceFinder::GetNumLines() == CHECK_NUM_LINES, "number of lines");
+  Check(ReferenceFinder::GetNumMarks() == CHECK_NUM_MARKS, "number of marks");
+  
+  size_t numMarkChecks = sizeof(MARK_CHECKS) / sizeof(MARK_CHECKS[0]);
+  for (size_t i = 0; i < numMarkChecks; i += NUM_PER_TARGET) {
+    XYPt pp(MARK_CHECKS[i].mX, MARK_CHECKS[i].mY);
+    vector<RefMark*> vm;
+    ReferenceFinder::FindBestMarks(pp, vm, NUM_PER_TARGET);
+    bool passed = (vm.size() == NUM_PER_TARGET);
+    for (size_t j = 0; passed && j < NUM_PER_TARGET; j++) {
+      const MarkCheck& mc = MARK_CHECKS[i + j];
+      passed = IsRef(vm[j], pp, mc.mRank, mc.mKey, mc.mError);
+    }
+    Check(passed, "FindBestMarks()");
+  }
+  
+  size_t numLineChecks = sizeof(LINE_CHECKS) / sizeof(LINE_CHECKS[0]);
+  for (size_t i = 0; i < numLineChecks; i += NUM_PER_TARGET) {
+    XYLine ll(XYPt(LINE_CHECKS[i].mX1, LINE_CHECKS[i].mY1), 
+      XYPt(LINE_CHECKS[i].mX2, LINE_CHECKS[i].mY2));
+    vector<RefLine*> vl;
+    ReferenceFinder::FindBestLines(ll, vl, NUM_PER_TARGET);
+    bool passed = (vl.size() == NUM_PER_TARGET);
+    for (size_t j = 0; passed && j < NUM_PER_TARGET; j++) {
+      const LineCheck& lc = LINE_CHECKS[i + j];
+      passed = IsRef(vl[j], ll, lc.mRank, lc.mKey, lc.mError);
+    }
+    Check(passed, "FindBestLines()");
+  }
+}
+
+
+/******************************
+Main program
+******************************/
+int main()
+{
+  BuildDatabase();
+  CheckSearches();
+  CheckDeeperRanks();
+  CheckFolds();
+  CheckRanges();
+  CheckMarksAlongLines();
+  CheckThreads();
+  CheckIncrementalBuilds();
+  CheckSnapshots();
+  CheckFrontiers();
+  CheckVirtualMarks();
+  CheckVirtualRefs();
+  
+  if (sNumFailed > 0) {
+    cout << sNumFailed << " checks failed." << endl;
+    return 1;
+  }
+  cout << "All checks passed." << endl;
+  return 0;
+}